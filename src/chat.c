@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <string.h>
+#include <stdlib.h>
 #include <stdbool.h>
 #include <unistd.h>
 
@@ -7,11 +8,33 @@
 
 // Print help info
 void print_help(void) {
-    printf("usage: chat [-h] [-s] [-u <server host>] <port_number>\n");
+    printf("usage: chat [-h] [-s] [-p] [-i] [-a <count>] [-j <threads>] [-b <backlog>] [-c <count>] [-w <usec>] [-q <bytes>] [-o <bytes>] [-g <bytes>] [-k <policy>] [-l <path>] [-m] [-d] [-e] [-K <path>] [-f <fingerprint>] [-t <msec>] [-x <path>] [-r <count>] [-y <bytes>] [-z <usec>] [-u <server host>] [<port_number>]\n");
     printf("\t-h:\t\t\tPrint help message.\n");
     printf("\t-s:\t\t\tStart server. (Defaults to client).\n");
-    printf("\t-u <server_host>:\tConnect to specified host. Defaults to localhost.\n");
-    printf("\t<port_number>: \t\tPort number to connect to.\n");
+    printf("\t-p:\t\t\tUse poll() event loop instead of epoll.\n");
+    printf("\t-i:\t\t\tUse io_uring I/O engine for server.\n");
+    printf("\t-a <count>:\t\tPreallocate <count> pooled packets per size class.\n");
+    printf("\t-j <threads>:\t\tSplit server across <threads> event loops.\n");
+    printf("\t-b <backlog>:\t\tQueue up to <backlog> pending connections.\n");
+    printf("\t-c <count>:\t\tAccept at most <count> connections per poll.\n");
+    printf("\t-w <usec>:\t\tHold outbound messages up to <usec> to send them together.\n");
+    printf("\t-q <bytes>:\t\tTreat clients with over <bytes> unsent as slow.\n");
+    printf("\t-o <bytes>:\t\tTreat slow clients normally again once under <bytes> unsent. Defaults to half of -q.\n");
+    printf("\t-g <bytes>:\t\tDisconnect slow clients with over <bytes> unsent, whatever the policy. Defaults to four times -q.\n");
+    printf("\t-k <policy>:\t\tSlow client policy: drop, pause, or disconnect. Defaults to drop.\n");
+    printf("\t-l <path>:\t\tAlso listen on Unix domain socket at <path>.\n");
+    printf("\t-m:\t\t\tSend messages over shared memory when connecting to unix:<path>.\n");
+    printf("\t-d:\t\t\tCarry pings over a UDP side channel.\n");
+    printf("\t-e:\t\t\tEncrypt TCP traffic, server and clients must all set it.\n");
+    printf("\t-K <path>:\t\tSign encrypted server's hellos with key at <path>, made if missing. Defaults to a new key each start.\n");
+    printf("\t-f <fingerprint>:\tOnly accept encrypted server with this key fingerprint, as it prints at start.\n");
+    printf("\t-t <msec>:\t\tSend heartbeat to clients quiet for <msec>, and drop them after 3 go unanswered.\n");
+    printf("\t-x <path>:\t\tTake over sockets of server running at <path>, and hand them to the next one started there.\n");
+    printf("\t-r <count>:\t\tLet each client send at most <count> messages per second, the rest are dropped.\n");
+    printf("\t-y <bytes>:\t\tLet each client send at most <bytes> of messages per second, the rest are dropped.\n");
+    printf("\t-z <usec>:\t\tBusy poll for lowest latency, sleeping only after <usec> with nothing arriving.\n");
+    printf("\t-u <server_host>:\tConnect to specified host, or unix:<path>. Defaults to localhost.\n");
+    printf("\t<port_number>: \t\tPort number to connect to, not needed for unix:<path>.\n");
 }
 
 int main(int argc, char* argv[]) {
@@ -26,7 +49,7 @@ int main(int argc, char* argv[]) {
     ChatStatus status;
 
     // Parse input options
-    while ((c = getopt(argc, argv, ":hsu:")) != -1) {
+    while ((c = getopt(argc, argv, ":hspia:j:b:c:w:q:o:g:k:l:mdeK:f:t:x:r:y:z:u:")) != -1) {
         switch (c) {
         case 'h':
             print_help();
@@ -34,6 +57,82 @@ int main(int argc, char* argv[]) {
         case 's':
             chat_server = true;
             break;
+        case 'p':
+            sock_get_config()->backend = SOCK_BACKEND_POLL;
+            break;
+        case 'i':
+            sock_get_config()->backend = SOCK_BACKEND_URING;
+            break;
+        case 'a':
+            sock_get_config()->packet_prealloc = atoi(optarg);
+            break;
+        case 'j':
+            sock_get_config()->num_shards = atoi(optarg);
+            break;
+        case 'b':
+            sock_get_config()->listen_backlog = atoi(optarg);
+            break;
+        case 'c':
+            sock_get_config()->accept_budget = atoi(optarg);
+            break;
+        case 'w':
+            sock_get_config()->coalesce_window = atoi(optarg);
+            break;
+        case 'q':
+            sock_get_config()->tx_high_water = strtoul(optarg, NULL, 10);
+            break;
+        case 'o':
+            sock_get_config()->tx_low_water = strtoul(optarg, NULL, 10);
+            break;
+        case 'g':
+            sock_get_config()->tx_hard_limit = strtoul(optarg, NULL, 10);
+            break;
+        case 'k':
+            if (strcmp(optarg, "drop") == 0) {
+                sock_get_config()->slow_policy = SOCK_SLOW_DROP;
+            } else if (strcmp(optarg, "pause") == 0) {
+                sock_get_config()->slow_policy = SOCK_SLOW_PAUSE;
+            } else if (strcmp(optarg, "disconnect") == 0) {
+                sock_get_config()->slow_policy = SOCK_SLOW_DISCONNECT;
+            } else {
+                printf("[ERROR] Unknown slow client policy: %s\n", optarg);
+                print_help();
+                return -1;
+            }
+            break;
+        case 'l':
+            sock_get_config()->unix_path = optarg;
+            break;
+        case 'm':
+            sock_get_config()->shm_rings = true;
+            break;
+        case 'd':
+            sock_get_config()->udp_channel = true;
+            break;
+        case 'e':
+            sock_get_config()->encrypt = true;
+            break;
+        case 'K':
+            sock_get_config()->server_key = optarg;
+            break;
+        case 'f':
+            sock_get_config()->server_fingerprint = optarg;
+            break;
+        case 't':
+            sock_get_config()->heartbeat_interval = atoi(optarg);
+            break;
+        case 'x':
+            sock_get_config()->handoff_path = optarg;
+            break;
+        case 'r':
+            sock_get_config()->rate_msgs = atoi(optarg);
+            break;
+        case 'y':
+            sock_get_config()->rate_bytes = atoi(optarg);
+            break;
+        case 'z':
+            sock_get_config()->busy_poll = atoi(optarg);
+            break;
         case 'u':
             host = optarg;
             break;
@@ -47,8 +146,9 @@ int main(int argc, char* argv[]) {
         }
     }
 
-    // Now parse port positional argument
-    if (argv[optind] == NULL) {
+    // Now parse port positional argument, clients on a Unix socket don't need one
+    bool unix_host = !chat_server && strncmp(host, SOCK_UNIX_PREFIX, strlen(SOCK_UNIX_PREFIX)) == 0;
+    if (argv[optind] == NULL && !unix_host) {
         printf("[ERROR] Missing positional argument <port_number>.\n");
         print_help();
         return -1;
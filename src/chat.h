@@ -3,6 +3,7 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <stdbool.h>
 
 #include "sock.h"
 
@@ -10,6 +11,9 @@
 #define MAX_CHATMSG_LEN  (255)
 #define SERVER_ID (0)
 
+#define MSG_HEADER_LEN    (11)                  // Serialized header: type(1), len(2), from(4), to(4)
+#define MAX_USERS_PER_MSG (2048)                // Users carried by one active user message, longer lists are paged
+
 typedef enum MessageType {
     MSG_PING,
     MSG_USER_SETNAME,
@@ -18,13 +22,14 @@ typedef enum MessageType {
     MSG_ACTIVE_USERS,
     MSG_CHAT,
     MSG_ERROR,
+    MSG_UDP_SESSION,
 } MessageType;
 
 typedef struct MessageHeader {
     uint8_t type;                           // Message type   
     uint16_t len;                           // Length of proceeding data, populated by serialize function
-    uint16_t from;                          // Message Source
-    uint16_t to;                            // Message Destination
+    uint32_t from;                          // Message Source
+    uint32_t to;                            // Message Destination
 } MessageHeader;
 
 typedef struct PingMessage {
@@ -34,15 +39,17 @@ typedef struct PingMessage {
 
 typedef struct UserMessage {
     MessageHeader header;
-    uint16_t id;
+    uint32_t id;
     char username[MAX_USERNAME_LEN + 1];
 } UserMessage;
 
 typedef struct ActiveUserMessage {
     MessageHeader header;
-    uint8_t num_users;
-    uint16_t ids[MAX_CLIENTS];
-    char usernames[MAX_CLIENTS][MAX_USERNAME_LEN + 1];
+    uint32_t total_users;                   // Users in whole list
+    uint32_t offset;                        // Position of first user in this page
+    uint16_t num_users;                     // Users in this page
+    uint32_t ids[MAX_USERS_PER_MSG];
+    char usernames[MAX_USERS_PER_MSG][MAX_USERNAME_LEN + 1];
 } ActiveUserMessage;
 
 typedef struct ChatMessage {
@@ -55,14 +62,33 @@ typedef struct ErrorMessage {
     char msg[MAX_CHATMSG_LEN + 1];
 } ErrorMessage;
 
+typedef struct UdpSessionMessage {
+    MessageHeader header;
+    uint16_t port;                          // Server's UDP side channel port
+    uint64_t token;                         // Secret client's datagrams must carry
+} UdpSessionMessage;
+
+// Borrowed view of a serialized message, text points into the buffer it was made from
+// Only valid as long as that buffer, copy anything that has to outlive the packet
+typedef struct MessageView {
+    MessageHeader header;
+    uint32_t time;                          // Ping time
+    uint32_t id;                            // User id carried by user messages
+    uint16_t port;                          // Side channel port of session messages
+    uint64_t token;                         // Side channel token of session messages
+    const char* text;                       // Username, chat or error text, null terminated, NULL if none
+} MessageView;
+
 typedef enum UserStatus {
     USER_INACTIVE = 0,
     USER_ACTIVE = 1,
 } UserStatus;
 
 typedef struct User {
-    uint16_t id;
+    uint32_t id;
     UserStatus active;
+    bool listed;                            // Seen in active user list being received, client only
+    int local;                              // Position + 1 in local_ids if user's client is on this shard, server only
     char name[MAX_USERNAME_LEN + 1];
 } User;
 
@@ -73,21 +99,31 @@ typedef enum ChatStatus {
 
 typedef struct ChatServer {
     int num_users;                          // Number of users connected to server
-    User users[MAX_CLIENTS];                // Array of users connected to server
+    int users_cap;                          // Number of users allocated
+    User* users;                            // Array of users connected to server
+    int* user_index;                        // Position + 1 in users for each id slot, 0 if none
+    int user_index_cap;                     // Number of id slots allocated in user_index
+    uint32_t* local_ids;                    // Ids of users whose clients are on this shard, broadcasts go to just these
+    int num_local;                          // Number of ids in local_ids, room is kept for users_cap
     SocketState* socket_connection;         // Pointer to socket interface
 } ChatServer;
 
 typedef struct ChatClient {
-    uint16_t id;                            // id of this client
+    uint32_t id;                            // id of this client
     char name[MAX_USERNAME_LEN + 1];        // Username of this client
     int num_users;                          // Number of users in chat room
-    User users[MAX_CLIENTS];                // List of users in chat room
+    int users_cap;                          // Number of users allocated
+    User* users;                            // List of users in chat room
+    int* user_index;                        // Position + 1 in users for each id slot, 0 if none
+    int user_index_cap;                     // Number of id slots allocated in user_index
+    SocketState* socket_connection;         // Pointer to socket interface
 } ChatClient;
 
 
 // serial.c: Serialize/Deserialize Messages
 int serialize_msg(const MessageHeader* msg, char** buffer);         // Serialize message, typecast message into header, function will malloc required memory
 MessageHeader* deserialize_msg(char* buffer, int num_bytes);        // Deserialize a message, function will malloc required memory
+int view_msg(const char* buffer, int num_bytes, MessageView* view);  // Check message and decode it in place without copying, return -1 if malformed
 
 // server.c: Server Utilties
 ChatStatus start_chat_server(const char* port);                     // Start chat server, and run until disconnected
@@ -9,22 +9,83 @@
 #include "sock.h"
 #include "chat.h"
 
+#define USERS_MIN (64)            // Initial size of user tables
+
 ChatClient client;
+static SocketState server_socket;     // Socket endpoint connected to server
 
 // Get index of user in user list
-static int get_user_index(uint16_t id) {
+static int get_user_index(uint32_t id) {
 
-    for (int i = 0; i < client.num_users; i++) {
-        if (client.users[i].id == id) {
-            return i;
-        }
+    unsigned slot = SOCK_ID_INDEX(id);
+    if (slot >= (unsigned)client.user_index_cap) return -1;
+
+    // Slot may still point at a user whose id was since recycled, so confirm the full id
+    int i = client.user_index[slot] - 1;
+    if (i < 0 || client.users[i].id != id) return -1;
+
+    return i;
+}
+
+// Grow user list and id slot index so they can hold a user with this id slot
+// Return -1 if out of memory
+static int reserve_user(unsigned slot) {
+
+    if (client.num_users >= client.users_cap) {
+        int cap = client.users_cap > 0 ? client.users_cap * 2 : USERS_MIN;
+        User* users = realloc(client.users, cap * sizeof(User));
+        if (users == NULL) return -1;
+        client.users = users;
+        client.users_cap = cap;
+    }
+
+    if (slot >= (unsigned)client.user_index_cap) {
+        int cap = client.user_index_cap > 0 ? client.user_index_cap : USERS_MIN;
+        while ((unsigned)cap <= slot) cap *= 2;
+        int* user_index = realloc(client.user_index, cap * sizeof(int));
+        if (user_index == NULL) return -1;
+        memset(user_index + client.user_index_cap, 0, (cap - client.user_index_cap) * sizeof(int));
+        client.user_index = user_index;
+        client.user_index_cap = cap;
+    }
+
+    return 0;
+}
+
+// Append user to user list, return index or -1 if list is full
+static int add_user(uint32_t id) {
+
+    unsigned slot = SOCK_ID_INDEX(id);
+    if (client.num_users >= MAX_CLIENTS || reserve_user(slot) != 0) return -1;
+
+    int i = client.num_users++;
+    client.users[i] = (User){0};
+    client.users[i].id = id;
+    client.users[i].active = USER_ACTIVE;
+    client.user_index[slot] = i + 1;
+
+    return i;
+}
+
+// Remove user from user list by overwriting with last user
+static void remove_user(int i) {
+
+    unsigned slot = SOCK_ID_INDEX(client.users[i].id);
+    int last = --client.num_users;
+
+    if (client.user_index[slot] == i + 1) client.user_index[slot] = 0;
+
+    if (i != last) {
+        unsigned last_slot = SOCK_ID_INDEX(client.users[last].id);
+        client.users[i] = client.users[last];
+        if (client.user_index[last_slot] == last + 1) client.user_index[last_slot] = i + 1;
     }
 
-    return -1;
+    client.users[last] = (User){0};
 }
 
 // Check if a user exists
-static bool check_user_exists(uint16_t id) {
+static bool check_user_exists(uint32_t id) {
 
     return get_user_index(id) != -1;
     
@@ -39,12 +100,12 @@ static ChatStatus client_send_message(const MessageHeader* msg) {
     
     num_bytes = serialize_msg(msg, &buffer);
 
-    if (num_bytes == 0) {
+    if (num_bytes <= 0) {
         printf_message("[ERROR] Failed to serialize message");
         return CHAT_FAILURE;
     }
 
-    status = client_socket_send_packet(buffer, num_bytes);
+    status = client_socket_send_packet(client.socket_connection, buffer, num_bytes);
     free(buffer);
 
     if (status != SOCK_SUCCESS) return CHAT_FAILURE;
@@ -52,6 +113,34 @@ static ChatStatus client_send_message(const MessageHeader* msg) {
     return CHAT_SUCCESS;
 }
 
+// Send message over side channel, fails if server hasn't given us one
+static ChatStatus client_send_datagram(const MessageHeader* msg) {
+
+    int status;
+    char* buffer;
+    int num_bytes;
+
+    num_bytes = serialize_msg(msg, &buffer);
+
+    if (num_bytes <= 0) return CHAT_FAILURE;
+
+    status = client_socket_send_datagram(client.socket_connection, buffer, num_bytes);
+    free(buffer);
+
+    if (status != SOCK_SUCCESS) return CHAT_FAILURE;
+
+    return CHAT_SUCCESS;
+}
+
+// Monotonic time in microseconds for pings, wraps around but differences stay right
+static uint32_t ping_clock(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint32_t)((uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u);
+}
+
 // Send request to server to set client name      
 static ChatStatus client_req_user_setname(const char* username) {
 
@@ -74,13 +163,29 @@ static ChatStatus client_ping_server(void) {
     ping_msg.header.from = client.id;
     ping_msg.header.to = SERVER_ID;   // Default Server Address
 
-    ping_msg.time = clock();
+    ping_msg.time = ping_clock();
+
+    // Side channel keeps the probe from queueing behind chat traffic, so it times the path itself
+    if (client_send_datagram((MessageHeader*)&ping_msg) == CHAT_SUCCESS) return CHAT_SUCCESS;
+
+    return client_send_message((MessageHeader*)&ping_msg);
+}
+
+// Answer heartbeat from server, addressed to ourselves so server takes it as a sign of life and doesn't echo it
+static ChatStatus client_answer_heartbeat(uint32_t time) {
+
+    PingMessage ping_msg = {0};
+    ping_msg.header.type = MSG_PING;
+    ping_msg.header.from = client.id;
+    ping_msg.header.to = client.id;
+
+    ping_msg.time = time;
 
     return client_send_message((MessageHeader*)&ping_msg);
 }
 
 // Send a chat message                
-static ChatStatus client_send_chat(uint16_t to, const char* msg_text) {
+static ChatStatus client_send_chat(uint32_t to, const char* msg_text) {
 
     ChatMessage chat_msg = {0};
     chat_msg.header.type = MSG_CHAT;
@@ -121,110 +226,126 @@ static void interpret_input(const char* buffer, int buff_len) {
 }
 
 // Update list of all active users in client
+// Long lists arrive over several pages, users missing from the whole list are removed after the last page
 static void client_update_active_users(const ActiveUserMessage* msg) {
-    
+
+    // First page starts a new list
+    if (msg->offset == 0) {
+        for (int i = 0; i < client.num_users; i++) {
+            client.users[i].listed = false;
+        }
+    }
+
     // Compare client list against server list, and add any new users
+    // Names are taken from the list as well, a resync may follow renames we missed
     for (int i = 0; i < msg->num_users; i++) {
-        if (!check_user_exists(msg->ids[i])) {
-            client.users[client.num_users].id = msg->ids[i];
-            client.users[client.num_users].active = USER_ACTIVE;
-            strncpy(client.users[client.num_users].name, msg->usernames[i], MAX_USERNAME_LEN);
-            client.num_users++;
+        int user_index = get_user_index(msg->ids[i]);
+        if (user_index == -1) {
+            user_index = add_user(msg->ids[i]);
+            if (user_index == -1) continue;
         }
+        strncpy(client.users[user_index].name, msg->usernames[i], MAX_USERNAME_LEN);
+        client.users[user_index].listed = true;
     }
 
-    // Also double check that all clients are in server list
+    // Once the last page is in, drop any clients that weren't in server list
+    if ((uint64_t)msg->offset + msg->num_users < msg->total_users) return;
+
     for (int i = client.num_users - 1; i >= 0; i--) {
-        bool user_active = false;
-        for (int j = 0; j < msg->num_users; j++) {
-            if (client.users[i].id == msg->ids[j]) {
-                user_active = true;
-                break;
-            }
-        }
         // If user isn't in active list, overwrite it with the last user
-        if (!user_active) {
-            client.num_users--;
-            client.users[i] = client.users[client.num_users];
-            client.users[client.num_users] = (User){0};
+        if (!client.users[i].listed) {
+            remove_user(i);
         }
     }
 
 }
 
 // Read message, and update chat room state
+// Message is viewed in place, only active user lists are copied out of the packet
 static void client_handle_packet(Packet* packet) {
 
-    MessageHeader* msg = deserialize_msg(packet->data, packet->len);
+    MessageView msg;
+
+    if (view_msg(packet->data, packet->len, &msg) != 0) {
+        printf_message("[ERROR] Received malformed message.");
+        return;
+    }
 
-    switch (msg->type) {
+    switch (msg.header.type) {
     case MSG_PING: {
-        double time = clock() - ((PingMessage*)msg)->time;
-        time *= 1000.0 / CLOCKS_PER_SEC; // Convert time to ms
+        // Heartbeats from server are addressed back to it, server drops us if we leave them unanswered
+        if (msg.header.to != client.id) {
+            client_answer_heartbeat(msg.time);
+            break;
+        }
+
+        double time = (uint32_t)(ping_clock() - msg.time) / 1000.0; // Convert time to ms
 
         printf_message("<PING! - %0.3fms>", time);
         break;
     }
     case MSG_USER_SETNAME: {
 
-        UserMessage* user_msg = (UserMessage*)msg;
-        int user_index = get_user_index(user_msg->id);
+        int user_index = get_user_index(msg.id);
 
         if (user_index == -1) {
-            printf_message("[ERROR] User id %d doesn't exist.",user_msg->id);
+            printf_message("[ERROR] User id %d doesn't exist.",msg.id);
             break;
         }
 
-        strncpy(client.users[user_index].name, user_msg->username, MAX_USERNAME_LEN);
-        printf_message("<Updated user %d to %s>",user_msg->id, user_msg->username);
+        strncpy(client.users[user_index].name, msg.text, MAX_USERNAME_LEN);
+        printf_message("<Updated user %d to %s>",msg.id, msg.text);
         update_user_display(client.users, client.num_users);
         break;
     }
     case MSG_USER_CONNECT: {
 
-        UserMessage* user_msg = (UserMessage*)msg;
-        int user_exists = check_user_exists(user_msg->id);
+        int user_exists = check_user_exists(msg.id);
 
         if (user_exists) {
-            printf_message("[ERROR] User id %d already exists.",user_msg->id);
+            printf_message("[ERROR] User id %d already exists.",msg.id);
             break;
         }
 
-        client.users[client.num_users].id = user_msg->id;
-        client.users[client.num_users].active = USER_ACTIVE;
-        client.num_users++;
+        if (add_user(msg.id) == -1) {
+            printf_message("[ERROR] Too many users to track user id %d.",msg.id);
+            break;
+        }
 
-        printf_message("<New User %d Connected>",user_msg->id);
+        printf_message("<New User %d Connected>",msg.id);
         update_user_display(client.users, client.num_users);
         break;
     }
     case MSG_USER_DISCONNECT: {
 
-        UserMessage* user_msg = (UserMessage*)msg;
-        int user_index = get_user_index(user_msg->id);
+        int user_index = get_user_index(msg.id);
 
         if (user_index == -1) {
-            printf_message("[ERROR] User id %d does not exist.",user_msg->id);
+            printf_message("[ERROR] User id %d does not exist.",msg.id);
             break;
         }
 
         // Mark user as inactive
         client.users[user_index].active = USER_INACTIVE;
 
-        printf_message("<User %d Disconnected>",user_msg->id);
+        printf_message("<User %d Disconnected>",msg.id);
         update_user_display(client.users, client.num_users);
         break;    
     }
-    case MSG_ACTIVE_USERS:
+    case MSG_ACTIVE_USERS: {
+        ActiveUserMessage* users_msg = (ActiveUserMessage*)deserialize_msg(packet->data, packet->len);
+        if (users_msg == NULL) break;
         printf_message("<Updating active user list>");
-        client_update_active_users((ActiveUserMessage*)msg);
+        client_update_active_users(users_msg);
         update_user_display(client.users, client.num_users);
+        free(users_msg);
         break;
+    }
     case MSG_CHAT: {
 
         // Look up user
         User user;
-        int i = get_user_index(msg->from);
+        int i = get_user_index(msg.header.from);
 
         if (i == -1) {
             printf_message("[ERROR] Received message from unknown user.");
@@ -235,21 +356,24 @@ static void client_handle_packet(Packet* packet) {
 
         // If there is no username, print id, otherwise print name
         if (strnlen(user.name, MAX_USERNAME_LEN) == 0) {
-            printf_message("%d: %s",msg->from,((ChatMessage*)msg)->msg);
+            printf_message("%d: %s",msg.header.from,msg.text);
         } else {
-            printf_message("%s: %s",user.name,((ChatMessage*)msg)->msg);
+            printf_message("%s: %s",user.name,msg.text);
         }
         break;
     }
     case MSG_ERROR:
-        printf_message("[ERROR]: %s",((ErrorMessage*)msg)->msg);
+        printf_message("[ERROR]: %s",msg.text);
+        break;
+    case MSG_UDP_SESSION:
+        if (client_socket_start_udp(client.socket_connection, msg.port, client.id, msg.token) == SOCK_SUCCESS) {
+            printf_message("<Using UDP side channel on port %d>", msg.port);
+        }
         break;
     default:
         printf_message("[ERROR] Received invalid message type.");
         break;
     }
-
-    free(msg);
 }
 
 // Check for message from socket
@@ -258,17 +382,17 @@ static ChatStatus client_check_messages(int timeout) {
     int status;
     Packet* packet;
 
-    status = poll_sockets(timeout);
+    status = poll_sockets(client.socket_connection, timeout);
 
     if (status != SOCK_SUCCESS) return CHAT_FAILURE;
 
-    // Check for messages
-    packet = pop_packet();
-
-    // Handle Packet
-    if (packet != NULL) {
+    // Handle every packet received, a single read can contain many
+    packet = pop_packets(client.socket_connection, NULL);
+    while (packet != NULL) {
+        Packet* next = packet->next_packet;
         client_handle_packet(packet);
-        free(packet);
+        free_packet(packet);
+        packet = next;
     }
 
     return CHAT_SUCCESS;
@@ -281,18 +405,23 @@ ChatStatus start_chat_client(const char* host, const char* port) {
     Packet* packet;
     MessageHeader* msg;
 
-    status = start_client_socket(host, port);
+    client.socket_connection = &server_socket;
+    status = start_client_socket(client.socket_connection, host, port);
 
     if (status != SOCK_SUCCESS) return CHAT_FAILURE;
     
     printf("Client started. Listening for server greeting...\n");
 
-    // 10 second timeout
-    status = poll_sockets(10000);
+    // 10 second timeout, wakeups that bring no whole message (socket turning writable, part of a record) don't count
+    uint32_t start = ping_clock();
+    while ((packet = pop_packet(client.socket_connection)) == NULL) {
+        uint32_t elapsed_ms = (ping_clock() - start) / 1000;
+        if (elapsed_ms >= 10000) break;
 
-    if (status != SOCK_SUCCESS) return CHAT_FAILURE;
+        status = poll_sockets(client.socket_connection, (int)(10000 - elapsed_ms));
+        if (status != SOCK_SUCCESS) return CHAT_FAILURE;
+    }
 
-    packet = pop_packet();
     if (packet == NULL) {
         printf("No reply from server. Disconnecting.\n");
         return CHAT_FAILURE;
@@ -300,10 +429,10 @@ ChatStatus start_chat_client(const char* host, const char* port) {
 
     // Expect first message to be list of active users
     msg = deserialize_msg(packet->data, packet->len);
-    if (msg->type != MSG_ACTIVE_USERS) {
+    if (msg == NULL || msg->type != MSG_ACTIVE_USERS) {
         printf("Incorrect greeting from server. Disconnecting.\n");
         free(msg);
-        free(packet);
+        free_packet(packet);
         return CHAT_FAILURE;
     }
     
@@ -315,7 +444,7 @@ ChatStatus start_chat_client(const char* host, const char* port) {
     printf("Client connected successfully. Client id: %d\n", client.id);
 
     free(msg);
-    free(packet);
+    free_packet(packet);
 
     return CHAT_SUCCESS;
 }
@@ -385,6 +514,6 @@ void end_chat_client(void) {
     kill_window();
 
     // Shutdown socket
-    shutdown_client_socket();
+    shutdown_client_socket(client.socket_connection);
 
 }
@@ -0,0 +1,560 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <endian.h>
+#include <arpa/inet.h>
+
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
+#include <openssl/pem.h>
+#include <openssl/crypto.h>
+
+#if defined(__aarch64__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+#include "crypt.h"
+
+#define CRYPT_MAGIC         "CHT\x02"       // Opens every hello, last byte is the protocol version
+#define CRYPT_MAGIC_LEN     (4)
+#define CRYPT_FLAG_AES      (0x01)          // Sender has AES instructions
+#define CRYPT_KEY_LEN       (32)
+#define CRYPT_NONCE_LEN     (12)
+#define CRYPT_STATE_INITIATOR (0x01)        // Exported session flags
+#define CRYPT_STATE_READY   (0x02)
+#define CRYPT_STATE_AES     (0x04)
+#define CRYPT_STATE_PINNED  (0x08)
+#define CRYPT_SIG_CONTEXT   "chat server hello"     // Opens what servers sign, so a signature can't be passed off as anything else
+#define CRYPT_SIGNED_LEN    (sizeof CRYPT_SIG_CONTEXT - 1 + CRYPT_HELLO_LEN + CRYPT_ID_KEY_LEN)   // Signed bytes: context, hello and identity key
+
+// Whether this CPU has AES and carry-less multiply instructions, which is what makes GCM fast
+static bool aes_hardware(void) {
+
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_cpu_supports("aes") && __builtin_cpu_supports("pclmul");
+#elif defined(__aarch64__)
+    return (getauxval(AT_HWCAP) & HWCAP_AES) && (getauxval(AT_HWCAP) & HWCAP_PMULL);
+#else
+    return false;
+#endif
+}
+
+// Nonce is the sequence number, padded out with zeroes
+static void make_nonce(uint64_t seq, unsigned char nonce[CRYPT_NONCE_LEN]) {
+
+    uint64_t nw_seq = htobe64(seq);
+
+    memset(nonce, 0, CRYPT_NONCE_LEN - sizeof nw_seq);
+    memcpy(nonce + CRYPT_NONCE_LEN - sizeof nw_seq, &nw_seq, sizeof nw_seq);
+}
+
+// Make cipher context holding key, return NULL on failure
+static EVP_CIPHER_CTX* make_cipher(const EVP_CIPHER* cipher, const unsigned char* key, bool encrypt) {
+
+    EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+    if (ctx == NULL) return NULL;
+
+    if (EVP_CipherInit_ex(ctx, cipher, NULL, key, NULL, encrypt) != 1) {
+        EVP_CIPHER_CTX_free(ctx);
+        return NULL;
+    }
+
+    return ctx;
+}
+
+// Load long-term key from PEM file, making it and writing it out first if missing
+// With no path the key is made fresh, so clients have to pin it again after every start
+EVP_PKEY* crypt_load_identity(const char* path) {
+
+    if (path == NULL) return EVP_PKEY_Q_keygen(NULL, NULL, "ED25519");
+
+    FILE* file = fopen(path, "r");
+    if (file != NULL) {
+        EVP_PKEY* identity = PEM_read_PrivateKey(file, NULL, NULL, NULL);
+        fclose(file);
+        if (identity != NULL && !EVP_PKEY_is_a(identity, "ED25519")) {
+            EVP_PKEY_free(identity);
+            return NULL;
+        }
+        return identity;
+    }
+    if (errno != ENOENT) return NULL;
+
+    // Only we may read the new key, and a file that appeared meanwhile is left alone
+    int fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd == -1) return NULL;
+
+    EVP_PKEY* identity = EVP_PKEY_Q_keygen(NULL, NULL, "ED25519");
+    file = fdopen(fd, "w");
+    bool saved = identity != NULL && file != NULL && PEM_write_PrivateKey(file, identity, NULL, NULL, 0, NULL, NULL) == 1;
+
+    if (file != NULL) saved = fclose(file) == 0 && saved;
+    else close(fd);
+
+    if (!saved) {
+        unlink(path);
+        EVP_PKEY_free(identity);
+        return NULL;
+    }
+
+    return identity;
+}
+
+// Release long-term key
+void crypt_free_identity(EVP_PKEY* identity) {
+
+    EVP_PKEY_free(identity);
+}
+
+// Fingerprint is SHA-256 of the raw public key
+static int fingerprint(const unsigned char* id_key, unsigned char out[CRYPT_FINGERPRINT_LEN]) {
+
+    return EVP_Digest(id_key, CRYPT_ID_KEY_LEN, out, NULL, EVP_sha256(), NULL) == 1 ? 0 : -1;
+}
+
+// Write key's fingerprint in hex, return -1 on failure
+int crypt_fingerprint(EVP_PKEY* identity, char hex[CRYPT_FINGERPRINT_HEX]) {
+
+    unsigned char id_key[CRYPT_ID_KEY_LEN];
+    unsigned char out[CRYPT_FINGERPRINT_LEN];
+    size_t key_len = CRYPT_ID_KEY_LEN;
+
+    if (EVP_PKEY_get_raw_public_key(identity, id_key, &key_len) != 1 || key_len != CRYPT_ID_KEY_LEN) return -1;
+    if (fingerprint(id_key, out) != 0) return -1;
+
+    for (int i = 0; i < CRYPT_FINGERPRINT_LEN; i++) snprintf(hex + 2 * i, 3, "%02x", out[i]);
+
+    return 0;
+}
+
+// Make ephemeral key and our hello, return -1 on failure
+int crypt_init(CryptSession* session, bool initiator) {
+
+    size_t key_len = CRYPT_KEY_LEN;
+
+    memset(session, 0, sizeof *session);
+    session->initiator = initiator;
+    session->hello_len = CRYPT_HELLO_LEN;
+
+    session->key = EVP_PKEY_Q_keygen(NULL, NULL, "X25519");
+    if (session->key == NULL) return -1;
+
+    memcpy(session->hello, CRYPT_MAGIC, CRYPT_MAGIC_LEN);
+    session->hello[CRYPT_MAGIC_LEN] = aes_hardware() ? CRYPT_FLAG_AES : 0;
+
+    if (EVP_PKEY_get_raw_public_key(session->key, (unsigned char*)session->hello + CRYPT_MAGIC_LEN + 1, &key_len) != 1 ||
+        key_len != CRYPT_KEY_LEN) {
+        crypt_free(session);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Bytes a server signs: context, then its hello and identity key
+static void signed_message(const char* hello, unsigned char message[CRYPT_SIGNED_LEN]) {
+
+    memcpy(message, CRYPT_SIG_CONTEXT, sizeof CRYPT_SIG_CONTEXT - 1);
+    memcpy(message + sizeof CRYPT_SIG_CONTEXT - 1, hello, CRYPT_HELLO_LEN + CRYPT_ID_KEY_LEN);
+}
+
+// Sign our hello with long-term key, so clients can tell it came from us, return -1 on failure
+// Signature covers our ephemeral key, and both hellos go into the keys, so nobody else can finish the handshake
+int crypt_sign_hello(CryptSession* session, EVP_PKEY* identity) {
+
+    unsigned char message[CRYPT_SIGNED_LEN];
+    unsigned char* id_key = (unsigned char*)session->hello + CRYPT_HELLO_LEN;
+    size_t key_len = CRYPT_ID_KEY_LEN;
+    size_t sig_len = CRYPT_SIG_LEN;
+    int status = -1;
+
+    if (session->initiator || session->key == NULL || session->hello_len != CRYPT_HELLO_LEN) return -1;
+    if (EVP_PKEY_get_raw_public_key(identity, id_key, &key_len) != 1 || key_len != CRYPT_ID_KEY_LEN) return -1;
+
+    signed_message(session->hello, message);
+
+    EVP_MD_CTX* ctx = EVP_MD_CTX_new();
+    if (ctx != NULL && EVP_DigestSignInit(ctx, NULL, NULL, NULL, identity) == 1 &&
+        EVP_DigestSign(ctx, id_key + CRYPT_ID_KEY_LEN, &sig_len, message, sizeof message) == 1 && sig_len == CRYPT_SIG_LEN) {
+        session->hello_len = CRYPT_SIGNED_HELLO_LEN;
+        status = 0;
+    }
+
+    EVP_MD_CTX_free(ctx);
+
+    return status;
+}
+
+// Value of one hex digit, -1 if it isn't one
+static int hex_digit(char c) {
+
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// Only accept a hello signed by key with this hex fingerprint, return -1 if it is malformed
+int crypt_pin(CryptSession* session, const char* hex) {
+
+    if (hex == NULL || strlen(hex) != 2 * CRYPT_FINGERPRINT_LEN) return -1;
+
+    for (int i = 0; i < CRYPT_FINGERPRINT_LEN; i++) {
+        int high = hex_digit(hex[2 * i]);
+        int low = hex_digit(hex[2 * i + 1]);
+        if (high < 0 || low < 0) return -1;
+        session->pin[i] = (unsigned char)(high << 4 | low);
+    }
+
+    session->pinned = true;
+
+    return 0;
+}
+
+// Check server's hello is signed by the key we pinned, return -1 if not
+static int verify_hello(const CryptSession* session, const char* peer_hello) {
+
+    unsigned char message[CRYPT_SIGNED_LEN];
+    unsigned char out[CRYPT_FINGERPRINT_LEN];
+    const unsigned char* id_key = (const unsigned char*)peer_hello + CRYPT_HELLO_LEN;
+    int status = -1;
+
+    if (!session->pinned) return -1;
+    if (fingerprint(id_key, out) != 0 || CRYPTO_memcmp(out, session->pin, sizeof out) != 0) return -1;
+
+    signed_message(peer_hello, message);
+
+    EVP_PKEY* identity = EVP_PKEY_new_raw_public_key(EVP_PKEY_ED25519, NULL, id_key, CRYPT_ID_KEY_LEN);
+    EVP_MD_CTX* ctx = EVP_MD_CTX_new();
+
+    if (identity != NULL && ctx != NULL && EVP_DigestVerifyInit(ctx, NULL, NULL, NULL, identity) == 1 &&
+        EVP_DigestVerify(ctx, id_key + CRYPT_ID_KEY_LEN, CRYPT_SIG_LEN, message, sizeof message) == 1) {
+        status = 0;
+    }
+
+    EVP_MD_CTX_free(ctx);
+    EVP_PKEY_free(identity);
+
+    return status;
+}
+
+// Get X25519 shared secret with peer's public key, return -1 on failure
+static int shared_secret(EVP_PKEY* key, const char* peer_key, unsigned char secret[CRYPT_KEY_LEN]) {
+
+    size_t len = CRYPT_KEY_LEN;
+    int status = -1;
+
+    EVP_PKEY* peer = EVP_PKEY_new_raw_public_key(EVP_PKEY_X25519, NULL, (const unsigned char*)peer_key, CRYPT_KEY_LEN);
+    EVP_PKEY_CTX* ctx = EVP_PKEY_CTX_new(key, NULL);
+
+    // Low order peer keys give an all zero secret, which derive refuses
+    if (peer != NULL && ctx != NULL && EVP_PKEY_derive_init(ctx) == 1 && EVP_PKEY_derive_set_peer(ctx, peer) == 1 &&
+        EVP_PKEY_derive(ctx, secret, &len) == 1 && len == CRYPT_KEY_LEN) {
+        status = 0;
+    }
+
+    EVP_PKEY_CTX_free(ctx);
+    EVP_PKEY_free(peer);
+
+    return status;
+}
+
+// Expand shared secret into every key with HKDF-SHA256, salted with both hellos
+static int expand_keys(const unsigned char* secret, const char* salt, size_t salt_len, unsigned char* keys, size_t len) {
+
+    static const char info[] = "chat record keys";
+    int status = -1;
+
+    EVP_PKEY_CTX* ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, NULL);
+
+    if (ctx != NULL && EVP_PKEY_derive_init(ctx) == 1 &&
+        EVP_PKEY_CTX_set_hkdf_md(ctx, EVP_sha256()) == 1 &&
+        EVP_PKEY_CTX_set1_hkdf_salt(ctx, (const unsigned char*)salt, salt_len) == 1 &&
+        EVP_PKEY_CTX_set1_hkdf_key(ctx, secret, CRYPT_KEY_LEN) == 1 &&
+        EVP_PKEY_CTX_add1_hkdf_info(ctx, (const unsigned char*)info, sizeof info - 1) == 1 &&
+        EVP_PKEY_derive(ctx, keys, &len) == 1) {
+        status = 0;
+    }
+
+    EVP_PKEY_CTX_free(ctx);
+
+    return status;
+}
+
+// Make a cipher context for each direction from agreed keys, return -1 on failure
+static int make_ciphers(CryptSession* session) {
+
+    const EVP_CIPHER* cipher = session->aes ? EVP_aes_256_gcm() : EVP_chacha20_poly1305();
+    const unsigned char* out = session->keys + (session->initiator ? 0 : CRYPT_KEY_LEN);
+    const unsigned char* in = session->keys + (session->initiator ? CRYPT_KEY_LEN : 0);
+
+    session->tx = make_cipher(cipher, out, true);
+    session->rx = make_cipher(cipher, in, false);
+    session->udp_tx = make_cipher(cipher, out + 2 * CRYPT_KEY_LEN, true);
+    session->udp_rx = make_cipher(cipher, in + 2 * CRYPT_KEY_LEN, false);
+
+    return session->tx != NULL && session->rx != NULL && session->udp_tx != NULL && session->udp_rx != NULL ? 0 : -1;
+}
+
+// Agree keys from peer's hello, return -1 if it is invalid
+// Initiators only finish with a server hello signed by the key they pinned, so nobody can sit in the middle
+int crypt_finish(CryptSession* session, const char* peer_hello) {
+
+    unsigned char secret[CRYPT_KEY_LEN];
+    char salt[CRYPT_HELLO_LEN + CRYPT_SIGNED_HELLO_LEN];
+    int status = -1;
+
+    if (session->ready || session->key == NULL) return -1;
+    if (memcmp(peer_hello, CRYPT_MAGIC, CRYPT_MAGIC_LEN) != 0) return -1;
+    if (session->initiator ? verify_hello(session, peer_hello) != 0 : session->hello_len != CRYPT_SIGNED_HELLO_LEN) return -1;
+
+    // Both sides salt with the initiator's hello first, which also ties the cipher choice to the keys
+    memcpy(salt, session->initiator ? session->hello : peer_hello, CRYPT_HELLO_LEN);
+    memcpy(salt + CRYPT_HELLO_LEN, session->initiator ? peer_hello : session->hello, CRYPT_SIGNED_HELLO_LEN);
+
+    session->aes = (session->hello[CRYPT_MAGIC_LEN] & CRYPT_FLAG_AES) && (peer_hello[CRYPT_MAGIC_LEN] & CRYPT_FLAG_AES);
+
+    if (shared_secret(session->key, peer_hello + CRYPT_MAGIC_LEN + 1, secret) == 0 &&
+        expand_keys(secret, salt, sizeof salt, session->keys, sizeof session->keys) == 0) {
+        status = make_ciphers(session);
+    }
+
+    OPENSSL_cleanse(secret, sizeof secret);
+
+    // Ephemeral key is done with either way
+    EVP_PKEY_free(session->key);
+    session->key = NULL;
+
+    session->ready = status == 0;
+
+    return status;
+}
+
+// Release keys
+void crypt_free(CryptSession* session) {
+
+    EVP_PKEY_free(session->key);
+    EVP_CIPHER_CTX_free(session->tx);
+    EVP_CIPHER_CTX_free(session->rx);
+    EVP_CIPHER_CTX_free(session->udp_tx);
+    EVP_CIPHER_CTX_free(session->udp_rx);
+
+    OPENSSL_cleanse(session, sizeof *session);
+}
+
+// Write session into CRYPT_STATE_LEN bytes, so a restarted server can carry it on, return length or 0
+// Sessions still waiting on the peer's hello carry their ephemeral key in place of agreed keys
+size_t crypt_export(const CryptSession* session, char* state) {
+
+    unsigned char* pos = (unsigned char*)state;
+    uint64_t seqs[4] = {session->tx_seq, session->rx_seq, session->udp_tx_seq, session->udp_rx_seq};
+    size_t key_len = CRYPT_KEY_LEN;
+
+    *pos++ = (session->initiator ? CRYPT_STATE_INITIATOR : 0) | (session->ready ? CRYPT_STATE_READY : 0) |
+             (session->aes ? CRYPT_STATE_AES : 0) | (session->pinned ? CRYPT_STATE_PINNED : 0);
+    *pos++ = (unsigned char)session->hello_len;
+    memcpy(pos, session->hello, CRYPT_SIGNED_HELLO_LEN);
+    pos += CRYPT_SIGNED_HELLO_LEN;
+    memcpy(pos, session->pin, CRYPT_FINGERPRINT_LEN);
+    pos += CRYPT_FINGERPRINT_LEN;
+
+    if (session->ready) {
+        memcpy(pos, session->keys, CRYPT_KEYS_LEN);
+    } else {
+        memset(pos, 0, CRYPT_KEYS_LEN);
+        if (session->key == NULL || EVP_PKEY_get_raw_private_key(session->key, pos, &key_len) != 1 || key_len != CRYPT_KEY_LEN) return 0;
+    }
+    pos += CRYPT_KEYS_LEN;
+
+    for (int i = 0; i < 4; i++) {
+        uint64_t nw_seq = htobe64(seqs[i]);
+        memcpy(pos, &nw_seq, sizeof nw_seq);
+        pos += sizeof nw_seq;
+    }
+
+    return CRYPT_STATE_LEN;
+}
+
+// Rebuild session crypt_export wrote, return -1 if it is invalid
+int crypt_import(CryptSession* session, const char* state, size_t len) {
+
+    const unsigned char* pos = (const unsigned char*)state;
+    uint64_t seqs[4];
+
+    memset(session, 0, sizeof *session);
+    if (len != CRYPT_STATE_LEN) return -1;
+
+    uint8_t flags = *pos++;
+    session->initiator = flags & CRYPT_STATE_INITIATOR;
+    session->ready = flags & CRYPT_STATE_READY;
+    session->aes = flags & CRYPT_STATE_AES;
+    session->pinned = flags & CRYPT_STATE_PINNED;
+    session->hello_len = *pos++;
+    memcpy(session->hello, pos, CRYPT_SIGNED_HELLO_LEN);
+    pos += CRYPT_SIGNED_HELLO_LEN;
+    memcpy(session->pin, pos, CRYPT_FINGERPRINT_LEN);
+    pos += CRYPT_FINGERPRINT_LEN;
+
+    if (session->hello_len != CRYPT_HELLO_LEN && session->hello_len != CRYPT_SIGNED_HELLO_LEN) return -1;
+
+    if (session->ready) {
+        memcpy(session->keys, pos, CRYPT_KEYS_LEN);
+    } else {
+        session->key = EVP_PKEY_new_raw_private_key(EVP_PKEY_X25519, NULL, pos, CRYPT_KEY_LEN);
+    }
+    pos += CRYPT_KEYS_LEN;
+
+    for (int i = 0; i < 4; i++) {
+        memcpy(&seqs[i], pos, sizeof seqs[i]);
+        seqs[i] = be64toh(seqs[i]);
+        pos += sizeof seqs[i];
+    }
+    session->tx_seq = seqs[0];
+    session->rx_seq = seqs[1];
+    session->udp_tx_seq = seqs[2];
+    session->udp_rx_seq = seqs[3];
+
+    if (session->ready ? make_ciphers(session) != 0 : session->key == NULL) {
+        crypt_free(session);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Length of next piece of the stream: peer's hello until the handshake is done, then records
+// Return 0 if its length isn't all there yet, -1 if it can't be one of ours
+ssize_t crypt_record_len(const CryptSession* session, const char* data, size_t num_bytes) {
+
+    uint16_t len;
+
+    if (!session->ready) return session->initiator ? CRYPT_SIGNED_HELLO_LEN : CRYPT_HELLO_LEN;
+    if (num_bytes < CRYPT_HEADER_LEN) return 0;
+
+    memcpy(&len, data, sizeof len);
+    len = ntohs(len);
+
+    if (len < CRYPT_TAG_LEN || len > CRYPT_RECORD_MAX + CRYPT_TAG_LEN) return -1;
+
+    return CRYPT_HEADER_LEN + len;
+}
+
+// Encrypt fragments to out under nonce, authenticating aad, and append tag
+// Return bytes written, or 0 on failure
+static size_t seal(EVP_CIPHER_CTX* ctx, uint64_t seq, const char* aad, size_t aad_len,
+                   const struct iovec* iov, int iovcnt, char* out) {
+
+    unsigned char nonce[CRYPT_NONCE_LEN];
+    size_t num_bytes = 0;
+    int len;
+
+    make_nonce(seq, nonce);
+
+    if (EVP_EncryptInit_ex(ctx, NULL, NULL, NULL, nonce) != 1) return 0;
+    if (aad_len > 0 && EVP_EncryptUpdate(ctx, NULL, &len, (const unsigned char*)aad, (int)aad_len) != 1) return 0;
+
+    for (int i = 0; i < iovcnt; i++) {
+        if (EVP_EncryptUpdate(ctx, (unsigned char*)out + num_bytes, &len, iov[i].iov_base, (int)iov[i].iov_len) != 1) return 0;
+        num_bytes += len;
+    }
+
+    if (EVP_EncryptFinal_ex(ctx, (unsigned char*)out + num_bytes, &len) != 1) return 0;
+    num_bytes += len;
+
+    if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, CRYPT_TAG_LEN, out + num_bytes) != 1) return 0;
+
+    return num_bytes + CRYPT_TAG_LEN;
+}
+
+// Decrypt data in place under nonce, checking aad and the tag that follows it
+// Return -1 if anything was tampered with
+static int open_in_place(EVP_CIPHER_CTX* ctx, uint64_t seq, const char* aad, size_t aad_len, char* data, size_t len) {
+
+    unsigned char nonce[CRYPT_NONCE_LEN];
+    int out_len;
+
+    make_nonce(seq, nonce);
+
+    if (EVP_DecryptInit_ex(ctx, NULL, NULL, NULL, nonce) != 1) return -1;
+    if (aad_len > 0 && EVP_DecryptUpdate(ctx, NULL, &out_len, (const unsigned char*)aad, (int)aad_len) != 1) return -1;
+    if (EVP_DecryptUpdate(ctx, (unsigned char*)data, &out_len, (unsigned char*)data, (int)len) != 1) return -1;
+    if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, CRYPT_TAG_LEN, data + len) != 1) return -1;
+    if (EVP_DecryptFinal_ex(ctx, (unsigned char*)data + out_len, &out_len) != 1) return -1;
+
+    return 0;
+}
+
+// Seal up to CRYPT_RECORD_MAX bytes of fragments into one record, return its length or 0
+// record needs room for CRYPT_RECORD_LEN of the fragments' total length
+size_t crypt_seal(CryptSession* session, const struct iovec* iov, int iovcnt, char* record) {
+
+    size_t num_bytes = 0;
+
+    if (!session->ready) return 0;
+
+    for (int i = 0; i < iovcnt; i++) num_bytes += iov[i].iov_len;
+    if (num_bytes > CRYPT_RECORD_MAX) return 0;
+
+    // Length prefix is authenticated along with the body
+    uint16_t nw_len = htons((uint16_t)(num_bytes + CRYPT_TAG_LEN));
+    memcpy(record, &nw_len, CRYPT_HEADER_LEN);
+
+    if (seal(session->tx, session->tx_seq, record, CRYPT_HEADER_LEN, iov, iovcnt, record + CRYPT_HEADER_LEN) == 0) return 0;
+    session->tx_seq++;
+
+    return CRYPT_RECORD_LEN(num_bytes);
+}
+
+// Open record in place, plaintext starts CRYPT_HEADER_LEN bytes in
+// Return plaintext length, or -1 if it fails to authenticate
+ssize_t crypt_open(CryptSession* session, char* record, size_t len) {
+
+    if (!session->ready || len < CRYPT_RECORD_LEN(0)) return -1;
+
+    size_t num_bytes = len - CRYPT_RECORD_LEN(0);
+    if (open_in_place(session->rx, session->rx_seq, record, CRYPT_HEADER_LEN, record + CRYPT_HEADER_LEN, num_bytes) != 0) return -1;
+    session->rx_seq++;
+
+    return (ssize_t)num_bytes;
+}
+
+// Seal datagram in place, return its new length or 0
+// Plaintext starts CRYPT_SEQ_LEN bytes in, and CRYPT_TAG_LEN bytes after it must be free
+size_t crypt_seal_datagram(CryptSession* session, char* datagram, size_t len) {
+
+    struct iovec iov = {.iov_base = datagram + CRYPT_SEQ_LEN, .iov_len = len};
+
+    if (!session->ready) return 0;
+
+    uint64_t seq = ++session->udp_tx_seq;
+    uint64_t nw_seq = htobe64(seq);
+    memcpy(datagram, &nw_seq, CRYPT_SEQ_LEN);
+
+    if (seal(session->udp_tx, seq, datagram, CRYPT_SEQ_LEN, &iov, 1, datagram + CRYPT_SEQ_LEN) == 0) return 0;
+
+    return CRYPT_SEQ_LEN + len + CRYPT_TAG_LEN;
+}
+
+// Open datagram in place, plaintext starts CRYPT_SEQ_LEN bytes in
+// Return plaintext length, or -1 if it fails to authenticate or was seen before
+// Anything older than the newest datagram counts as seen, late datagrams are as good as lost
+ssize_t crypt_open_datagram(CryptSession* session, char* datagram, size_t len) {
+
+    uint64_t seq;
+
+    if (!session->ready || len < CRYPT_SEQ_LEN + CRYPT_TAG_LEN) return -1;
+
+    memcpy(&seq, datagram, CRYPT_SEQ_LEN);
+    seq = be64toh(seq);
+    if (seq <= session->udp_rx_seq) return -1;
+
+    size_t num_bytes = len - CRYPT_SEQ_LEN - CRYPT_TAG_LEN;
+    if (open_in_place(session->udp_rx, seq, datagram, CRYPT_SEQ_LEN, datagram + CRYPT_SEQ_LEN, num_bytes) != 0) return -1;
+    session->udp_rx_seq = seq;
+
+    return (ssize_t)num_bytes;
+}
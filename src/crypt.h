@@ -0,0 +1,65 @@
+#ifndef CRYPT_H
+#define CRYPT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/uio.h>
+#include <sys/types.h>
+
+#define CRYPT_HELLO_LEN     (37)            // Magic and version(4), flags(1), X25519 public key(32)
+#define CRYPT_ID_KEY_LEN    (32)            // Ed25519 public key of a server's long-term identity
+#define CRYPT_SIG_LEN       (64)            // Ed25519 signature
+#define CRYPT_SIGNED_HELLO_LEN (CRYPT_HELLO_LEN + CRYPT_ID_KEY_LEN + CRYPT_SIG_LEN)  // Server's hello, followed by its identity key and signature
+#define CRYPT_FINGERPRINT_LEN (32)          // SHA-256 of an identity key, clients pin servers by it
+#define CRYPT_FINGERPRINT_HEX (2 * CRYPT_FINGERPRINT_LEN + 1)   // Buffer for a fingerprint in hex
+#define CRYPT_HEADER_LEN    (2)             // Record length prefix, covers ciphertext and tag
+#define CRYPT_TAG_LEN       (16)            // AEAD tag closing each record or datagram
+#define CRYPT_SEQ_LEN       (8)             // Sequence number opening each datagram
+#define CRYPT_RECORD_MAX    (16384)         // Most plaintext bytes sealed in one record
+#define CRYPT_RECORD_LEN(n) (CRYPT_HEADER_LEN + (n) + CRYPT_TAG_LEN)   // Record length for n plaintext bytes
+#define CRYPT_KEYS_LEN      (4 * 32)        // Stream then datagram keys, initiator's direction first
+#define CRYPT_STATE_LEN     (2 + CRYPT_SIGNED_HELLO_LEN + CRYPT_FINGERPRINT_LEN + CRYPT_KEYS_LEN + 4 * 8)   // Session as crypt_export writes it
+
+// One side's record layer state
+// Records are numbered per direction, and that number is the nonce, so none go on the wire
+// Datagrams may be lost or reordered, so they carry their own numbers under separate keys
+// Servers sign their hello with a long-term key, and clients only take a hello signed by the key they pinned
+typedef struct CryptSession {
+    struct evp_pkey_st* key;                // Our ephemeral key, freed once the handshake is done
+    char hello[CRYPT_SIGNED_HELLO_LEN];     // Hello we sent, both hellos go into the keys
+    size_t hello_len;                       // Length of our hello, longer once signed
+    unsigned char pin[CRYPT_FINGERPRINT_LEN];   // Fingerprint server's identity key must have
+    bool pinned;                            // Whether pin is set, initiators refuse to finish without one
+    bool initiator;                         // Whether we connected, so sent the first hello
+    bool ready;                             // Whether keys are agreed
+    bool aes;                               // AES-GCM if both sides have AES instructions, ChaCha20-Poly1305 otherwise
+    unsigned char keys[CRYPT_KEYS_LEN];     // Agreed keys, kept so a restarted server can carry the session on
+
+    struct evp_cipher_ctx_st* tx;           // Stream keys, one for each direction
+    struct evp_cipher_ctx_st* rx;
+    struct evp_cipher_ctx_st* udp_tx;       // Datagram keys, one for each direction
+    struct evp_cipher_ctx_st* udp_rx;
+    uint64_t tx_seq;                        // Next record numbers
+    uint64_t rx_seq;
+    uint64_t udp_tx_seq;                    // Next datagram number to send
+    uint64_t udp_rx_seq;                    // Last datagram number accepted, older ones are replays
+} CryptSession;
+
+struct evp_pkey_st* crypt_load_identity(const char* path);              // Load long-term key from PEM file, making it if missing, NULL path for one that lasts until exit
+void crypt_free_identity(struct evp_pkey_st* identity);                 // Release long-term key
+int crypt_fingerprint(struct evp_pkey_st* identity, char hex[CRYPT_FINGERPRINT_HEX]);   // Write key's fingerprint in hex, return -1 on failure
+int crypt_init(CryptSession* session, bool initiator);                  // Make ephemeral key and our hello, return -1 on failure
+int crypt_sign_hello(CryptSession* session, struct evp_pkey_st* identity);  // Sign our hello with long-term key, for servers, return -1 on failure
+int crypt_pin(CryptSession* session, const char* fingerprint);          // Only accept a hello signed by key with this hex fingerprint, for clients, return -1 if malformed
+int crypt_finish(CryptSession* session, const char* peer_hello);         // Agree keys from peer's hello, return -1 if it is invalid or not signed by pinned key
+void crypt_free(CryptSession* session);                                 // Release keys
+size_t crypt_export(const CryptSession* session, char* state);          // Write session into CRYPT_STATE_LEN bytes for a restarted server, return length or 0
+int crypt_import(CryptSession* session, const char* state, size_t len); // Rebuild session crypt_export wrote, return -1 if it is invalid
+ssize_t crypt_record_len(const CryptSession* session, const char* data, size_t num_bytes);  // Length of next hello or record, 0 if unknown yet, -1 if invalid
+size_t crypt_seal(CryptSession* session, const struct iovec* iov, int iovcnt, char* record);  // Seal up to CRYPT_RECORD_MAX bytes into a record, return its length or 0
+ssize_t crypt_open(CryptSession* session, char* record, size_t len);    // Open record in place, return plaintext length or -1 if it fails to authenticate
+size_t crypt_seal_datagram(CryptSession* session, char* datagram, size_t len);  // Seal datagram in place, return its new length or 0
+ssize_t crypt_open_datagram(CryptSession* session, char* datagram, size_t len); // Open datagram in place, return plaintext length or -1
+
+#endif // CRYPT_H
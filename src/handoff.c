@@ -0,0 +1,464 @@
+#define _GNU_SOURCE    // MSG_CMSG_CLOEXEC
+
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+#include <endian.h>
+
+#include "handoff.h"
+
+#define HANDOFF_UNIX_SOCKET (0x01)          // Listener flags: Unix listener is passed
+#define HANDOFF_UDP_SOCKET  (0x02)          // Side channel is passed
+#define HANDOFF_DATAGRAM    (0x01)          // Packet flags: packet arrived on the side channel
+#define HANDOFF_CRYPT       (0x01)          // Client flags: session follows
+#define HANDOFF_SHM         (0x02)          // Shared rings are passed
+#define HANDOFF_SHM_PENDING (0x04)          // Shared rings are asked for
+#define HANDOFF_SEALED      (0x01)          // TX flags: bytes are records or our hello, so go out as they are
+
+// Write fields at pos in network byte order, and move pos past them
+static void put_u8(char** pos, uint8_t value) {
+    **pos = (char)value;
+    *pos += 1;
+}
+
+static void put_u16(char** pos, uint16_t value) {
+    uint16_t nw_value = htons(value);
+    memcpy(*pos, &nw_value, sizeof nw_value);
+    *pos += sizeof nw_value;
+}
+
+static void put_u32(char** pos, uint32_t value) {
+    uint32_t nw_value = htonl(value);
+    memcpy(*pos, &nw_value, sizeof nw_value);
+    *pos += sizeof nw_value;
+}
+
+static void put_u64(char** pos, uint64_t value) {
+    uint64_t nw_value = htobe64(value);
+    memcpy(*pos, &nw_value, sizeof nw_value);
+    *pos += sizeof nw_value;
+}
+
+static void put_bytes(char** pos, const void* data, size_t len) {
+    memcpy(*pos, data, len);
+    *pos += len;
+}
+
+// Read fields written by put, callers check the record is long enough first
+static uint8_t get_u8(const char** pos) {
+    uint8_t value = (uint8_t)**pos;
+    *pos += 1;
+    return value;
+}
+
+static uint16_t get_u16(const char** pos) {
+    uint16_t nw_value;
+    memcpy(&nw_value, *pos, sizeof nw_value);
+    *pos += sizeof nw_value;
+    return ntohs(nw_value);
+}
+
+static uint32_t get_u32(const char** pos) {
+    uint32_t nw_value;
+    memcpy(&nw_value, *pos, sizeof nw_value);
+    *pos += sizeof nw_value;
+    return ntohl(nw_value);
+}
+
+static uint64_t get_u64(const char** pos) {
+    uint64_t nw_value;
+    memcpy(&nw_value, *pos, sizeof nw_value);
+    *pos += sizeof nw_value;
+    return be64toh(nw_value);
+}
+
+static void get_bytes(const char** pos, void* data, size_t len) {
+    memcpy(data, *pos, len);
+    *pos += len;
+}
+
+// Bound how long either server blocks on the other during a handoff
+int handoff_set_timeout(int fd) {
+
+    struct timeval tv = {.tv_sec = HANDOFF_TIMEOUT / 1000, .tv_usec = (HANDOFF_TIMEOUT % 1000) * 1000};
+
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv) != 0) return -1;
+    return setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+}
+
+#define HANDOFF_MAX_IOV     (3)             // Most pieces of data in one record
+
+// Send one handoff record, made of its type, a fixed part and pieces of data, along with any descriptors it carries
+// Return -1 on failure
+static int handoff_sendv(int fd, HandoffType type, const void* head, size_t head_len, const struct iovec* data, int num_data, const int* fds, int num_fds) {
+
+    char control[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)] = {0};
+    uint32_t tag = htonl(type);
+    struct iovec iov[2 + HANDOFF_MAX_IOV] = {
+        {.iov_base = &tag, .iov_len = sizeof tag},
+        {.iov_base = (void*)head, .iov_len = head_len},
+    };
+    size_t len = sizeof tag + head_len;
+    struct msghdr msg = {0};
+
+    if (num_data > HANDOFF_MAX_IOV || num_fds > HANDOFF_MAX_FDS) return -1;
+
+    for (int i = 0; i < num_data; i++) {
+        iov[2 + i] = data[i];
+        len += data[i].iov_len;
+    }
+
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2 + num_data;
+
+    if (num_fds > 0) {
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * num_fds);
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * num_fds);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * num_fds);
+    }
+
+    return sendmsg(fd, &msg, MSG_NOSIGNAL) == (ssize_t)len ? 0 : -1;
+}
+
+// Send one handoff record, made of its type, a fixed part and data, along with any descriptors it carries
+// Return -1 on failure
+int handoff_send(int fd, HandoffType type, const void* head, size_t head_len, const void* data, size_t len, const int* fds, int num_fds) {
+
+    struct iovec iov = {.iov_base = (void*)data, .iov_len = len};
+
+    return handoff_sendv(fd, type, head, head_len, &iov, 1, fds, num_fds);
+}
+
+// Send data that may not fit in one record as a run of records of type
+int handoff_send_chunks(int fd, HandoffType type, const char* data, size_t len) {
+
+    for (size_t offset = 0; offset < len; offset += HANDOFF_CHUNK_LEN) {
+        size_t num_bytes = len - offset < HANDOFF_CHUNK_LEN ? len - offset : HANDOFF_CHUNK_LEN;
+        if (handoff_send(fd, type, NULL, 0, data + offset, num_bytes, NULL, 0) != 0) return -1;
+    }
+
+    return 0;
+}
+
+// Receive one handoff record into buffer, which holds HANDOFF_RECORD_LEN bytes, and its tag into type
+// Passed descriptors go in fds, those beyond max_fds are closed
+// Return length of what follows the tag, which is left at the start of buffer, or -1 on failure
+ssize_t handoff_recv(int fd, char* buffer, HandoffType* type, int* fds, int max_fds, int* num_fds) {
+
+    char control[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+    struct iovec iov = {.iov_base = buffer, .iov_len = HANDOFF_RECORD_LEN};
+    struct msghdr msg = {0};
+    ssize_t num_bytes;
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof control;
+
+    *num_fds = 0;
+
+    do {
+        num_bytes = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    } while (num_bytes == -1 && errno == EINTR);
+
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); num_bytes > 0 && cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+
+        int count = (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+        for (int i = 0; i < count; i++) {
+            int passed;
+            memcpy(&passed, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            if (*num_fds < max_fds) fds[(*num_fds)++] = passed;
+            else close(passed);
+        }
+    }
+
+    if (num_bytes < HANDOFF_TAG_LEN || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+        for (int i = 0; i < *num_fds; i++) close(fds[i]);
+        *num_fds = 0;
+        return -1;
+    }
+
+    const char* pos = buffer;
+    *type = (HandoffType)get_u32(&pos);
+    memmove(buffer, buffer + HANDOFF_TAG_LEN, num_bytes - HANDOFF_TAG_LEN);
+
+    return num_bytes - HANDOFF_TAG_LEN;
+}
+
+// Connect to server running at handoff path and ask for its sockets, return -1 if there is none
+int handoff_connect(const char* path) {
+
+    struct sockaddr_un addr = {0};
+    uint32_t version = htonl(HANDOFF_VERSION);
+    int fd;
+
+    if (strlen(path) >= sizeof addr.sun_path) return -1;
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd == -1) return -1;
+
+    if (connect(fd, (struct sockaddr*)&addr, sizeof addr) != 0 || handoff_set_timeout(fd) != 0 ||
+        send(fd, &version, sizeof version, MSG_NOSIGNAL) != sizeof version) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+// Send listeners, passing the TCP listener, then the Unix listener and side channel if there are any
+int handoff_send_listeners(int fd, const HandoffListeners* listeners, const int* fds, int num_fds) {
+
+    char head[HANDOFF_LISTENERS_LEN];
+    char* pos = head;
+
+    put_u16(&pos, listeners->udp_port);
+    put_u8(&pos, (listeners->unix_socket ? HANDOFF_UNIX_SOCKET : 0) | (listeners->udp_socket ? HANDOFF_UDP_SOCKET : 0));
+
+    return handoff_send(fd, HANDOFF_LISTENERS, head, sizeof head, NULL, 0, fds, num_fds);
+}
+
+// Take predecessor's listeners, fds gets TCP listener, Unix listener and side channel, -1 for any it hasn't got
+// Return -1 if predecessor turned us away
+int handoff_take_listeners(int predecessor, int fds[HANDOFF_MAX_FDS], uint16_t* udp_port) {
+
+    char* record = malloc(HANDOFF_RECORD_LEN);
+    int passed[HANDOFF_MAX_FDS];
+    int num_fds = 0;
+    HandoffType type = HANDOFF_DONE;
+    HandoffListeners listeners = {0};
+
+    ssize_t len = record != NULL ? handoff_recv(predecessor, record, &type, passed, HANDOFF_MAX_FDS, &num_fds) : -1;
+    if (len == HANDOFF_LISTENERS_LEN) {
+        const char* pos = record;
+        listeners.udp_port = get_u16(&pos);
+        uint8_t flags = get_u8(&pos);
+        listeners.unix_socket = flags & HANDOFF_UNIX_SOCKET;
+        listeners.udp_socket = flags & HANDOFF_UDP_SOCKET;
+    }
+    free(record);
+
+    if (len != HANDOFF_LISTENERS_LEN || type != HANDOFF_LISTENERS ||
+        num_fds != 1 + listeners.unix_socket + listeners.udp_socket) {
+        for (int i = 0; i < num_fds; i++) close(passed[i]);
+        return -1;
+    }
+
+    fds[0] = passed[0];
+    fds[1] = listeners.unix_socket ? passed[1] : -1;
+    fds[2] = listeners.udp_socket ? passed[num_fds - 1] : -1;
+    *udp_port = listeners.udp_port;
+
+    return 0;
+}
+
+// Check restarted server reads the same records, return -1 if not
+int handoff_check_version(int fd) {
+
+    uint32_t version = 0;
+
+    if (handoff_set_timeout(fd) != 0 || recv(fd, &version, sizeof version, 0) != sizeof version) return -1;
+
+    return ntohl(version) == HANDOFF_VERSION ? 0 : -1;
+}
+
+// Send slot generations, as many to a record as fit
+int handoff_send_slots(int fd, const uint16_t* slot_gen, int num_slots) {
+
+    char* chunk = malloc(HANDOFF_CHUNK_LEN);
+    int per_chunk = HANDOFF_CHUNK_LEN / sizeof(uint16_t);
+    int status = chunk != NULL ? 0 : -1;
+
+    for (int first = 0; first < num_slots && status == 0; first += per_chunk) {
+        int count = num_slots - first < per_chunk ? num_slots - first : per_chunk;
+        char* pos = chunk;
+        for (int i = 0; i < count; i++) put_u16(&pos, slot_gen[first + i]);
+        status = handoff_send(fd, HANDOFF_SLOTS, NULL, 0, chunk, pos - chunk, NULL, 0);
+    }
+
+    free(chunk);
+
+    return status;
+}
+
+// Decode up to max_slots slot generations from a record, return how many
+int handoff_read_slots(const char* data, size_t len, uint16_t* slot_gen, int max_slots) {
+
+    int num_slots = (int)(len / sizeof(uint16_t));
+    const char* pos = data;
+
+    if (num_slots > max_slots) num_slots = max_slots;
+    for (int i = 0; i < num_slots; i++) slot_gen[i] = get_u16(&pos);
+
+    return num_slots;
+}
+
+// Write side channel address, IPv4 ones use the first four bytes of the address field
+static void put_addr(char** pos, const struct sockaddr_in6* addr, socklen_t addr_len) {
+
+    const struct sockaddr_in* addr4 = (const struct sockaddr_in*)addr;
+    char bytes[16] = {0};
+    uint16_t family = addr_len > 0 ? addr->sin6_family : AF_UNSPEC;
+
+    if (family == AF_INET) memcpy(bytes, &addr4->sin_addr, sizeof addr4->sin_addr);
+    if (family == AF_INET6) memcpy(bytes, &addr->sin6_addr, sizeof addr->sin6_addr);
+
+    put_u16(pos, family);
+    put_u16(pos, family == AF_INET ? ntohs(addr4->sin_port) : family == AF_INET6 ? ntohs(addr->sin6_port) : 0);
+    put_u32(pos, family == AF_INET6 ? ntohl(addr->sin6_flowinfo) : 0);
+    put_bytes(pos, bytes, sizeof bytes);
+    put_u32(pos, family == AF_INET6 ? addr->sin6_scope_id : 0);
+}
+
+// Read side channel address, unknown families read as no address
+static void get_addr(const char** pos, struct sockaddr_in6* addr, socklen_t* addr_len) {
+
+    struct sockaddr_in* addr4 = (struct sockaddr_in*)addr;
+    char bytes[16];
+
+    uint16_t family = get_u16(pos);
+    uint16_t port = get_u16(pos);
+    uint32_t flowinfo = get_u32(pos);
+    get_bytes(pos, bytes, sizeof bytes);
+    uint32_t scope_id = get_u32(pos);
+
+    memset(addr, 0, sizeof *addr);
+    *addr_len = 0;
+
+    if (family == AF_INET) {
+        addr4->sin_family = AF_INET;
+        addr4->sin_port = htons(port);
+        memcpy(&addr4->sin_addr, bytes, sizeof addr4->sin_addr);
+        *addr_len = sizeof *addr4;
+    } else if (family == AF_INET6) {
+        addr->sin6_family = AF_INET6;
+        addr->sin6_port = htons(port);
+        addr->sin6_flowinfo = htonl(flowinfo);
+        memcpy(&addr->sin6_addr, bytes, sizeof addr->sin6_addr);
+        addr->sin6_scope_id = scope_id;
+        *addr_len = sizeof *addr;
+    }
+}
+
+static void put_bucket(char** pos, const RateBucket* bucket) {
+    put_u64(pos, (uint64_t)bucket->tokens);
+    put_u64(pos, bucket->refilled);
+}
+
+static void get_bucket(const char** pos, RateBucket* bucket) {
+    bucket->tokens = (int64_t)get_u64(pos);
+    bucket->refilled = get_u64(pos);
+}
+
+// Send client, followed by its session, and the bytes of the frame and record it was part way through sending
+// Its socket is passed first, then its shared rings
+int handoff_send_client(int fd, const HandoffClient* client, const struct iovec* iov, int iovcnt, const int* fds, int num_fds) {
+
+    char head[HANDOFF_CLIENT_LEN];
+    char* pos = head;
+
+    put_u32(&pos, client->id);
+    put_u64(&pos, client->udp_token);
+    put_addr(&pos, &client->udp_addr, client->udp_addr_len);
+    put_u32(&pos, client->rx_dropping);
+    put_bucket(&pos, &client->rx_msgs);
+    put_bucket(&pos, &client->rx_bytes);
+    put_u64(&pos, client->rx_notified);
+    put_u8(&pos, (client->crypt ? HANDOFF_CRYPT : 0) | (client->shm ? HANDOFF_SHM : 0) | (client->shm_pending ? HANDOFF_SHM_PENDING : 0));
+    put_u32(&pos, client->rx_record_len);
+
+    return handoff_sendv(fd, HANDOFF_CLIENT, head, sizeof head, iov, iovcnt, fds, num_fds);
+}
+
+// Decode client from the start of a record, what it had part way in follows HANDOFF_CLIENT_LEN bytes in
+// Return -1 if record is too short to hold one
+int handoff_read_client(const char* data, size_t len, HandoffClient* client) {
+
+    const char* pos = data;
+
+    if (len < HANDOFF_CLIENT_LEN) return -1;
+
+    client->id = get_u32(&pos);
+    client->udp_token = get_u64(&pos);
+    get_addr(&pos, &client->udp_addr, &client->udp_addr_len);
+    client->rx_dropping = get_u32(&pos);
+    get_bucket(&pos, &client->rx_msgs);
+    get_bucket(&pos, &client->rx_bytes);
+    client->rx_notified = get_u64(&pos);
+    uint8_t flags = get_u8(&pos);
+    client->crypt = flags & HANDOFF_CRYPT;
+    client->shm = flags & HANDOFF_SHM;
+    client->shm_pending = flags & HANDOFF_SHM_PENDING;
+    client->rx_record_len = get_u32(&pos);
+
+    return 0;
+}
+
+// Send bytes queued for last client, each record opening with whether they are sealed
+int handoff_send_tx(int fd, const char* data, size_t len, bool sealed) {
+
+    char head[HANDOFF_TX_LEN];
+    char* pos = head;
+
+    put_u8(&pos, sealed ? HANDOFF_SEALED : 0);
+
+    for (size_t offset = 0; offset < len; offset += HANDOFF_CHUNK_LEN) {
+        size_t num_bytes = len - offset < HANDOFF_CHUNK_LEN ? len - offset : HANDOFF_CHUNK_LEN;
+        if (handoff_send(fd, HANDOFF_TX, head, sizeof head, data + offset, num_bytes, NULL, 0) != 0) return -1;
+    }
+
+    return 0;
+}
+
+// Decode flags of queued bytes, which follow HANDOFF_TX_LEN bytes in
+// Return -1 if record is too short to hold them
+int handoff_read_tx(const char* data, size_t len, bool* sealed) {
+
+    const char* pos = data;
+
+    if (len < HANDOFF_TX_LEN) return -1;
+
+    *sealed = get_u8(&pos) & HANDOFF_SEALED;
+
+    return 0;
+}
+
+// Send packet received but not yet handled
+int handoff_send_packet(int fd, const HandoffPacket* packet, const char* data, size_t len) {
+
+    char head[HANDOFF_PACKET_LEN];
+    char* pos = head;
+
+    put_u32(&pos, packet->sender);
+    put_u8(&pos, packet->datagram ? HANDOFF_DATAGRAM : 0);
+
+    return handoff_send(fd, HANDOFF_PACKET, head, sizeof head, data, len, NULL, 0);
+}
+
+// Decode packet from the start of a record, its data follows HANDOFF_PACKET_LEN bytes in
+// Return -1 if record is too short to hold one
+int handoff_read_packet(const char* data, size_t len, HandoffPacket* packet) {
+
+    const char* pos = data;
+
+    if (len < HANDOFF_PACKET_LEN) return -1;
+
+    packet->sender = get_u32(&pos);
+    packet->datagram = get_u8(&pos) & HANDOFF_DATAGRAM;
+
+    return 0;
+}
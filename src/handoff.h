@@ -0,0 +1,88 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+
+#include "sock.h"
+#include "crypt.h"
+#include "shm.h"
+
+// A restarted server takes sockets over from the running one as SOCK_SEQPACKET records, each opening with its HandoffType
+// Every field is written out at a fixed width in network byte order, so records don't depend on either build's struct layout
+#define HANDOFF_VERSION     (4)             // Bumped whenever records change, a server sending another version is turned away
+#define HANDOFF_TIMEOUT     (5000)          // Milliseconds either server waits on the other during a handoff
+#define HANDOFF_MAX_FDS     (1 + SHM_NUM_FDS)   // Most descriptors passed with one record, a client's socket and its shared rings
+#define HANDOFF_CHUNK_LEN   (MAX_MESSAGE_LEN + 2)   // Most data bytes in one record, a whole frame with its prefix
+
+// Records a running server sends to the one taking over from it, in this order
+typedef enum HandoffType {
+    HANDOFF_LISTENERS,                  // HandoffListeners, carries TCP listener, then Unix listener and side channel if there are any
+    HANDOFF_SLOTS,                      // Generations of the next run of client slots
+    HANDOFF_CLIENT,                     // HandoffClient, then its session if sealed, bytes of the frame it was part way through sending, or just the prefix of one being dropped,
+                                        // and bytes of the record it was part way through, carries its socket then its shared rings if it has them
+    HANDOFF_TX,                         // Sealed flag, then unsent bytes queued for the last client
+    HANDOFF_PACKET,                     // HandoffPacket, then packet received but not yet handled
+    HANDOFF_STATE,                      // Next run of caller's state
+    HANDOFF_DONE,                       // Everything has been handed over
+} HandoffType;
+
+#define HANDOFF_TAG_LEN       (4)         // Record type opening every record
+#define HANDOFF_LISTENERS_LEN (3)         // Side channel port(2), flags(1)
+#define HANDOFF_ADDR_LEN      (28)        // Family(2), port(2), flow info(4), address(16), scope(4)
+#define HANDOFF_CLIENT_LEN    (4 + 8 + HANDOFF_ADDR_LEN + 4 + 2 * 16 + 8 + 1 + 4)   // Id, token, address, bytes dropped, rate buckets, notice time, flags, partial record length
+#define HANDOFF_TX_LEN        (1)         // Flags(1)
+#define HANDOFF_PACKET_LEN    (5)         // Sender(4), flags(1)
+
+// Records as both servers hold them, they only go on the wire through the functions below
+typedef struct HandoffListeners {
+    uint16_t udp_port;                  // Port of side channel
+    bool unix_socket;                   // Whether Unix listener is passed
+    bool udp_socket;                    // Whether side channel is passed
+} HandoffListeners;
+
+typedef struct HandoffClient {
+    uint32_t id;                        // Client keeps its id, so other users still reach it
+    uint64_t udp_token;                 // Side channel session, so client keeps using it
+    struct sockaddr_in6 udp_addr;
+    socklen_t udp_addr_len;
+    uint32_t rx_dropping;               // Bytes in so far of a frame being dropped, prefix included, 0 if none
+    RateBucket rx_msgs;                 // Rate buckets, so restarting doesn't hand out a fresh allowance
+    RateBucket rx_bytes;
+    uint64_t rx_notified;
+    bool crypt;                         // Session follows, so client carries on with the keys it agreed
+    bool shm;                           // Shared rings are passed after the socket
+    bool shm_pending;                   // Client asked for shared rings and hasn't had its answer yet
+    uint32_t rx_record_len;             // Bytes of a hello or record part way in, they close the record
+} HandoffClient;
+
+typedef struct HandoffPacket {
+    uint32_t sender;
+    bool datagram;
+} HandoffPacket;
+
+// Largest record, a sealed client with a whole frame and a whole record part way in
+#define HANDOFF_RECORD_LEN  (HANDOFF_TAG_LEN + HANDOFF_CLIENT_LEN + CRYPT_STATE_LEN + HANDOFF_CHUNK_LEN + CRYPT_RECORD_LEN(CRYPT_RECORD_MAX))
+
+int handoff_set_timeout(int fd);                                       // Bound how long either server blocks on the other, return -1 on failure
+int handoff_send(int fd, HandoffType type, const void* head, size_t head_len, const void* data, size_t len, const int* fds, int num_fds);  // Send one record, return -1 on failure
+int handoff_send_chunks(int fd, HandoffType type, const char* data, size_t len);   // Send data as a run of records of type, return -1 on failure
+ssize_t handoff_recv(int fd, char* buffer, HandoffType* type, int* fds, int max_fds, int* num_fds);   // Receive one record into HANDOFF_RECORD_LEN bytes, return length after its tag or -1
+int handoff_connect(const char* path);                                 // Connect to running server and ask for its sockets, return -1 if there is none
+int handoff_check_version(int fd);                                     // Check restarted server reads the same records, return -1 if not
+int handoff_send_listeners(int fd, const HandoffListeners* listeners, const int* fds, int num_fds);   // Send listeners along with their sockets, return -1 on failure
+int handoff_take_listeners(int predecessor, int fds[HANDOFF_MAX_FDS], uint16_t* udp_port);    // Take running server's listeners, return -1 if it turned us away
+int handoff_send_slots(int fd, const uint16_t* slot_gen, int num_slots);   // Send slot generations as a run of records, return -1 on failure
+int handoff_read_slots(const char* data, size_t len, uint16_t* slot_gen, int max_slots);   // Decode slot generations, return how many
+int handoff_send_client(int fd, const HandoffClient* client, const struct iovec* iov, int iovcnt, const int* fds, int num_fds);   // Send client, what it had part way in, and its socket and rings, return -1 on failure
+int handoff_read_client(const char* data, size_t len, HandoffClient* client);  // Decode client, return -1 if record is too short for one
+int handoff_send_tx(int fd, const char* data, size_t len, bool sealed);        // Send bytes queued for last client as a run of records, return -1 on failure
+int handoff_read_tx(const char* data, size_t len, bool* sealed);               // Decode queued bytes' flags, return -1 if record is too short
+int handoff_send_packet(int fd, const HandoffPacket* packet, const char* data, size_t len);    // Send unhandled packet, return -1 on failure
+int handoff_read_packet(const char* data, size_t len, HandoffPacket* packet);  // Decode packet, return -1 if record is too short for one
+
+#endif // HANDOFF_H
@@ -0,0 +1,112 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "sock.h"
+
+#define NUM_SIZE_CLASSES (4)
+
+// Capacity of packet data in each size class, largest must fit any message
+static const size_t class_size[NUM_SIZE_CLASSES] = {64, 512, 4096, MAX_MESSAGE_LEN};
+
+// Most packets kept on each free list, so a burst doesn't pin memory forever
+static const int class_limit[NUM_SIZE_CLASSES] = {4096, 1024, 256, 16};
+
+typedef struct PacketPool {
+    Packet* free_list[NUM_SIZE_CLASSES];    // Packets ready for reuse, linked through next_packet
+    int num_free[NUM_SIZE_CLASSES];         // Number of packets on each free list
+    int prealloc;                           // Packets requested per class at startup, raises limits
+} PacketPool;
+
+// One pool per shard thread, packets may be freed on a different shard than allocated them
+static _Thread_local PacketPool pool;
+
+// Get smallest size class that fits len bytes
+static int size_class(size_t len) {
+
+    for (int i = 0; i < NUM_SIZE_CLASSES; i++) {
+        if (len <= class_size[i]) return i;
+    }
+
+    return -1;
+}
+
+// Get packet with room for len bytes from smallest size class that fits
+// Returns NULL if len exceeds maximum message length, or out of memory
+Packet* alloc_packet(size_t len) {
+
+    Packet* packet;
+    int class = size_class(len);
+
+    if (class == -1) return NULL;
+
+    // Reuse a free packet if there is one, otherwise allocate a new one
+    packet = pool.free_list[class];
+    if (packet != NULL) {
+        pool.free_list[class] = packet->next_packet;
+        pool.num_free[class]--;
+    } else {
+        packet = malloc(sizeof(Packet) + class_size[class]);
+        if (packet == NULL) return NULL;
+    }
+
+    packet->len = 0;
+    packet->sender = 0;
+    packet->size_class = (uint8_t)class;
+    packet->datagram = false;
+    packet->next_packet = NULL;
+
+    return packet;
+}
+
+// Return packet to its size class free list
+void free_packet(Packet* packet) {
+
+    if (packet == NULL) return;
+
+    int class = packet->size_class;
+    int limit = class_limit[class] > pool.prealloc ? class_limit[class] : pool.prealloc;
+
+    if (pool.num_free[class] >= limit) {
+        free(packet);
+        return;
+    }
+
+    packet->next_packet = pool.free_list[class];
+    pool.free_list[class] = packet;
+    pool.num_free[class]++;
+}
+
+// Fill every size class free list with count packets, so early bursts don't hit malloc
+void packet_pool_prealloc(int count) {
+
+    pool.prealloc = count;
+
+    for (int class = 0; class < NUM_SIZE_CLASSES; class++) {
+        while (pool.num_free[class] < count) {
+            Packet* packet = malloc(sizeof(Packet) + class_size[class]);
+            if (packet == NULL) return;
+            memset(packet->data, 0, class_size[class]);    // Touch pages now, instead of faulting mid-burst
+            packet->size_class = (uint8_t)class;
+            packet->next_packet = pool.free_list[class];
+            pool.free_list[class] = packet;
+            pool.num_free[class]++;
+        }
+    }
+}
+
+// Release every packet held on free lists
+void packet_pool_clear(void) {
+
+    for (int class = 0; class < NUM_SIZE_CLASSES; class++) {
+        while (pool.free_list[class] != NULL) {
+            Packet* next = pool.free_list[class]->next_packet;
+            free(pool.free_list[class]);
+            pool.free_list[class] = next;
+        }
+        pool.num_free[class] = 0;
+    }
+
+    pool.prealloc = 0;
+}
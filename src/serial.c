@@ -4,6 +4,7 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <arpa/inet.h>
+#include <endian.h>
 
 #include "chat.h"
 
@@ -79,7 +80,7 @@ int serialize_msg(const MessageHeader* msg, char** buffer) {
         if (status == -1) return -1;
 
         // Increment databuffer pointer past header
-        if (db_has_room(&db, 7)) inc_db(&db, 7);
+        if (db_has_room(&db, MSG_HEADER_LEN)) inc_db(&db, MSG_HEADER_LEN);
         else {
             free(db.buffer);
             return -1;
@@ -102,7 +103,7 @@ int serialize_msg(const MessageHeader* msg, char** buffer) {
 
         // Get relevant data
         UserMessage* user_msg = (UserMessage*)msg;
-        uint16_t id = htons(user_msg->id);
+        uint32_t id = htonl(user_msg->id);
         int un_len;
 
         // Allocate data buffer memory
@@ -110,16 +111,16 @@ int serialize_msg(const MessageHeader* msg, char** buffer) {
         if (status == -1) return -1;
 
         // Increment databuffer pointer past header
-        if (db_has_room(&db, 7)) inc_db(&db, 7);
+        if (db_has_room(&db, MSG_HEADER_LEN)) inc_db(&db, MSG_HEADER_LEN);
         else {
             free(db.buffer);
             return -1;
         }
 
         // Serialize id
-        if (db_has_room(&db, sizeof(uint16_t))) {
-            memcpy(db.ptr, &id, sizeof(uint16_t));
-            inc_db(&db, sizeof(uint16_t));
+        if (db_has_room(&db, sizeof(uint32_t))) {
+            memcpy(db.ptr, &id, sizeof(uint32_t));
+            inc_db(&db, sizeof(uint32_t));
         } else {
             free(db.buffer);
             return -1;
@@ -151,24 +152,34 @@ int serialize_msg(const MessageHeader* msg, char** buffer) {
 
         // Get relevant data
         ActiveUserMessage* user_msg = (ActiveUserMessage*)msg;
-        uint8_t num_users = user_msg->num_users;
-        uint16_t id;
+        uint16_t num_users = user_msg->num_users;
+        uint32_t total_users = htonl(user_msg->total_users);
+        uint32_t offset = htonl(user_msg->offset);
+        uint16_t nw_num_users = htons(num_users);
+        uint32_t id;
+
+        // Lists longer than one page must be split across messages
+        if (num_users > MAX_USERS_PER_MSG) return -1;
 
         // Allocate data buffer memory
         status = init_empty_buff(&db, sizeof(ActiveUserMessage));
         if (status == -1) return -1;
 
         // Increment databuffer pointer past header
-        if (db_has_room(&db, 7)) inc_db(&db, 7);
+        if (db_has_room(&db, MSG_HEADER_LEN)) inc_db(&db, MSG_HEADER_LEN);
         else {
             free(db.buffer);
             return -1;
         }
 
-        // Serialize num_users
-        if (db_has_room(&db, sizeof(uint8_t))) {
-            memcpy(db.ptr, &num_users, sizeof(uint8_t));
-            inc_db(&db, sizeof(uint8_t));
+        // Serialize page position, then num_users
+        if (db_has_room(&db, 2 * sizeof(uint32_t) + sizeof(uint16_t))) {
+            memcpy(db.ptr, &total_users, sizeof(uint32_t));
+            inc_db(&db, sizeof(uint32_t));
+            memcpy(db.ptr, &offset, sizeof(uint32_t));
+            inc_db(&db, sizeof(uint32_t));
+            memcpy(db.ptr, &nw_num_users, sizeof(uint16_t));
+            inc_db(&db, sizeof(uint16_t));
         } else {
             free(db.buffer);
             return -1;
@@ -176,10 +187,10 @@ int serialize_msg(const MessageHeader* msg, char** buffer) {
 
         // Now serialize array of user ids
         for (int i = 0; i < num_users; i++) {
-            if (db_has_room(&db, sizeof(uint16_t))) {
-                id = htons(user_msg->ids[i]);
-                memcpy(db.ptr, &id, sizeof(uint16_t));
-                inc_db(&db, sizeof(uint16_t));
+            if (db_has_room(&db, sizeof(uint32_t))) {
+                id = htonl(user_msg->ids[i]);
+                memcpy(db.ptr, &id, sizeof(uint32_t));
+                inc_db(&db, sizeof(uint32_t));
             } else {
                 free(db.buffer);
                 return -1;
@@ -225,7 +236,7 @@ int serialize_msg(const MessageHeader* msg, char** buffer) {
         if (status == -1) return -1;
 
         // Increment databuffer pointer past header
-        if (db_has_room(&db, 7)) inc_db(&db, 7);
+        if (db_has_room(&db, MSG_HEADER_LEN)) inc_db(&db, MSG_HEADER_LEN);
         else {
             free(db.buffer);
             return -1;
@@ -265,7 +276,7 @@ int serialize_msg(const MessageHeader* msg, char** buffer) {
         if (status == -1) return -1;
 
         // Increment databuffer pointer past header
-        if (db_has_room(&db, 7)) inc_db(&db, 7);
+        if (db_has_room(&db, MSG_HEADER_LEN)) inc_db(&db, MSG_HEADER_LEN);
         else {
             free(db.buffer);
             return -1;
@@ -293,19 +304,50 @@ int serialize_msg(const MessageHeader* msg, char** buffer) {
 
         break;
     }
+    case MSG_UDP_SESSION: {
+
+        // Get relevant data
+        UdpSessionMessage* session_msg = (UdpSessionMessage*)msg;
+        uint16_t port = htons(session_msg->port);
+        uint64_t token = htobe64(session_msg->token);
+
+        // Allocate memory for data buffer
+        status = init_empty_buff(&db, MSG_HEADER_LEN + sizeof(port) + sizeof(token));
+        if (status == -1) return -1;
+
+        // Increment databuffer pointer past header
+        if (db_has_room(&db, MSG_HEADER_LEN)) inc_db(&db, MSG_HEADER_LEN);
+        else {
+            free(db.buffer);
+            return -1;
+        }
+
+        // Serialize port and token
+        if (db_has_room(&db, sizeof(port) + sizeof(token))) {
+            memcpy(db.ptr, &port, sizeof(port));
+            memcpy(db.ptr + sizeof(port), &token, sizeof(token));
+            inc_db(&db, sizeof(port) + sizeof(token));
+        } else {
+            free(db.buffer);
+            return -1;
+        }
+
+        msg_len = db.ptr - db.buffer;
+        break;
+    }
     default:
         return -1;
     }
 
     // Now fill in header information
     uint16_t nw_len = htons(msg_len);       // Message Length
-    uint16_t nw_from = htons(msg->from);    // From
-    uint16_t nw_to = htons(msg->to);        // To
+    uint32_t nw_from = htonl(msg->from);    // From
+    uint32_t nw_to = htonl(msg->to);        // To
 
     db.buffer[0] = (uint8_t)msg->type;        // Type
     memcpy(&(db.buffer[1]), &nw_len, 2);    // Length
-    memcpy(&(db.buffer[3]), &nw_from, 2);   // From
-    memcpy(&(db.buffer[5]), &nw_to, 2);     // To
+    memcpy(&(db.buffer[3]), &nw_from, 4);   // From
+    memcpy(&(db.buffer[7]), &nw_to, 4);     // To
 
     // Set return value
     *buffer = db.buffer;
@@ -355,20 +397,20 @@ MessageHeader* deserialize_msg(char* buffer, int buffer_size) {
     }
 
     // Deserialize Message From
-    if (db_has_room(&db, 2)) {
-        memcpy(&msg->from, db.ptr, 2); 
-        msg->from = (uint16_t)ntohs(msg->from);   // Ensure data is host-endian
-        inc_db(&db, 2);
+    if (db_has_room(&db, 4)) {
+        memcpy(&msg->from, db.ptr, 4); 
+        msg->from = (uint32_t)ntohl(msg->from);   // Ensure data is host-endian
+        inc_db(&db, 4);
     } else {
         free(msg);
         return NULL;
     }
 
     // Deserialize Message To
-    if (db_has_room(&db, 2)) {
-        memcpy(&msg->to, db.ptr, 2); 
-        msg->to = (uint16_t)ntohs(msg->to);   // Ensure data is host-endian
-        inc_db(&db, 2);
+    if (db_has_room(&db, 4)) {
+        memcpy(&msg->to, db.ptr, 4); 
+        msg->to = (uint32_t)ntohl(msg->to);   // Ensure data is host-endian
+        inc_db(&db, 4);
     } else {
         free(msg);
         return NULL;
@@ -413,10 +455,10 @@ MessageHeader* deserialize_msg(char* buffer, int buffer_size) {
         memset((char*)user_msg + sizeof(MessageHeader), 0, sizeof(UserMessage) - sizeof(MessageHeader));
 
         // Deserialize id
-        if (db_has_room(&db, 2)) {
-            memcpy(&user_msg->id, db.ptr, 2); 
-            user_msg->id = (uint16_t)ntohs(user_msg->id);   // Ensure data is host-endian
-            inc_db(&db, 2);
+        if (db_has_room(&db, 4)) {
+            memcpy(&user_msg->id, db.ptr, 4); 
+            user_msg->id = (uint32_t)ntohl(user_msg->id);   // Ensure data is host-endian
+            inc_db(&db, 4);
         } else {
             free(user_msg);
             return NULL;
@@ -451,21 +493,34 @@ MessageHeader* deserialize_msg(char* buffer, int buffer_size) {
         }
         memset((char*)user_msg + sizeof(MessageHeader), 0, sizeof(ActiveUserMessage) - sizeof(MessageHeader));
 
-        // Deserialize number of users
-        if (db_has_room(&db, 1)) { 
-            user_msg->num_users = (uint8_t)db.ptr[0];
-            inc_db(&db, 1);
+        // Deserialize page position, then number of users
+        if (db_has_room(&db, 10)) { 
+            memcpy(&user_msg->total_users, db.ptr, 4);
+            user_msg->total_users = (uint32_t)ntohl(user_msg->total_users);   // Ensure data is host-endian
+            inc_db(&db, 4);
+            memcpy(&user_msg->offset, db.ptr, 4);
+            user_msg->offset = (uint32_t)ntohl(user_msg->offset);   // Ensure data is host-endian
+            inc_db(&db, 4);
+            memcpy(&user_msg->num_users, db.ptr, 2);
+            user_msg->num_users = (uint16_t)ntohs(user_msg->num_users);   // Ensure data is host-endian
+            inc_db(&db, 2);
         } else {
             free(user_msg);
             return NULL;
         }
 
+        // Reject pages bigger than we have room for
+        if (user_msg->num_users > MAX_USERS_PER_MSG) {
+            free(user_msg);
+            return NULL;
+        }
+
         // Now deserialize array of user ids
         for (int i = 0; i < user_msg->num_users; i++) {
-            if (db_has_room(&db, 2)) {
-                memcpy(&(user_msg->ids[i]), db.ptr, 2); 
-                user_msg->ids[i] = (uint16_t)ntohs(user_msg->ids[i]);   // Ensure data is host-endian
-                inc_db(&db, 2);
+            if (db_has_room(&db, 4)) {
+                memcpy(&(user_msg->ids[i]), db.ptr, 4); 
+                user_msg->ids[i] = (uint32_t)ntohl(user_msg->ids[i]);   // Ensure data is host-endian
+                inc_db(&db, 4);
             } else {
                 free(user_msg);
                 return NULL;
@@ -548,8 +603,141 @@ MessageHeader* deserialize_msg(char* buffer, int buffer_size) {
     
         return (MessageHeader*)err_msg;
     }
+    case MSG_UDP_SESSION: {
+
+        // Reallocate enough room for this message, set to all zeroes
+        UdpSessionMessage* session_msg = (UdpSessionMessage*)realloc(msg, sizeof(UdpSessionMessage));
+        if (session_msg == NULL) {
+            free(msg);
+            return NULL;
+        }
+        memset((char*)session_msg + sizeof(MessageHeader), 0, sizeof(UdpSessionMessage) - sizeof(MessageHeader));
+
+        // Deserialize port and token
+        if (db_has_room(&db, sizeof(uint16_t) + sizeof(uint64_t))) {
+            memcpy(&session_msg->port, db.ptr, sizeof(uint16_t));
+            memcpy(&session_msg->token, db.ptr + sizeof(uint16_t), sizeof(uint64_t));
+            session_msg->port = (uint16_t)ntohs(session_msg->port);     // Ensure data is host-endian
+            session_msg->token = (uint64_t)be64toh(session_msg->token);
+            inc_db(&db, sizeof(uint16_t) + sizeof(uint64_t));
+        } else {
+            free(session_msg);
+            return NULL;
+        }
+
+        // Confirm we reached the end of the buffer
+        if (db_has_room(&db, 1)) {
+            free(session_msg);
+            return NULL;
+        }
+
+        return (MessageHeader*)session_msg;
+    }
     default:
         free(msg);
         return NULL;
     }
 }
+
+// Check message and decode it in place, without allocating or copying strings
+// Checks are the same as deserialize_msg, text is left pointing into buffer
+// Return 0 on success, -1 if message is malformed
+int view_msg(const char* buffer, int buffer_size, MessageView* view) {
+
+    DataBuffer db = {0};
+    db.buffer = (char*)buffer;
+    db.ptr = db.buffer;
+    db.size = buffer_size;
+
+    int str_len;
+
+    memset(view, 0, sizeof *view);
+
+    // Decode the header, buffer size must match message length
+    if (!db_has_room(&db, MSG_HEADER_LEN)) return -1;
+
+    view->header.type = (uint8_t)db.ptr[0];
+    memcpy(&view->header.len, db.ptr + 1, 2);
+    memcpy(&view->header.from, db.ptr + 3, 4);
+    memcpy(&view->header.to, db.ptr + 7, 4);
+    view->header.len = (uint16_t)ntohs(view->header.len);
+    view->header.from = (uint32_t)ntohl(view->header.from);
+    view->header.to = (uint32_t)ntohl(view->header.to);
+    inc_db(&db, MSG_HEADER_LEN);
+
+    if (db.size != view->header.len) return -1;
+
+    switch (view->header.type) {
+    case MSG_PING:
+
+        // Time is optional
+        if (db_has_room(&db, sizeof(uint32_t))) {
+            memcpy(&view->time, db.ptr, sizeof(uint32_t));
+            view->time = (uint32_t)ntohl(view->time);
+            inc_db(&db, sizeof(uint32_t));
+        }
+        break;
+
+    case MSG_USER_SETNAME:      // Intentional fall through
+    case MSG_USER_CONNECT:      // Intentional fall through
+    case MSG_USER_DISCONNECT:
+
+        if (!db_has_room(&db, sizeof(uint32_t))) return -1;
+        memcpy(&view->id, db.ptr, sizeof(uint32_t));
+        view->id = (uint32_t)ntohl(view->id);
+        inc_db(&db, sizeof(uint32_t));
+
+        str_len = db_strnlen(&db, MAX_USERNAME_LEN + 1);
+        if (str_len == -1) return -1;
+        view->text = db.ptr;
+        inc_db(&db, str_len);
+        break;
+
+    case MSG_ACTIVE_USERS: {
+
+        uint16_t num_users;
+
+        // Skip page position, then walk ids and names to check they are all there
+        if (!db_has_room(&db, 10)) return -1;
+        memcpy(&num_users, db.ptr + 8, 2);
+        num_users = (uint16_t)ntohs(num_users);
+        inc_db(&db, 10);
+
+        if (num_users > MAX_USERS_PER_MSG) return -1;
+        if (inc_db(&db, num_users * sizeof(uint32_t)) == -1) return -1;
+
+        for (int i = 0; i < num_users; i++) {
+            str_len = db_strnlen(&db, MAX_USERNAME_LEN + 1);
+            if (str_len == -1) return -1;
+            inc_db(&db, str_len);
+        }
+        break;
+    }
+    case MSG_CHAT:              // Intentional fall through
+    case MSG_ERROR:
+
+        str_len = db_strnlen(&db, MAX_CHATMSG_LEN + 1);
+        if (str_len == -1) return -1;
+        view->text = db.ptr;
+        inc_db(&db, str_len);
+        break;
+
+    case MSG_UDP_SESSION:
+
+        if (!db_has_room(&db, sizeof(uint16_t) + sizeof(uint64_t))) return -1;
+        memcpy(&view->port, db.ptr, sizeof(uint16_t));
+        memcpy(&view->token, db.ptr + sizeof(uint16_t), sizeof(uint64_t));
+        view->port = (uint16_t)ntohs(view->port);
+        view->token = (uint64_t)be64toh(view->token);
+        inc_db(&db, sizeof(uint16_t) + sizeof(uint64_t));
+        break;
+
+    default:
+        return -1;
+    }
+
+    // Confirm we reached the end of the buffer
+    if (db_has_room(&db, 1)) return -1;
+
+    return 0;
+}
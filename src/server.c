@@ -3,26 +3,110 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <pthread.h>
+#include <arpa/inet.h>
 
 #include "chat.h"
 #include "sock.h"
 
-ChatServer server;
+#define USERS_MIN (64)            // Initial size of user tables
+#define USER_STATE_LEN (sizeof(uint32_t) + MAX_USERNAME_LEN + 1)  // Id in network byte order and name of each user handed to a restarted server
+
+// Every shard thread runs its own server, with its own copy of the user list
+_Thread_local ChatServer server;
+static _Thread_local SocketState shard_socket;      // Socket endpoint of the shard running on this thread
 
 // Get index of user in user list
-static int get_user_index(uint16_t id) {
+static int get_user_index(uint32_t id) {
 
-    for (int i = 0; i < server.num_users; i++) {
-        if (server.users[i].id == id) {
-            return i;
+    unsigned slot = SOCK_ID_INDEX(id);
+    if (slot >= (unsigned)server.user_index_cap) return -1;
+
+    // Slot may still point at a user whose id was since recycled, so confirm the full id
+    int i = server.user_index[slot] - 1;
+    if (i < 0 || server.users[i].id != id) return -1;
+
+    return i;
+}
+
+// Grow user list and id slot index so they can hold a user with this id slot
+// Return -1 if out of memory
+static int reserve_user(unsigned slot) {
+
+    if (server.num_users >= server.users_cap) {
+        int cap = server.users_cap > 0 ? server.users_cap * 2 : USERS_MIN;
+        uint32_t* local_ids = realloc(server.local_ids, cap * sizeof(uint32_t));
+        if (local_ids == NULL) return -1;
+        server.local_ids = local_ids;
+        User* users = realloc(server.users, cap * sizeof(User));
+        if (users == NULL) return -1;
+        server.users = users;
+        server.users_cap = cap;
+    }
+
+    if (slot >= (unsigned)server.user_index_cap) {
+        int cap = server.user_index_cap > 0 ? server.user_index_cap : USERS_MIN;
+        while ((unsigned)cap <= slot) cap *= 2;
+        int* user_index = realloc(server.user_index, cap * sizeof(int));
+        if (user_index == NULL) return -1;
+        memset(user_index + server.user_index_cap, 0, (cap - server.user_index_cap) * sizeof(int));
+        server.user_index = user_index;
+        server.user_index_cap = cap;
+    }
+
+    return 0;
+}
+
+// Append user to user list, return index or -1 if list is full
+static int add_user(uint32_t id) {
+
+    unsigned slot = SOCK_ID_INDEX(id);
+    if (server.num_users >= MAX_CLIENTS || reserve_user(slot) != 0) return -1;
+
+    int i = server.num_users++;
+    server.users[i] = (User){0};
+    server.users[i].id = id;
+    server.users[i].active = USER_ACTIVE;
+    server.user_index[slot] = i + 1;
+
+    // Every shard tracks every user, but only sends to its own
+    if (id_to_shard(server.socket_connection, id) == server.socket_connection->shard) {
+        server.local_ids[server.num_local++] = id;
+        server.users[i].local = server.num_local;
+    }
+
+    return i;
+}
+
+// Remove user from user list by overwriting with last user
+static void remove_user(int i) {
+
+    unsigned slot = SOCK_ID_INDEX(server.users[i].id);
+    int last = --server.num_users;
+
+    if (server.user_index[slot] == i + 1) server.user_index[slot] = 0;
+
+    // Take id off local list by overwriting with last local id
+    int local = server.users[i].local - 1;
+    if (local >= 0) {
+        int last_local = --server.num_local;
+        if (local != last_local) {
+            server.local_ids[local] = server.local_ids[last_local];
+            server.users[get_user_index(server.local_ids[local])].local = local + 1;
         }
     }
 
-    return -1;
+    if (i != last) {
+        unsigned last_slot = SOCK_ID_INDEX(server.users[last].id);
+        server.users[i] = server.users[last];
+        if (server.user_index[last_slot] == last + 1) server.user_index[last_slot] = i + 1;
+    }
+
+    server.users[last] = (User){0};
 }
 
 // Check if a user exists
-static bool check_user_exists(uint16_t id) {
+static bool check_user_exists(uint32_t id) {
 
     return get_user_index(id) != -1;
     
@@ -40,6 +124,49 @@ static bool username_taken(const char* username) {
     return false;
 }
 
+// Presence updates can be dropped for clients that fall behind, everything else must arrive
+static FramePriority msg_priority(uint8_t type) {
+
+    switch (type) {
+    case MSG_USER_SETNAME:
+    case MSG_USER_CONNECT:
+    case MSG_USER_DISCONNECT:
+        return FRAME_PRIORITY_LOW;
+    default:
+        return FRAME_PRIORITY_NORMAL;
+    }
+}
+
+// Send serialized message to users connected to this shard
+// If relay is set, also pass it on to shards owning the rest of the destinations
+static int server_deliver(uint32_t to, const char* buffer, int num_bytes, bool relay) {
+
+    int status = 0;
+    int shard = server.socket_connection->shard;
+    int num_shards = server.socket_connection->num_shards;
+
+    if (to == SERVER_ID) {
+        // Frame broadcast once, every user's queue holds a reference to it
+        Frame* frame = alloc_frame(buffer, num_bytes);
+        if (frame == NULL) return SOCK_ERR_SEND_FAILURE;
+        frame->priority = msg_priority((uint8_t)buffer[0]);
+        // Presence stays on the stream, a lost datagram would leave a user's list wrong for good
+        for (int i = 0; i < server.num_local; i++) {
+            status = server_socket_send_frame(server.socket_connection, server.local_ids[i], frame);
+        }
+        release_frame(frame);
+        for (int i = 0; relay && i < num_shards; i++) {
+            if (i != shard) shard_send_packet(server.socket_connection, i, buffer, num_bytes);
+        }
+    } else if (id_to_shard(server.socket_connection, to) == shard) {
+        status = server_socket_send_packet(server.socket_connection, to, buffer, num_bytes);
+    } else if (relay) {
+        status = shard_send_packet(server.socket_connection, id_to_shard(server.socket_connection, to), buffer, num_bytes);
+    }
+
+    return status;
+}
+
 // Send a message
 static ChatStatus server_send_message(const MessageHeader* msg) {
 
@@ -49,24 +176,35 @@ static ChatStatus server_send_message(const MessageHeader* msg) {
     
     num_bytes = serialize_msg(msg, &buffer);
 
-    if (num_bytes == 0) return CHAT_FAILURE;
+    if (num_bytes <= 0) return CHAT_FAILURE;
 
-    if (msg->to == SERVER_ID) {
-        status = 0;
-        for (int i = 0; i < server.num_users; i++) {
-            status = server_socket_send_packet(server.users[i].id, buffer, num_bytes);
-        }
-    } else {
-        status = server_socket_send_packet(msg->to, buffer, num_bytes);
-    }
+    status = server_deliver(msg->to, buffer, num_bytes, true);
     
     free(buffer);
 
     return status;
 }
 
+// Send a message to one of our users over the side channel, fails if it has none
+static ChatStatus server_send_datagram(const MessageHeader* msg) {
+
+    int status;
+    char* buffer;
+    int num_bytes;
+
+    num_bytes = serialize_msg(msg, &buffer);
+
+    if (num_bytes <= 0) return CHAT_FAILURE;
+
+    status = server_socket_send_datagram(server.socket_connection, msg->to, buffer, num_bytes);
+
+    free(buffer);
+
+    return status == SOCK_SUCCESS ? CHAT_SUCCESS : CHAT_FAILURE;
+}
+
 // Send set name request to all users               
-static ChatStatus server_send_user_setname(uint16_t id, const char* name) {
+static ChatStatus server_send_user_setname(uint32_t id, const char* name) {
 
     UserMessage user_msg = {0};
     user_msg.header.type = MSG_USER_SETNAME;
@@ -81,7 +219,7 @@ static ChatStatus server_send_user_setname(uint16_t id, const char* name) {
 }
 
 // Send user connect message to all users  
-static ChatStatus server_send_user_connect(uint16_t id) {
+static ChatStatus server_send_user_connect(uint32_t id) {
 
     UserMessage user_msg = {0};
     user_msg.header.type = MSG_USER_CONNECT;
@@ -95,7 +233,7 @@ static ChatStatus server_send_user_connect(uint16_t id) {
 }        
 
 // Send user disconnect message to all users      
-static ChatStatus server_send_user_disconnect(uint16_t id) {
+static ChatStatus server_send_user_disconnect(uint32_t id) {
 
     UserMessage user_msg = {0};
     user_msg.header.type = MSG_USER_DISCONNECT;
@@ -108,30 +246,112 @@ static ChatStatus server_send_user_disconnect(uint16_t id) {
 }   
 
 // Send list of all active users to all users        
-static ChatStatus server_send_active_users(uint16_t id) {
+static ChatStatus server_send_active_users(uint32_t id) {
 
     printf("Broadcasting %d active users.\n", server.num_users);
- 
-    ActiveUserMessage msg = {0};
+
+    // Message is too big for the stack once it can hold a full page
+    ActiveUserMessage* msg = calloc(1, sizeof(ActiveUserMessage));
+    if (msg == NULL) return CHAT_FAILURE;
 
     // Build active user message
-    msg.header.type = MSG_ACTIVE_USERS;
-    msg.header.from = SERVER_ID;
-    msg.header.to = id;
+    msg->header.type = MSG_ACTIVE_USERS;
+    msg->header.from = SERVER_ID;
+    msg->header.to = id;
+    msg->total_users = server.num_users;
+
+    // Send list in pages, always at least one so an empty list still arrives
+    int offset = 0;
+    ChatStatus status = CHAT_SUCCESS;
+    do {
+        int num_users = server.num_users - offset;
+        if (num_users > MAX_USERS_PER_MSG) num_users = MAX_USERS_PER_MSG;
 
-    msg.num_users = server.num_users;
+        msg->offset = offset;
+        msg->num_users = num_users;
+        memset(msg->usernames, 0, sizeof msg->usernames);
 
-    for (int i = 0; i < server.num_users; i++) {
-        msg.ids[i] = server.users[i].id;
-        strncpy(msg.usernames[i], server.users[i].name, MAX_USERNAME_LEN);
-    }
+        for (int i = 0; i < num_users; i++) {
+            msg->ids[i] = server.users[offset + i].id;
+            strncpy(msg->usernames[i], server.users[offset + i].name, MAX_USERNAME_LEN);
+        }
+
+        if (server_send_message((MessageHeader*)msg) != CHAT_SUCCESS) status = CHAT_FAILURE;
+
+        offset += num_users;
+    } while (offset < server.num_users);
+
+    free(msg);
+
+    return status;
+
+}
+
+// Hand user its side channel session, if server has a side channel it can use
+static ChatStatus server_send_udp_session(uint32_t id) {
+
+    UdpSessionMessage session_msg = {0};
+    session_msg.header.type = MSG_UDP_SESSION;
+    session_msg.header.from = SERVER_ID;
+    session_msg.header.to = id;
+
+    if (server_socket_udp_session(server.socket_connection, id, &session_msg.port, &session_msg.token) != SOCK_SUCCESS) return CHAT_SUCCESS;
+
+    return server_send_message((MessageHeader*)&session_msg);
+}
+
+// Hand socket layer the ping it sends to clients that go quiet
+// Addressed back to the server so clients leave it unanswered, TCP acknowledging it is all that's needed
+static ChatStatus server_set_heartbeat(void) {
+
+    int status;
+    char* buffer;
+    int num_bytes;
+
+    PingMessage ping = {0};
+    ping.header.type = MSG_PING;
+    ping.header.from = SERVER_ID;
+    ping.header.to = SERVER_ID;
+
+    num_bytes = serialize_msg((MessageHeader*)&ping, &buffer);
 
-    return server_send_message((MessageHeader*)&msg);
+    if (num_bytes <= 0) return CHAT_FAILURE;
 
+    status = server_socket_set_heartbeat(server.socket_connection, buffer, num_bytes);
+
+    free(buffer);
+
+    return status == SOCK_SUCCESS ? CHAT_SUCCESS : CHAT_FAILURE;
+}
+
+// Hand socket layer the error it sends to clients going over a rate limit
+// The one frame is shared by every client, so it is addressed to none of them
+static ChatStatus server_set_throttle_notice(void) {
+
+    int status;
+    char* buffer;
+    int num_bytes;
+
+    ErrorMessage err_msg = {0};
+    err_msg.header.type = MSG_ERROR;
+    err_msg.header.from = SERVER_ID;
+    err_msg.header.to = SERVER_ID;
+
+    strncpy(err_msg.msg, "Sending too fast, messages are being dropped.", MAX_CHATMSG_LEN);
+
+    num_bytes = serialize_msg((MessageHeader*)&err_msg, &buffer);
+
+    if (num_bytes <= 0) return CHAT_FAILURE;
+
+    status = server_socket_set_throttle_notice(server.socket_connection, buffer, num_bytes);
+
+    free(buffer);
+
+    return status == SOCK_SUCCESS ? CHAT_SUCCESS : CHAT_FAILURE;
 }
 
 // Send error message to user      
-static int server_send_error(uint16_t id, const char* err) {
+static int server_send_error(uint32_t id, const char* err) {
 
     ErrorMessage err_msg = {0};
     err_msg.header.type = MSG_ERROR;
@@ -143,57 +363,157 @@ static int server_send_error(uint16_t id, const char* err) {
     return server_send_message((MessageHeader*)&err_msg);
 }    
 
-// Check for new connections and disconnections
+// Apply connections and disconnections socket layer reported since last poll
+// Only clients that came or went are touched, so a tick without any costs nothing
 static void server_sync_users(void) {
 
-    // Iterate over all connected clients
-    for (int i = 0; i < server.socket_connection->num_clients; i++) {
+    SockEvent event;
+
+    while (pop_event(server.socket_connection, &event)) {
 
-        uint16_t user_id = server.socket_connection->clients[i].id;
+        uint32_t user_id = event.client_id;
         int user_index = get_user_index(user_id);
-        bool user_exists = check_user_exists(user_id);
-        bool user_active = server.socket_connection->clients[i].active;
 
         // If user isn't in chat, broadcast connection and update user list
-        if (!user_exists && user_active) {
+        if (event.type == SOCK_EVENT_CONNECT && user_index == -1) {
+            // Make room first, so a user is never announced without being tracked
+            if (reserve_user(SOCK_ID_INDEX(user_id)) != 0) {
+                printf("[ERROR] Unable to track user id: %d\n", user_id);
+                disconnect_client_socket(server.socket_connection, user_id);
+                continue;
+            }
             // Let clients know user is connected
             server_send_user_connect(user_id);
-            server.users[server.num_users].id = user_id;
-            server.users[server.num_users].active = USER_ACTIVE;
-            server.num_users++;
-            // Send list of active users to new client
+            add_user(user_id);
+            // Send list of active users to new client, then its side channel session
             server_send_active_users(user_id);
+            server_send_udp_session(user_id);
 
         // If user is in chat but leaves, update user list then broadcast
-        } else if (user_exists && !user_active) {
+        } else if (event.type == SOCK_EVENT_DISCONNECT && user_index != -1) {
 
-            // Remove user from user list by overwriting with last value
-            server.num_users--;
-            server.users[user_index] = server.users[server.num_users];
-            server.users[server.num_users] = (User){0};
+            remove_user(user_index);
             server_send_user_disconnect(user_id);
+
+        // Slow client missed presence updates while they were dropped, so send it the whole list again
+        } else if (event.type == SOCK_EVENT_RESYNC && user_index != -1) {
+            server_send_active_users(user_id);
+        }
+    }
+
+    // Flush clients that went, now their users are gone
+    flush_inactive_client_sockets(server.socket_connection);
+}
+
+// Take user list from the server we took over from, its users already know each other so nothing is announced
+// Users whose clients didn't come along with them are announced as gone
+static void server_restore_users(const char* state, size_t len) {
+
+    for (size_t offset = 0; offset + USER_STATE_LEN <= len; offset += USER_STATE_LEN) {
+        uint32_t id;
+        memcpy(&id, state + offset, sizeof id);
+        id = ntohl(id);
+        if (check_user_exists(id)) continue;
+
+        int i = add_user(id);
+        if (i == -1) break;
+        memcpy(server.users[i].name, state + offset + sizeof id, MAX_USERNAME_LEN);
+        server.users[i].active = USER_INACTIVE;
+    }
+
+    for (int i = server.num_users - 1; i >= 0; i--) {
+        if (server_socket_client_active(server.socket_connection, server.users[i].id)) server.users[i].active = USER_ACTIVE;
+        if (server.users[i].active == USER_ACTIVE) continue;
+        uint32_t user_id = server.users[i].id;
+        remove_user(i);
+        server_send_user_disconnect(user_id);
+    }
+}
+
+// Hand our sockets and user list to the restarted server that asked for them
+static void server_handoff(void) {
+
+    size_t len = (size_t)server.num_users * USER_STATE_LEN;
+    char* state = malloc(len > 0 ? len : 1);
+
+    // Without a user list, restarted server announces every user again
+    if (state == NULL) len = 0;
+
+    for (size_t i = 0; i * USER_STATE_LEN < len; i++) {
+        uint32_t nw_id = htonl(server.users[i].id);
+        memcpy(state + i * USER_STATE_LEN, &nw_id, sizeof nw_id);
+        memcpy(state + i * USER_STATE_LEN + sizeof(uint32_t), server.users[i].name, MAX_USERNAME_LEN + 1);
+    }
+
+    if (server_socket_handoff(server.socket_connection, state, len) == SOCK_SUCCESS) {
+        printf("Handed %d users over to restarted server.\n", server.num_users);
+    }
+
+    free(state);
+}
+
+// Handle a message relayed from another shard
+// Keep our copy of the user list in step, then hand it to our own users
+static void server_handle_relay(Packet* packet, const MessageView* msg) {
+
+    switch (msg->header.type) {
+    case MSG_USER_CONNECT:
+        if (!check_user_exists(msg->id) && reserve_user(SOCK_ID_INDEX(msg->id)) == 0) {
+            add_user(msg->id);
         }
+        break;
+    case MSG_USER_DISCONNECT: {
+        int user_index = get_user_index(msg->id);
+        if (user_index != -1) remove_user(user_index);
+        break;
+    }
+    case MSG_USER_SETNAME: {
+        int user_index = get_user_index(msg->id);
+        if (user_index != -1) strncpy(server.users[user_index].name, msg->text, MAX_USERNAME_LEN);
+        break;
+    }
+    default:
+        break;
     }
 
-    // Flush inactive clients from SocketConnection
-    flush_inactive_client_sockets();
+    server_deliver(msg->header.to, packet->data, packet->len, false);
 }
 
 // Handle an incoming message
+// Message is only viewed in place, anything forwarded goes out straight from the packet
 static void server_handle_packet(Packet* packet) {
 
-    MessageHeader* msg = deserialize_msg(packet->data, packet->len);
+    MessageView msg;
+
+    // Drop packets that fail to deserialize
+    if (view_msg(packet->data, packet->len, &msg) != 0) {
+        printf("[ERROR] Received malformed packet from id: %d\n", packet->sender);
+        return;
+    }
+
+    // Client ids are never zero, so this came from another shard
+    if (packet->sender == SERVER_ID) {
+        server_handle_relay(packet, &msg);
+        return;
+    }
 
-    printf("Handling message of type: %d\n", msg->type);
+    printf("Handling message of type: %d\n", msg.header.type);
 
-    switch (msg->type) {
+    switch (msg.header.type) {
     case MSG_PING: {
 
-        // Update message metadata, then reply back with a ping
+        // Heartbeat answers are addressed back to their sender, arriving was all they had to do
+        if (msg.header.to == packet->sender) break;
+
+        // Reply back with a ping carrying the same time, on the channel it came in on
         printf("PING!\n");
-        msg->to = packet->sender;
-        msg->from = SERVER_ID;
-        server_send_message(msg);
+        PingMessage ping = {0};
+        ping.header.type = MSG_PING;
+        ping.header.from = SERVER_ID;
+        ping.header.to = packet->sender;
+        ping.time = msg.time;
+        if (packet->datagram && server_send_datagram((MessageHeader*)&ping) == CHAT_SUCCESS) break;
+        server_send_message((MessageHeader*)&ping);
         break;
     }
     case MSG_USER_SETNAME: {
@@ -206,14 +526,14 @@ static void server_handle_packet(Packet* packet) {
         }
 
         // Confirm username isn't taken
-        if (username_taken(((UserMessage*)msg)->username)) {
-            printf("User id: %d requested taken username: %s\n",packet->sender,((UserMessage*)msg)->username);
+        if (username_taken(msg.text)) {
+            printf("User id: %d requested taken username: %s\n",packet->sender,msg.text);
             server_send_error(packet->sender, "Username already taken.");
             break;
         }
 
-        printf("Setting name of id %d to: %s\n",packet->sender,((UserMessage*)msg)->username);
-        strncpy(server.users[user_index].name, ((UserMessage*)msg)->username, MAX_USERNAME_LEN);
+        printf("Setting name of id %d to: %s\n",packet->sender,msg.text);
+        strncpy(server.users[user_index].name, msg.text, MAX_USERNAME_LEN);
         server_send_user_setname(packet->sender, server.users[user_index].name);
         break;
     }
@@ -222,13 +542,10 @@ static void server_handle_packet(Packet* packet) {
         break;
     case MSG_CHAT: {
         // Forward chat message to destination
-        printf("Forwarding chat to id: %d\n",msg->to);
-        if (msg->to == SERVER_ID) {
-            for (int i = 0; i < server.num_users; i++) {
-                server_socket_send_packet(server.users[i].id, packet->data, packet->len);
-            }
-        } else {
-            server_socket_send_packet(msg->to, packet->data, packet->len);
+        printf("Forwarding chat to id: %d\n",msg.header.to);
+        // Shard owning the destination may be too far behind to take it, so sender learns it was lost
+        if (server_deliver(msg.header.to, packet->data, packet->len, true) == SOCK_ERR_SHARD_BUSY) {
+            server_send_error(packet->sender, "Server busy, message not delivered.");
         }
         break;
     }
@@ -237,20 +554,60 @@ static void server_handle_packet(Packet* packet) {
         break;
     }
 
-    free(msg);
-
 }    
 
+typedef struct ShardArgs {
+    const char* port;
+    int shard;
+} ShardArgs;
+
+// Run one extra shard on its own thread until its socket fails
+static void* server_shard_thread(void* arg) {
+
+    ShardArgs args = *(ShardArgs*)arg;
+    free(arg);
+
+    server.socket_connection = &shard_socket;
+    if (start_server_shard(server.socket_connection, args.port, args.shard) != SOCK_SUCCESS || server_set_heartbeat() != CHAT_SUCCESS || server_set_throttle_notice() != CHAT_SUCCESS) {
+        printf("[ERROR] Unable to start shard: %d\n", args.shard);
+        return NULL;
+    }
+
+    chat_server_run();
+
+    return NULL;
+}
+
 // Start chat server, and run until disconnected
+// With more than one shard configured, shard 0 runs on the calling thread and the rest get their own
 ChatStatus start_chat_server(const char* port) {
 
     int status;
+    int num_shards = sock_get_config()->num_shards;
 
-    status = start_server_socket(port);
+    if (num_shards > 1 && init_server_shards() != SOCK_SUCCESS) return CHAT_FAILURE;
 
-    if (status != SOCK_SUCCESS) return CHAT_FAILURE;
+    server.socket_connection = &shard_socket;
+    status = start_server_shard(server.socket_connection, port, 0);
 
-    server.socket_connection = sock_get_state();
+    if (status != SOCK_SUCCESS || server_set_heartbeat() != CHAT_SUCCESS || server_set_throttle_notice() != CHAT_SUCCESS) return CHAT_FAILURE;
+
+    if (server.socket_connection->handoff_state != NULL) {
+        server_restore_users(server.socket_connection->handoff_state, server.socket_connection->handoff_state_len);
+    }
+
+    for (int i = 1; i < num_shards; i++) {
+        pthread_t thread;
+        ShardArgs* args = malloc(sizeof(ShardArgs));
+        if (args == NULL) return CHAT_FAILURE;
+        args->port = port;
+        args->shard = i;
+        if (pthread_create(&thread, NULL, server_shard_thread, args) != 0) {
+            free(args);
+            return CHAT_FAILURE;
+        }
+        pthread_detach(thread);
+    }
 
     return CHAT_SUCCESS;
 }  
@@ -264,22 +621,26 @@ void chat_server_run(void) {
 
         Packet* packet;
 
-        // Poll for inputs, timeout of one second
-        status = poll_sockets(1000);
+        // Poll for inputs, socket layer wakes itself for heartbeats and other timers
+        status = poll_sockets(server.socket_connection, -1);
 
         // Check for new connections and disconnections
         server_sync_users();
 
-        // Check for messages
-        packet = pop_packet();
+        // Take every waiting message at once
+        packet = pop_packets(server.socket_connection, NULL);
 
-        // Handle Packet
+        // Handle Packets
         while (packet != NULL) {
+            Packet* next = packet->next_packet;
             server_handle_packet(packet);
-            free(packet);
-            packet = pop_packet();
+            free_packet(packet);
+            packet = next;
         }
 
     } while (status == SOCK_SUCCESS);
 
+    // A restarted server asked to take over, now that everything polled so far is handled
+    if (status == SOCK_HANDOFF_REQUESTED) server_handoff();
+
 }
@@ -0,0 +1,248 @@
+#define _GNU_SOURCE    // memfd_create
+
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+
+#include "shm.h"
+
+#define SHM_MASK (SHM_RING_SIZE - 1)
+
+// Signal peer's eventfd, a full counter still leaves it readable so errors don't matter
+static void shm_wake(ShmLink* link) {
+
+    uint64_t one = 1;
+
+    if (write(link->wake_fd, &one, sizeof one) < 0) return;
+}
+
+// Map both rings from memfd, creator produces on the first ring and attacher on the second
+static int shm_map(ShmLink* link, int memfd, bool creator) {
+
+    link->map_len = 2 * sizeof(ShmRing);
+    link->map = mmap(NULL, link->map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, memfd, 0);
+    if (link->map == MAP_FAILED) {
+        link->map = NULL;
+        return -1;
+    }
+
+    ShmRing* rings = link->map;
+    link->tx = creator ? &rings[0] : &rings[1];
+    link->rx = creator ? &rings[1] : &rings[0];
+
+    return 0;
+}
+
+// Create rings and eventfds, return -1 on failure
+// Every descriptor in fds stays owned by link
+int shm_create(ShmLink* link, int fds[SHM_NUM_FDS]) {
+
+    int memfd;
+
+    memset(link, 0, sizeof *link);
+    link->wait_fd = -1;
+    link->wake_fd = -1;
+    link->mem_fd = -1;
+
+    memfd = memfd_create("chat-shm", MFD_CLOEXEC);
+    if (memfd == -1) return -1;
+
+    // New memfd pages read as zero, so both rings start out empty
+    if (ftruncate(memfd, 2 * sizeof(ShmRing)) != 0 || shm_map(link, memfd, true) != 0) {
+        close(memfd);
+        return -1;
+    }
+
+    link->mem_fd = memfd;
+    link->wait_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    link->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (link->wait_fd == -1 || link->wake_fd == -1) {
+        shm_close(link);
+        return -1;
+    }
+
+    // Peer waits on what we signal, and signals what we wait on
+    fds[0] = memfd;
+    fds[1] = link->wait_fd;
+    fds[2] = link->wake_fd;
+
+    return 0;
+}
+
+// Map rings handed over by creator, takes ownership of fds, return -1 on failure
+int shm_attach(ShmLink* link, const int fds[SHM_NUM_FDS]) {
+
+    struct stat st;
+
+    memset(link, 0, sizeof *link);
+    link->wake_fd = fds[1];
+    link->wait_fd = fds[2];
+    link->mem_fd = -1;
+
+    // Refuse anything that isn't sized like a pair of our rings
+    if (fstat(fds[0], &st) != 0 || (size_t)st.st_size != 2 * sizeof(ShmRing) || shm_map(link, fds[0], false) != 0) {
+        close(fds[0]);
+        shm_close(link);
+        return -1;
+    }
+
+    // Mapping keeps the memory alive
+    close(fds[0]);
+
+    return 0;
+}
+
+// Get creator's memfd, wait fd and wake fd, in the order shm_adopt takes them
+void shm_creator_fds(const ShmLink* link, int fds[SHM_NUM_FDS]) {
+
+    fds[0] = link->mem_fd;
+    fds[1] = link->wait_fd;
+    fds[2] = link->wake_fd;
+}
+
+// Take creator's side of rings another process made, takes ownership of fds, return -1 on failure
+// Ring positions live in the shared memory, so whatever either side had in flight carries on
+int shm_adopt(ShmLink* link, const int fds[SHM_NUM_FDS]) {
+
+    struct stat st;
+
+    memset(link, 0, sizeof *link);
+    link->mem_fd = fds[0];
+    link->wait_fd = fds[1];
+    link->wake_fd = fds[2];
+
+    if (fstat(fds[0], &st) != 0 || (size_t)st.st_size != 2 * sizeof(ShmRing) || shm_map(link, fds[0], true) != 0) {
+        shm_close(link);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Unmap rings and close descriptors
+void shm_close(ShmLink* link) {
+
+    if (link->map != NULL) munmap(link->map, link->map_len);
+    if (link->wait_fd >= 0) close(link->wait_fd);
+    if (link->wake_fd >= 0) close(link->wake_fd);
+    if (link->mem_fd >= 0) close(link->mem_fd);
+
+    memset(link, 0, sizeof *link);
+    link->wait_fd = -1;
+    link->wake_fd = -1;
+    link->mem_fd = -1;
+}
+
+// Copy bytes into ring at position pos, wrapping around the end
+static void shm_copy_in(ShmRing* ring, uint32_t pos, const char* data, size_t len) {
+
+    size_t offset = pos & SHM_MASK;
+    size_t first = len < SHM_RING_SIZE - offset ? len : SHM_RING_SIZE - offset;
+
+    memcpy(ring->data + offset, data, first);
+    memcpy(ring->data, data + first, len - first);
+}
+
+// Copy as much of the iovec as fits into tx ring, skipping bytes already written
+// Publishes new tail, and wakes peer if it had read everything before, since it may be asleep
+static size_t shm_fill(ShmLink* link, const struct iovec* iov, int iovcnt, size_t skip) {
+
+    ShmRing* ring = link->tx;
+    uint32_t tail = ring->tail;
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    size_t room = SHM_RING_SIZE - (uint32_t)(tail - head);
+    size_t written = 0;
+
+    for (int i = 0; i < iovcnt && room > 0; i++) {
+
+        if (skip >= iov[i].iov_len) {
+            skip -= iov[i].iov_len;
+            continue;
+        }
+
+        size_t len = iov[i].iov_len - skip;
+        if (len > room) len = room;
+
+        shm_copy_in(ring, tail + (uint32_t)written, (const char*)iov[i].iov_base + skip, len);
+        written += len;
+        room -= len;
+        skip = 0;
+    }
+
+    if (written == 0) return 0;
+
+    __atomic_store_n(&ring->tail, tail + (uint32_t)written, __ATOMIC_RELEASE);
+
+    // Pairs with fence in shm_consume, either peer sees our tail or we see it caught up
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->head, __ATOMIC_RELAXED) == tail) shm_wake(link);
+
+    return written;
+}
+
+// Copy as much as fits into tx ring, return bytes written
+// When it doesn't all fit, peer is asked to wake us once it makes room
+size_t shm_write(ShmLink* link, const struct iovec* iov, int iovcnt) {
+
+    ShmRing* ring = link->tx;
+    size_t total = 0;
+    size_t written = 0;
+
+    for (int i = 0; i < iovcnt; i++) total += iov[i].iov_len;
+
+    for (;;) {
+
+        written += shm_fill(link, iov, iovcnt, written);
+        if (written == total) return written;
+
+        __atomic_store_n(&ring->want_space, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+        // Peer may have made room before it saw our request, so look again
+        if ((uint32_t)(ring->tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) == SHM_RING_SIZE) return written;
+    }
+}
+
+// Get contiguous readable bytes in rx ring, NULL if empty
+// Bytes that wrap around the end are returned by the next peek
+const char* shm_peek(ShmLink* link, size_t* len) {
+
+    ShmRing* ring = link->rx;
+    uint32_t head = ring->head;
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    size_t offset = head & SHM_MASK;
+
+    if (head == tail) return NULL;
+
+    *len = (uint32_t)(tail - head);
+    if (*len > SHM_RING_SIZE - offset) *len = SHM_RING_SIZE - offset;
+
+    return ring->data + offset;
+}
+
+// Release bytes returned by peek, and wake peer if it is waiting for room
+void shm_consume(ShmLink* link, size_t len) {
+
+    ShmRing* ring = link->rx;
+
+    __atomic_store_n(&ring->head, ring->head + (uint32_t)len, __ATOMIC_RELEASE);
+
+    // Pairs with fences in shm_fill and shm_write
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->want_space, __ATOMIC_RELAXED) && __atomic_exchange_n(&ring->want_space, 0, __ATOMIC_RELAXED)) {
+        shm_wake(link);
+    }
+}
+
+// Reset wait_fd, call before draining so no wakeup is lost
+void shm_clear_wake(ShmLink* link) {
+
+    uint64_t count;
+
+    if (read(link->wait_fd, &count, sizeof count) < 0) return;
+}
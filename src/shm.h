@@ -0,0 +1,42 @@
+#ifndef SHM_H
+#define SHM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/uio.h>
+
+#define SHM_RING_SIZE   (1u << 18)      // Bytes in each ring, power of two
+#define SHM_NUM_FDS     (3)             // Descriptors handed to the attaching side: memfd, its wake fd, its wait fd
+
+// Single producer single consumer byte ring, lives in memory shared by both processes
+// Positions run freely and are masked on use, so head == tail means empty
+typedef struct ShmRing {
+    _Alignas(64) uint32_t head;         // Consumer position, only written by consumer
+    uint32_t want_space;                // Set by producer when it found ring full, consumer wakes it once it frees some
+    _Alignas(64) uint32_t tail;         // Producer position, only written by producer
+    _Alignas(64) char data[SHM_RING_SIZE];
+} ShmRing;
+
+// One side's view of a pair of rings, one for each direction
+typedef struct ShmLink {
+    ShmRing* rx;                        // Ring we consume
+    ShmRing* tx;                        // Ring we produce
+    void* map;                          // Mapping holding both rings
+    size_t map_len;
+    int wait_fd;                        // eventfd peer signals when our rx ring gets data, or our tx ring gets room
+    int wake_fd;                        // eventfd we signal for the peer
+    int mem_fd;                         // memfd holding the rings, kept by creator so a restarted server can map them, -1 otherwise
+} ShmLink;
+
+int shm_create(ShmLink* link, int fds[SHM_NUM_FDS]);           // Create rings and eventfds, fill fds to hand to peer, return -1 on failure
+int shm_attach(ShmLink* link, const int fds[SHM_NUM_FDS]);     // Map rings handed over by creator, takes ownership of fds, return -1 on failure
+void shm_creator_fds(const ShmLink* link, int fds[SHM_NUM_FDS]);   // Get creator's memfd, wait fd and wake fd, to hand rings to a restarted server
+int shm_adopt(ShmLink* link, const int fds[SHM_NUM_FDS]);      // Take creator's side of rings from shm_creator_fds, takes ownership of fds, return -1 on failure
+void shm_close(ShmLink* link);                                  // Unmap rings and close eventfds
+size_t shm_write(ShmLink* link, const struct iovec* iov, int iovcnt);  // Copy as much as fits into tx ring, return bytes written
+const char* shm_peek(ShmLink* link, size_t* len);               // Get contiguous readable bytes in rx ring, NULL if empty
+void shm_consume(ShmLink* link, size_t len);                    // Release bytes returned by peek
+void shm_clear_wake(ShmLink* link);                             // Reset wait_fd, call before draining so no wakeup is lost
+
+#endif // SHM_H
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE    // accept4, recvmmsg, sendmmsg
+
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
@@ -7,13 +9,26 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
 #include <sys/poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/random.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <errno.h>
 #include <sys/fcntl.h>
+#include <sys/uio.h>
+#include <netinet/tcp.h>
+#include <time.h>
+#include <endian.h>
 
 #include "sock.h"
+#include "uring.h"
+#include "shm.h"
+#include "crypt.h"
+#include "handoff.h"
 
 #define PRINT_ERROR(msg) (fprintf(stderr, "[ERROR] %s Exit with error: %s\n", msg, strerror(errno)))
 #define PRINT_ERROR2(msg1, msg2) (fprintf(stderr, "[ERROR] %s %s\n", msg1, msg2))
@@ -28,527 +43,4017 @@
 #define DEBUG_PRINT3(msg, val)
 #endif
 
-static SocketState connection;
+#define MAX_EPOLL_EVENTS (64)
+#define RX_BUFFER_LEN    (MAX_MESSAGE_LEN + 2)
+#define TX_MAX_IOV       (64)                   // Maximum frames covered by one send
+#define TX_HARD_LIMIT_FACTOR (4)                // Default hard limit on queued bytes, in high watermarks
+#define SHM_REPLY_TIMEOUT (1000)                // Milliseconds a client waits for server to answer a shared ring request
+#define CRYPT_HELLO_TIMEOUT (1000)              // Milliseconds a client waits for server's hello
+#define ACCEPT_BACKOFF      (100)               // Milliseconds a listener goes unwatched once we run out of descriptors for its connections
+#define THROTTLE_NOTICE_GAP (1000)              // Milliseconds between notices to a client that keeps going over a rate limit
+#define HEARTBEAT_MISSES    (3)                 // Heartbeats a client may leave unanswered before it is dropped
+#define USER_TIMEOUT_FACTOR (2)                 // TCP gives up on unacknowledged data this many times later than heartbeats would
+#define HANDOFF_SETTLE      (10)                // Milliseconds io_uring must stay quiet before its sockets are handed over
+
+// Side channel datagrams hold length prefixed messages, framed the same as the stream
+// Client to server ones start with client id and session token, server to client ones with just the token
+#define UDP_ID_LEN          (4)
+#define UDP_TOKEN_LEN       (8)
+#define UDP_BATCH           (32)                // Datagrams moved per recvmmsg or sendmmsg, a batch must fit in rx_buffer
+
+#define SHARD_INBOX_MAX     (65536)         // Most packets waiting in a shard's inbox, so a stalled shard can't take all memory
+#define CLIENT_SLOTS_MIN    (64)            // Initial size of client slot tables
+#define EVENTS_PER_SLOT     (3)             // Most events a client slot queues between flushes
+#define SLOT_REUSE_DELAY    (1024)          // Flushed slots wait until this many are free, so ids take longer to come round
+
+#define URING_ENTRIES       (256)           // Submission queue size
+#define URING_CQ_ENTRIES    (4096)          // Completion queue size
+#define URING_BUF_COUNT     (512)           // Number of provided receive buffers
+#define URING_BUF_SIZE      (4096)          // Size of each provided receive buffer
+#define URING_BUF_GROUP     (0)             // Buffer group id for receives
+
+// Operation tag stored in low bits of io_uring user_data
+#define URING_OP_SEND       (0)             // user_data is a pointer to UringSend
+#define URING_OP_RECV       (1)             // user_data holds client id, and receive's generation above it
+#define URING_OP_ACCEPT     (2)             // user_data holds listening socket fd
+#define URING_OP_WAKE       (3)             // Another shard queued packets for us
+#define URING_OP_CANCEL     (4)             // Cancel of a paused client's receive
+#define URING_OP_SHM        (5)             // user_data holds client id, peer signalled its shared rings
+#define URING_OP_UDP        (6)             // Side channel socket has datagrams
+#define URING_OP_HANDOFF    (7)             // Restarted server is waiting on handoff listener
+#define URING_OP_MASK       (7)
+#define URING_OP_SHIFT      (3)
+
+// Outbound frame waiting to be written to a socket
+typedef struct TxFrame {
+    struct TxFrame* next;               // Next frame in queue
+    Frame* frame;                       // Frame contents, one reference held by this entry
+    size_t offset;                      // Bytes of frame already sent
+    bool sealed;                        // Frame is our hello or a sealed record, so goes out as it is
+} TxFrame;
+
+// Send in flight on io_uring, owns its frames until it completes
+typedef struct UringSend {
+    uint32_t id;                        // Destination client
+    TxFrame* frames;                    // Frames covered by this send
+    struct msghdr msg;                  // Points at iov
+    struct iovec iov[TX_MAX_IOV];       // Unsent part of each frame
+} UringSend;
+
+// Side channel datagram being filled for one client, goes out at the start of the next poll
+typedef struct UdpDatagram {
+    uint32_t id;                        // Destination client
+    size_t len;                         // Bytes used in data
+    char data[SOCK_UDP_MAX_PAYLOAD];    // Session token followed by framed messages
+} UdpDatagram;
+
+// Packets handed to a shard by other shards
+typedef struct ShardInbox {
+    Packet* head;                       // Pushed by any shard, newest first, taken all at once by owner
+    int depth;                          // Packets pushed and not yet taken, counted before they are pushed
+    int wake_fd;                        // eventfd watched by owner's event loop
+} ShardInbox;
+
+static _Thread_local char rx_buffer[RX_BUFFER_LEN];    // Scratch space for reads, shared by every endpoint on a thread since nothing outlives a read
+
+static SocketConfig config = {
+    .backend = SOCK_BACKEND_EPOLL,
+    .num_shards = 1,
+    .listen_backlog = SOMAXCONN,
+    .coalesce_window = -1,
+};
+
+static ShardInbox shard_inboxes[MAX_SHARDS];    // Shared by all shards
+static bool shards_ready;                       // Whether shard inboxes were created
+static int unix_listener = -1;                  // Listening Unix domain socket, opened once and shared by all shards
+static struct evp_pkey_st* server_identity;     // Long-term key encrypted servers sign hellos with, loaded once and shared by all shards
+
+// Lookup active client based on client id
+static Client* id_to_client(SocketState* connection, uint32_t id) {
+
+    unsigned index = SOCK_ID_INDEX(id);
+
+    // Clients of other shards live in their own tables
+    if (connection->num_shards < 1 || index % connection->num_shards != (unsigned)connection->shard) return NULL;
+
+    // Generation must match, so ids of flushed clients don't resolve to whoever reused the slot
+    unsigned slot = index / connection->num_shards;
+    if (slot >= (unsigned)connection->num_clients) return NULL;
+    if (connection->clients[slot].id != id || connection->clients[slot].active != ACTIVE) return NULL;
+
+    return &connection->clients[slot];
+}
 
-// Lookup id based on client fd
-static int id_to_fd(uint16_t id) {
+// Lookup active client based on socket fd
+static Client* fd_to_client(SocketState* connection, int fd) {
 
-    for (int i = 0; i < connection.num_clients; i++) {
-        if (connection.clients[i].id == id) {
-            return connection.clients[i].fd;
-        }
-    }
+    // Closed fds may be reused by new clients, so only match active clients
+    if (fd < 0 || fd >= connection->fd_ids_len) return NULL;
 
-    return -1;  
+    return id_to_client(connection, connection->fd_ids[fd]);
 }
 
-// Lookup fd based on client id                                 
-static int fd_to_id(int fd) {
+// Record client id for socket fd, growing fd table as needed
+static int fd_table_set(SocketState* connection, int fd, uint32_t id) {
 
-    for (int i = 0; i < connection.num_clients; i++) {
-        if (connection.clients[i].fd == fd) {
-            return connection.clients[i].id;
-        }
-    }
+    if (fd >= connection->fd_ids_len) {
 
-    return -1;  
-}
+        int len = connection->fd_ids_len > 0 ? connection->fd_ids_len : 64;
+        while (len <= fd) len *= 2;
 
-// Send data to a socket
-static SocketStatus send_packet(int socket_fd, const char* data, size_t num_bytes) {
+        uint32_t* fd_ids = realloc(connection->fd_ids, len * sizeof(uint32_t));
+        if (fd_ids == NULL) return -1;
 
-    int bytes_sent;
-    uint16_t nw_len;
-    char buffer[MAX_MESSAGE_LEN + 2] = {0};
+        memset(fd_ids + connection->fd_ids_len, 0, (len - connection->fd_ids_len) * sizeof(uint32_t));
+        connection->fd_ids = fd_ids;
+        connection->fd_ids_len = len;
+    }
 
-    if (connection.type == SOCK_UNINITIALIZED) return SOCK_ERR_UNINITIALIZED;
-    if (num_bytes > MAX_MESSAGE_LEN) return SOCK_ERR_INVALID_MSG_LENGTH;
+    connection->fd_ids[fd] = id;
 
-    // Convert packet to string of bytes in network order
-    nw_len = htons((uint16_t)num_bytes);
-    memcpy(&buffer, &nw_len, 2);
-    memcpy(&buffer[2], data, num_bytes);
+    return 0;
+}
 
-    bytes_sent = send(socket_fd, &buffer, num_bytes + sizeof(nw_len), 0);
+// Add filled packet to end of packet queue, ownership passes to queue
+static void enqueue_packet(SocketState* connection, Packet* packet) {
 
-    if (bytes_sent == -1) return SOCK_ERR_SEND_FAILURE;
+    packet->next_packet = NULL;
 
-    return SOCK_SUCCESS;
+    if (connection->packet_queue == NULL) {
+        connection->packet_queue = packet;
+    } else {
+        connection->packet_queue_tail->next_packet = packet;
+    }
+    connection->packet_queue_tail = packet;
+    connection->num_packets++;
 }
 
-// Receive and unpack a packet, store in packet queue
+// Construct packet and add to end of packet queue
 // Allocates memory for storage, hands ownership to queue owner
-static SocketStatus recv_packet(int socket_fd) {
+// Return queued packet, or NULL if out of memory
+static Packet* queue_packet(SocketState* connection, uint32_t sender, const char* data, uint16_t len) {
 
-    ssize_t num_bytes;
-    char buffer[MAX_MESSAGE_LEN] = {0};
-    uint16_t packet_len = 0;
+    Packet *packet = alloc_packet(len);
+    if (packet == NULL) return NULL;
 
-    if (connection.type == SOCK_UNINITIALIZED) return SOCK_ERR_UNINITIALIZED;
+    packet->len = len;
+    packet->sender = sender;
+    memcpy(packet->data, data, len);
 
-    // First check packet length
-    num_bytes = recv(socket_fd, &packet_len, sizeof(packet_len), 0);
+    enqueue_packet(connection, packet);
 
-    if (num_bytes == -1) {
-        DEBUG_PRINT("No packet read.");
-        return SOCK_ERR_NO_DATA;
-    } else if (num_bytes == 0) {
-        DEBUG_PRINT("Socket disconnected.");
-        return SOCK_ERR_SOCKET_DISCONNECT;
-    } else if (num_bytes != 2) {
-        DEBUG_PRINT("Invalid packet format.");
-        return SOCK_ERR_INVALID_MSG_FORMAT;
-    }
+    return packet;
+}
 
-    // Convert to host endianness
-    packet_len = ntohs(packet_len);
+// Get total length of payload fragments, or SIZE_MAX if they don't make a valid message
+static size_t iov_length(const struct iovec* iov, int iovcnt) {
 
-    DEBUG_PRINT3("Packet length:",packet_len);
+    size_t num_bytes = 0;
 
-    if (packet_len > MAX_MESSAGE_LEN) {
-        DEBUG_PRINT("Invalid packet length.");
-        return SOCK_ERR_INVALID_MSG_LENGTH;
+    if (iovcnt < 0 || (iovcnt > 0 && iov == NULL)) return SIZE_MAX;
+
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len > MAX_MESSAGE_LEN - num_bytes) return SIZE_MAX;
+        num_bytes += iov[i].iov_len;
     }
 
-    // Attempt to receive rest of packet
-    num_bytes = recv(socket_fd, &buffer, packet_len, 0);
+    return num_bytes;
+}
 
-    // TODO - ADD CAPABILITY FOR NOT GETTING ENTIRE MESSAGE
-    if (num_bytes == 0) {
-        return SOCK_ERR_SOCKET_DISCONNECT;
-    } else if (num_bytes != packet_len) {
-        DEBUG_PRINT("Did not receive entire packet.");
-        return SOCK_ERR_INVALID_MSG_LENGTH;
-    }
+// Build frame from payload fragments, length prefix in network order
+// Caller holds one reference, returns NULL if message is too long, or out of memory
+Frame* alloc_framev(const struct iovec* iov, int iovcnt) {
 
-    DEBUG_PRINT2("Packet:", buffer);
+    uint16_t nw_len;
+    Frame* frame;
+    size_t num_bytes = iov_length(iov, iovcnt);
 
-    // Now construct packet
-    Packet *packet = calloc(1, sizeof(Packet));
-    packet->len = packet_len;
-    memcpy(packet->data, buffer, packet_len);
+    if (num_bytes == SIZE_MAX) return NULL;
 
-    // Populate sender field
-    if (connection.type == SOCK_SERVER) {
-        packet->sender = fd_to_id(socket_fd);
-    } else {
-        packet->sender = 0;    // ID 0 is reserved for server
-    }
+    frame = malloc(sizeof(Frame) + sizeof(nw_len) + num_bytes);
+    if (frame == NULL) return NULL;
 
-    // Find end of packet queue, and add packet to end
-    if (connection.packet_queue == NULL) {
-        connection.packet_queue = packet;
-    } else {
-        Packet* queue_end = connection.packet_queue;
-        while (queue_end->next_packet != NULL) {
-            queue_end = queue_end->next_packet;
-        }
-        queue_end->next_packet = packet;
+    nw_len = htons((uint16_t)num_bytes);
+    memcpy(frame->data, &nw_len, sizeof(nw_len));
+    frame->len = sizeof(nw_len);
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len == 0) continue;
+        memcpy(frame->data + frame->len, iov[i].iov_base, iov[i].iov_len);
+        frame->len += iov[i].iov_len;
     }
+    frame->refs = 1;
+    frame->priority = FRAME_PRIORITY_NORMAL;
 
-    return SOCK_SUCCESS;
+    return frame;
 }
 
-SocketState* sock_get_state(void) {
+// Build frame with length prefix in network order, caller holds one reference
+// Returns NULL if message is too long, or out of memory
+Frame* alloc_frame(const char* data, size_t num_bytes) {
 
-    return &connection;
-}
+    struct iovec iov = {.iov_base = (void*)data, .iov_len = num_bytes};
 
-// Return number of packets in queue
-int num_packets(void) {
-    
-    int num_packets = 0;
+    return alloc_framev(&iov, 1);
+}
 
-    Packet* q_ptr = connection.packet_queue;
-    while (q_ptr != NULL) {
-        num_packets++;
-        q_ptr = q_ptr->next_packet;
-    }
+// Drop a reference, frees frame once the last is gone
+void release_frame(Frame* frame) {
 
-    return num_packets;
+    if (frame != NULL && --frame->refs == 0) free(frame);
 }
 
-// Pop packet at top of packet queue and return pointer. Ownership passes to caller.
-Packet* pop_packet(void) {
+// Release all entries in an outbound frame list
+static void free_tx_frames(TxFrame* frame) {
 
-    Packet* q_ptr = connection.packet_queue;
-    if (q_ptr != NULL) {
-        connection.packet_queue = connection.packet_queue->next_packet;
-        q_ptr->next_packet = NULL;
+    while (frame != NULL) {
+        TxFrame* next = frame->next;
+        release_frame(frame->frame);
+        free(frame);
+        frame = next;
     }
+}
 
-    return q_ptr;
-}            
+static void backend_pause_client(SocketState* connection, Client* client, bool paused);
 
-// Start a server on the local host at specified port
-SocketStatus start_server_socket(const char* port) {
+static void event_push(SocketState* connection, SockEventType type, uint32_t client_id);
 
-    memset(&connection, 0, sizeof connection);   // Clear out state
+// Take bytes that were sent or dropped off client's outbound count
+// Once a slow client drains to the low watermark it is treated normally again,
+// and application is told to resync it if anything it was sent was dropped
+static void tx_drained(SocketState* connection, Client* client, size_t num_bytes) {
 
-    int status;             // Variable for storing function return status
-    int socket_fd;          // Variable for storing socket file descriptor
+    size_t low_water = config.tx_low_water > 0 ? config.tx_low_water : config.tx_high_water / 2;
 
-    struct addrinfo hints = {0}; // Struct to pass inputs to getaddrinfo
-    struct addrinfo *addr, *addr0;       // Struct to get results from getaddrinfo
+    client->tx_bytes = num_bytes < client->tx_bytes ? client->tx_bytes - num_bytes : 0;
 
-    // If already initialized, return error
-    if (connection.type != SOCK_UNINITIALIZED) return SOCK_ERR_ALREADY_INITIALIZED;
+    if (!client->tx_slow || client->tx_bytes > low_water) return;
 
-    hints.ai_family = AF_UNSPEC;        // Either IPv4 or IPv6
-    hints.ai_socktype = SOCK_STREAM;    // TCP Stream Socket
-    hints.ai_flags = AI_PASSIVE;        // Fill in IP
+    client->tx_slow = false;
+    if (client->rx_paused) backend_pause_client(connection, client, false);
 
-    status = getaddrinfo(NULL, port, &hints, &addr0);
-    if (status != 0 || addr0 == NULL) {
-        PRINT_ERROR2("Unable to get address.", gai_strerror(status));
-        return SOCK_ERR_SERVER_START_FAILURE;
+    // One resync covers every drop before it is popped, so a client never has more than one queued
+    if (client->tx_dropped && client->active == ACTIVE) {
+        client->tx_dropped = false;
+        if (!client->tx_resync) {
+            client->tx_resync = true;
+            event_push(connection, SOCK_EVENT_RESYNC, client->id);
+        }
     }
+}
 
-    // Bind to first address we can
-    for (addr = addr0; addr != NULL; addr = addr->ai_next) {
+// Apply slow consumer policy once client's outbound queue passes the high watermark
+// Normal priority frames still queue under drop and pause, so past the hard limit client is disconnected anyway
+// Returns SOCK_ERR_CLIENT_TOO_SLOW if client was disconnected
+static SocketStatus tx_check_slow(SocketState* connection, Client* client) {
 
-        // Open a streaming socket
-        socket_fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
-        if (socket_fd == -1) {
-            continue;
-        }
+    if (connection->type != SOCK_SERVER || config.tx_high_water == 0) return SOCK_SUCCESS;
+    if (client->tx_bytes <= config.tx_high_water) return SOCK_SUCCESS;
 
-        // Bind socket to our ip and port
-        status = bind(socket_fd, addr->ai_addr, addr->ai_addrlen);
-        if (status != 0) {
-            close(socket_fd);
-            socket_fd = -1;
-            continue;
-        }
+    size_t hard_limit = config.tx_hard_limit > 0 ? config.tx_hard_limit : config.tx_high_water * TX_HARD_LIMIT_FACTOR;
+    if (client->tx_bytes > hard_limit) {
+        printf("[Client id: %d over hard limit with %zu bytes queued]\n", client->id, client->tx_bytes);
+        connection->slow.clients_disconnected++;
+        disconnect_client_socket(connection, client->id);
+        return SOCK_ERR_CLIENT_TOO_SLOW;
+    }
 
-        // If we succeed in binding to socket, exit loop
+    if (client->tx_slow) return SOCK_SUCCESS;
+
+    client->tx_slow = true;
+
+    switch (config.slow_policy) {
+    case SOCK_SLOW_DROP:
+        // Low priority frames are turned away as they are queued
         break;
+    case SOCK_SLOW_PAUSE:
+        connection->slow.clients_paused++;
+        backend_pause_client(connection, client, true);
+        break;
+    case SOCK_SLOW_DISCONNECT:
+        printf("[Client id: %d too slow with %zu bytes queued]\n", client->id, client->tx_bytes);
+        connection->slow.clients_disconnected++;
+        disconnect_client_socket(connection, client->id);
+        return SOCK_ERR_CLIENT_TOO_SLOW;
     }
 
-    // Free memory allocated for addresses
-    freeaddrinfo(addr0);
+    return SOCK_SUCCESS;
+}
 
-    // If unable to bind, exit with failure
-    if (socket_fd == -1) {
-        PRINT_ERROR("Unable to bind to socket.");
-        return SOCK_ERR_SERVER_START_FAILURE;
-    }
+// List client for io_uring to send its queue next loop, so idle clients cost nothing per loop
+static void tx_mark_pending(SocketState* connection, Client* client) {
 
-    // Make this socket nonblocking
-    status = fcntl(socket_fd, F_SETFL, O_NONBLOCK);
-    if (status != 0) {
-        PRINT_ERROR("Unable to configure socket to non-blocking.");
-        return SOCK_ERR_SERVER_START_FAILURE;
-    }
+    if (connection->backend != SOCK_BACKEND_URING || client->tx_pending) return;
 
-    // Allow other sockets to bind to this port if no one is listening
-    int opt = 1;
-    status = setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-    if (status != 0) {
-        PRINT_ERROR("Unable to allow other sockets to bind to port.");
-        return SOCK_ERR_SERVER_START_FAILURE;
+    if (connection->num_tx_pending >= connection->tx_pending_cap) {
+        int cap = connection->tx_pending_cap > 0 ? connection->tx_pending_cap * 2 : CLIENT_SLOTS_MIN;
+        uint32_t* ids = realloc(connection->tx_pending_ids, cap * sizeof(uint32_t));
+        if (ids == NULL) {
+            connection->tx_pending_lost = true;
+            return;
+        }
+        connection->tx_pending_ids = ids;
+        connection->tx_pending_cap = cap;
     }
 
-    // Begin listening for connections on socket, with maximum backlog of 10
-    status = listen(socket_fd, 10);
-    if (status != 0) {
-        PRINT_ERROR("Unable to listen on socket.");
-        return SOCK_ERR_SERVER_START_FAILURE;
+    connection->tx_pending_ids[connection->num_tx_pending++] = client->id;
+    client->tx_pending = true;
+}
+
+// Queue shared frame on client's outbound queue
+// Low priority frames are dropped for slow clients if policy says so
+static SocketStatus tx_queue_frame(SocketState* connection, Client* client, Frame* frame) {
+
+    TxFrame* entry;
+
+    if (connection->type == SOCK_UNINITIALIZED) return SOCK_ERR_UNINITIALIZED;
+    if (client == NULL || client->active != ACTIVE) return SOCK_ERR_CLIENT_NOT_FOUND;
+
+    if (client->tx_slow && config.slow_policy == SOCK_SLOW_DROP && frame->priority == FRAME_PRIORITY_LOW) {
+        connection->slow.frames_dropped++;
+        client->tx_dropped = true;
+        return SOCK_ERR_CLIENT_TOO_SLOW;
     }
 
-    // Update type, and save socket fd
-    connection.type = SOCK_SERVER;
-    connection.socket = socket_fd;
+    entry = malloc(sizeof(TxFrame));
+    if (entry == NULL) return SOCK_ERR_SEND_FAILURE;
 
-    // Update default id #
-    connection.next_id = 1000;
+    frame->refs++;
+    entry->frame = frame;
+    entry->offset = 0;
+    entry->sealed = false;
+    entry->next = NULL;
 
-    // Setup our packet queue
-    connection.packet_queue = NULL;
+    if (client->tx_tail == NULL) {
+        client->tx_head = entry;
+    } else {
+        client->tx_tail->next = entry;
+    }
+    client->tx_tail = entry;
+    client->tx_bytes += frame->len;
+    tx_mark_pending(connection, client);
 
     return SOCK_SUCCESS;
 }
 
-// Accept any incoming connections, add to client list
-SocketStatus accept_client_socket(void) {
-    
-    int client_socket;
-    struct sockaddr_storage cli_addr;
-    socklen_t addr_len = sizeof cli_addr;
-
-    if (connection.type == SOCK_UNINITIALIZED) return SOCK_ERR_UNINITIALIZED;
-    else if (connection.type == SOCK_CLIENT) return SOCK_ERR_INVALID_CMD;
+// Fill iovec with the unsent part of each frame, return number of entries used
+// Encrypted connections only send what is sealed, plaintext waits for the handshake
+static int tx_iov(const Client* client, struct iovec* iov, int max_iov) {
 
-    // Accept incoming connections
-    client_socket = accept(connection.socket, (struct sockaddr *)&cli_addr, &addr_len);
-    
-    if (client_socket == -1 && errno == EWOULDBLOCK) return SOCK_ERR_NO_NEW_CONNECTIONS;
-    else if (client_socket == -1) return SOCK_ERR_SOCKET_DISCONNECT;
+    int iovcnt = 0;
 
-    if (connection.num_clients >= MAX_CLIENTS) {
-        close(client_socket);
-        return SOCK_ERR_TOO_MANY_CONNECTIONS;
+    for (const TxFrame* frame = client->tx_head; frame != NULL && iovcnt < max_iov; frame = frame->next) {
+        if (client->crypt != NULL && !frame->sealed) break;
+        iov[iovcnt].iov_base = frame->frame->data + frame->offset;
+        iov[iovcnt].iov_len = frame->frame->len - frame->offset;
+        iovcnt++;
     }
 
-    // Add new client to list
-    connection.clients[connection.num_clients].id = connection.next_id;
-    connection.clients[connection.num_clients].fd = client_socket;
-    connection.clients[connection.num_clients].active = ACTIVE;
-    connection.num_clients++;
-    connection.next_id++;
+    return iovcnt;
+}
 
-    printf("[Connecting client id: %d on socket: %d]\n", connection.clients[connection.num_clients-1].id, client_socket);
+// Release frames that were written completely, and advance into a partially written one
+// Returns first frame that still has unsent bytes
+static TxFrame* tx_consume(TxFrame* frame, size_t num_sent) {
 
-    return SOCK_SUCCESS;
+    while (frame != NULL && num_sent >= frame->frame->len - frame->offset) {
+        TxFrame* next = frame->next;
+        num_sent -= frame->frame->len - frame->offset;
+        release_frame(frame->frame);
+        free(frame);
+        frame = next;
+    }
+
+    if (frame != NULL) frame->offset += num_sent;
+
+    return frame;
 }
 
-// Close connection to client, mark connection as closed
-// Note: client still remains in list until it is flushed
-SocketStatus disconnect_client_socket(uint16_t client_id) {
+// Seal queued frames into records, packing as many as fit into each
+// so a coalesced batch costs one tag rather than one per frame
+// Nothing can be sealed until the handshake is done, frames wait in the queue till then
+static void tx_seal(Client* client) {
 
-    if (connection.type == SOCK_UNINITIALIZED) return SOCK_ERR_UNINITIALIZED;
-    else if (connection.type == SOCK_CLIENT) return SOCK_ERR_INVALID_CMD;
+    struct iovec iov[TX_MAX_IOV];
+    TxFrame** link = &client->tx_head;
+    TxFrame* last = NULL;
 
-    // Remove from client and fd list by overwriting entry with final entry
-    for (int i = 0; i < connection.num_clients; i++) {
-        if (client_id == connection.clients[i].id) {
+    if (client->crypt == NULL || !client->crypt->ready) return;
 
-            int socket_fd = connection.clients[i].fd;
-            printf("[Disconnecting client id: %d on socket: %d]\n", client_id, socket_fd);
+    while (*link != NULL) {
 
-            // Mark socket as inactive
-            connection.clients[i].active = INACTIVE;
+        TxFrame* frame = *link;
+        if (frame->sealed) {
+            last = frame;
+            link = &frame->next;
+            continue;
+        }
 
-            // Close socket
-            close(connection.clients[i].fd);
+        // Gather a run of frames, splitting the last one if it overflows the record
+        int iovcnt = 0;
+        size_t num_bytes = 0;
+        for (; frame != NULL && !frame->sealed && iovcnt < TX_MAX_IOV && num_bytes < CRYPT_RECORD_MAX; frame = frame->next) {
+            size_t len = frame->frame->len - frame->offset;
+            if (len > CRYPT_RECORD_MAX - num_bytes) len = CRYPT_RECORD_MAX - num_bytes;
+            iov[iovcnt].iov_base = frame->frame->data + frame->offset;
+            iov[iovcnt].iov_len = len;
+            iovcnt++;
+            num_bytes += len;
+        }
 
-            return SOCK_SUCCESS;
+        TxFrame* entry = malloc(sizeof(TxFrame));
+        Frame* record = malloc(sizeof(Frame) + CRYPT_RECORD_LEN(num_bytes));
+        if (entry == NULL || record == NULL) {
+            free(entry);
+            free(record);
+            break;
+        }
+
+        record->refs = 1;
+        record->priority = FRAME_PRIORITY_NORMAL;
+        record->len = crypt_seal(client->crypt, iov, iovcnt, record->data);
+        if (record->len == 0) {
+            free(entry);
+            free(record);
+            break;
         }
+
+        // Record takes the place of the plaintext it holds
+        entry->frame = record;
+        entry->offset = 0;
+        entry->sealed = true;
+        entry->next = tx_consume(*link, num_bytes);
+        *link = entry;
+        client->tx_bytes += record->len - num_bytes;
+
+        last = entry;
+        link = &entry->next;
     }
 
-    return SOCK_ERR_CLIENT_NOT_FOUND;
+    while (last != NULL && last->next != NULL) last = last->next;
+    client->tx_tail = last;
 }
 
-// Remove inactive clients from list of clients
-SocketStatus flush_inactive_client_sockets(void) {
+static void shm_offer(SocketState* connection, Client* client);
+
+// Write gathered bytes to client, through its shared rings if it has them
+// Behaves like sendmsg, a full ring fails with EAGAIN
+static ssize_t tx_write(Client* client, const struct msghdr* msg) {
+
+    if (client->shm == NULL) return sendmsg(client->fd, msg, MSG_NOSIGNAL);
+
+    size_t num_bytes = shm_write(client->shm, msg->msg_iov, (int)msg->msg_iovlen);
+    if (num_bytes == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    return (ssize_t)num_bytes;
+}
+
+// Write as much of the outbound queue as the socket will take
+// Whatever doesn't fit stays queued, and is flushed when the socket is writable
+static SocketStatus tx_flush(SocketState* connection, Client* client) {
 
-    if (connection.type == SOCK_UNINITIALIZED) return SOCK_ERR_UNINITIALIZED;
-    else if (connection.type == SOCK_CLIENT) return SOCK_ERR_INVALID_CMD;
+    struct iovec iov[TX_MAX_IOV];
+    struct msghdr msg = {0};
+    ssize_t num_bytes;
+
+    if (client == NULL) return SOCK_ERR_CLIENT_NOT_FOUND;
 
-    // Remove from client and fd list by overwriting entry with final entry
-    for (int i = connection.num_clients - 1; i >= 0; i--) {
-        if (connection.clients[i].active == INACTIVE) {
+    tx_seal(client);
 
-            DEBUG_PRINT3("Flushing inactive client:", connection.clients[i].id);
+    while (client->tx_head != NULL) {
 
-            // Overwrite entry with data from last entry
-            connection.clients[i] = connection.clients[connection.num_clients - 1];
+        msg.msg_iov = iov;
+        msg.msg_iovlen = tx_iov(client, iov, TX_MAX_IOV);
+        if (msg.msg_iovlen == 0) return SOCK_SUCCESS;
 
-            // Overwrite last entry with zeroes
-            memset(&connection.clients[connection.num_clients - 1], 0, sizeof(struct Client));
+        // Vectored send, so frames are written back to back without copying them together
+        num_bytes = tx_write(client, &msg);
 
-            // Decrement number of clients
-            connection.num_clients--;
-            
+        if (num_bytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return SOCK_SUCCESS;
+        } else if (num_bytes == -1 && errno == EINTR) {
+            continue;
+        } else if (num_bytes == -1) {
+            // Peer is gone, the read side will pick up the disconnect
+            free_tx_frames(client->tx_head);
+            client->tx_head = NULL;
+            client->tx_tail = NULL;
+            tx_drained(connection, client, client->tx_bytes);
+            return SOCK_ERR_SEND_FAILURE;
         }
-        
+
+        client->tx_head = tx_consume(client->tx_head, num_bytes);
+        tx_drained(connection, client, num_bytes);
     }
 
+    client->tx_tail = NULL;
+
+    // Queue has drained, so a shared ring answer can go out now
+    if (client->shm_pending && connection->type == SOCK_SERVER) shm_offer(connection, client);
+
     return SOCK_SUCCESS;
 }
 
-// Send packet to client
-SocketStatus server_socket_send_packet(uint16_t client_id, const char* data, size_t num_bytes) {
+// Get monotonic time in microseconds
+static int64_t now_usec(void) {
 
-    return send_packet(id_to_fd(client_id), data, num_bytes);
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
-// Receive packet from client
-SocketStatus server_socket_recv_packet(uint16_t client_id) {
+// Get monotonic time in milliseconds, the tick timers run on
+static uint64_t now_msec(void) {
 
-    return recv_packet(id_to_fd(client_id));
+    return (uint64_t)(now_usec() / 1000);
 }
 
-// Shutdown server and all client connections
-SocketStatus shutdown_server_socket(void) {
+// Whether outbound frames are held to go out together, busy polling sends everything straight away instead
+static bool tx_coalescing(void) {
 
-    if (connection.type == SOCK_UNINITIALIZED) return SOCK_ERR_UNINITIALIZED;
-    else if (connection.type == SOCK_CLIENT) return SOCK_ERR_INVALID_CMD;
+    return config.coalesce_window >= 0 && config.busy_poll <= 0;
+}
 
-    printf("Shutting down connection.\n");
-    for (int i = 1; i < connection.num_clients; i++) {
-        disconnect_client_socket(connection.clients[i].id);
-    }
+// Hold client's frames until the coalescing window closes, so they go out in one write
+// io_uring already gathers each client's frames into one send per tick, so only the window applies
+static void tx_hold(SocketState* connection, Client* client) {
 
-    close(connection.socket);
+    if (connection->tx_deadline == 0) connection->tx_deadline = now_usec() + config.coalesce_window;
 
-    memset(&connection, 0, sizeof(SocketState));
+    if (connection->backend == SOCK_BACKEND_URING || client->tx_held) return;
 
-    return SOCK_SUCCESS;
+    if (connection->num_tx_held >= connection->tx_held_cap) {
+        int cap = connection->tx_held_cap > 0 ? connection->tx_held_cap * 2 : CLIENT_SLOTS_MIN;
+        uint32_t* ids = realloc(connection->tx_held_ids, cap * sizeof(uint32_t));
+        if (ids == NULL) return;    // Not held, goes out as soon as socket is writable
+        connection->tx_held_ids = ids;
+        connection->tx_held_cap = cap;
+    }
+
+    connection->tx_held_ids[connection->num_tx_held++] = client->id;
+    client->tx_held = true;
 }
 
-// Poll connection for connections or packets
-// Accept any new connections, and add new packets to queue
-SocketStatus poll_sockets(int timeout) {
+// Write every held queue, once coalescing window has closed
+static void tx_flush_held(SocketState* connection) {
 
-    // Poll for any activity
-    struct pollfd active_fds[MAX_CLIENTS + 1] = {0};
-    uint16_t active_ids[MAX_CLIENTS + 1] = {0};
-    int num_active;
-    int num_events;
-    int status;
+    for (int i = 0; i < connection->num_tx_held; i++) {
+        Client* client = connection->type == SOCK_CLIENT ? &connection->server : id_to_client(connection, connection->tx_held_ids[i]);
+        if (client == NULL) continue;
+        client->tx_held = false;
+        tx_flush(connection, client);
+    }
 
-    if (connection.type == SOCK_UNINITIALIZED) return SOCK_ERR_UNINITIALIZED;
+    connection->num_tx_held = 0;
+    connection->tx_deadline = 0;
+}
 
-    // Create list of fds
-    num_active = 1;
-    active_fds[0].fd = connection.socket;
-    active_fds[0].events = POLLIN;
-    for (int i = 0; i < connection.num_clients; i++) {
-        if (connection.clients[i].active == ACTIVE) {
-            active_fds[num_active].fd = connection.clients[i].fd;
-            active_fds[num_active].events = POLLIN;
-            active_ids[num_active] = connection.clients[i].id; // Store id for future use
-            num_active++;
-        }
-    }
+// Queue frame for client, and write it straight away if nothing is waiting ahead of it
+// When coalescing, frames are held and written together at the end of the tick instead
+static SocketStatus send_frame(SocketState* connection, Client* client, Frame* frame) {
 
-    // Also poll stdin if this is a client
-    if (connection.type == SOCK_CLIENT) {
-        active_fds[num_active].fd = 0;  // stdin file descriptor
-        active_fds[num_active].events = POLLIN;
-        num_active++;
-    }
+    SocketStatus status;
+    bool idle;
 
-    num_events = poll(active_fds, num_active, timeout);
+    if (client == NULL) return SOCK_ERR_CLIENT_NOT_FOUND;
 
-    if (num_events < 0) return SOCK_ERR_POLL_FAILURE;
+    idle = client->tx_head == NULL;
 
-    if (connection.type == SOCK_SERVER) {
-        // First check our connection for any incoming requests
-        if (active_fds[0].revents & POLLIN) {
-            DEBUG_PRINT("Polled new connection");
-            status = accept_client_socket();
-            if (status == SOCK_ERR_SOCKET_DISCONNECT) {
-                DEBUG_PRINT("Socket error.");
-                shutdown_server_socket();
-                return SOCK_ERR_SOCKET_DISCONNECT;
-            }
-        }
+    status = tx_queue_frame(connection, client, frame);
+    if (status != SOCK_SUCCESS) return status;
 
-        // Now check remaining ports for packets
-        for (int i = 1; i < num_active; i++) {
-            if (active_fds[i].revents & POLLIN) {
-                DEBUG_PRINT("Polled new packet");
-                status = recv_packet(active_fds[i].fd);
-                if (status == SOCK_ERR_SOCKET_DISCONNECT) {
-                    disconnect_client_socket(active_ids[i]);
-                }
-            }
-        }
-    } else if (connection.type == SOCK_CLIENT) {
-        // Check if our client socket has any packets
-        if (active_fds[0].revents & POLLIN) {
-            DEBUG_PRINT("Polled new packet");
-            status = recv_packet(active_fds[0].fd);
-            if (status == SOCK_ERR_SOCKET_DISCONNECT) {
-                DEBUG_PRINT("Server disconnected.");
-                shutdown_client_socket();
-                return SOCK_ERR_SOCKET_DISCONNECT;
-            }
-        }
+    status = tx_check_slow(connection, client);
+    if (status != SOCK_SUCCESS) return status;
+
+    if (tx_coalescing()) {
+        tx_hold(connection, client);
+        return SOCK_SUCCESS;
     }
 
+    // io_uring submits once per loop, and a busy queue is flushed when writable
+    // Shared rings are written straight away on every backend
+    if ((connection->backend == SOCK_BACKEND_URING && client->shm == NULL) || !idle) return SOCK_SUCCESS;
 
-    return SOCK_SUCCESS;
+    return tx_flush(connection, client);
 }
 
-// Start a client and connect to host at specified port
-SocketStatus start_client_socket(const char* host, const char* port) {
+// Drop connection whose frame was only partly written, since everything after it would be misframed
+// Server disconnects the client, a client endpoint leaves the read side to pick up the hang up
+static void tx_abort(SocketState* connection, Client* client) {
 
-    int status;             // Variable for storing function return status
-    int socket_fd;           // Variable for storing socket file descriptor
+    if (connection->type == SOCK_SERVER) disconnect_client_socket(connection, client->id);
+    else shutdown(client->fd, SHUT_RDWR);
+}
 
-    struct addrinfo hints = {0};    // Struct to pass inputs to getaddrinfo
-    struct addrinfo *addr, *addr0;  // Structs to get results from getaddrinfo
+// Send message gathered from payload fragments to a single client
+// An idle socket is written straight from the fragments, and only what it doesn't take
+// is copied into a frame. Otherwise the message is framed and queued behind the rest
+static SocketStatus send_packetv(SocketState* connection, Client* client, const struct iovec* iov, int iovcnt) {
 
-    // If already initialized, return error
-    if (connection.type != SOCK_UNINITIALIZED) return SOCK_ERR_ALREADY_INITIALIZED;
+    SocketStatus status;
+    Frame* frame;
+    ssize_t num_sent = 0;
+    bool direct;
+    size_t num_bytes = iov_length(iov, iovcnt);
 
-    hints.ai_family = AF_UNSPEC;        // Either IPv4 or IPv6
-    hints.ai_socktype = SOCK_STREAM;    // TCP Stream Socket
-    hints.ai_flags = AI_PASSIVE;        // Fill in IP
+    if (connection->type == SOCK_UNINITIALIZED) return SOCK_ERR_UNINITIALIZED;
+    if (client == NULL || client->active != ACTIVE) return SOCK_ERR_CLIENT_NOT_FOUND;
+    if (num_bytes == SIZE_MAX) return SOCK_ERR_INVALID_MSG_LENGTH;
 
-    status = getaddrinfo(host, port, &hints, &addr0);
-    if (status != 0 || addr0 == NULL) {
-        PRINT_ERROR2("Unable to get address.", gai_strerror(status));
-        return SOCK_ERR_CLIENT_START_FAILURE;
-    }
+    direct = (connection->backend != SOCK_BACKEND_URING || client->shm != NULL) && !tx_coalescing() &&
+             client->tx_head == NULL && client->crypt == NULL && iovcnt < TX_MAX_IOV;
 
-    // Connect to first address that works
-    for (addr = addr0; addr != NULL; addr = addr->ai_next) {
+    if (direct) {
 
-        // Attempt to open streaming socket
-        socket_fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
-        if (socket_fd == -1) {
-            continue;
-        }
+        struct iovec msg_iov[TX_MAX_IOV];
+        struct msghdr msg = {0};
+        uint16_t nw_len = htons((uint16_t)num_bytes);
 
-        // Attempt to connect to socket
-        status = connect(socket_fd, addr->ai_addr, addr->ai_addrlen);
-        if (status == -1) {
-            close(socket_fd);
-            socket_fd = -1;
-            continue;
-        }
+        msg_iov[0].iov_base = &nw_len;
+        msg_iov[0].iov_len = sizeof(nw_len);
+        if (iovcnt > 0) memcpy(&msg_iov[1], iov, iovcnt * sizeof(struct iovec));
+        msg.msg_iov = msg_iov;
+        msg.msg_iovlen = iovcnt + 1;
 
-        // If we connect successfully, leave loop
-        break;
-    }
+        do {
+            num_sent = tx_write(client, &msg);
+        } while (num_sent == -1 && errno == EINTR);
 
-    // Free memory allocated for addresses
-    freeaddrinfo(addr0);
+        if (num_sent == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            // Peer is gone, the read side will pick up the disconnect
+            return SOCK_ERR_SEND_FAILURE;
+        }
 
-    if (socket_fd == -1) {
-        PRINT_ERROR("Unable to connect to socket.");
-        return SOCK_ERR_CLIENT_START_FAILURE;
+        if (num_sent == (ssize_t)(sizeof(nw_len) + num_bytes)) return SOCK_SUCCESS;
+        if (num_sent < 0) num_sent = 0;
     }
 
-    // Make this socket nonblocking
-    status = fcntl(socket_fd, F_SETFL, O_NONBLOCK);
-    if (status != 0) {
-        PRINT_ERROR("Unable to configure socket to non-blocking.");
-        return SOCK_ERR_CLIENT_START_FAILURE;
+    frame = alloc_framev(iov, iovcnt);
+    if (frame == NULL) status = SOCK_ERR_SEND_FAILURE;
+    else if (direct) status = tx_queue_frame(connection, client, frame);
+    else status = send_frame(connection, client, frame);
+
+    // Skip whatever the direct write already took, the rest goes out when writable
+    if (direct && status == SOCK_SUCCESS) {
+        client->tx_tail->offset = num_sent;
+        tx_drained(connection, client, num_sent);
+        status = tx_check_slow(connection, client);
+    } else if (direct && num_sent > 0) {
+        tx_abort(connection, client);
+        status = SOCK_ERR_SEND_FAILURE;
     }
+    release_frame(frame);
 
-    // Update type, and save socked fd
-    connection.type = SOCK_CLIENT;
-    connection.socket = socket_fd;
+    return status;
+}
 
-    // Setup our packet queue
-    connection.packet_queue = NULL;
+// Frame packet and send it to a single client
+static SocketStatus send_packet(SocketState* connection, Client* client, const char* data, size_t num_bytes) {
 
-    return SOCK_SUCCESS;
+    struct iovec iov = {.iov_base = (void*)data, .iov_len = num_bytes};
+
+    return send_packetv(connection, client, &iov, 1);
 }
 
-// Send packet from client to server
-SocketStatus client_socket_send_packet(const char* data, size_t num_bytes) {
+// Get current tick if this endpoint rate limits its clients, 0 if it doesn't
+// Read once per batch of input rather than per frame
+static uint64_t rx_limit_now(const SocketState* connection) {
 
-    if (connection.type != SOCK_CLIENT) return SOCK_ERR_INVALID_CMD;
+    if (connection->type != SOCK_SERVER || (config.rate_msgs <= 0 && config.rate_bytes <= 0)) return 0;
 
-    return send_packet(connection.socket, data, num_bytes);
+    return now_msec();
 }
 
-// Shutdown client
-SocketStatus shutdown_client_socket(void) {
+// Fill client's buckets, so it may burst straight after it connects
+static void rx_limit_start(Client* client, uint64_t now) {
+
+    client->rx_msgs = (RateBucket){.tokens = (int64_t)config.rate_msgs * 1000, .refilled = now};
+    client->rx_bytes = (RateBucket){.tokens = (int64_t)config.rate_bytes * 1000, .refilled = now};
+}
 
-    if (connection.type != SOCK_CLIENT) return SOCK_ERR_INVALID_CMD;
+// Add tokens for time passed since bucket was last refilled, up to a second's worth
+static void rate_refill(RateBucket* bucket, int rate, uint64_t now) {
 
-    printf("Shutting down client.\n");
+    uint64_t elapsed = now > bucket->refilled ? now - bucket->refilled : 0;
+
+    bucket->tokens += (int64_t)(elapsed < 1000 ? elapsed : 1000) * rate;
+    if (bucket->tokens > (int64_t)rate * 1000) bucket->tokens = (int64_t)rate * 1000;
+    bucket->refilled = now;
+}
+
+// Tell client it went over a rate limit
+// Runs from the timer wheel, so nothing is sent while its frames are still being split
+static void throttle_notify(void* arg, uint64_t client_id) {
+
+    SocketState* connection = arg;
+    Client* client = id_to_client(connection, (uint32_t)client_id);
 
-    close(connection.socket);
+    if (client == NULL || client->active != ACTIVE || connection->throttle_notice == NULL) return;
+
+    if (send_frame(connection, client, connection->throttle_notice) == SOCK_SUCCESS) {
+        client->throttle.notices_sent++;
+        connection->throttle.notices_sent++;
+    }
+}
+
+// Check frame of len payload bytes against client's rate limits, taking its tokens if it is within them
+// Frames over a limit are counted and dropped before anyone parses them, and the client is told at most
+// once per THROTTLE_NOTICE_GAP, so a flood costs the server no more than reading it
+// A frame bigger than a second's worth of bytes needs a full bucket, rather than never getting through
+static bool rx_admit(SocketState* connection, Client* client, uint16_t len, uint64_t now) {
+
+    int64_t byte_cost = (int64_t)(len < config.rate_bytes ? len : config.rate_bytes) * 1000;
+
+    if (config.rate_msgs > 0) rate_refill(&client->rx_msgs, config.rate_msgs, now);
+    if (config.rate_bytes > 0) rate_refill(&client->rx_bytes, config.rate_bytes, now);
+
+    if ((config.rate_msgs <= 0 || client->rx_msgs.tokens >= 1000) && (config.rate_bytes <= 0 || client->rx_bytes.tokens >= byte_cost)) {
+        if (config.rate_msgs > 0) client->rx_msgs.tokens -= 1000;
+        if (config.rate_bytes > 0) client->rx_bytes.tokens -= byte_cost;
+        return true;
+    }
+
+    client->throttle.frames_throttled++;
+    client->throttle.bytes_throttled += len;
+    connection->throttle.frames_throttled++;
+    connection->throttle.bytes_throttled += len;
+
+    if (client->rx_notified == 0 || now - client->rx_notified >= THROTTLE_NOTICE_GAP) {
+        client->rx_notified = now;
+        timer_add(&connection->timers, now, throttle_notify, connection, client->id);
+    }
+
+    return false;
+}
+
+// Account for body bytes that landed in partial frame's packet, queue it once it is whole
+// Frames whose packet couldn't be allocated are read and dropped, to keep the stream in step
+static void rx_fill(SocketState* connection, Client* client, size_t num_bytes) {
+
+    uint16_t packet_len;
+
+    memcpy(&packet_len, client->rx_prefix, sizeof(packet_len));
+    packet_len = ntohs(packet_len);
+
+    client->rx_len += num_bytes;
+    if (client->rx_len < sizeof(packet_len) + packet_len) return;
+
+    if (client->rx_packet != NULL) enqueue_packet(connection, client->rx_packet);
+    client->rx_packet = NULL;
+    client->rx_len = 0;
+}
+
+static void rx_control(SocketState* connection, Client* client);
+
+// Split received bytes into packets, carrying any partial frame over to the next read
+// Each frame is a 2 byte length prefix followed by the packet, and a frame may be
+// split across any number of reads. While rx_len is below 2 we are waiting on the
+// prefix, after that the body goes straight into the packet that will carry it.
+// Frames over client's rate limits are read and dropped like ones whose packet couldn't be allocated
+static void rx_feed(SocketState* connection, Client* client, const char* data, size_t num_bytes) {
+
+    uint16_t packet_len;
+    uint64_t now = rx_limit_now(connection);
+
+    // Anything arriving answers every heartbeat sent so far
+    if (connection->type == SOCK_SERVER && config.heartbeat_interval > 0) {
+        client->rx_last = now > 0 ? now : now_msec();
+        client->rx_missed = 0;
+    }
+
+    while (num_bytes > 0) {
+
+        // Queue whole frames straight from the data when nothing is carried over
+        if (client->rx_len == 0 && num_bytes >= sizeof(packet_len)) {
+            memcpy(&packet_len, data, sizeof(packet_len));
+            packet_len = ntohs(packet_len);
+            if (num_bytes >= sizeof(packet_len) + packet_len) {
+                if (packet_len == 0) rx_control(connection, client);
+                else if (now == 0 || rx_admit(connection, client, packet_len, now)) queue_packet(connection, client->id, data + sizeof(packet_len), packet_len);
+                data += sizeof(packet_len) + packet_len;
+                num_bytes -= sizeof(packet_len) + packet_len;
+                continue;
+            }
+        }
+
+        // Otherwise collect the length prefix first, so the packet can be sized
+        if (client->rx_len < sizeof(packet_len)) {
+            client->rx_prefix[client->rx_len++] = (uint8_t)*data;
+            data++;
+            num_bytes--;
+            if (client->rx_len < sizeof(packet_len)) continue;
+
+            memcpy(&packet_len, client->rx_prefix, sizeof(packet_len));
+            packet_len = ntohs(packet_len);
+            if (packet_len == 0) {
+                client->rx_len = 0;
+                rx_control(connection, client);
+                continue;
+            }
+
+            if (now == 0 || rx_admit(connection, client, packet_len, now)) client->rx_packet = alloc_packet(packet_len);
+            if (client->rx_packet != NULL) {
+                client->rx_packet->len = packet_len;
+                client->rx_packet->sender = client->id;
+            }
+            continue;
+        }
+
+        // Then copy body into packet, later reads go there without this copy
+        memcpy(&packet_len, client->rx_prefix, sizeof(packet_len));
+        size_t num_body = client->rx_len - sizeof(packet_len);
+        size_t num_copy = ntohs(packet_len) - num_body;
+        if (num_copy > num_bytes) num_copy = num_bytes;
+
+        if (client->rx_packet != NULL) memcpy(client->rx_packet->data + num_body, data, num_copy);
+        rx_fill(connection, client, num_copy);
+        data += num_copy;
+        num_bytes -= num_copy;
+    }
+}
+
+// Handle one whole piece of an encrypted stream, the peer's hello or a record
+// Return -1 if the handshake fails or the record doesn't authenticate
+static int rx_open(SocketState* connection, Client* client, char* piece, size_t len) {
+
+    if (!client->crypt->ready) {
+        if (crypt_finish(client->crypt, piece) != 0) return -1;
+        // Whatever we queued while waiting can be sealed and sent now, io_uring picks it up next loop
+        if (connection->backend != SOCK_BACKEND_URING && client->tx_head != NULL && !client->tx_held) tx_flush(connection, client);
+        return 0;
+    }
+
+    ssize_t num_bytes = crypt_open(client->crypt, piece, len);
+    if (num_bytes < 0) return -1;
+
+    rx_feed(connection, client, piece + CRYPT_HEADER_LEN, num_bytes);
+
+    return 0;
+}
+
+// Pass received bytes through client's record layer, then split them into packets
+// Records that arrived whole are opened where they landed, only split ones are gathered first
+// Return -1 if the connection can't be trusted any more
+static int rx_input(SocketState* connection, Client* client, char* data, size_t num_bytes) {
+
+    if (client->crypt == NULL) {
+        rx_feed(connection, client, data, num_bytes);
+        return 0;
+    }
+
+    while (num_bytes > 0) {
+
+        ssize_t len;
+
+        if (client->rx_record == NULL) {
+            len = crypt_record_len(client->crypt, data, num_bytes);
+            if (len < 0) return -1;
+            if (len > 0 && (size_t)len <= num_bytes) {
+                if (rx_open(connection, client, data, len) != 0) return -1;
+                data += len;
+                num_bytes -= len;
+                continue;
+            }
+
+            client->rx_record = alloc_packet(CRYPT_RECORD_LEN(CRYPT_RECORD_MAX));
+            if (client->rx_record == NULL) return -1;
+            client->rx_record_len = 0;
+        }
+
+        // Take the length prefix first, then the rest of the piece
+        char* record = client->rx_record->data;
+        len = crypt_record_len(client->crypt, record, client->rx_record_len);
+        if (len < 0) return -1;
+
+        size_t num_wanted = (len > 0 ? (size_t)len : CRYPT_HEADER_LEN) - client->rx_record_len;
+        size_t num_copy = num_wanted < num_bytes ? num_wanted : num_bytes;
+
+        memcpy(record + client->rx_record_len, data, num_copy);
+        client->rx_record_len += num_copy;
+        data += num_copy;
+        num_bytes -= num_copy;
+
+        if (len == 0 || client->rx_record_len < (size_t)len) continue;
+
+        int status = rx_open(connection, client, record, len);
+        free_packet(client->rx_record);
+        client->rx_record = NULL;
+        client->rx_record_len = 0;
+        if (status != 0) return -1;
+    }
+
+    return 0;
+}
+
+// Receive on socket, and keep any descriptors passed along with the data for shm_accept
+static ssize_t recv_fds(SocketState* connection, int fd, char* buffer, size_t len) {
+
+    char control[CMSG_SPACE(sizeof(int) * SHM_NUM_FDS)];
+    struct iovec iov = {.iov_base = buffer, .iov_len = len};
+    struct msghdr msg = {0};
+    ssize_t num_bytes;
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof control;
+
+    num_bytes = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    if (num_bytes <= 0) return num_bytes;
+
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+
+        int num_fds = (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+        for (int i = 0; i < num_fds; i++) {
+            int passed;
+            memcpy(&passed, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            if (connection->num_shm_fds < SHM_NUM_FDS) connection->shm_fds[connection->num_shm_fds++] = passed;
+            else close(passed);
+        }
+    }
+
+    return num_bytes;
+}
+
+// Read everything available on a socket, and queue every complete packet
+// Partial frames are kept on the client until the rest arrives, and the rest is
+// read straight into the packet instead of through the scratch buffer
+static SocketStatus recv_packets(SocketState* connection, Client* client) {
+
+    ssize_t num_bytes;
+    size_t num_wanted;
+    bool direct;
+
+    if (connection->type == SOCK_UNINITIALIZED) return SOCK_ERR_UNINITIALIZED;
+    if (client == NULL) return SOCK_ERR_CLIENT_NOT_FOUND;
+
+    do {
+        direct = client->rx_packet != NULL && client->crypt == NULL;
+
+        if (direct) {
+            size_t num_body = client->rx_len - sizeof(client->rx_prefix);
+            num_wanted = client->rx_packet->len - num_body;
+            num_bytes = recv(client->fd, client->rx_packet->data + num_body, num_wanted, 0);
+        } else if (client->shm_pending && connection->type == SOCK_CLIENT) {
+            num_wanted = sizeof(rx_buffer);
+            num_bytes = recv_fds(connection, client->fd, rx_buffer, num_wanted);
+        } else {
+            num_wanted = sizeof(rx_buffer);
+            num_bytes = recv(client->fd, rx_buffer, num_wanted, 0);
+        }
+
+        if (num_bytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            DEBUG_PRINT("No packet read.");
+            return SOCK_ERR_NO_DATA;
+        } else if (num_bytes <= 0) {
+            DEBUG_PRINT("Socket disconnected.");
+            return SOCK_ERR_SOCKET_DISCONNECT;
+        }
+
+        DEBUG_PRINT3("Bytes received:", (int)num_bytes);
+
+        if (direct) rx_fill(connection, client, num_bytes);
+        else if (rx_input(connection, client, rx_buffer, num_bytes) != 0) return SOCK_ERR_SOCKET_DISCONNECT;
+
+    // A short read means the socket has been drained
+    } while ((size_t)num_bytes == num_wanted);
+
+    return SOCK_SUCCESS;
+}
+
+// Register fd with epoll instance
+static int epoll_add_fd(SocketState* connection, int fd, uint32_t events) {
+
+    struct epoll_event event = {0};
+
+    event.events = events;
+    event.data.fd = fd;
+
+    return epoll_ctl(connection->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+}
+
+// Receive's user_data, generation sits above the 32 bit client id
+static uint64_t uring_recv_data(uint32_t id, uint8_t arm) {
+    return ((uint64_t)arm << (32 + URING_OP_SHIFT)) | ((uint64_t)id << URING_OP_SHIFT) | URING_OP_RECV;
+}
+
+// Arm multishot receive into provided buffers for client, unless one is still outstanding
+static void uring_arm_recv(SocketState* connection, Client* client) {
+
+    if (client->rx_armed) return;
+
+    struct io_uring_sqe* sqe = uring_get_sqe(connection->ring);
+    if (sqe == NULL) return;
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = client->fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    client->rx_armed = true;
+    client->rx_arm++;
+    sqe->user_data = uring_recv_data(client->id, client->rx_arm);
+}
+
+// Cancel client's multishot receive, its final completion comes back with -ECANCELED
+static void uring_cancel_recv(SocketState* connection, const Client* client) {
+
+    struct io_uring_sqe* sqe = uring_get_sqe(connection->ring);
+    if (sqe == NULL) return;
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = uring_recv_data(client->id, client->rx_arm);
+    sqe->user_data = URING_OP_CANCEL;
+}
+
+// Arm multishot accept on a listening socket
+static void uring_arm_accept(SocketState* connection, int listen_fd) {
+
+    struct io_uring_sqe* sqe = uring_get_sqe(connection->ring);
+    if (sqe == NULL) return;
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = ((uint64_t)listen_fd << URING_OP_SHIFT) | URING_OP_ACCEPT;
+}
+
+// Arm multishot poll on eventfd a client signals its shared rings with
+static void uring_arm_shm(SocketState* connection, const Client* client) {
+
+    struct io_uring_sqe* sqe = uring_get_sqe(connection->ring);
+    if (sqe == NULL) return;
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = client->shm->wait_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = ((uint64_t)client->id << URING_OP_SHIFT) | URING_OP_SHM;
+}
+
+// Arm poll on handoff listener, the restarted server is accepted outside the ring
+static void uring_arm_handoff(SocketState* connection) {
+
+    struct io_uring_sqe* sqe = uring_get_sqe(connection->ring);
+    if (sqe == NULL) return;
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = connection->handoff_socket;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = URING_OP_HANDOFF;
+}
+
+// Arm multishot poll on shard wake eventfd
+static void uring_arm_wake(SocketState* connection) {
+
+    struct io_uring_sqe* sqe = uring_get_sqe(connection->ring);
+    if (sqe == NULL) return;
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = connection->wake_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = URING_OP_WAKE;
+}
+
+// Reset shard wake eventfd, packets themselves are collected at the end of every poll
+static void shard_clear_wake(SocketState* connection) {
+
+    uint64_t count;
+
+    if (read(connection->wake_fd, &count, sizeof count) < 0 && errno != EAGAIN) {
+        PRINT_ERROR("Unable to read shard wake event.");
+    }
+}
+
+// Start watching a newly accepted client
+static SocketStatus backend_add_client(SocketState* connection, Client* client) {
+
+    switch (connection->backend) {
+    case SOCK_BACKEND_EPOLL:
+        // Register once, edge-triggered, so we are only woken for new data or new room to write
+        if (epoll_add_fd(connection, client->fd, EPOLLIN | EPOLLOUT | EPOLLET) == -1) {
+            PRINT_ERROR("Unable to register client with epoll.");
+            return SOCK_ERR_POLL_FAILURE;
+        }
+        break;
+    case SOCK_BACKEND_URING:
+        uring_arm_recv(connection, client);
+        break;
+    case SOCK_BACKEND_POLL:
+        break;
+    }
+
+    return SOCK_SUCCESS;
+}
+
+// Stop or restart reading from a client, so a client that won't read can't keep adding work
+static void backend_pause_client(SocketState* connection, Client* client, bool paused) {
+
+    struct epoll_event event = {0};
+
+    client->rx_paused = paused;
+
+    switch (connection->backend) {
+    case SOCK_BACKEND_EPOLL:
+        // Registering again checks readiness, so data that arrived while paused isn't missed
+        if (!paused) {
+            event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+            event.data.fd = client->fd;
+            epoll_ctl(connection->epoll_fd, EPOLL_CTL_MOD, client->fd, &event);
+        }
+        break;
+    case SOCK_BACKEND_URING:
+        if (paused) uring_cancel_recv(connection, client);
+        else if (!connection->handing_off) uring_arm_recv(connection, client);
+        break;
+    case SOCK_BACKEND_POLL:
+        break;
+    }
+
+    // Frames left in shared rings while paused are read on the next poll
+    if (!paused && client->shm != NULL) eventfd_write(client->shm->wait_fd, 1);
+}
+
+// Stop watching a client, before its socket is closed
+static void backend_remove_client(SocketState* connection, const Client* client) {
+
+    switch (connection->backend) {
+    case SOCK_BACKEND_EPOLL:
+        epoll_ctl(connection->epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+        break;
+    case SOCK_BACKEND_URING:
+        // Requests in flight hold the socket open, shutting it down completes them
+        shutdown(client->fd, SHUT_RDWR);
+        break;
+    case SOCK_BACKEND_POLL:
+        break;
+    }
+}
+
+// Start watching eventfd peer signals client's shared rings with
+static int backend_add_shm(SocketState* connection, const Client* client) {
+
+    switch (connection->backend) {
+    case SOCK_BACKEND_EPOLL:
+        return epoll_add_fd(connection, client->shm->wait_fd, EPOLLIN);
+    case SOCK_BACKEND_URING:
+        uring_arm_shm(connection, client);
+        break;
+    case SOCK_BACKEND_POLL:
+        break;
+    }
+
+    return 0;
+}
+
+// Stop watching client's shared ring eventfd, before it is closed
+static void backend_remove_shm(SocketState* connection, const Client* client) {
+
+    struct io_uring_sqe* sqe;
+
+    switch (connection->backend) {
+    case SOCK_BACKEND_EPOLL:
+        epoll_ctl(connection->epoll_fd, EPOLL_CTL_DEL, client->shm->wait_fd, NULL);
+        break;
+    case SOCK_BACKEND_URING:
+        // Poll holds its own reference to the eventfd, so cancel it instead of relying on close
+        sqe = uring_get_sqe(connection->ring);
+        if (sqe == NULL) break;
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = ((uint64_t)client->id << URING_OP_SHIFT) | URING_OP_SHM;
+        sqe->user_data = URING_OP_CANCEL;
+        break;
+    case SOCK_BACKEND_POLL:
+        break;
+    }
+}
+
+// Stop using client's shared rings, and release them
+static void shm_release(SocketState* connection, Client* client) {
+
+    if (client->shm == NULL) return;
+
+    backend_remove_shm(connection, client);
+    if (connection->type == SOCK_SERVER) connection->fd_ids[client->shm->wait_fd] = 0;
+    shm_close(client->shm);
+    free(client->shm);
+    client->shm = NULL;
+    connection->num_shm--;
+}
+
+// Answer a client's request for shared rings, on the server
+// Descriptors can only be passed over Unix sockets, anything else gets an empty frame with none.
+// The answer must not overtake frames already queued on the socket, so it waits for them to go out
+static void shm_offer(SocketState* connection, Client* client) {
+
+    char control[CMSG_SPACE(sizeof(int) * SHM_NUM_FDS)] = {0};
+    uint16_t nw_len = 0;
+    struct iovec iov = {.iov_base = &nw_len, .iov_len = sizeof(nw_len)};
+    struct msghdr msg = {0};
+    struct cmsghdr* cmsg;
+    int fds[SHM_NUM_FDS];
+    int domain = 0;
+    socklen_t domain_len = sizeof domain;
+    ssize_t num_sent;
+    ShmLink* link;
+
+    if (client->shm != NULL) return;
+
+    if (client->tx_head != NULL || client->tx_busy) {
+        client->shm_pending = true;
+        return;
+    }
+    client->shm_pending = false;
+
+    if (getsockopt(client->fd, SOL_SOCKET, SO_DOMAIN, &domain, &domain_len) != 0 || domain != AF_UNIX) {
+        send_packetv(connection, client, NULL, 0);
+        return;
+    }
+
+    link = malloc(sizeof(ShmLink));
+    if (link == NULL || shm_create(link, fds) != 0) {
+        PRINT_ERROR("Unable to create shared memory rings.");
+        free(link);
+        send_packetv(connection, client, NULL, 0);
+        return;
+    }
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof control;
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof fds);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof fds);
+
+    // io_uring clients are blocking sockets, so never wait here
+    do {
+        num_sent = sendmsg(client->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+    } while (num_sent == -1 && errno == EINTR);
+
+    if (num_sent == -1) {
+        shm_close(link);
+        free(link);
+        send_packetv(connection, client, NULL, 0);
+        return;
+    }
+
+    client->shm = link;
+    connection->num_shm++;
+
+    // Client already has the rings if any of the answer went out, so it can't be taken back
+    if (num_sent != sizeof(nw_len) || fd_table_set(connection, link->wait_fd, client->id) != 0 || backend_add_shm(connection, client) != 0) {
+        PRINT_ERROR("Unable to start shared memory rings.");
+        disconnect_client_socket(connection, client->id);
+        return;
+    }
+
+    printf("[Client id: %d using shared memory rings]\n", client->id);
+}
+
+// Take server's answer to our shared ring request, on the client
+// A server that can't offer rings answers without descriptors, and we stay on the socket
+static void shm_accept(SocketState* connection, Client* client) {
+
+    ShmLink* link;
+
+    if (!client->shm_pending || client->shm != NULL || connection->num_shm_fds != SHM_NUM_FDS) {
+        for (int i = 0; i < connection->num_shm_fds; i++) close(connection->shm_fds[i]);
+        connection->num_shm_fds = 0;
+        client->shm_pending = false;
+        return;
+    }
+
+    client->shm_pending = false;
+    connection->num_shm_fds = 0;
+
+    link = malloc(sizeof(ShmLink));
+    if (link == NULL || shm_attach(link, connection->shm_fds) != 0) {
+        if (link == NULL) for (int i = 0; i < SHM_NUM_FDS; i++) close(connection->shm_fds[i]);
+        free(link);
+        link = NULL;
+    }
+
+    client->shm = link;
+    if (link != NULL) connection->num_shm++;
+
+    // Server writes to the rings from now on, so without them the connection is no use
+    if (link == NULL || backend_add_shm(connection, client) != 0) {
+        PRINT_ERROR("Unable to start shared memory rings.");
+        shutdown(client->fd, SHUT_RDWR);
+    }
+}
+
+// Zero length frames carry the shared ring handshake, nothing else sends them
+static void rx_control(SocketState* connection, Client* client) {
+
+    if (connection->type == SOCK_SERVER) shm_offer(connection, client);
+    else shm_accept(connection, client);
+}
+
+// Read client's shared rx ring and refill its tx ring, once peer has signalled us
+// At most one ring's worth is read per call, so a busy peer can't starve the rest
+static SocketStatus shm_service(SocketState* connection, Client* client) {
+
+    const char* data;
+    size_t num_bytes;
+    size_t num_read = 0;
+
+    shm_clear_wake(client->shm);
+
+    while (!client->rx_paused && num_read < SHM_RING_SIZE && (data = shm_peek(client->shm, &num_bytes)) != NULL) {
+        rx_feed(connection, client, data, num_bytes);
+        shm_consume(client->shm, num_bytes);
+        num_read += num_bytes;
+    }
+
+    // Come back for the rest next poll
+    if (num_read >= SHM_RING_SIZE) eventfd_write(client->shm->wait_fd, 1);
+
+    if (client->tx_head != NULL && !client->tx_held) return tx_flush(connection, client);
+
+    return SOCK_SUCCESS;
+}
+
+// Ask server to carry frames over shared rings, and wait a little while for its answer
+// Nothing else is sent until it answers, so our frames can't reach it out of order
+static void shm_request(SocketState* connection) {
+
+    Client* server = &connection->server;
+    struct pollfd pfd = {.fd = server->fd, .events = POLLIN};
+    int64_t deadline = now_usec() + (int64_t)SHM_REPLY_TIMEOUT * 1000;
+
+    server->shm_pending = true;
+
+    if (send_packetv(connection, server, NULL, 0) != SOCK_SUCCESS) {
+        server->shm_pending = false;
+        return;
+    }
+
+    // Anything the server sends ahead of its answer is queued as usual
+    while (server->shm_pending) {
+        int64_t remaining = deadline - now_usec();
+        if (remaining <= 0 || poll(&pfd, 1, (int)((remaining + 999) / 1000)) <= 0) break;
+        if (recv_packets(connection, server) == SOCK_ERR_SOCKET_DISCONNECT) break;
+    }
+
+    if (server->shm_pending) {
+        PRINT_ERROR2("No shared memory rings from server.", "Staying on socket.");
+        server->shm_pending = false;
+    }
+}
+
+// Queue every whole message in a datagram, a truncated one ends it
+// Messages over the sender's rate limits are dropped, they take from the same buckets as its stream
+static void udp_feed(SocketState* connection, Client* client, const char* data, size_t num_bytes) {
+
+    uint16_t packet_len;
+    uint64_t now = rx_limit_now(connection);
+
+    while (num_bytes >= sizeof(packet_len)) {
+
+        memcpy(&packet_len, data, sizeof(packet_len));
+        packet_len = ntohs(packet_len);
+        if (packet_len == 0 || packet_len > num_bytes - sizeof(packet_len)) return;
+
+        if (now == 0 || rx_admit(connection, client, packet_len, now)) {
+            Packet* packet = queue_packet(connection, client->id, data + sizeof(packet_len), packet_len);
+            if (packet != NULL) packet->datagram = true;
+        }
+
+        data += sizeof(packet_len) + packet_len;
+        num_bytes -= sizeof(packet_len) + packet_len;
+    }
+}
+
+// Check datagram carries the session token it should, and queue its messages
+// Token only ever travels over the client's own stream, so it ties the datagram to that client
+// On encrypted connections the datagram is opened first, under keys from the same handshake
+static void udp_accept(SocketState* connection, char* data, size_t num_bytes, const struct sockaddr_in6* addr, socklen_t addr_len) {
+
+    uint32_t id;
+    uint64_t token;
+    Client* client = &connection->server;
+
+    if (connection->type == SOCK_SERVER) {
+        if (num_bytes < UDP_ID_LEN || addr_len > sizeof *addr) return;
+        memcpy(&id, data, UDP_ID_LEN);
+        data += UDP_ID_LEN;
+        num_bytes -= UDP_ID_LEN;
+
+        client = id_to_client(connection, ntohl(id));
+        if (client == NULL) return;
+    }
+
+    if (client->crypt != NULL) {
+        ssize_t len = crypt_open_datagram(client->crypt, data, num_bytes);
+        if (len < 0) return;
+        data += CRYPT_SEQ_LEN;
+        num_bytes = len;
+    }
+
+    if (num_bytes < UDP_TOKEN_LEN) return;
+    memcpy(&token, data, UDP_TOKEN_LEN);
+    if (client->udp_token == 0 || be64toh(token) != client->udp_token) return;
+
+    // Replies go wherever the client last sent from, so it can move between addresses
+    if (connection->type == SOCK_SERVER) {
+        memcpy(&client->udp_addr, addr, addr_len);
+        client->udp_addr_len = addr_len;
+    }
+
+    udp_feed(connection, client, data + UDP_TOKEN_LEN, num_bytes - UDP_TOKEN_LEN);
+}
+
+// Read side channel datagrams a batch at a time until none are left
+// Batch lands in rx_buffer, which is only scratch space between reads
+static void udp_recv(SocketState* connection) {
+
+    struct mmsghdr msgs[UDP_BATCH];
+    struct iovec iov[UDP_BATCH];
+    struct sockaddr_in6 addrs[UDP_BATCH];
+    int num_msgs;
+
+    do {
+        for (int i = 0; i < UDP_BATCH; i++) {
+            iov[i].iov_base = rx_buffer + i * SOCK_UDP_MAX_PAYLOAD;
+            iov[i].iov_len = SOCK_UDP_MAX_PAYLOAD;
+            msgs[i].msg_hdr = (struct msghdr){
+                .msg_name = &addrs[i], .msg_namelen = sizeof addrs[i], .msg_iov = &iov[i], .msg_iovlen = 1,
+            };
+        }
+
+        num_msgs = recvmmsg(connection->udp_socket, msgs, UDP_BATCH, MSG_DONTWAIT, NULL);
+
+        for (int i = 0; i < num_msgs; i++) {
+            // Nothing bigger than a full payload is ours
+            if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) continue;
+            udp_accept(connection, iov[i].iov_base, msgs[i].msg_len, &addrs[i], msgs[i].msg_hdr.msg_namelen);
+        }
+    } while (num_msgs == UDP_BATCH);
+}
+
+// Send every datagram coalesced since the last poll, a batch per system call
+// Side channel is lossy anyway, so whatever the socket won't take is dropped
+static void udp_flush(SocketState* connection) {
+
+    struct mmsghdr msgs[UDP_BATCH];
+    struct iovec iov[UDP_BATCH];
+    int num_msgs = 0;
+
+    for (int i = 0; i < connection->num_udp_out; i++) {
+
+        UdpDatagram* datagram = &connection->udp_out[i];
+        Client* client = id_to_client(connection, datagram->id);
+
+        // Client may have gone since its datagram was started
+        if (client == NULL) continue;
+        client->udp_slot = 0;
+
+        if (client->crypt != NULL) {
+            datagram->len = crypt_seal_datagram(client->crypt, datagram->data, datagram->len - CRYPT_SEQ_LEN);
+            if (datagram->len == 0) continue;
+        }
+
+        iov[num_msgs].iov_base = datagram->data;
+        iov[num_msgs].iov_len = datagram->len;
+        msgs[num_msgs].msg_hdr = (struct msghdr){
+            .msg_name = &client->udp_addr, .msg_namelen = client->udp_addr_len, .msg_iov = &iov[num_msgs], .msg_iovlen = 1,
+        };
+        num_msgs++;
+    }
+
+    connection->num_udp_out = 0;
+
+    for (int sent = 0; sent < num_msgs;) {
+        int status = sendmmsg(connection->udp_socket, msgs + sent, num_msgs - sent, MSG_DONTWAIT);
+        if (status > 0) sent += status;
+        else if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+        else if (errno != EINTR) sent++;        // Skip a datagram the kernel refused outright
+    }
+}
+
+// Have the kernel spin on the device queue for a socket's data rather than wait for its interrupt
+static void set_busy_poll(int fd) {
+
+    int usec = config.busy_poll;
+    int prefer = 1;
+
+    // Going above the system default needs CAP_NET_ADMIN, without it the socket just keeps the default
+    setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec));
+#ifdef SO_PREFER_BUSY_POLL
+    setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, sizeof(prefer));
+#else
+    (void)prefer;
+#endif
+}
+
+// Open side channel next to listening socket, on the same address and a port the kernel picks
+// Each shard has its own, since nothing would steer a datagram to the shard owning its client
+static int open_udp_socket(SocketState* connection) {
+
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof addr;
+    int socket_fd;
+
+    if (getsockname(connection->socket, (struct sockaddr*)&addr, &addr_len) != 0) return -1;
+    if (addr.ss_family == AF_INET) ((struct sockaddr_in*)&addr)->sin_port = 0;
+    else if (addr.ss_family == AF_INET6) ((struct sockaddr_in6*)&addr)->sin6_port = 0;
+    else return -1;
+
+    socket_fd = socket(addr.ss_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (socket_fd == -1) return -1;
+    if (config.busy_poll > 0) set_busy_poll(socket_fd);
+
+    if (bind(socket_fd, (struct sockaddr*)&addr, addr_len) != 0 ||
+        getsockname(socket_fd, (struct sockaddr*)&addr, &addr_len) != 0) {
+        close(socket_fd);
+        return -1;
+    }
+
+    connection->udp_port = ntohs(addr.ss_family == AF_INET ? ((struct sockaddr_in*)&addr)->sin_port : ((struct sockaddr_in6*)&addr)->sin6_port);
+
+    return socket_fd;
+}
+
+// Arm multishot poll on side channel socket, datagrams are then read in batches
+static void uring_arm_udp(SocketState* connection) {
+
+    struct io_uring_sqe* sqe = uring_get_sqe(connection->ring);
+    if (sqe == NULL) return;
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = connection->udp_socket;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = URING_OP_UDP;
+}
+
+// Start record layer on a connection, with our hello queued ahead of anything else
+// Return -1 on failure
+static int crypt_start(SocketState* connection, Client* client, bool initiator) {
+
+    client->crypt = malloc(sizeof(CryptSession));
+    if (client->crypt == NULL) return -1;
+
+    // Servers prove who they are by signing their hello, clients only take one signed by the key they pinned
+    Frame* hello = malloc(sizeof(Frame) + CRYPT_SIGNED_HELLO_LEN);
+    if (hello == NULL || crypt_init(client->crypt, initiator) != 0) {
+        free(hello);
+        free(client->crypt);
+        client->crypt = NULL;
+        return -1;
+    }
+    if ((initiator ? crypt_pin(client->crypt, config.server_fingerprint) : crypt_sign_hello(client->crypt, server_identity)) != 0) {
+        free(hello);
+        crypt_free(client->crypt);
+        free(client->crypt);
+        client->crypt = NULL;
+        return -1;
+    }
+
+    hello->refs = 1;
+    hello->priority = FRAME_PRIORITY_NORMAL;
+    hello->len = client->crypt->hello_len;
+    memcpy(hello->data, client->crypt->hello, hello->len);
+
+    SocketStatus status = tx_queue_frame(connection, client, hello);
+    if (status == SOCK_SUCCESS) client->tx_tail->sealed = true;
+    release_frame(hello);
+
+    return status == SOCK_SUCCESS ? 0 : -1;
+}
+
+// Drop connection's record layer, along with any record it was part way through
+static void crypt_stop(Client* client) {
+
+    if (client->crypt != NULL) {
+        crypt_free(client->crypt);
+        free(client->crypt);
+        client->crypt = NULL;
+    }
+
+    free_packet(client->rx_record);
+    client->rx_record = NULL;
+    client->rx_record_len = 0;
+}
+
+// Swap hellos with server, and wait a little while for its answer
+// Return -1 if it doesn't answer with a valid hello in time
+static int crypt_connect(SocketState* connection) {
+
+    Client* server = &connection->server;
+    struct pollfd pfd = {.fd = server->fd, .events = POLLIN};
+    int64_t deadline = now_usec() + (int64_t)CRYPT_HELLO_TIMEOUT * 1000;
+
+    if (crypt_start(connection, server, true) != 0 || tx_flush(connection, server) != SOCK_SUCCESS) return -1;
+
+    // Anything the server sends after its hello is queued as usual
+    while (!server->crypt->ready) {
+        int64_t remaining = deadline - now_usec();
+        if (remaining <= 0 || poll(&pfd, 1, (int)((remaining + 999) / 1000)) <= 0) return -1;
+        if (recv_packets(connection, server) == SOCK_ERR_SOCKET_DISCONNECT) return -1;
+    }
+
+    return 0;
+}
+
+// Setup configured event loop backend for newly started socket
+static SocketStatus backend_init(SocketState* connection) {
+
+    timer_init(&connection->timers, now_msec());
+
+    connection->backend = config.backend;
+    connection->epoll_fd = -1;
+    connection->ring = NULL;
+
+    // Clients only have a single socket, so io_uring buys them nothing
+    if (connection->backend == SOCK_BACKEND_URING && connection->type == SOCK_CLIENT) {
+        connection->backend = SOCK_BACKEND_EPOLL;
+    }
+
+    if (connection->backend == SOCK_BACKEND_URING) {
+
+        connection->ring = calloc(1, sizeof(Uring));
+        if (connection->ring != NULL &&
+            uring_init(connection->ring, URING_ENTRIES, URING_CQ_ENTRIES) == 0 &&
+            uring_setup_buffers(connection->ring, URING_BUF_COUNT, URING_BUF_SIZE, URING_BUF_GROUP) == 0) {
+            uring_arm_accept(connection, connection->socket);
+            if (connection->unix_socket != -1) uring_arm_accept(connection, connection->unix_socket);
+            if (connection->handoff_socket != -1) uring_arm_handoff(connection);
+            if (connection->wake_fd != -1) uring_arm_wake(connection);
+            if (connection->udp_socket != -1) uring_arm_udp(connection);
+            return SOCK_SUCCESS;
+        }
+
+        // Kernel may not support io_uring or have it disabled
+        PRINT_ERROR("Unable to setup io_uring, falling back to epoll.");
+        if (connection->ring != NULL) uring_exit(connection->ring);
+        free(connection->ring);
+        connection->ring = NULL;
+        connection->backend = SOCK_BACKEND_EPOLL;
+    }
+
+    if (connection->backend != SOCK_BACKEND_EPOLL) return SOCK_SUCCESS;
+
+    connection->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (connection->epoll_fd == -1) {
+        PRINT_ERROR("Unable to create epoll instance.");
+        return SOCK_ERR_POLL_FAILURE;
+    }
+
+    // Listening sockets stay level-triggered, client sockets are edge-triggered
+    // Every shard watches the one Unix listener, exclusive so a connection only wakes one of them
+    if (connection->type == SOCK_SERVER) {
+        if (epoll_add_fd(connection, connection->socket, EPOLLIN) == -1 ||
+            (connection->unix_socket != -1 && epoll_add_fd(connection, connection->unix_socket, EPOLLIN | EPOLLEXCLUSIVE) == -1) ||
+            (connection->handoff_socket != -1 && epoll_add_fd(connection, connection->handoff_socket, EPOLLIN) == -1) ||
+            (connection->wake_fd != -1 && epoll_add_fd(connection, connection->wake_fd, EPOLLIN) == -1) ||
+            (connection->udp_socket != -1 && epoll_add_fd(connection, connection->udp_socket, EPOLLIN) == -1)) {
+            PRINT_ERROR("Unable to register socket with epoll.");
+            close(connection->epoll_fd);
+            return SOCK_ERR_POLL_FAILURE;
+        }
+    } else {
+        if (epoll_add_fd(connection, connection->socket, EPOLLIN | EPOLLOUT | EPOLLET) == -1) {
+            PRINT_ERROR("Unable to register socket with epoll.");
+            close(connection->epoll_fd);
+            return SOCK_ERR_POLL_FAILURE;
+        }
+        // Wake up on stdin as well, not fatal if stdin can't be polled
+        epoll_add_fd(connection, 0, EPOLLIN);
+    }
+
+    return SOCK_SUCCESS;
+}
+
+// Release event loop backend resources
+static void backend_close(SocketState* connection) {
+
+    if (connection->backend == SOCK_BACKEND_EPOLL && connection->epoll_fd != -1) {
+        close(connection->epoll_fd);
+    }
+
+    if (connection->backend == SOCK_BACKEND_URING && connection->ring != NULL) {
+        uring_exit(connection->ring);
+        free(connection->ring);
+    }
+
+    free(connection->poll_fds);
+    free(connection->poll_ids);
+    free(connection->tx_held_ids);
+    free(connection->tx_pending_ids);
+    free(connection->udp_out);
+    timer_free(&connection->timers);
+}
+
+// Prepare one sendmsg covering client's queued frames
+// Return -1 if there is no room to submit it, so client has to wait for the next loop
+static int uring_prep_send(SocketState* connection, Client* client) {
+
+    if (client->tx_busy || client->tx_head == NULL) return 0;
+
+    // Shared rings need no system call, so are written here rather than submitted
+    if (client->shm != NULL) {
+        tx_flush(connection, client);
+        return 0;
+    }
+
+    // Encrypted clients send nothing but our hello until the handshake is done
+    tx_seal(client);
+    if (client->crypt != NULL && !client->tx_head->sealed) return 0;
+
+    UringSend* send = calloc(1, sizeof(UringSend));
+    struct io_uring_sqe* sqe = uring_get_sqe(connection->ring);
+    if (send == NULL || sqe == NULL) {
+        free(send);
+        return -1;
+    }
+
+    // Detach up to TX_MAX_IOV frames from the client queue
+    int iovcnt = tx_iov(client, send->iov, TX_MAX_IOV);
+    TxFrame* last = client->tx_head;
+    for (int j = 1; j < iovcnt; j++) last = last->next;
+
+    send->id = client->id;
+    send->frames = client->tx_head;
+    send->msg.msg_iov = send->iov;
+    send->msg.msg_iovlen = iovcnt;
+
+    client->tx_head = last->next;
+    if (client->tx_head == NULL) client->tx_tail = NULL;
+    last->next = NULL;
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = client->fd;
+    sqe->addr = (uint64_t)(uintptr_t)&send->msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uint64_t)(uintptr_t)send | URING_OP_SEND;
+
+    client->tx_busy = true;
+
+    return 0;
+}
+
+// Prepare sends for clients listed as having frames waiting
+// Only one send is kept in flight per client, so frames can't be reordered, and a completion lists the
+// client again if more arrived meanwhile. Clients whose frames can't go yet stay listed for the next loop.
+static void uring_prep_sends(SocketState* connection) {
+
+    int num = connection->num_tx_pending;
+    int kept = 0;
+    bool full = false;
+
+    // Somebody couldn't be listed, so look at everybody once
+    if (connection->tx_pending_lost) {
+        connection->tx_pending_lost = false;
+        for (int i = 0; i < connection->num_clients; i++) {
+            if (connection->clients[i].active == ACTIVE && connection->clients[i].tx_head != NULL) tx_mark_pending(connection, &connection->clients[i]);
+        }
+        num = connection->num_tx_pending;
+    }
+
+    for (int i = 0; i < num; i++) {
+
+        uint32_t id = connection->tx_pending_ids[i];
+        Client* client = id_to_client(connection, id);
+        if (client == NULL) continue;
+
+        if (!full && uring_prep_send(connection, client) != 0) full = true;
+
+        if (!client->tx_busy && client->tx_head != NULL) connection->tx_pending_ids[kept++] = id;
+        else client->tx_pending = false;
+    }
+
+    // Flushing shared rings may have listed clients behind the ones walked
+    if (connection->num_tx_pending > num) memmove(connection->tx_pending_ids + kept, connection->tx_pending_ids + num, (connection->num_tx_pending - num) * sizeof(uint32_t));
+    connection->num_tx_pending = kept + connection->num_tx_pending - num;
+}
+
+// Handle completed send, put any unsent frames back at the head of the queue
+static void uring_complete_send(SocketState* connection, UringSend* send, int result) {
+
+    Client* client = id_to_client(connection, send->id);
+    TxFrame* frame = tx_consume(send->frames, result > 0 ? (size_t)result : 0);
+
+    if (client != NULL && client->active != ACTIVE) client = NULL;
+    if (client != NULL && result > 0) tx_drained(connection, client, result);
+
+    // Drop unsent data for clients that have gone away, retry if the socket was just full
+    // Sends cancelled for a handoff sent nothing, so their frames go along with the client
+    if (client == NULL || (result < 0 && result != -EAGAIN && result != -ECANCELED)) {
+        if (client != NULL) {
+            for (TxFrame* f = frame; f != NULL; f = f->next) tx_drained(connection, client, f->frame->len - f->offset);
+            client->tx_busy = false;
+            if (client->tx_head != NULL) tx_mark_pending(connection, client);
+        }
+        free_tx_frames(frame);
+        free(send);
+        return;
+    }
+
+    if (frame != NULL) {
+        TxFrame* last = frame;
+        while (last->next != NULL) last = last->next;
+        last->next = client->tx_head;
+        if (client->tx_head == NULL) client->tx_tail = last;
+        client->tx_head = frame;
+    }
+
+    client->tx_busy = false;
+    free(send);
+    if (client->tx_head != NULL) tx_mark_pending(connection, client);
+
+    if (client->shm_pending && client->tx_head == NULL) shm_offer(connection, client);
+}
+
+SocketConfig* sock_get_config(void) {
+
+    return &config;
+}
+
+// Return number of packets in queue
+int num_packets(SocketState* connection) {
+
+    return connection->num_packets;
+}
+
+// Pop packet at top of packet queue and return pointer. Ownership passes to caller.
+Packet* pop_packet(SocketState* connection) {
+
+    Packet* q_ptr = connection->packet_queue;
+    if (q_ptr != NULL) {
+        connection->packet_queue = q_ptr->next_packet;
+        if (connection->packet_queue == NULL) connection->packet_queue_tail = NULL;
+        connection->num_packets--;
+        q_ptr->next_packet = NULL;
+    }
+
+    return q_ptr;
+}
+
+// Pop every packet in queue, return head of list linked through next_packet. Ownership passes to caller.
+Packet* pop_packets(SocketState* connection, int* count) {
+
+    Packet* q_ptr = connection->packet_queue;
+
+    if (count != NULL) *count = connection->num_packets;
+
+    connection->packet_queue = NULL;
+    connection->packet_queue_tail = NULL;
+    connection->num_packets = 0;
+
+    return q_ptr;
+}
+
+// Make room for every event clients in num_slots slots can queue, return -1 if out of memory
+// A slot queues at most a connect, a resync and a disconnect before application pops them and flushes it,
+// so once a client's slot is reserved its later events can always be queued
+static int event_reserve(SocketState* connection, int num_slots) {
+
+    int needed = EVENTS_PER_SLOT * num_slots;
+    if (connection->events_cap >= needed) return 0;
+
+    int cap = connection->events_cap > 0 ? connection->events_cap : CLIENT_SLOTS_MIN;
+    while (cap < needed) cap *= 2;
+    SockEvent* events = realloc(connection->events, cap * sizeof(SockEvent));
+    if (events == NULL) return -1;
+    connection->events = events;
+    connection->events_cap = cap;
+
+    return 0;
+}
+
+// Queue event for the application, its slot must have been reserved first
+// Popped events are dropped once the end is reached, so a queue emptied every poll stays its size
+static void event_push(SocketState* connection, SockEventType type, uint32_t client_id) {
+
+    if (connection->num_events == connection->events_cap) {
+        connection->num_events -= connection->event_head;
+        memmove(connection->events, connection->events + connection->event_head, connection->num_events * sizeof(SockEvent));
+        connection->event_head = 0;
+    }
+
+    connection->events[connection->num_events++] = (SockEvent){.type = type, .client_id = client_id};
+}
+
+// Pop oldest client connect or disconnect, false if there are none
+// Nothing is queued while clients come and go, so an idle tick costs one comparison
+bool pop_event(SocketState* connection, SockEvent* event) {
+
+    if (connection->event_head == connection->num_events) return false;
+
+    *event = connection->events[connection->event_head++];
+
+    // Client may be resynced again once application has seen this one
+    if (event->type == SOCK_EVENT_RESYNC) {
+        Client* client = id_to_client(connection, event->client_id);
+        if (client != NULL) client->tx_resync = false;
+    }
+
+    if (connection->event_head == connection->num_events) {
+        connection->event_head = 0;
+        connection->num_events = 0;
+    }
+
+    return true;
+}
+
+// Release every packet still waiting in queue
+static void free_packet_queue(SocketState* connection) {
+
+    Packet* packet = pop_packets(connection, NULL);
+
+    while (packet != NULL) {
+        Packet* next = packet->next_packet;
+        free_packet(packet);
+        packet = next;
+    }
+}
+
+// Queue packet on another shard, arrives there with sender 0
+// Inbox is a lock free stack, so any number of shards can push at once
+SocketStatus shard_send_packet(SocketState* connection, int shard, const char* data, size_t num_bytes) {
+
+    if (connection->type != SOCK_SERVER || connection->wake_fd == -1) return SOCK_ERR_UNINITIALIZED;
+    if (shard < 0 || shard >= connection->num_shards || shard == connection->shard) return SOCK_ERR_INVALID_CMD;
+    if (num_bytes > MAX_MESSAGE_LEN) return SOCK_ERR_INVALID_MSG_LENGTH;
+
+    // Take a place in the inbox first, a shard that isn't keeping up turns relays away
+    ShardInbox* inbox = &shard_inboxes[shard];
+    if (__atomic_add_fetch(&inbox->depth, 1, __ATOMIC_RELAXED) > SHARD_INBOX_MAX) {
+        __atomic_sub_fetch(&inbox->depth, 1, __ATOMIC_RELAXED);
+        connection->relays_refused++;
+        return SOCK_ERR_SHARD_BUSY;
+    }
+
+    Packet* packet = alloc_packet(num_bytes);
+    if (packet == NULL) {
+        __atomic_sub_fetch(&inbox->depth, 1, __ATOMIC_RELAXED);
+        return SOCK_ERR_SEND_FAILURE;
+    }
+
+    packet->len = (uint16_t)num_bytes;
+    packet->sender = 0;
+    memcpy(packet->data, data, num_bytes);
+
+    Packet* head = __atomic_load_n(&inbox->head, __ATOMIC_RELAXED);
+    do {
+        packet->next_packet = head;
+    } while (!__atomic_compare_exchange_n(&inbox->head, &head, packet, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    // Only the push onto an empty inbox needs to wake the owner, it takes everything at once
+    if (head == NULL) {
+        uint64_t one = 1;
+        if (write(inbox->wake_fd, &one, sizeof one) < 0 && errno != EAGAIN) {
+            PRINT_ERROR("Unable to wake shard.");
+        }
+    }
+
+    return SOCK_SUCCESS;
+}
+
+// Move packets other shards pushed to our inbox onto packet queue, oldest first
+static void shard_recv_packets(SocketState* connection) {
+
+    ShardInbox* inbox = &shard_inboxes[connection->shard];
+    Packet* packet = __atomic_exchange_n(&inbox->head, NULL, __ATOMIC_ACQUIRE);
+    Packet* oldest = NULL;
+    int count = 0;
+
+    // Inbox is newest first, so reverse it
+    while (packet != NULL) {
+        Packet* next = packet->next_packet;
+        packet->next_packet = oldest;
+        oldest = packet;
+        packet = next;
+        count++;
+    }
+
+    // Give the places back, once they are off the inbox
+    if (count > 0) __atomic_sub_fetch(&inbox->depth, count, __ATOMIC_RELAXED);
+
+    while (oldest != NULL) {
+        Packet* next = oldest->next_packet;
+        enqueue_packet(connection, oldest);
+        oldest = next;
+    }
+}
+
+// Get shard that owns client
+int id_to_shard(SocketState* connection, uint32_t client_id) {
+
+    int num_shards = connection->num_shards > 0 ? connection->num_shards : 1;
+
+    return (int)(SOCK_ID_INDEX(client_id) % num_shards);
+}
+
+// Open listening Unix domain socket of type at path, return -1 on failure
+// A socket file left behind by a server that is gone is replaced, a live server's is left alone
+static int open_unix_listener(const char* path, int type) {
+
+    struct sockaddr_un addr = {0};
+    struct stat st;
+    int socket_fd;
+
+    if (strlen(path) >= sizeof addr.sun_path) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    socket_fd = socket(AF_UNIX, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (socket_fd == -1) return -1;
+
+    // Only remove sockets, and only once nothing answers on them
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        int probe = socket(AF_UNIX, type | SOCK_CLOEXEC, 0);
+        if (probe != -1 && connect(probe, (struct sockaddr*)&addr, sizeof addr) != 0 && errno == ECONNREFUSED) {
+            unlink(path);
+        }
+        if (probe != -1) close(probe);
+    }
+
+    if (bind(socket_fd, (struct sockaddr*)&addr, sizeof addr) != 0 ||
+        listen(socket_fd, config.listen_backlog > 0 ? config.listen_backlog : SOMAXCONN) != 0) {
+        close(socket_fd);
+        return -1;
+    }
+
+    return socket_fd;
+}
+
+// Close Unix listener and remove its socket file
+static void close_unix_listener(void) {
+
+    if (unix_listener == -1) return;
+
+    close(unix_listener);
+    unlink(config.unix_path);
+    unix_listener = -1;
+}
+
+// Load key encrypted servers sign their hellos with, and show clients what to pin
+// Return -1 if the key file can't be read or made
+static int load_server_identity(void) {
+
+    char hex[CRYPT_FINGERPRINT_HEX];
+
+    if (server_identity != NULL) return 0;
+
+    server_identity = crypt_load_identity(config.server_key);
+    if (server_identity == NULL || crypt_fingerprint(server_identity, hex) != 0) {
+        PRINT_ERROR("Unable to load server key.");
+        crypt_free_identity(server_identity);
+        server_identity = NULL;
+        return -1;
+    }
+
+    printf("Server key fingerprint: %s\n", hex);
+
+    return 0;
+}
+
+// Release server's long-term key
+static void free_server_identity(void) {
+
+    crypt_free_identity(server_identity);
+    server_identity = NULL;
+}
+
+// Open TCP socket listening on port, return -1 on failure
+static int open_tcp_listener(const char* port) {
+
+    int status;             // Variable for storing function return status
+    int socket_fd = -1;     // Variable for storing socket file descriptor
+
+    struct addrinfo hints = {0}; // Struct to pass inputs to getaddrinfo
+    struct addrinfo *addr, *addr0;       // Struct to get results from getaddrinfo
+
+    hints.ai_family = AF_UNSPEC;        // Either IPv4 or IPv6
+    hints.ai_socktype = SOCK_STREAM;    // TCP Stream Socket
+    hints.ai_flags = AI_PASSIVE;        // Fill in IP
+
+    status = getaddrinfo(NULL, port, &hints, &addr0);
+    if (status != 0 || addr0 == NULL) {
+        PRINT_ERROR2("Unable to get address.", gai_strerror(status));
+        return -1;
+    }
+
+    // Bind to first address we can
+    for (addr = addr0; addr != NULL; addr = addr->ai_next) {
+
+        // Open a streaming socket
+        socket_fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+        if (socket_fd == -1) {
+            continue;
+        }
+
+        // Let every shard bind its own listening socket to the port
+        int reuse_port = 1;
+        if (config.num_shards > 1 && setsockopt(socket_fd, SOL_SOCKET, SO_REUSEPORT, &reuse_port, sizeof(reuse_port)) != 0) {
+            close(socket_fd);
+            socket_fd = -1;
+            continue;
+        }
+
+        // Bind socket to our ip and port
+        status = bind(socket_fd, addr->ai_addr, addr->ai_addrlen);
+        if (status != 0) {
+            close(socket_fd);
+            socket_fd = -1;
+            continue;
+        }
+
+        // If we succeed in binding to socket, exit loop
+        break;
+    }
+
+    // Free memory allocated for addresses
+    freeaddrinfo(addr0);
+
+    // If unable to bind, exit with failure
+    if (socket_fd == -1) {
+        PRINT_ERROR("Unable to bind to socket.");
+        return -1;
+    }
+
+    // Make this socket nonblocking
+    status = fcntl(socket_fd, F_SETFL, O_NONBLOCK);
+    if (status != 0) {
+        PRINT_ERROR("Unable to configure socket to non-blocking.");
+        close(socket_fd);
+        return -1;
+    }
+
+    // Allow other sockets to bind to this port if no one is listening
+    int opt = 1;
+    status = setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if (status != 0) {
+        PRINT_ERROR("Unable to allow other sockets to bind to port.");
+        close(socket_fd);
+        return -1;
+    }
+
+    // Begin listening for connections on socket, kernel caps backlog at net.core.somaxconn
+    status = listen(socket_fd, config.listen_backlog > 0 ? config.listen_backlog : SOMAXCONN);
+    if (status != 0) {
+        PRINT_ERROR("Unable to listen on socket.");
+        close(socket_fd);
+        return -1;
+    }
+
+    return socket_fd;
+}
+
+static void handoff_take_clients(SocketState* connection, int predecessor);
+
+// Start a server on the local host at specified port
+SocketStatus start_server_socket(SocketState* connection, const char* port) {
+
+    return start_server_shard(connection, port, 0);
+}
+
+// Create inboxes for every configured shard, call before starting any shard
+// so packets sent to a shard that is still starting up wait for it
+SocketStatus init_server_shards(void) {
+
+    if (shards_ready) return SOCK_ERR_ALREADY_INITIALIZED;
+    if (config.num_shards < 1 || config.num_shards > MAX_SHARDS) return SOCK_ERR_SERVER_START_FAILURE;
+
+    for (int i = 0; i < config.num_shards; i++) {
+        shard_inboxes[i].head = NULL;
+        shard_inboxes[i].depth = 0;
+        shard_inboxes[i].wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (shard_inboxes[i].wake_fd == -1) {
+            PRINT_ERROR("Unable to create shard inbox.");
+            return SOCK_ERR_SERVER_START_FAILURE;
+        }
+    }
+
+    if (config.encrypt && load_server_identity() != 0) return SOCK_ERR_SERVER_START_FAILURE;
+
+    // Unix sockets can't share a path between listeners, so every shard accepts from one
+    if (config.unix_path != NULL && unix_listener == -1) {
+        unix_listener = open_unix_listener(config.unix_path, SOCK_STREAM);
+        if (unix_listener == -1) {
+            PRINT_ERROR("Unable to listen on Unix socket.");
+            return SOCK_ERR_SERVER_START_FAILURE;
+        }
+    }
+
+    shards_ready = true;
+
+    return SOCK_SUCCESS;
+}
+
+// Start one server shard, only one thread may use its state from then on
+// Every shard listens on the same port, and the kernel spreads new connections between them
+SocketStatus start_server_shard(SocketState* connection, const char* port, int shard) {
+
+    memset(connection, 0, sizeof *connection);   // Clear out state
+
+    int socket_fd;                  // Variable for storing socket file descriptor
+    int predecessor = -1;           // Server handing its sockets over to us, -1 if we start cold
+    int inherited[HANDOFF_MAX_FDS]; // TCP listener, Unix listener and side channel predecessor handed over
+    uint16_t udp_port = 0;          // Port of inherited side channel
+
+    // If already initialized, return error
+    if (connection->type != SOCK_UNINITIALIZED) return SOCK_ERR_ALREADY_INITIALIZED;
+
+    // Shards can only talk to each other once inboxes exist
+    if (shard < 0 || shard >= config.num_shards) return SOCK_ERR_SERVER_START_FAILURE;
+    if (config.num_shards > 1 && !shards_ready) return SOCK_ERR_UNINITIALIZED;
+
+    // Shards share listeners and id space, so only a single shard can be handed over whole
+    if (config.handoff_path != NULL && config.num_shards > 1) {
+        PRINT_ERROR2("Unable to start server.", "Hot restart needs a single shard.");
+        return SOCK_ERR_SERVER_START_FAILURE;
+    }
+
+    // Shards share the key from init_server_shards, unsharded servers load it here
+    if (config.encrypt && load_server_identity() != 0) return SOCK_ERR_SERVER_START_FAILURE;
+
+    // A server running at the handoff path passes us its listeners, so nothing is bound again
+    if (config.handoff_path != NULL) predecessor = handoff_connect(config.handoff_path);
+    if (predecessor != -1 && handoff_take_listeners(predecessor, inherited, &udp_port) != 0) {
+        PRINT_ERROR2("Unable to take over from running server.", "It turned us away.");
+        close(predecessor);
+        return SOCK_ERR_SERVER_START_FAILURE;
+    }
+    if (predecessor == -1) inherited[0] = inherited[1] = inherited[2] = -1;
+
+    socket_fd = predecessor != -1 ? inherited[0] : open_tcp_listener(port);
+    if (socket_fd == -1) return SOCK_ERR_SERVER_START_FAILURE;
+
+    // Unsharded servers open their Unix listener here, or keep predecessor's, shards share the one from init_server_shards
+    if (config.unix_path != NULL && unix_listener == -1) {
+        unix_listener = inherited[1] != -1 ? inherited[1] : open_unix_listener(config.unix_path, SOCK_STREAM);
+        inherited[1] = -1;
+        if (unix_listener == -1) {
+            PRINT_ERROR("Unable to listen on Unix socket.");
+            close(socket_fd);
+            if (inherited[2] != -1) close(inherited[2]);
+            if (predecessor != -1) close(predecessor);
+            return SOCK_ERR_SERVER_START_FAILURE;
+        }
+    }
+    if (inherited[1] != -1) close(inherited[1]);
+
+    // Update type, and save socket fd
+    connection->type = SOCK_SERVER;
+    connection->socket = socket_fd;
+    connection->unix_socket = config.unix_path != NULL ? unix_listener : -1;
+    connection->handoff_socket = -1;
+    connection->successor = -1;
+    connection->shard = shard;
+    connection->num_shards = config.num_shards;
+    connection->wake_fd = config.num_shards > 1 ? shard_inboxes[shard].wake_fd : -1;
+    connection->udp_socket = -1;
+
+    // Open side channel, or keep predecessor's, with room to coalesce a batch of datagrams
+    if (config.udp_channel) {
+        connection->udp_out = calloc(UDP_BATCH, sizeof(UdpDatagram));
+        if (connection->udp_out != NULL && inherited[2] != -1) {
+            connection->udp_socket = inherited[2];
+            connection->udp_port = udp_port;
+            inherited[2] = -1;
+        } else if (connection->udp_out != NULL) {
+            connection->udp_socket = open_udp_socket(connection);
+        }
+        if (connection->udp_socket == -1) {
+            PRINT_ERROR("Unable to open UDP side channel.");
+            free(connection->udp_out);
+            close(socket_fd);
+            if (inherited[2] != -1) close(inherited[2]);
+            if (config.num_shards == 1) close_unix_listener();
+            if (predecessor != -1) close(predecessor);
+            memset(connection, 0, sizeof *connection);
+            return SOCK_ERR_SERVER_START_FAILURE;
+        }
+    }
+    if (inherited[2] != -1) close(inherited[2]);
+
+    // Next restart finds us at the handoff path, in place of predecessor
+    if (config.handoff_path != NULL) {
+        if (predecessor != -1) unlink(config.handoff_path);
+        connection->handoff_socket = open_unix_listener(config.handoff_path, SOCK_SEQPACKET);
+        if (connection->handoff_socket == -1) {
+            PRINT_ERROR("Unable to listen for restarted servers.");
+            close(socket_fd);
+            if (connection->udp_socket != -1) close(connection->udp_socket);
+            free(connection->udp_out);
+            if (config.num_shards == 1) close_unix_listener();
+            if (predecessor != -1) close(predecessor);
+            memset(connection, 0, sizeof *connection);
+            return SOCK_ERR_SERVER_START_FAILURE;
+        }
+    }
+
+    // Setup event loop
+    if (backend_init(connection) != SOCK_SUCCESS) {
+        close(socket_fd);
+        if (connection->udp_socket != -1) close(connection->udp_socket);
+        if (connection->handoff_socket != -1) close(connection->handoff_socket);
+        free(connection->udp_out);
+        if (config.num_shards == 1) close_unix_listener();
+        if (predecessor != -1) close(predecessor);
+        memset(connection, 0, sizeof *connection);
+        return SOCK_ERR_SERVER_START_FAILURE;
+    }
+
+    // Warm up packet pool
+    if (config.packet_prealloc > 0) packet_pool_prealloc(config.packet_prealloc);
+
+    // Setup our packet queue
+    connection->packet_queue = NULL;
+    connection->packet_queue_tail = NULL;
+    connection->num_packets = 0;
+
+    // Clients carry on where predecessor left them
+    if (predecessor != -1) {
+        handoff_take_clients(connection, predecessor);
+        close(predecessor);
+    }
+
+    return SOCK_SUCCESS;
+}
+
+// Most client slots this shard can hand out, id slots are shared between shards
+static int shard_slots(SocketState* connection) {
+
+    return (MAX_CLIENTS + 1) / connection->num_shards;
+}
+
+// Double size of client slot tables, return -1 if out of memory
+static int grow_client_slots(SocketState* connection) {
+
+    int cap = connection->clients_cap > 0 ? connection->clients_cap * 2 : CLIENT_SLOTS_MIN;
+    if (cap > shard_slots(connection)) cap = shard_slots(connection);
+
+    Client* clients = realloc(connection->clients, cap * sizeof(Client));
+    if (clients == NULL) return -1;
+    connection->clients = clients;
+
+    uint16_t* slot_gen = realloc(connection->slot_gen, cap * sizeof(uint16_t));
+    if (slot_gen == NULL) return -1;
+    memset(slot_gen + connection->clients_cap, 0, (cap - connection->clients_cap) * sizeof(uint16_t));
+    connection->slot_gen = slot_gen;
+
+    // Free slot ring wraps at table size, so unroll it into the new ring oldest first
+    uint32_t* free_slots = malloc(cap * sizeof(uint32_t));
+    if (free_slots == NULL) return -1;
+    for (int i = 0; i < connection->num_free_slots; i++) {
+        free_slots[i] = connection->free_slots[(connection->free_head + i) % connection->clients_cap];
+    }
+    free(connection->free_slots);
+    connection->free_slots = free_slots;
+    connection->free_head = 0;
+
+    // Each slot is disconnected at most once between flushes, so this never overflows
+    uint32_t* inactive_slots = realloc(connection->inactive_slots, cap * sizeof(uint32_t));
+    if (inactive_slots == NULL) return -1;
+    connection->inactive_slots = inactive_slots;
+
+    connection->clients_cap = cap;
+
+    return 0;
+}
+
+// Turn off Nagle, so small frames aren't stuck behind a delayed ack
+// Outbound frames are already gathered into as few writes as possible
+static void set_nodelay(int fd) {
+
+    int opt = 1;
+
+    // Fails harmlessly on sockets that aren't TCP
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+}
+
+// Abort connection once sent data goes unacknowledged for timeout ms, a backstop behind heartbeats
+static void set_user_timeout(int fd, int timeout) {
+
+    unsigned opt = (unsigned)timeout;
+
+    // Fails harmlessly on sockets that aren't TCP, their peers are on this machine and hang up when they go
+    setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &opt, sizeof(opt));
+}
+
+// Check whether client went quiet for an interval, and send it a heartbeat if so
+// Client is dropped once it leaves HEARTBEAT_MISSES of them in a row unanswered
+// Reschedules itself for as long as the client is around, a flushed or reused slot ends the chain
+static void heartbeat_check(void* arg, uint64_t client_id) {
+
+    SocketState* connection = arg;
+    Client* client = id_to_client(connection, (uint32_t)client_id);
+
+    if (client == NULL || client->active != ACTIVE) return;
+
+    uint64_t now = connection->timers.now;
+    uint64_t quiet = now > client->rx_last ? now - client->rx_last : 0;
+
+    if (quiet >= (uint64_t)config.heartbeat_interval && connection->heartbeat != NULL) {
+        if (client->rx_missed >= HEARTBEAT_MISSES) {
+            printf("[Client id: %d missed %d heartbeats]\n", client->id, client->rx_missed);
+            disconnect_client_socket(connection, client->id);
+            return;
+        }
+
+        // Goes behind anything still queued, a client that is reading answers it all the same
+        send_frame(connection, client, connection->heartbeat);
+        client->rx_missed++;
+    }
+
+    timer_add(&connection->timers, connection->timers.now + (uint64_t)config.heartbeat_interval, heartbeat_check, connection, client_id);
+}
+
+// Add accepted socket to list of clients
+static SocketStatus add_client(SocketState* connection, int client_socket) {
+
+    Client* client;
+    uint32_t slot;
+
+    if (connection->num_free_slots == 0 && connection->num_clients >= shard_slots(connection)) {
+        close(client_socket);
+        return SOCK_ERR_TOO_MANY_CONNECTIONS;
+    }
+
+    if (connection->num_clients >= connection->clients_cap && connection->num_free_slots <= SLOT_REUSE_DELAY && connection->clients_cap < shard_slots(connection)) {
+        if (grow_client_slots(connection) != 0) {
+            PRINT_ERROR("Unable to grow client table.");
+            close(client_socket);
+            return SOCK_ERR_TOO_MANY_CONNECTIONS;
+        }
+    }
+
+    // Application only learns of clients through their events, so one it can't be told about isn't taken
+    // Room for its disconnect is taken now as well, so that one can't fail later
+    if (event_reserve(connection, connection->num_clients + 1) != 0) {
+        PRINT_ERROR("Unable to queue client event.");
+        close(client_socket);
+        return SOCK_ERR_TOO_MANY_CONNECTIONS;
+    }
+
+    set_nodelay(client_socket);
+    if (config.heartbeat_interval > 0) set_user_timeout(client_socket, config.heartbeat_interval * HEARTBEAT_MISSES * USER_TIMEOUT_FACTOR);
+    if (config.busy_poll > 0) set_busy_poll(client_socket);
+
+    // Reuse the longest flushed slot once enough have piled up, otherwise take a fresh slot
+    // so each slot's generations last as long as possible
+    bool reuse = connection->num_free_slots > SLOT_REUSE_DELAY || connection->num_clients >= connection->clients_cap;
+    slot = reuse ? connection->free_slots[connection->free_head] : (uint32_t)connection->num_clients;
+
+    // Move slot on to its next generation, skipping 0 so ids are never 0
+    uint16_t gen = connection->slot_gen[slot] >= SOCK_ID_GEN_MAX ? 1 : connection->slot_gen[slot] + 1;
+
+    // Add new client to list
+    client = &connection->clients[slot];
+    *client = (Client){0};
+    client->id = ((uint32_t)gen << SOCK_ID_INDEX_BITS) | (slot * connection->num_shards + connection->shard);
+    client->fd = client_socket;
+    client->active = ACTIVE;
+    rx_limit_start(client, rx_limit_now(connection));
+
+    // Unix socket peers are on this machine, so only TCP is sealed
+    int domain;
+    socklen_t domain_len = sizeof domain;
+    bool encrypt = config.encrypt && getsockopt(client_socket, SOL_SOCKET, SO_DOMAIN, &domain, &domain_len) == 0 && domain != AF_UNIX;
+
+    if ((encrypt && crypt_start(connection, client, false) != 0) ||
+        fd_table_set(connection, client_socket, client->id) != 0 || backend_add_client(connection, client) != SOCK_SUCCESS) {
+        close(client_socket);
+        free_tx_frames(client->tx_head);
+        crypt_stop(client);
+        *client = (Client){0};
+        return SOCK_ERR_POLL_FAILURE;
+    }
+
+    // Our hello goes first, io_uring sends it with the rest of the loop's sends
+    if (client->crypt != NULL && connection->backend != SOCK_BACKEND_URING) tx_flush(connection, client);
+
+    if (config.heartbeat_interval > 0) {
+        client->rx_last = now_msec();
+        timer_add(&connection->timers, client->rx_last + (uint64_t)config.heartbeat_interval, heartbeat_check, connection, client->id);
+    }
+
+    connection->slot_gen[slot] = gen;
+    if (reuse) {
+        connection->free_head = (connection->free_head + 1) % connection->clients_cap;
+        connection->num_free_slots--;
+    } else {
+        connection->num_clients++;
+    }
+
+    event_push(connection, SOCK_EVENT_CONNECT, client->id);
+    printf("[Connecting client id: %d on socket: %d]\n", client->id, client_socket);
+
+    return SOCK_SUCCESS;
+}
+
+// Take over one client predecessor handed us, in the slot and with the id it had there
+// Sealed clients carry on with the session they agreed, and shared rings from where predecessor left them.
+// Bytes of the frame and record it was part way through sending are fed in again, so the rest lands where it would have
+// A frame predecessor was dropping carries on being skipped
+static Client* handoff_add_client(SocketState* connection, const int* fds, int num_fds, char* data, size_t len) {
+
+    HandoffClient handed;
+    CryptSession* session = NULL;
+    ShmLink* link = NULL;
+    Client* client;
+
+    // Socket comes first, then client's shared rings if it has them
+    bool valid = handoff_read_client(data, len, &handed) == 0 && num_fds == 1 + (handed.shm ? SHM_NUM_FDS : 0);
+    size_t num_session = valid && handed.crypt ? CRYPT_STATE_LEN : 0;
+    valid = valid && len - HANDOFF_CLIENT_LEN >= num_session + handed.rx_record_len &&
+            (handed.crypt || handed.rx_record_len == 0) && handed.rx_record_len < CRYPT_RECORD_LEN(CRYPT_RECORD_MAX);
+    if (!valid) {
+        for (int i = 0; i < num_fds; i++) close(fds[i]);
+        return NULL;
+    }
+
+    int client_socket = fds[0];
+    char* state = data + HANDOFF_CLIENT_LEN;
+    char* record = data + len - handed.rx_record_len;
+    data = state + num_session;
+    len = record - data;
+
+    // Predecessor ran a single shard as well, so slots are id indexes
+    uint32_t slot = SOCK_ID_INDEX(handed.id);
+    valid = slot < (uint32_t)connection->num_clients && connection->clients[slot].active != ACTIVE;
+    valid = valid && (handed.rx_dropping == 0 || (handed.rx_dropping >= sizeof client->rx_prefix && len == sizeof client->rx_prefix));
+
+    if (valid && handed.crypt) {
+        session = malloc(sizeof(CryptSession));
+        valid = session != NULL && crypt_import(session, state, num_session) == 0;
+        if (!valid) free(session);
+    }
+    if (!valid) {
+        for (int i = 0; i < num_fds; i++) close(fds[i]);
+        return NULL;
+    }
+
+    // Rings are adopted as their creator, ring positions live in the shared memory so nothing in them is lost
+    if (handed.shm) {
+        link = malloc(sizeof(ShmLink));
+        if (link == NULL) for (int i = 1; i < num_fds; i++) close(fds[i]);
+        if (link == NULL || shm_adopt(link, fds + 1) != 0) {
+            free(link);
+            if (session != NULL) crypt_free(session);
+            free(session);
+            close(client_socket);
+            return NULL;
+        }
+    }
+
+    // io_uring waits on blocking sockets, the other backends need them nonblocking
+    int flags = fcntl(client_socket, F_GETFL);
+    if (flags != -1) fcntl(client_socket, F_SETFL, connection->backend == SOCK_BACKEND_URING ? flags & ~O_NONBLOCK : flags | O_NONBLOCK);
+    if (config.busy_poll > 0) set_busy_poll(client_socket);
+
+    client = &connection->clients[slot];
+    *client = (Client){0};
+    client->id = handed.id;
+    client->fd = client_socket;
+    client->active = ACTIVE;
+    client->udp_token = handed.udp_token;
+    client->udp_addr = handed.udp_addr;
+    client->udp_addr_len = handed.udp_addr_len;
+    client->rx_msgs = handed.rx_msgs;
+    client->rx_bytes = handed.rx_bytes;
+    client->rx_notified = handed.rx_notified;
+    client->crypt = session;
+    client->shm_pending = handed.shm_pending;
+
+    if (fd_table_set(connection, client_socket, client->id) != 0 || backend_add_client(connection, client) != SOCK_SUCCESS) {
+        close(client_socket);
+        crypt_stop(client);
+        if (link != NULL) shm_close(link);
+        free(link);
+        *client = (Client){0};
+        return NULL;
+    }
+
+    connection->slot_gen[slot] = (uint16_t)SOCK_ID_GEN(handed.id);
+
+    // Client may have written to its rings since predecessor last looked, so they are read straight away
+    if (link != NULL) {
+        client->shm = link;
+        connection->num_shm++;
+        if (fd_table_set(connection, link->wait_fd, client->id) != 0 || backend_add_shm(connection, client) != 0) {
+            PRINT_ERROR("Unable to start shared memory rings.");
+            disconnect_client_socket(connection, client->id);
+            return NULL;
+        }
+        eventfd_write(link->wait_fd, 1);
+    }
+
+    if (handed.rx_dropping > 0) {
+        memcpy(client->rx_prefix, data, sizeof client->rx_prefix);
+        client->rx_len = handed.rx_dropping;
+    } else {
+        rx_feed(connection, client, data, len);
+    }
+
+    // Partial record goes back through the record layer, which holds on to it till the rest arrives
+    if (handed.rx_record_len > 0 && rx_input(connection, client, record, handed.rx_record_len) != 0) {
+        disconnect_client_socket(connection, client->id);
+        return NULL;
+    }
+
+    if (config.heartbeat_interval > 0) {
+        client->rx_last = now_msec();
+        timer_add(&connection->timers, client->rx_last + (uint64_t)config.heartbeat_interval, heartbeat_check, connection, client->id);
+    }
+
+    printf("[Taking over client id: %d on socket: %d]\n", client->id, client_socket);
+
+    return client;
+}
+
+// Queue unsent bytes predecessor handed over for client, they already hold whole frames
+// Sealed bytes are records or our hello, so go out as they are rather than being sealed again
+static void handoff_add_tx(SocketState* connection, Client* client, const char* data, size_t len) {
+
+    bool sealed;
+
+    if (handoff_read_tx(data, len, &sealed) != 0) return;
+    data += HANDOFF_TX_LEN;
+    len -= HANDOFF_TX_LEN;
+
+    Frame* frame = malloc(sizeof(Frame) + len);
+    if (frame == NULL) return;
+
+    frame->refs = 1;
+    frame->priority = FRAME_PRIORITY_NORMAL;
+    frame->len = len;
+    memcpy(frame->data, data, len);
+
+    if (tx_queue_frame(connection, client, frame) == SOCK_SUCCESS) {
+        client->tx_tail->sealed = sealed;
+        tx_check_slow(connection, client);
+    }
+    release_frame(frame);
+}
+
+// Add the next run of predecessor's client slots, all free until their clients arrive
+// Generations carry on from predecessor's, so ids it handed out aren't handed out again soon
+static void handoff_add_slots(SocketState* connection, const char* data, size_t len) {
+
+    int num_slots = (int)(len / sizeof(uint16_t));   // Generations are sent two bytes each
+
+    while (connection->clients_cap < connection->num_clients + num_slots && connection->clients_cap < shard_slots(connection)) {
+        if (grow_client_slots(connection) != 0) return;
+    }
+    if (num_slots > connection->clients_cap - connection->num_clients) num_slots = connection->clients_cap - connection->num_clients;
+    if (event_reserve(connection, connection->num_clients + num_slots) != 0) return;
+
+    handoff_read_slots(data, len, connection->slot_gen + connection->num_clients, num_slots);
+    memset(connection->clients + connection->num_clients, 0, num_slots * sizeof(Client));
+    connection->num_clients += num_slots;
+}
+
+// Take over predecessor's clients, then any packets it hadn't handled and its caller's state
+// If predecessor goes away part way through, we carry on with the clients we have and drop the
+// state, so every client is announced again
+static void handoff_take_clients(SocketState* connection, int predecessor) {
+
+    char* record = malloc(HANDOFF_RECORD_LEN);
+    Client* client = NULL;      // Client TX records belong to
+    bool done = false;
+
+    while (record != NULL && !done) {
+
+        int passed[HANDOFF_MAX_FDS];
+        int num_fds;
+        HandoffType type;
+        ssize_t len = handoff_recv(predecessor, record, &type, passed, HANDOFF_MAX_FDS, &num_fds);
+        if (len == -1) break;
+
+        char* data = record;
+        size_t num_bytes = len;
+
+        // Descriptors only come with clients
+        if (num_fds > 0 && type != HANDOFF_CLIENT) {
+            for (int i = 0; i < num_fds; i++) close(passed[i]);
+            num_fds = 0;
+        }
+
+        switch (type) {
+        case HANDOFF_SLOTS:
+            handoff_add_slots(connection, data, num_bytes);
+            break;
+        case HANDOFF_CLIENT:
+            client = num_fds > 0 ? handoff_add_client(connection, passed, num_fds, data, num_bytes) : NULL;
+            break;
+        case HANDOFF_TX:
+            if (client != NULL && client->active == ACTIVE) handoff_add_tx(connection, client, data, num_bytes);
+            break;
+        case HANDOFF_PACKET: {
+            HandoffPacket handed;
+            if (handoff_read_packet(data, num_bytes, &handed) != 0) break;
+            if (num_bytes == HANDOFF_PACKET_LEN || num_bytes - HANDOFF_PACKET_LEN > MAX_MESSAGE_LEN) break;
+            Packet* packet = queue_packet(connection, handed.sender, data + HANDOFF_PACKET_LEN, (uint16_t)(num_bytes - HANDOFF_PACKET_LEN));
+            if (packet != NULL) packet->datagram = handed.datagram;
+            break;
+        }
+        case HANDOFF_STATE: {
+            char* state = realloc(connection->handoff_state, connection->handoff_state_len + num_bytes);
+            if (state == NULL) break;
+            memcpy(state + connection->handoff_state_len, data, num_bytes);
+            connection->handoff_state = state;
+            connection->handoff_state_len += num_bytes;
+            break;
+        }
+        case HANDOFF_DONE:
+            done = true;
+            break;
+        case HANDOFF_LISTENERS:     // Only ever comes first, and was taken before any clients
+            break;
+        }
+    }
+
+    free(record);
+
+    // Shared ring answers that waited on the queue go out once nothing is left ahead of them
+    for (int i = 0; i < connection->num_clients; i++) {
+        Client* pending = &connection->clients[i];
+        if (pending->active == ACTIVE && pending->shm_pending && pending->tx_head == NULL) shm_offer(connection, pending);
+    }
+
+    // Slots predecessor had free, or whose clients didn't make it, can be handed out again
+    for (int i = 0; i < connection->num_clients; i++) {
+        if (connection->clients[i].active == ACTIVE) continue;
+        connection->clients[i] = (Client){0};
+        connection->free_slots[(connection->free_head + connection->num_free_slots) % connection->clients_cap] = (uint32_t)i;
+        connection->num_free_slots++;
+    }
+
+    // Any that were disconnected already are freed above rather than on the next flush
+    connection->num_inactive = 0;
+
+    if (!done) {
+        PRINT_ERROR2("Handoff cut short.", "Carrying on with clients taken over so far.");
+        free(connection->handoff_state);
+        connection->handoff_state = NULL;
+        connection->handoff_state_len = 0;
+    }
+}
+
+// Accept restarted server asking to take over from us, once it shows it reads the same records
+static void handoff_accept(SocketState* connection) {
+
+    int fd = accept4(connection->handoff_socket, NULL, NULL, SOCK_CLOEXEC);
+
+    if (fd == -1) return;
+
+    if (connection->successor != -1 || handoff_check_version(fd) != 0) {
+        printf("[Turning away restarted server]\n");
+        close(fd);
+        return;
+    }
+
+    printf("[Handing over to restarted server]\n");
+    connection->successor = fd;
+}
+
+// Whether accept failed for want of descriptors or memory, so the connections will still be there later
+static bool accept_exhausted(int error) {
+
+    return error == EMFILE || error == ENFILE || error == ENOBUFS || error == ENOMEM;
+}
+
+// Bit for listener in accept_paused
+static int listener_bit(const SocketState* connection, int listen_fd) {
+
+    return listen_fd == connection->socket ? 1 : 2;
+}
+
+// Watch listener again once accept backoff is over
+static void accept_resume(void* arg, uint64_t data) {
+
+    SocketState* connection = arg;
+    int listen_fd = (int)data;
+    struct epoll_event event = {.events = EPOLLIN, .data.fd = listen_fd};
+
+    connection->accept_paused &= ~listener_bit(connection, listen_fd);
+
+    if (connection->backend == SOCK_BACKEND_EPOLL) epoll_ctl(connection->epoll_fd, EPOLL_CTL_MOD, listen_fd, &event);
+    else if (connection->backend == SOCK_BACKEND_URING && !connection->handing_off) uring_arm_accept(connection, listen_fd);
+}
+
+// Stop watching a listener for ACCEPT_BACKOFF ms, after running out of descriptors to accept with
+// Listener stays readable with connections we can't take, so watching it would wake every poll for nothing
+// io_uring's accept has already ended by now, it just isn't armed again until the backoff is over
+static void accept_pause(SocketState* connection, int listen_fd) {
+
+    int bit = listener_bit(connection, listen_fd);
+    struct epoll_event event = {.events = 0, .data.fd = listen_fd};
+
+    if (connection->accept_paused & bit) return;
+    connection->accept_paused |= bit;
+
+    if (connection->backend == SOCK_BACKEND_EPOLL) epoll_ctl(connection->epoll_fd, EPOLL_CTL_MOD, listen_fd, &event);
+
+    timer_add(&connection->timers, now_msec() + ACCEPT_BACKOFF, accept_resume, connection, (uint64_t)listen_fd);
+}
+
+// Accept one incoming connection from a listening socket, add to client list
+static SocketStatus accept_from(SocketState* connection, int listen_fd) {
+
+    int client_socket;
+    struct sockaddr_storage cli_addr;
+    socklen_t addr_len = sizeof cli_addr;
+
+    // Accept incoming connections, nonblocking so edge-triggered reads can drain them
+    // io_uring waits for blocking sockets itself, and fails nonblocking ones with EAGAIN
+    int flags = SOCK_CLOEXEC;
+    if (connection->backend != SOCK_BACKEND_URING) flags |= SOCK_NONBLOCK;
+
+    client_socket = accept4(listen_fd, (struct sockaddr *)&cli_addr, &addr_len, flags);
+
+    if (client_socket != -1) return add_client(connection, client_socket);
+    if (accept_exhausted(errno)) accept_pause(connection, listen_fd);
+
+    switch (errno) {
+    case EAGAIN:
+        return SOCK_ERR_NO_NEW_CONNECTIONS;
+    // Connection went away before we got to it, try the next one
+    case ECONNABORTED:
+    case EPROTO:
+    case EINTR:
+        return SOCK_ERR_CLIENT_NOT_FOUND;
+    // Out of descriptors or memory, leave the rest in the backlog until the backoff is over
+    case EMFILE:
+    case ENFILE:
+    case ENOBUFS:
+    case ENOMEM:
+        return SOCK_ERR_TOO_MANY_CONNECTIONS;
+    default:
+        return SOCK_ERR_SOCKET_DISCONNECT;
+    }
+}
+
+// Accept any incoming connections, add to client list
+// Checks TCP listener first, then Unix listener once TCP has nothing waiting
+SocketStatus accept_client_socket(SocketState* connection) {
+
+    SocketStatus status;
+
+    if (connection->type == SOCK_UNINITIALIZED) return SOCK_ERR_UNINITIALIZED;
+    else if (connection->type == SOCK_CLIENT) return SOCK_ERR_INVALID_CMD;
+
+    status = accept_from(connection, connection->socket);
+    if (status == SOCK_ERR_NO_NEW_CONNECTIONS && connection->unix_socket != -1) status = accept_from(connection, connection->unix_socket);
+
+    return status;
+}
+
+// Accept waiting connections on a listener until backlog is empty, or accept budget is spent
+// Listening sockets are level-triggered, so anything left over is picked up next poll
+static SocketStatus accept_client_sockets(SocketState* connection, int listen_fd) {
+
+    SocketStatus status;
+    int accepted = 0;
+
+    // Only connections actually accepted count against the budget, ones that were gone already are skipped
+    do {
+        status = accept_from(connection, listen_fd);
+        if (status == SOCK_SUCCESS) accepted++;
+    } while ((status == SOCK_SUCCESS || status == SOCK_ERR_CLIENT_NOT_FOUND) &&
+             (config.accept_budget <= 0 || accepted < config.accept_budget));
+
+    return status;
+}
+
+// Note: client still remains in list until it is flushed
+SocketStatus disconnect_client_socket(SocketState* connection, uint32_t client_id) {
+
+    if (connection->type == SOCK_UNINITIALIZED) return SOCK_ERR_UNINITIALIZED;
+    else if (connection->type == SOCK_CLIENT) return SOCK_ERR_INVALID_CMD;
+
+    Client* client = id_to_client(connection, client_id);
+    if (client == NULL) return SOCK_ERR_CLIENT_NOT_FOUND;
+
+    printf("[Disconnecting client id: %d on socket: %d]\n", client_id, client->fd);
+    if (client->throttle.frames_throttled > 0) {
+        printf("[Client id: %d went over rate limits with %llu frames]\n", client_id, (unsigned long long)client->throttle.frames_throttled);
+    }
+
+    // Mark socket as inactive, slot is freed once application has seen it go
+    client->active = INACTIVE;
+    connection->inactive_slots[connection->num_inactive++] = (uint32_t)(client - connection->clients);
+    event_push(connection, SOCK_EVENT_DISCONNECT, client_id);
+
+    // Stop watching socket, then close it
+    shm_release(connection, client);
+    backend_remove_client(connection, client);
+    connection->fd_ids[client->fd] = 0;
+    close(client->fd);
+
+    // Drop any partial frames in either direction
+    free_packet(client->rx_packet);
+    client->rx_packet = NULL;
+    client->rx_len = 0;
+    free_tx_frames(client->tx_head);
+    client->tx_head = NULL;
+    client->tx_tail = NULL;
+    client->tx_bytes = 0;
+    client->tx_slow = false;
+    client->rx_paused = false;
+    crypt_stop(client);
+
+    return SOCK_SUCCESS;
+}
+
+// Remove inactive clients from list of clients
+SocketStatus flush_inactive_client_sockets(SocketState* connection) {
+
+    if (connection->type == SOCK_UNINITIALIZED) return SOCK_ERR_UNINITIALIZED;
+    else if (connection->type == SOCK_CLIENT) return SOCK_ERR_INVALID_CMD;
+
+    // Release slots of clients disconnected since last flush, ids stay reserved until slot is reused with a new generation
+    // Only those slots are visited, so a flush with nobody gone costs nothing
+    for (int i = 0; i < connection->num_inactive; i++) {
+
+        uint32_t slot = connection->inactive_slots[i];
+
+        DEBUG_PRINT3("Flushing inactive client:", connection->clients[slot].id);
+
+        // Overwrite entry with zeroes, and return slot to free list
+        memset(&connection->clients[slot], 0, sizeof(struct Client));
+        connection->free_slots[(connection->free_head + connection->num_free_slots) % connection->clients_cap] = slot;
+        connection->num_free_slots++;
+    }
+
+    connection->num_inactive = 0;
+
+    return SOCK_SUCCESS;
+}
+
+// Send packet to client
+SocketStatus server_socket_send_packet(SocketState* connection, uint32_t client_id, const char* data, size_t num_bytes) {
+
+    return send_packet(connection, id_to_client(connection, client_id), data, num_bytes);
+}
+
+// Send message gathered from payload fragments to client
+SocketStatus server_socket_send_packetv(SocketState* connection, uint32_t client_id, const struct iovec* iov, int iovcnt) {
+
+    return send_packetv(connection, id_to_client(connection, client_id), iov, iovcnt);
+}
+
+// Queue shared frame for client, without copying it
+// Caller keeps its own reference, and releases it once every client is queued
+SocketStatus server_socket_send_frame(SocketState* connection, uint32_t client_id, Frame* frame) {
+
+    if (frame == NULL) return SOCK_ERR_INVALID_MSG_LENGTH;
+
+    return send_frame(connection, id_to_client(connection, client_id), frame);
+}
+
+// Set message sent to clients that stay quiet for a heartbeat interval, replacing any set before
+SocketStatus server_socket_set_heartbeat(SocketState* connection, const char* data, size_t num_bytes) {
+
+    if (connection->type != SOCK_SERVER) return SOCK_ERR_INVALID_CMD;
+
+    Frame* frame = alloc_frame(data, num_bytes);
+    if (frame == NULL) return SOCK_ERR_INVALID_MSG_LENGTH;
+
+    if (connection->heartbeat != NULL) release_frame(connection->heartbeat);
+    connection->heartbeat = frame;
+
+    return SOCK_SUCCESS;
+}
+
+// Set message sent to clients that go over a rate limit, frame is shared by every notice
+SocketStatus server_socket_set_throttle_notice(SocketState* connection, const char* data, size_t num_bytes) {
+
+    if (connection->type != SOCK_SERVER) return SOCK_ERR_INVALID_CMD;
+
+    Frame* frame = alloc_frame(data, num_bytes);
+    if (frame == NULL) return SOCK_ERR_INVALID_MSG_LENGTH;
+
+    if (connection->throttle_notice != NULL) release_frame(connection->throttle_notice);
+    connection->throttle_notice = frame;
+
+    return SOCK_SUCCESS;
+}
+
+// Get what rate limits have done to a client so far
+SocketStatus server_socket_throttle_counters(SocketState* connection, uint32_t client_id, ThrottleCounters* counters) {
+
+    if (connection->type != SOCK_SERVER) return SOCK_ERR_INVALID_CMD;
+
+    Client* client = id_to_client(connection, client_id);
+    if (client == NULL) return SOCK_ERR_CLIENT_NOT_FOUND;
+
+    *counters = client->throttle;
+
+    return SOCK_SUCCESS;
+}
+
+// Check whether client is connected, it may have come over from a predecessor
+bool server_socket_client_active(SocketState* connection, uint32_t client_id) {
+
+    return connection->type == SOCK_SERVER && id_to_client(connection, client_id) != NULL;
+}
+
+// Receive packet from client
+SocketStatus server_socket_recv_packet(SocketState* connection, uint32_t client_id) {
+
+    return recv_packets(connection, id_to_client(connection, client_id));
+}
+
+// Get side channel port and session token to hand to a client over its stream
+// Clients on the Unix socket have no address to send datagrams from, so they stay on the stream
+SocketStatus server_socket_udp_session(SocketState* connection, uint32_t client_id, uint16_t* port, uint64_t* token) {
+
+    int domain;
+    socklen_t len = sizeof domain;
+
+    if (connection->type != SOCK_SERVER) return SOCK_ERR_INVALID_CMD;
+
+    Client* client = id_to_client(connection, client_id);
+    if (client == NULL) return SOCK_ERR_CLIENT_NOT_FOUND;
+
+    if (connection->udp_socket == -1) return SOCK_ERR_NO_DATAGRAM_PATH;
+    if (getsockopt(client->fd, SOL_SOCKET, SO_DOMAIN, &domain, &len) != 0 || domain == AF_UNIX) return SOCK_ERR_NO_DATAGRAM_PATH;
+
+    // Token must be unguessable, it is all that ties a datagram to the session
+    while (client->udp_token == 0) {
+        if (getrandom(&client->udp_token, sizeof client->udp_token, 0) != sizeof client->udp_token) {
+            client->udp_token = 0;
+            return SOCK_ERR_NO_DATAGRAM_PATH;
+        }
+    }
+
+    *port = connection->udp_port;
+    *token = client->udp_token;
+
+    return SOCK_SUCCESS;
+}
+
+// Add message to client's side channel datagram for this tick, starting another if it is full
+// Datagrams go out together at the start of the next poll
+// Until client's first datagram shows where it is, this fails so callers can use the stream
+SocketStatus server_socket_send_datagram(SocketState* connection, uint32_t client_id, const char* data, size_t num_bytes) {
+
+    if (connection->type != SOCK_SERVER) return SOCK_ERR_INVALID_CMD;
+
+    Client* client = id_to_client(connection, client_id);
+    if (client == NULL) return SOCK_ERR_CLIENT_NOT_FOUND;
+
+    // Sealed datagrams open with a sequence number and end with a tag
+    size_t header = (client->crypt != NULL ? CRYPT_SEQ_LEN : 0) + UDP_TOKEN_LEN;
+    size_t room = SOCK_UDP_MAX_PAYLOAD - (client->crypt != NULL ? CRYPT_TAG_LEN : 0);
+
+    if (connection->udp_socket == -1 || client->udp_addr_len == 0) return SOCK_ERR_NO_DATAGRAM_PATH;
+    if (num_bytes == 0 || num_bytes > room - header - 2) return SOCK_ERR_INVALID_MSG_LENGTH;
+
+    UdpDatagram* datagram = client->udp_slot > 0 ? &connection->udp_out[client->udp_slot - 1] : NULL;
+
+    if (datagram == NULL || datagram->len + 2 + num_bytes > room) {
+
+        if (connection->num_udp_out == UDP_BATCH) udp_flush(connection);
+
+        uint64_t token = htobe64(client->udp_token);
+        datagram = &connection->udp_out[connection->num_udp_out++];
+        datagram->id = client_id;
+        memcpy(datagram->data + header - UDP_TOKEN_LEN, &token, UDP_TOKEN_LEN);
+        datagram->len = header;
+        client->udp_slot = connection->num_udp_out;
+    }
+
+    uint16_t prefix = htons((uint16_t)num_bytes);
+    memcpy(datagram->data + datagram->len, &prefix, sizeof prefix);
+    memcpy(datagram->data + datagram->len + sizeof prefix, data, num_bytes);
+    datagram->len += sizeof prefix + num_bytes;
+
+    return SOCK_SUCCESS;
+}
+
+// Release what a server holds besides its sockets, and clear its state
+static void release_server_state(SocketState* connection) {
+
+    backend_close(connection);
+    free(connection->clients);
+    free(connection->slot_gen);
+    free(connection->free_slots);
+    free(connection->inactive_slots);
+    free(connection->events);
+    free(connection->fd_ids);
+    free(connection->handoff_state);
+    free_packet_queue(connection);
+    packet_pool_clear();
+    if (connection->heartbeat != NULL) release_frame(connection->heartbeat);
+    if (connection->throttle_notice != NULL) release_frame(connection->throttle_notice);
+
+    memset(connection, 0, sizeof *connection);
+}
+
+// Shutdown server and all client connections
+SocketStatus shutdown_server_socket(SocketState* connection) {
+
+    if (connection->type == SOCK_UNINITIALIZED) return SOCK_ERR_UNINITIALIZED;
+    else if (connection->type == SOCK_CLIENT) return SOCK_ERR_INVALID_CMD;
+
+    printf("Shutting down connection.\n");
+    for (int i = 0; i < connection->num_clients; i++) {
+        if (connection->clients[i].active == ACTIVE) disconnect_client_socket(connection, connection->clients[i].id);
+    }
+
+    if (connection->num_udp_out > 0) udp_flush(connection);
+    close(connection->socket);
+    if (connection->udp_socket != -1) close(connection->udp_socket);
+    if (connection->num_shards == 1) {      // Shards keep sharing theirs
+        close_unix_listener();
+        free_server_identity();
+    }
+    if (connection->handoff_socket != -1) {
+        close(connection->handoff_socket);
+        unlink(config.handoff_path);
+    }
+    if (connection->successor != -1) close(connection->successor);
+    release_server_state(connection);
+
+    return SOCK_SUCCESS;
+}
+
+static SocketStatus poll_sockets_uring(SocketState* connection, int timeout);
+
+// Write out what is queued before sockets are handed over, so as little as possible has to go with them
+// io_uring requests hold on to their sockets, so every one is cancelled and its completion handled first
+static void handoff_settle(SocketState* connection) {
+
+    if (connection->num_udp_out > 0) udp_flush(connection);
+
+    if (connection->backend != SOCK_BACKEND_URING) {
+        tx_flush_held(connection);
+        for (int i = 0; i < connection->num_clients; i++) {
+            if (connection->clients[i].active == ACTIVE && connection->clients[i].tx_head != NULL) tx_flush(connection, &connection->clients[i]);
+        }
+        return;
+    }
+
+    // Sends go in ahead of the cancel, so whatever sockets take straight away still goes out
+    connection->tx_deadline = 0;
+    uring_prep_sends(connection);
+    connection->handing_off = true;
+
+    struct io_uring_sqe* sqe = uring_get_sqe(connection->ring);
+    if (sqe != NULL) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+        sqe->user_data = URING_OP_CANCEL;
+    }
+
+    // Ring has settled once no sends are in flight and nothing completes for a little while
+    int64_t deadline = now_usec() + (int64_t)HANDOFF_TIMEOUT * 1000;
+    while (now_usec() < deadline && uring_submit_and_wait(connection->ring, HANDOFF_SETTLE) == 0) {
+        bool busy = false;
+        for (int i = 0; i < connection->num_clients; i++) {
+            if (connection->clients[i].active == ACTIVE && connection->clients[i].tx_busy) busy = true;
+        }
+        if (!busy && uring_peek_cqe(connection->ring) == NULL) break;
+        if (poll_sockets_uring(connection, 0) != SOCK_SUCCESS) break;
+    }
+}
+
+// Send listeners, then every client with what it had part way through in either direction, then packets and caller's state
+// Return -1 if successor stops taking them
+static int handoff_send_all(SocketState* connection, const char* state, size_t len) {
+
+    char session[CRYPT_STATE_LEN];
+    int fd = connection->successor;
+    HandoffListeners listeners = {
+        .udp_port = connection->udp_port,
+        .unix_socket = connection->unix_socket != -1,
+        .udp_socket = connection->udp_socket != -1,
+    };
+    int fds[HANDOFF_MAX_FDS] = {connection->socket};
+    int num_fds = 1;
+
+    if (listeners.unix_socket) fds[num_fds++] = connection->unix_socket;
+    if (listeners.udp_socket) fds[num_fds++] = connection->udp_socket;
+
+    if (handoff_send_listeners(fd, &listeners, fds, num_fds) != 0 ||
+        handoff_send_slots(fd, connection->slot_gen, connection->num_clients) != 0) return -1;
+
+    for (int i = 0; i < connection->num_clients; i++) {
+
+        Client* client = &connection->clients[i];
+        if (client->active != ACTIVE) continue;
+
+        HandoffClient handed = {
+            .id = client->id,
+            .udp_token = client->udp_token,
+            .udp_addr = client->udp_addr,
+            .udp_addr_len = client->udp_addr_len,
+            .rx_msgs = client->rx_msgs,
+            .rx_bytes = client->rx_bytes,
+            .rx_notified = client->rx_notified,
+            .crypt = client->crypt != NULL,
+            .shm = client->shm != NULL,
+            .shm_pending = client->shm_pending,
+            .rx_record_len = client->rx_record != NULL ? (uint32_t)client->rx_record_len : 0,
+        };
+
+        // Session goes ahead of everything else, a client whose session can't be written out reconnects
+        if (client->crypt != NULL && crypt_export(client->crypt, session) == 0) {
+            disconnect_client_socket(connection, client->id);
+            continue;
+        }
+
+        // Partial frame goes as the bytes it arrived as, prefix then body so far
+        // One being dropped has no body to send, successor is told how far in it is instead
+        size_t num_prefix = client->rx_len < sizeof client->rx_prefix ? client->rx_len : sizeof client->rx_prefix;
+        size_t num_body = client->rx_len - num_prefix;
+        memcpy(rx_buffer, client->rx_prefix, num_prefix);
+        if (client->rx_packet != NULL) {
+            memcpy(rx_buffer + num_prefix, client->rx_packet->data, num_body);
+        } else if (num_prefix == sizeof client->rx_prefix) {
+            handed.rx_dropping = (uint32_t)client->rx_len;
+            num_body = 0;
+        }
+
+        struct iovec iov[3] = {
+            {.iov_base = session, .iov_len = handed.crypt ? CRYPT_STATE_LEN : 0},
+            {.iov_base = rx_buffer, .iov_len = num_prefix + num_body},
+            {.iov_base = handed.rx_record_len > 0 ? client->rx_record->data : NULL, .iov_len = handed.rx_record_len},
+        };
+        int client_fds[HANDOFF_MAX_FDS] = {client->fd};
+        if (client->shm != NULL) shm_creator_fds(client->shm, client_fds + 1);
+
+        int status = handoff_send_client(fd, &handed, iov, 3, client_fds, client->shm != NULL ? HANDOFF_MAX_FDS : 1);
+        explicit_bzero(session, sizeof session);    // Keys don't outlive the record they went out in
+        if (status != 0) return -1;
+
+        for (TxFrame* frame = client->tx_head; frame != NULL; frame = frame->next) {
+            if (handoff_send_tx(fd, frame->frame->data + frame->offset, frame->frame->len - frame->offset, frame->sealed) != 0) return -1;
+        }
+    }
+
+    for (Packet* packet = connection->packet_queue; packet != NULL; packet = packet->next_packet) {
+        HandoffPacket handed = {.sender = packet->sender, .datagram = packet->datagram};
+        if (handoff_send_packet(fd, &handed, packet->data, packet->len) != 0) return -1;
+    }
+
+    if (handoff_send_chunks(fd, HANDOFF_STATE, state, len) != 0) return -1;
+
+    return handoff_send(fd, HANDOFF_DONE, NULL, 0, NULL, 0, NULL, 0);
+}
+
+// Let go of everything once it is handed over
+// Sockets are closed without being shut down, so successor's copies carry on
+static void handoff_release(SocketState* connection) {
+
+    for (int i = 0; i < connection->num_clients; i++) {
+        Client* client = &connection->clients[i];
+        if (client->active != ACTIVE) continue;
+        close(client->fd);
+        free_packet(client->rx_packet);
+        free_tx_frames(client->tx_head);
+        crypt_stop(client);
+        if (client->shm != NULL) {
+            shm_close(client->shm);
+            free(client->shm);
+        }
+    }
+
+    close(connection->socket);
+    if (connection->udp_socket != -1) close(connection->udp_socket);
+    if (unix_listener != -1) {
+        close(unix_listener);
+        unix_listener = -1;
+    }
+    close(connection->handoff_socket);
+    close(connection->successor);
+    release_server_state(connection);
+}
+
+// Hand listeners, clients and caller's state to the restarted server that asked for them, then release everything
+// Sealed clients go with their session and shared memory clients with their rings, so none of them reconnect.
+// If successor stops taking them part way through, clients not yet handed over are dropped
+SocketStatus server_socket_handoff(SocketState* connection, const char* state, size_t len) {
+
+    if (connection->type == SOCK_UNINITIALIZED) return SOCK_ERR_UNINITIALIZED;
+    else if (connection->type == SOCK_CLIENT || connection->successor == -1) return SOCK_ERR_INVALID_CMD;
+
+    handoff_settle(connection);
+    if (connection->type != SOCK_SERVER) return SOCK_ERR_SOCKET_DISCONNECT;
+
+    int status = handoff_send_all(connection, state, len);
+    if (status != 0) PRINT_ERROR("Unable to hand everything over to restarted server.");
+
+    handoff_release(connection);
+
+    return status == 0 ? SOCK_SUCCESS : SOCK_ERR_SEND_FAILURE;
+}
+
+// Poll every socket with poll(), rebuilding the fd list on each call
+static SocketStatus poll_sockets_poll(SocketState* connection, int timeout) {
+
+    struct pollfd* active_fds;
+    uint32_t* active_ids;
+    int num_active;
+    int num_events;
+    int status;
+    int wake_index = -1;
+    int unix_index = -1;
+    int udp_index = -1;
+    int handoff_index = -1;
+
+    // Make room for listening socket, every client slot and shared ring eventfd, stdin or shard wake fd, Unix listener, side channel and handoff listener
+    if (connection->poll_cap < connection->num_clients + connection->num_shm + 5) {
+
+        int cap = connection->num_clients + connection->num_shm + 5 + CLIENT_SLOTS_MIN;
+        struct pollfd* fds = realloc(connection->poll_fds, cap * sizeof(struct pollfd));
+        if (fds == NULL) return SOCK_ERR_POLL_FAILURE;
+        connection->poll_fds = fds;
+
+        uint32_t* ids = realloc(connection->poll_ids, cap * sizeof(uint32_t));
+        if (ids == NULL) return SOCK_ERR_POLL_FAILURE;
+        connection->poll_ids = ids;
+
+        connection->poll_cap = cap;
+    }
+
+    active_fds = connection->poll_fds;
+    active_ids = connection->poll_ids;
+    memset(active_fds, 0, connection->poll_cap * sizeof(struct pollfd));
+
+    // Create list of fds
+    num_active = 1;
+    active_fds[0].fd = connection->socket;
+    active_fds[0].events = connection->accept_paused & 1 ? 0 : POLLIN;
+    if (connection->type == SOCK_CLIENT && connection->server.tx_head != NULL && !connection->server.tx_held && connection->server.shm == NULL) active_fds[0].events |= POLLOUT;
+    for (int i = 0; i < connection->num_clients; i++) {
+        if (connection->clients[i].active == ACTIVE) {
+            active_fds[num_active].fd = connection->clients[i].fd;
+            active_fds[num_active].events = connection->clients[i].rx_paused ? 0 : POLLIN;
+            if (connection->clients[i].tx_head != NULL && !connection->clients[i].tx_held && connection->clients[i].shm == NULL) active_fds[num_active].events |= POLLOUT;
+            active_ids[num_active] = connection->clients[i].id; // Store id for future use
+            num_active++;
+        }
+    }
+
+    int num_polled_clients = num_active;
+
+    // Shared ring eventfds follow the sockets, a full ring waits on these instead of POLLOUT
+    for (int i = 0; i < connection->num_clients && connection->num_shm > 0; i++) {
+        if (connection->clients[i].active == ACTIVE && connection->clients[i].shm != NULL) {
+            active_fds[num_active].fd = connection->clients[i].shm->wait_fd;
+            active_fds[num_active].events = POLLIN;
+            active_ids[num_active] = connection->clients[i].id;
+            num_active++;
+        }
+    }
+    if (connection->type == SOCK_CLIENT && connection->server.shm != NULL) {
+        active_fds[num_active].fd = connection->server.shm->wait_fd;
+        active_fds[num_active].events = POLLIN;
+        num_active++;
+    }
+
+    int num_polled_shm = num_active;
+
+    // Also poll stdin if this is a client, or wake fd if this is a shard
+    if (connection->type == SOCK_CLIENT) {
+        active_fds[num_active].fd = 0;  // stdin file descriptor
+        active_fds[num_active].events = POLLIN;
+        num_active++;
+    } else if (connection->wake_fd != -1) {
+        wake_index = num_active;
+        active_fds[num_active].fd = connection->wake_fd;
+        active_fds[num_active].events = POLLIN;
+        num_active++;
+    }
+
+    if (connection->type == SOCK_SERVER && connection->unix_socket != -1) {
+        unix_index = num_active;
+        active_fds[num_active].fd = connection->unix_socket;
+        active_fds[num_active].events = connection->accept_paused & 2 ? 0 : POLLIN;
+        num_active++;
+    }
+
+    if (connection->udp_socket != -1) {
+        udp_index = num_active;
+        active_fds[num_active].fd = connection->udp_socket;
+        active_fds[num_active].events = POLLIN;
+        num_active++;
+    }
+
+    if (connection->type == SOCK_SERVER && connection->handoff_socket != -1) {
+        handoff_index = num_active;
+        active_fds[num_active].fd = connection->handoff_socket;
+        active_fds[num_active].events = POLLIN;
+        num_active++;
+    }
+
+    num_events = poll(active_fds, num_active, timeout);
+
+    if (num_events < 0) return SOCK_ERR_POLL_FAILURE;
+
+    if (udp_index != -1 && (active_fds[udp_index].revents & POLLIN)) udp_recv(connection);
+    if (handoff_index != -1 && (active_fds[handoff_index].revents & POLLIN)) handoff_accept(connection);
+
+    if (connection->type == SOCK_SERVER) {
+        // First check listening sockets for any incoming requests
+        int listeners[2] = {0, unix_index};
+        for (int i = 0; i < 2; i++) {
+            if (listeners[i] == -1 || !(active_fds[listeners[i]].revents & POLLIN)) continue;
+            DEBUG_PRINT("Polled new connection");
+            status = accept_client_sockets(connection, active_fds[listeners[i]].fd);
+            if (status == SOCK_ERR_SOCKET_DISCONNECT) {
+                DEBUG_PRINT("Socket error.");
+                shutdown_server_socket(connection);
+                return SOCK_ERR_SOCKET_DISCONNECT;
+            }
+        }
+
+        // Another shard queued packets for us
+        if (wake_index != -1 && (active_fds[wake_index].revents & POLLIN)) {
+            shard_clear_wake(connection);
+        }
+
+        // Now check remaining ports for room to write and for packets
+        for (int i = 1; i < num_polled_clients; i++) {
+            if (active_fds[i].revents & POLLOUT) {
+                tx_flush(connection, id_to_client(connection, active_ids[i]));
+            }
+            if (active_fds[i].revents & POLLIN) {
+                DEBUG_PRINT("Polled new packet");
+                status = recv_packets(connection, id_to_client(connection, active_ids[i]));
+                if (status == SOCK_ERR_SOCKET_DISCONNECT) {
+                    disconnect_client_socket(connection, active_ids[i]);
+                }
+            }
+        }
+
+        // Clients that disconnected above no longer resolve
+        for (int i = num_polled_clients; i < num_polled_shm; i++) {
+            Client* client = id_to_client(connection, active_ids[i]);
+            if ((active_fds[i].revents & POLLIN) && client != NULL && client->shm != NULL) shm_service(connection, client);
+        }
+    } else if (connection->type == SOCK_CLIENT) {
+        // Server signalled shared rings
+        if (num_polled_shm > num_polled_clients && (active_fds[num_polled_clients].revents & POLLIN)) {
+            shm_service(connection, &connection->server);
+        }
+
+        // Flush anything the server couldn't take earlier
+        if (active_fds[0].revents & POLLOUT) {
+            tx_flush(connection, &connection->server);
+        }
+
+        // Check if our client socket has any packets
+        if (active_fds[0].revents & POLLIN) {
+            DEBUG_PRINT("Polled new packet");
+            status = recv_packets(connection, &connection->server);
+            if (status == SOCK_ERR_SOCKET_DISCONNECT) {
+                DEBUG_PRINT("Server disconnected.");
+                shutdown_client_socket(connection);
+                return SOCK_ERR_SOCKET_DISCONNECT;
+            }
+        }
+    }
+
+
+    return SOCK_SUCCESS;
+}
+
+// Wait on epoll instance, and only service sockets that are ready
+static SocketStatus poll_sockets_epoll(SocketState* connection, int timeout) {
+
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    int num_events;
+    int status;
+
+    num_events = epoll_wait(connection->epoll_fd, events, MAX_EPOLL_EVENTS, timeout);
+
+    if (num_events < 0) return SOCK_ERR_POLL_FAILURE;
+
+    for (int i = 0; i < num_events; i++) {
+
+        int fd = events[i].data.fd;
+
+        // Client reads stdin directly, we only needed to wake up
+        if (connection->type == SOCK_CLIENT && fd == 0) continue;
+
+        // Another shard queued packets for us
+        if (fd == connection->wake_fd) {
+            shard_clear_wake(connection);
+            continue;
+        }
+
+        if (fd == connection->udp_socket) {
+            udp_recv(connection);
+            continue;
+        }
+
+        if (fd == connection->handoff_socket) {
+            handoff_accept(connection);
+            continue;
+        }
+
+        // Check listening sockets for any incoming requests
+        if (connection->type == SOCK_SERVER && (fd == connection->socket || fd == connection->unix_socket)) {
+            DEBUG_PRINT("Polled new connection");
+            status = accept_client_sockets(connection, fd);
+            if (status == SOCK_ERR_SOCKET_DISCONNECT) {
+                DEBUG_PRINT("Socket error.");
+                shutdown_server_socket(connection);
+                return SOCK_ERR_SOCKET_DISCONNECT;
+            }
+            continue;
+        }
+
+        Client* client = connection->type == SOCK_SERVER ? fd_to_client(connection, fd) : &connection->server;
+        if (client == NULL) continue;
+
+        // Peer signalled shared rings, socket itself is only watched for hangups
+        if (client->shm != NULL && fd == client->shm->wait_fd) {
+            shm_service(connection, client);
+            continue;
+        }
+
+        // Socket has room again, write out whatever is queued
+        if ((events[i].events & EPOLLOUT) && client->tx_head != NULL && !client->tx_held) {
+            tx_flush(connection, client);
+        }
+
+        if (!(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) continue;
+
+        // Paused clients are read once they drain, unless they have gone away
+        if (client->rx_paused && !(events[i].events & (EPOLLHUP | EPOLLERR))) continue;
+
+        // Edge-triggered, so drain every packet before waiting again
+        DEBUG_PRINT("Polled new packet");
+        status = recv_packets(connection, client);
+
+        if (status != SOCK_ERR_SOCKET_DISCONNECT && !(events[i].events & (EPOLLHUP | EPOLLERR))) continue;
+
+        if (connection->type == SOCK_SERVER) {
+            disconnect_client_socket(connection, client->id);
+        } else {
+            DEBUG_PRINT("Server disconnected.");
+            shutdown_client_socket(connection);
+            return SOCK_ERR_SOCKET_DISCONNECT;
+        }
+    }
+
+    return SOCK_SUCCESS;
+}
+
+// Submit queued sends and rearmed requests, wait for completions, then handle them
+// Everything queued since the last call goes to the kernel in one system call
+static SocketStatus poll_sockets_uring(SocketState* connection, int timeout) {
+
+    struct io_uring_cqe* cqe;
+
+    if (connection->tx_deadline == 0 && !connection->handing_off) uring_prep_sends(connection);
+
+    if (uring_submit_and_wait(connection->ring, timeout) != 0) return SOCK_ERR_POLL_FAILURE;
+
+    while ((cqe = uring_peek_cqe(connection->ring)) != NULL) {
+
+        uint64_t user_data = cqe->user_data;
+        uint32_t flags = cqe->flags;
+        int result = cqe->res;
+
+        uring_cqe_seen(connection->ring);
+
+        // Finished requests are armed again, unless sockets are being handed over
+        bool rearm = !(flags & IORING_CQE_F_MORE) && !connection->handing_off;
+
+        switch (user_data & URING_OP_MASK) {
+        case URING_OP_ACCEPT:
+            DEBUG_PRINT("Polled new connection");
+            if (result >= 0) {
+                add_client(connection, result);
+            } else if (result == -EINVAL || result == -EBADF) {
+                DEBUG_PRINT("Socket error.");
+                shutdown_server_socket(connection);
+                return SOCK_ERR_SOCKET_DISCONNECT;
+            }
+            if (rearm && result < 0 && accept_exhausted(-result)) accept_pause(connection, (int)(user_data >> URING_OP_SHIFT));
+            else if (rearm) uring_arm_accept(connection, (int)(user_data >> URING_OP_SHIFT));
+            break;
+        case URING_OP_RECV: {
+            uint32_t id = (uint32_t)(user_data >> URING_OP_SHIFT);
+            Client* client = id_to_client(connection, id);
+
+            // Completions can still arrive for clients that already disconnected
+            if (flags & IORING_CQE_F_BUFFER) {
+                uint16_t bid = (uint16_t)(flags >> IORING_CQE_BUFFER_SHIFT);
+                if (client != NULL && result > 0) {
+                    DEBUG_PRINT("Polled new packet");
+                    if (rx_input(connection, client, uring_buffer(connection->ring, bid), result) != 0) result = -EBADMSG;
+                }
+                uring_recycle_buffer(connection->ring, bid);
+            }
+
+            if (client == NULL) break;
+
+            // Receive is over once a completion comes without more to follow
+            if (!(flags & IORING_CQE_F_MORE) && (uint8_t)(user_data >> (32 + URING_OP_SHIFT)) == client->rx_arm) client->rx_armed = false;
+
+            // Out of buffers or a pause just ends the multishot, anything else means the client is gone
+            // A paused client is armed again once it drains, resuming before the cancel lands rearms here
+            if (result == 0 || (result < 0 && result != -ENOBUFS && result != -ECANCELED)) {
+                disconnect_client_socket(connection, id);
+            } else if (rearm && !client->rx_paused) {
+                uring_arm_recv(connection, client);
+            }
+            break;
+        }
+        case URING_OP_SHM: {
+            Client* client = id_to_client(connection, (uint32_t)(user_data >> URING_OP_SHIFT));
+            if (client == NULL || client->shm == NULL || result < 0) break;
+            shm_service(connection, client);
+            if (rearm) uring_arm_shm(connection, client);
+            break;
+        }
+        case URING_OP_CANCEL:
+            // Cancelled request's own completion reports the outcome
+            break;
+        case URING_OP_SEND:
+            uring_complete_send(connection, (UringSend*)(uintptr_t)(user_data & ~(uint64_t)URING_OP_MASK), result);
+            break;
+        case URING_OP_WAKE:
+            shard_clear_wake(connection);
+            if (rearm) uring_arm_wake(connection);
+            break;
+        case URING_OP_UDP:
+            udp_recv(connection);
+            if (rearm) uring_arm_udp(connection);
+            break;
+        case URING_OP_HANDOFF:
+            handoff_accept(connection);
+            if (rearm && connection->successor == -1) uring_arm_handoff(connection);
+            break;
+        }
+    }
+
+    return SOCK_SUCCESS;
+}
+
+// Wait up to timeout ms for the backend to have work, and handle it
+static SocketStatus poll_backend(SocketState* connection, int timeout) {
+
+    if (connection->backend == SOCK_BACKEND_URING) return poll_sockets_uring(connection, timeout);
+    else if (connection->backend == SOCK_BACKEND_EPOLL) return poll_sockets_epoll(connection, timeout);
+    else return poll_sockets_poll(connection, timeout);
+}
+
+// Whether a poll turned up anything for the caller, or another shard has packets waiting for it
+static bool poll_has_work(SocketState* connection) {
+
+    if (connection->num_packets > 0 || connection->event_head < connection->num_events || connection->successor != -1) return true;
+
+    return connection->wake_fd != -1 && __atomic_load_n(&shard_inboxes[connection->shard].head, __ATOMIC_RELAXED) != NULL;
+}
+
+// Spin on readiness with timeout 0 until something turns up for the caller, then return straight away
+// After busy_poll usec of nothing, sleep for the rest of timeout as usual, so a loaded server never
+// sleeps and an idle one doesn't keep burning a core
+static SocketStatus poll_busy(SocketState* connection, int timeout) {
+
+    SocketStatus status;
+    int64_t start = now_usec();
+    int64_t spin = timeout < 0 || (int64_t)timeout * 1000 > config.busy_poll ? config.busy_poll : (int64_t)timeout * 1000;
+    int64_t elapsed;
+
+    do {
+        status = poll_backend(connection, 0);
+        if (status != SOCK_SUCCESS || poll_has_work(connection)) return status;
+        elapsed = now_usec() - start;
+    } while (elapsed < spin);
+
+    if (timeout >= 0) {
+        timeout -= (int)(elapsed / 1000);
+        if (timeout <= 0) return status;
+    }
+
+    return poll_backend(connection, timeout);
+}
+
+// Poll connection for connections or packets
+// Accept any new connections, and add new packets to queue
+// With busy polling configured, a server spins rather than sleeps while packets keep coming
+SocketStatus poll_sockets(SocketState* connection, int timeout) {
+
+    SocketStatus status;
+
+    if (connection->type == SOCK_UNINITIALIZED) return SOCK_ERR_UNINITIALIZED;
+
+    // Tasks that came due run first, so anything they send goes out with the rest, and waiting stops when the next is due
+    timer_advance(&connection->timers, now_msec());
+    int64_t next = timer_next(&connection->timers);
+    if (next >= 0 && (timeout < 0 || timeout > next)) timeout = (int)next;
+
+    // Datagrams coalesced last tick go out before we wait
+    if (connection->num_udp_out > 0) udp_flush(connection);
+
+    // Frames held last tick go out once the coalescing window closes, and waiting stops when it does
+    if (connection->tx_deadline != 0) {
+        int64_t remaining = connection->tx_deadline - now_usec();
+        if (remaining <= 0) {
+            tx_flush_held(connection);
+        } else if (timeout < 0 || timeout > (remaining + 999) / 1000) {
+            timeout = (int)((remaining + 999) / 1000);
+        }
+    }
+
+    if (config.busy_poll > 0 && connection->type == SOCK_SERVER && timeout != 0) status = poll_busy(connection, timeout);
+    else status = poll_backend(connection, timeout);
+
+    // Collect packets from other shards, whether or not we were woken for them
+    if (status == SOCK_SUCCESS && connection->wake_fd != -1) shard_recv_packets(connection);
+
+    // Caller hands sockets over once it has dealt with what this poll brought in
+    if (status == SOCK_SUCCESS && connection->successor != -1) status = SOCK_HANDOFF_REQUESTED;
+
+    return status;
+}
+
+// Run fn from poll_sockets once delay ms have passed, delay is rounded up to the next tick
+SocketStatus sock_schedule(SocketState* connection, int delay, TimerFn fn, void* arg, uint64_t data) {
+
+    if (connection->type == SOCK_UNINITIALIZED) return SOCK_ERR_UNINITIALIZED;
+    if (delay < 0 || fn == NULL) return SOCK_ERR_INVALID_CMD;
+
+    if (timer_add(&connection->timers, now_msec() + (uint64_t)delay, fn, arg, data) != 0) return SOCK_ERR_POLL_FAILURE;
+
+    return SOCK_SUCCESS;
+}
+
+// Connect to first address of host and port that works, return -1 on failure
+static int connect_tcp(const char* host, const char* port) {
+
+    int status;             // Variable for storing function return status
+    int socket_fd = -1;     // Variable for storing socket file descriptor
+
+    struct addrinfo hints = {0};    // Struct to pass inputs to getaddrinfo
+    struct addrinfo *addr, *addr0;  // Structs to get results from getaddrinfo
+
+    hints.ai_family = AF_UNSPEC;        // Either IPv4 or IPv6
+    hints.ai_socktype = SOCK_STREAM;    // TCP Stream Socket
+    hints.ai_flags = AI_PASSIVE;        // Fill in IP
+
+    status = getaddrinfo(host, port, &hints, &addr0);
+    if (status != 0 || addr0 == NULL) {
+        PRINT_ERROR2("Unable to get address.", gai_strerror(status));
+        return -1;
+    }
+
+    // Connect to first address that works
+    for (addr = addr0; addr != NULL; addr = addr->ai_next) {
+
+        // Attempt to open streaming socket
+        socket_fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+        if (socket_fd == -1) {
+            continue;
+        }
+
+        // Attempt to connect to socket
+        status = connect(socket_fd, addr->ai_addr, addr->ai_addrlen);
+        if (status == -1) {
+            close(socket_fd);
+            socket_fd = -1;
+            continue;
+        }
+
+        // If we connect successfully, leave loop
+        break;
+    }
+
+    // Free memory allocated for addresses
+    freeaddrinfo(addr0);
+
+    return socket_fd;
+}
+
+// Connect to server listening on Unix domain socket path, return -1 on failure
+static int connect_unix(const char* path) {
+
+    struct sockaddr_un addr = {0};
+    int socket_fd;
+
+    if (strlen(path) >= sizeof addr.sun_path) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    socket_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (socket_fd == -1) return -1;
+
+    if (connect(socket_fd, (struct sockaddr*)&addr, sizeof addr) != 0) {
+        close(socket_fd);
+        return -1;
+    }
+
+    return socket_fd;
+}
+
+// Start a client and connect to host at specified port
+// A host of unix:<path> connects to a server on this machine through its Unix socket, port is unused
+SocketStatus start_client_socket(SocketState* connection, const char* host, const char* port) {
+
+    int status;             // Variable for storing function return status
+    int socket_fd;          // Variable for storing socket file descriptor
+
+    // If already initialized, return error
+    if (connection->type != SOCK_UNINITIALIZED) return SOCK_ERR_ALREADY_INITIALIZED;
+
+    bool unix_host = host != NULL && strncmp(host, SOCK_UNIX_PREFIX, strlen(SOCK_UNIX_PREFIX)) == 0;
+
+    if (unix_host) {
+        socket_fd = connect_unix(host + strlen(SOCK_UNIX_PREFIX));
+    } else {
+        socket_fd = connect_tcp(host, port);
+    }
+
+    if (socket_fd == -1) {
+        PRINT_ERROR("Unable to connect to socket.");
+        return SOCK_ERR_CLIENT_START_FAILURE;
+    }
+
+    // Make this socket nonblocking
+    status = fcntl(socket_fd, F_SETFL, O_NONBLOCK);
+    if (status != 0) {
+        PRINT_ERROR("Unable to configure socket to non-blocking.");
+        return SOCK_ERR_CLIENT_START_FAILURE;
+    }
+
+    set_nodelay(socket_fd);
+
+    // Update type, and save socked fd
+    connection->type = SOCK_CLIENT;
+    connection->socket = socket_fd;
+    connection->unix_socket = -1;
+    connection->handoff_socket = -1;
+    connection->successor = -1;
+    connection->num_shards = 1;
+    connection->wake_fd = -1;
+    connection->udp_socket = -1;
+
+    // Warm up packet pool
+    if (config.packet_prealloc > 0) packet_pool_prealloc(config.packet_prealloc);
+
+    // Track server like any other peer, ID 0 is reserved for server
+    connection->server = (Client){0};
+    connection->server.id = 0;
+    connection->server.fd = socket_fd;
+    connection->server.active = ACTIVE;
+
+    // Setup event loop
+    if (backend_init(connection) != SOCK_SUCCESS) {
+        close(socket_fd);
+        memset(connection, 0, sizeof *connection);
+        return SOCK_ERR_CLIENT_START_FAILURE;
+    }
+
+    // Setup our packet queue
+    connection->packet_queue = NULL;
+    connection->packet_queue_tail = NULL;
+    connection->num_packets = 0;
+
+    // Same-host servers can skip the socket for frames altogether, anything else may need sealing
+    if (unix_host && config.shm_rings) shm_request(connection);
+
+    if (!unix_host && config.encrypt && config.server_fingerprint == NULL) {
+        PRINT_ERROR2("Unable to encrypt connection.", "Server key fingerprint is needed to know who answers.");
+        shutdown_client_socket(connection);
+        return SOCK_ERR_CLIENT_START_FAILURE;
+    }
+
+    if (!unix_host && config.encrypt && crypt_connect(connection) != 0) {
+        PRINT_ERROR2("No valid hello from server.", "Is it running with encryption, under the key whose fingerprint was given?");
+        shutdown_client_socket(connection);
+        return SOCK_ERR_CLIENT_START_FAILURE;
+    }
+
+    return SOCK_SUCCESS;
+}
+
+// Send packet from client to server
+SocketStatus client_socket_send_packet(SocketState* connection, const char* data, size_t num_bytes) {
+
+    if (connection->type != SOCK_CLIENT) return SOCK_ERR_INVALID_CMD;
+
+    return send_packet(connection, &connection->server, data, num_bytes);
+}
+
+// Send message gathered from payload fragments to server
+SocketStatus client_socket_send_packetv(SocketState* connection, const struct iovec* iov, int iovcnt) {
+
+    if (connection->type != SOCK_CLIENT) return SOCK_ERR_INVALID_CMD;
+
+    return send_packetv(connection, &connection->server, iov, iovcnt);
+}
+
+// Open side channel to server with the session it handed out over the stream
+// Datagrams go to the address we reached the server on, at the port it gave
+SocketStatus client_socket_start_udp(SocketState* connection, uint16_t port, uint32_t id, uint64_t token) {
+
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof addr;
+    int socket_fd;
+
+    if (connection->type != SOCK_CLIENT) return SOCK_ERR_INVALID_CMD;
+    if (connection->udp_socket != -1) return SOCK_ERR_ALREADY_INITIALIZED;
+
+    if (getpeername(connection->socket, (struct sockaddr*)&addr, &addr_len) != 0) return SOCK_ERR_CLIENT_START_FAILURE;
+    if (addr.ss_family == AF_INET) ((struct sockaddr_in*)&addr)->sin_port = htons(port);
+    else if (addr.ss_family == AF_INET6) ((struct sockaddr_in6*)&addr)->sin6_port = htons(port);
+    else return SOCK_ERR_NO_DATAGRAM_PATH;
+
+    // Connected, so the kernel drops datagrams from anyone but the server
+    socket_fd = socket(addr.ss_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (socket_fd == -1) return SOCK_ERR_CLIENT_START_FAILURE;
+
+    if (connect(socket_fd, (struct sockaddr*)&addr, addr_len) != 0 ||
+        (connection->backend == SOCK_BACKEND_EPOLL && epoll_add_fd(connection, socket_fd, EPOLLIN) == -1)) {
+        PRINT_ERROR("Unable to open UDP side channel.");
+        close(socket_fd);
+        return SOCK_ERR_CLIENT_START_FAILURE;
+    }
+
+    connection->udp_socket = socket_fd;
+    connection->udp_id = id;
+    connection->server.udp_token = token;
+
+    // Server only learns where to send datagrams once one arrives from us
+    return client_socket_send_datagram(connection, NULL, 0);
+}
+
+// Send message to server over side channel straight away, clients send too little to coalesce
+// With no message, the datagram just tells the server where we are
+SocketStatus client_socket_send_datagram(SocketState* connection, const char* data, size_t num_bytes) {
+
+    char datagram[SOCK_UDP_MAX_PAYLOAD];
+    CryptSession* crypt = connection->server.crypt;
+    size_t len = UDP_ID_LEN + (crypt != NULL ? CRYPT_SEQ_LEN : 0) + UDP_TOKEN_LEN;
+    size_t room = sizeof datagram - (crypt != NULL ? CRYPT_TAG_LEN : 0);
+    uint32_t id = htonl(connection->udp_id);
+    uint64_t token = htobe64(connection->server.udp_token);
+    uint16_t prefix = htons((uint16_t)num_bytes);
+
+    if (connection->type != SOCK_CLIENT) return SOCK_ERR_INVALID_CMD;
+    if (connection->udp_socket == -1) return SOCK_ERR_NO_DATAGRAM_PATH;
+    if (num_bytes > room - len - sizeof prefix) return SOCK_ERR_INVALID_MSG_LENGTH;
+
+    memcpy(datagram, &id, UDP_ID_LEN);
+    memcpy(datagram + len - UDP_TOKEN_LEN, &token, UDP_TOKEN_LEN);
+    if (num_bytes > 0) {
+        memcpy(datagram + len, &prefix, sizeof prefix);
+        memcpy(datagram + len + sizeof prefix, data, num_bytes);
+        len += sizeof prefix + num_bytes;
+    }
+
+    // Everything after our id is sealed
+    if (crypt != NULL) {
+        size_t sealed = crypt_seal_datagram(crypt, datagram + UDP_ID_LEN, len - UDP_ID_LEN - CRYPT_SEQ_LEN);
+        if (sealed == 0) return SOCK_ERR_SEND_FAILURE;
+        len = UDP_ID_LEN + sealed;
+    }
+
+    if (send(connection->udp_socket, datagram, len, MSG_DONTWAIT) != (ssize_t)len) return SOCK_ERR_SEND_FAILURE;
+
+    return SOCK_SUCCESS;
+}
+
+// Shutdown client
+SocketStatus shutdown_client_socket(SocketState* connection) {
+
+    if (connection->type != SOCK_CLIENT) return SOCK_ERR_INVALID_CMD;
+
+    printf("Shutting down client.\n");
 
-    memset(&connection, 0, sizeof(SocketState));
+    shm_release(connection, &connection->server);
+    crypt_stop(&connection->server);
+    close(connection->socket);
+    if (connection->udp_socket != -1) close(connection->udp_socket);
+    backend_close(connection);
+    free_packet(connection->server.rx_packet);
+    free_tx_frames(connection->server.tx_head);
+    free_packet_queue(connection);
+    packet_pool_clear();
+
+    memset(connection, 0, sizeof *connection);
 
     return SOCK_SUCCESS;
 }
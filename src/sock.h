@@ -4,10 +4,33 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <sys/poll.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
 #include <stdbool.h>
 
+#include "shm.h"
+#include "timer.h"
+
 #define MAX_MESSAGE_LEN (65535)
-#define MAX_CLIENTS     (255)
+
+// Client ids are (generation << SOCK_ID_INDEX_BITS) | slot, generation starts at 1 so id 0 stays free
+// A slot's generation moves on each time it is reused, so stale ids never reach a new client
+#define SOCK_ID_INDEX_BITS  (20)
+#define SOCK_ID_INDEX(id)   ((id) & ((1u << SOCK_ID_INDEX_BITS) - 1))   // Client slot of an id
+#define SOCK_ID_GEN(id)     ((id) >> SOCK_ID_INDEX_BITS)                // Generation of an id
+#define SOCK_ID_GEN_MAX     (UINT32_MAX >> SOCK_ID_INDEX_BITS)
+
+#define MAX_CLIENTS     ((1 << SOCK_ID_INDEX_BITS) - 1)                // Most clients at once, tables grow on demand up to this
+
+// Server shards interleave id slots, shard s hands out slots s, s + N, s + 2N, ... so ids stay unique
+#define MAX_SHARDS      (64)
+
+// Host prefix that connects clients to a Unix domain socket path instead of a TCP address
+#define SOCK_UNIX_PREFIX "unix:"
+
+// UDP side channel carries pings, so they don't queue behind bulk data on the stream
+#define SOCK_UDP_MAX_PAYLOAD (1200)     // Largest datagram sent or accepted, stays clear of fragmentation on common paths
 
 typedef enum {
     SOCK_SUCCESS = 0,
@@ -26,17 +49,74 @@ typedef enum {
     SOCK_ERR_CLIENT_NOT_FOUND,
     SOCK_ERR_INVALID_CMD,
     SOCK_ERR_CLIENT_STILL_ACTIVE,
+    SOCK_ERR_CLIENT_TOO_SLOW,
+    SOCK_ERR_NO_DATAGRAM_PATH,
+    SOCK_ERR_SHARD_BUSY,
+    SOCK_HANDOFF_REQUESTED,
 } SocketStatus;
 
 typedef enum {
     SOCK_UNINITIALIZED = 0, SOCK_SERVER, SOCK_CLIENT
 } ConnectionType;
 
+typedef enum {
+    SOCK_BACKEND_EPOLL = 0,             // Edge-triggered epoll, only ready sockets are touched
+    SOCK_BACKEND_POLL,                  // Portable poll, rebuilds fd list every call
+    SOCK_BACKEND_URING,                 // io_uring completions, server only, one submission per loop
+} SocketBackend;
+
+// What to do with a client whose outbound queue passes the high watermark
+typedef enum SlowPolicy {
+    SOCK_SLOW_DROP,                     // Drop low priority frames until it drains to the low watermark
+    SOCK_SLOW_PAUSE,                    // Stop reading from it until it drains to the low watermark
+    SOCK_SLOW_DISCONNECT,               // Disconnect it
+} SlowPolicy;
+
+typedef enum FramePriority {
+    FRAME_PRIORITY_NORMAL = 0,
+    FRAME_PRIORITY_LOW,                 // May be dropped for slow clients, such as presence updates
+} FramePriority;
+
+typedef struct SocketConfig {
+    SocketBackend backend;              // Event loop backend, read when socket is started
+    int packet_prealloc;                // Packets to preallocate per pool size class when socket is started
+    int num_shards;                     // Server reactor threads, each with its own listening socket
+    int listen_backlog;                 // Pending connection queue length passed to listen()
+    int accept_budget;                  // Most connections accepted per poll, 0 for no limit
+    int coalesce_window;                // Microseconds outbound frames are held so they go out together, -1 to send straight away
+    size_t tx_high_water;               // Queued outbound bytes that mark a client as slow, 0 for no limit
+    size_t tx_low_water;                // Queued outbound bytes a slow client must drain to, 0 for half of high watermark
+    size_t tx_hard_limit;               // Queued outbound bytes that disconnect a slow client whatever the policy, 0 for four times high watermark
+    SlowPolicy slow_policy;             // What to do with slow clients
+    const char* unix_path;              // Also listen on this Unix domain socket path, NULL for TCP only
+    bool shm_rings;                     // Clients on a Unix socket ask server to carry frames over shared memory rings
+    bool udp_channel;                   // Open a UDP side channel next to each TCP listener
+    bool encrypt;                       // Seal TCP traffic in AEAD records under keys agreed at connect, both ends must set it
+    const char* server_key;             // PEM file with the long-term key encrypted servers sign hellos with, made if missing, NULL for a fresh key each start
+    const char* server_fingerprint;     // Hex fingerprint of the only server key encrypted clients accept, they refuse to connect without one
+    int heartbeat_interval;             // Send heartbeat to clients quiet for this many ms, and drop them once a few go unanswered, 0 for never
+    const char* handoff_path;           // Take sockets over from a server running at this Unix socket path, and hand them to the next one, NULL for cold restarts
+    int rate_msgs;                      // Frames each client may send per second, with a second's worth of burst, 0 for no limit
+    int rate_bytes;                     // Payload bytes each client may send per second, with a second's worth of burst, 0 for no limit
+    int busy_poll;                      // Microseconds server spins on readiness with nothing arriving before it sleeps, sending without coalescing, 0 to block
+} SocketConfig;
+
+// Immutable outbound frame, shared by every client queue it is sent on
+// Only used on the thread that made it, so the count needs no atomics
+typedef struct Frame {
+    int refs;                           // Queues and callers holding this frame
+    FramePriority priority;             // Whether frame may be dropped for slow clients, defaults to normal
+    size_t len;                         // Length of frame including prefix
+    char data[];                        // Length prefix followed by payload
+} Frame;
+
 typedef struct Packet {
     uint16_t len;                       // Length of Packet in Bytes
-    uint16_t sender;                    // Sender of message
-    char data[MAX_MESSAGE_LEN];         // Actual message
+    uint32_t sender;                    // Sender of message
+    uint8_t size_class;                 // Pool size class packet was allocated from
+    bool datagram;                      // Whether packet arrived on UDP side channel
     struct Packet* next_packet;         // Pointer to next message in queue
+    char data[];                        // Actual message, capacity set by size class
 } Packet;
 
 typedef enum ClientState {
@@ -44,22 +124,155 @@ typedef enum ClientState {
     ACTIVE = 1,
 } ClientState;
 
+// Token bucket refilled at a steady rate, holding at most a second's worth
+typedef struct RateBucket {
+    int64_t tokens;                     // Thousandths of a token available
+    uint64_t refilled;                  // Monotonic ms bucket was last refilled at
+} RateBucket;
+
+// Rate limit counters, kept per client and totalled per shard
+typedef struct ThrottleCounters {
+    uint64_t frames_throttled;          // Frames over a limit, read and dropped without being parsed
+    uint64_t bytes_throttled;           // Payload bytes in those frames
+    uint64_t notices_sent;              // Times a client was told it went over
+} ThrottleCounters;
+
 typedef struct Client {
-    uint16_t id;                        // Unique Client id
+    uint32_t id;                        // Unique Client id
     int fd;                             // Client Socket File Descriptor
     ClientState active;                 // Whether client is active or not
+
+    Packet* rx_packet;                  // Packet the partial frame is read into, NULL until its prefix is in
+    size_t rx_len;                      // Bytes of partial frame received so far, prefix included
+    uint8_t rx_prefix[2];               // Length prefix of partial frame
+
+    struct TxFrame* tx_head;            // Outbound frames waiting to be sent
+    struct TxFrame* tx_tail;            // Last outbound frame
+    bool tx_busy;                       // Whether a send is in flight on io_uring
+    bool tx_pending;                    // Listed in tx_pending_ids, so io_uring looks at its queue next loop
+    bool tx_held;                       // Whether frames are held back to coalesce with the rest of the tick
+    size_t tx_bytes;                    // Outbound bytes queued or in flight
+    bool tx_slow;                       // Passed high watermark, and hasn't drained to low watermark yet
+    bool tx_dropped;                    // Frames were dropped while it was slow, so it is resynced once it drains
+    bool tx_resync;                     // Resync event is queued and hasn't been popped yet
+    bool rx_paused;                     // Reading is paused until client drains
+    bool rx_armed;                      // Whether an io_uring receive is outstanding, until its final completion
+    uint8_t rx_arm;                     // Generation of the latest io_uring receive, so a cancel hits only that one
+
+    struct ShmLink* shm;                // Shared memory rings carrying frames instead of the socket, NULL if none
+    bool shm_pending;                   // Client asked for shared memory rings, and hasn't had its answer yet
+
+    uint64_t udp_token;                 // Secret datagrams for this session must carry, 0 until one is handed out
+    struct sockaddr_in6 udp_addr;       // Where client's datagrams come from, big enough for either family
+    socklen_t udp_addr_len;             // Length of udp_addr, 0 until client's first datagram
+    int udp_slot;                       // Position + 1 of client's datagram in outbound batch, 0 if none
+
+    struct CryptSession* crypt;         // Record layer sealing this connection, NULL if it is in the clear
+    Packet* rx_record;                  // Partial hello or record, NULL unless one is split across reads
+    size_t rx_record_len;               // Bytes of it received so far
+
+    uint64_t rx_last;                   // Monotonic ms bytes last arrived at, or client connected, when heartbeats are on
+    int rx_missed;                      // Heartbeats sent since client was last heard from, reset by anything arriving
+
+    RateBucket rx_msgs;                 // Frames client may still send, when config limits them
+    RateBucket rx_bytes;                // Payload bytes client may still send, when config limits them
+    uint64_t rx_notified;               // Monotonic ms client was last told it went over a limit, 0 if never
+    ThrottleCounters throttle;          // What rate limits have done to this client
 } Client;
 
+// Change in a server's clients, queued for the application as it happens
+typedef enum SockEventType {
+    SOCK_EVENT_CONNECT,                 // Client connected, and can be sent to
+    SOCK_EVENT_DISCONNECT,              // Client went away, its slot isn't reused until inactive clients are flushed
+    SOCK_EVENT_RESYNC,                  // Slow client drained after low priority frames to it were dropped, so its view is stale
+} SockEventType;
+
+typedef struct SockEvent {
+    SockEventType type;
+    uint32_t client_id;
+} SockEvent;
+
+// Slow consumer policy counters, kept per shard
+typedef struct SlowCounters {
+    uint64_t frames_dropped;            // Low priority frames dropped for slow clients
+    uint64_t clients_paused;            // Times reading from a slow client was paused
+    uint64_t clients_disconnected;      // Slow clients disconnected
+} SlowCounters;
+
+// One socket endpoint, a server shard or a client, any number can run in a process
+// Caller owns it, start functions fill it in and shutdown functions release what it holds and zero it
 typedef struct SocketState {
 
     ConnectionType type;                // Whether this is a server or client
     int socket;                         // Socket file descriptor
+    int unix_socket;                    // Listening Unix domain socket shared by every shard, -1 if none
+    int handoff_socket;                 // Listening socket a restarted server asks for our sockets on, -1 if none
+    int successor;                      // Restarted server waiting to take our sockets over, -1 if none
+    bool handing_off;                   // Sockets are being handed over, so io_uring requests aren't armed again
+    char* handoff_state;                // Caller's state handed over by the server we took over from, NULL if none, freed with the socket
+    size_t handoff_state_len;           // Length of handoff_state
+
+    int shard;                          // Server shard this state runs
+    int num_shards;                     // Number of server shards
+    int wake_fd;                        // eventfd other shards write to when they queue packets, -1 if unsharded
+    uint64_t relays_refused;            // Packets for other shards turned away because their inbox was full
+
+    int accept_paused;                  // Listeners left unwatched while out of descriptors, bit 0 for TCP and bit 1 for Unix
+
+    int udp_socket;                     // UDP side channel, one per shard on server, connected to server on client, -1 if none
+    uint16_t udp_port;                  // Port of side channel, server only
+    uint32_t udp_id;                    // Our client id, sent with each datagram, client only
+    struct UdpDatagram* udp_out;        // Datagrams coalesced this tick, sent together at the start of the next poll
+    int num_udp_out;                    // Number of datagrams in udp_out
 
-    uint16_t next_id;                   // Next unique client id
-    int num_clients;                    // Current number of clients
-    Client clients[MAX_CLIENTS];        // List of clients
+    SocketBackend backend;              // Event loop backend in use
+    int epoll_fd;                       // epoll instance, -1 unless using epoll backend
+    struct Uring* ring;                 // io_uring instance, NULL unless using io_uring backend
+
+    int num_clients;                    // Client slots in use, slots below this may be inactive or free
+    int clients_cap;                    // Number of slots allocated in each slot table
+    Client* clients;                    // List of clients, indexed by SOCK_ID_INDEX of client id
+    uint16_t* slot_gen;                 // Generation of last id handed out from each slot
+    uint32_t* free_slots;               // Ring of flushed slots ready for reuse, oldest first so generations age evenly
+    int free_head;                      // Position of oldest slot in free_slots
+    int num_free_slots;                 // Number of slots in free_slots
+    uint32_t* inactive_slots;           // Slots of clients disconnected since last flush, sized like the slot tables
+    int num_inactive;                   // Number of slots in inactive_slots
+
+    SockEvent* events;                  // Client connects and disconnects, oldest not yet popped at event_head
+    int event_head;                     // Position of oldest event not yet popped
+    int num_events;                     // Number of entries used in events, popped ones included
+    int events_cap;                     // Number of entries allocated in events
+
+    uint32_t* fd_ids;                   // Client id for each socket fd or shared ring eventfd, 0 if none
+    int fd_ids_len;                     // Number of entries in fd_ids
+
+    struct pollfd* poll_fds;            // Scratch fd list for poll backend
+    uint32_t* poll_ids;                 // Client id for each entry in poll_fds
+    int poll_cap;                       // Number of entries allocated in poll_fds and poll_ids
+    int num_shm;                        // Clients using shared memory rings
+    Client server;                      // Connection to server, only used by clients
+    int shm_fds[SHM_NUM_FDS];           // Descriptors server passed with its shared ring answer, only used by clients
+    int num_shm_fds;                    // Number of descriptors in shm_fds
+
+    uint32_t* tx_held_ids;              // Clients with frames held back for coalescing
+    int num_tx_held;                    // Number of entries in tx_held_ids
+    int tx_held_cap;                    // Number of entries allocated in tx_held_ids
+    uint32_t* tx_pending_ids;           // Clients with frames for io_uring to send, stale ids are dropped as they are walked
+    int num_tx_pending;                 // Number of entries in tx_pending_ids
+    int tx_pending_cap;                 // Number of entries allocated in tx_pending_ids
+    bool tx_pending_lost;               // A client couldn't be listed, so next loop looks at every client instead
+    int64_t tx_deadline;                // Monotonic time in microseconds held frames must go out by, 0 if none
+    SlowCounters slow;                  // What the slow consumer policy has done so far
+
+    TimerWheel timers;                  // Deferred tasks and heartbeat checks, ticks are monotonic ms
+    Frame* heartbeat;                   // Frame sent to quiet clients, NULL for none
+    Frame* throttle_notice;             // Frame sent to clients going over a rate limit, NULL for none
+    ThrottleCounters throttle;          // What rate limits have done so far, over every client
 
     Packet* packet_queue;               // Incoming Packet Queue
+    Packet* packet_queue_tail;          // Last packet in queue
+    int num_packets;                    // Number of packets in queue
 
     bool verbose;                       // Whether to print errors or not, default to false
 
@@ -67,26 +280,58 @@ typedef struct SocketState {
 
 
 // General functions
-SocketState* sock_get_state(void);                              // Get pointer to global state
-SocketStatus poll_sockets(int timeout);                         // Poll sockets for incoming connections or messages
+SocketConfig* sock_get_config(void);                            // Get pointer to config, modify before starting socket
+SocketStatus poll_sockets(SocketState* connection, int timeout); // Poll sockets for incoming connections or messages, waking early for due tasks
+SocketStatus sock_schedule(SocketState* connection, int delay, TimerFn fn, void* arg, uint64_t data); // Run fn from poll_sockets once delay ms have passed
 void sock_set_verbose(bool verbose);                            // Set verbosity
 
 // Packet Queue Operations
-int num_packets(void);                                          // Check how many messages are in the queue
-Packet* pop_packet(void);                                       // Pop message at top of message queue and return pointer. Ownership passes to caller.
+int num_packets(SocketState* connection);                       // Check how many messages are in the queue
+Packet* pop_packet(SocketState* connection);                    // Pop message at top of message queue and return pointer. Ownership passes to caller.
+Packet* pop_packets(SocketState* connection, int* count);       // Pop every message as a list linked through next_packet. Ownership passes to caller.
+
+// Event Queue Operations
+bool pop_event(SocketState* connection, SockEvent* event);      // Pop oldest client connect or disconnect, false if there are none
+
+// Packet Pool Operations (pool.c)
+Packet* alloc_packet(size_t len);                               // Get packet with room for len bytes from smallest size class that fits
+void free_packet(Packet* packet);                               // Return packet to its size class free list
+void packet_pool_prealloc(int count);                           // Fill every size class free list with count packets
+void packet_pool_clear(void);                                   // Release every packet held on free lists
+
+// Frame Operations
+Frame* alloc_frame(const char* data, size_t num_bytes);         // Build frame with length prefix, caller holds one reference
+Frame* alloc_framev(const struct iovec* iov, int iovcnt);       // Build frame from payload fragments, caller holds one reference
+void release_frame(Frame* frame);                               // Drop a reference, frees frame once the last is gone
 
 // Server Socket Functions
-SocketStatus start_server_socket(const char* port);                             // Start a server on the local host at specified port
-SocketStatus accept_client_socket(void);                                        // Accept any incoming connections, called from server poll
-SocketStatus disconnect_client_socket(uint16_t client_id);                      // Close connection to a client
-SocketStatus flush_inactive_client_sockets(void);                               // Stop tracking all inactive clients
-SocketStatus server_socket_send_packet(uint16_t client_id, const char* data, size_t num_bytes); // Send message from server to client
-SocketStatus server_socket_recv_packet(uint16_t client_id);                     // Receive and unpack a message, store in message queue
-SocketStatus shutdown_server_socket(void);                                      // Shutdown server
+SocketStatus start_server_socket(SocketState* connection, const char* port);    // Start a server on the local host at specified port, and configured Unix path
+SocketStatus init_server_shards(void);                                          // Create inboxes for every configured shard, call before starting any shard
+SocketStatus start_server_shard(SocketState* connection, const char* port, int shard); // Start one server shard, only one thread may use its state from then on
+SocketStatus shard_send_packet(SocketState* connection, int shard, const char* data, size_t num_bytes); // Queue packet on another shard, arrives with sender 0, refused if its inbox is full
+int id_to_shard(SocketState* connection, uint32_t client_id);                   // Get shard that owns client
+SocketStatus accept_client_socket(SocketState* connection);                     // Accept any incoming connections, called from server poll
+SocketStatus disconnect_client_socket(SocketState* connection, uint32_t client_id); // Close connection to a client
+SocketStatus flush_inactive_client_sockets(SocketState* connection);            // Stop tracking clients disconnected since last flush, pop their events first
+SocketStatus server_socket_send_packet(SocketState* connection, uint32_t client_id, const char* data, size_t num_bytes); // Send message from server to client
+SocketStatus server_socket_send_packetv(SocketState* connection, uint32_t client_id, const struct iovec* iov, int iovcnt); // Send message gathered from payload fragments
+SocketStatus server_socket_send_frame(SocketState* connection, uint32_t client_id, Frame* frame); // Queue shared frame for client, without copying it
+SocketStatus server_socket_recv_packet(SocketState* connection, uint32_t client_id); // Receive and unpack a message, store in message queue
+SocketStatus server_socket_udp_session(SocketState* connection, uint32_t client_id, uint16_t* port, uint64_t* token); // Get side channel port and token to hand to a client
+SocketStatus server_socket_set_heartbeat(SocketState* connection, const char* data, size_t num_bytes); // Set message sent to clients that go quiet
+SocketStatus server_socket_set_throttle_notice(SocketState* connection, const char* data, size_t num_bytes); // Set message sent to clients going over a rate limit
+SocketStatus server_socket_throttle_counters(SocketState* connection, uint32_t client_id, ThrottleCounters* counters); // Get what rate limits have done to a client
+bool server_socket_client_active(SocketState* connection, uint32_t client_id); // Check whether client is connected, such as one handed over by predecessor
+SocketStatus server_socket_send_datagram(SocketState* connection, uint32_t client_id, const char* data, size_t num_bytes); // Add message to client's side channel datagram for this tick
+SocketStatus server_socket_handoff(SocketState* connection, const char* state, size_t len); // Hand sockets and caller's state to restarted server, then release everything
+SocketStatus shutdown_server_socket(SocketState* connection);                   // Shutdown server
 
 // Client Socket Functions
-SocketStatus start_client_socket(const char* host, const char* port);           // Start a client and connect to host at specified port
-SocketStatus client_socket_send_packet(const char* data, size_t num_bytes);     // Send message from client to server
-SocketStatus shutdown_client_socket(void);                                      // Shutdown client
+SocketStatus start_client_socket(SocketState* connection, const char* host, const char* port); // Start a client and connect to host at specified port, or unix:<path>
+SocketStatus client_socket_send_packet(SocketState* connection, const char* data, size_t num_bytes); // Send message from client to server
+SocketStatus client_socket_send_packetv(SocketState* connection, const struct iovec* iov, int iovcnt); // Send message gathered from payload fragments
+SocketStatus client_socket_start_udp(SocketState* connection, uint16_t port, uint32_t id, uint64_t token); // Open side channel with session server handed out
+SocketStatus client_socket_send_datagram(SocketState* connection, const char* data, size_t num_bytes); // Send message to server over side channel
+SocketStatus shutdown_client_socket(SocketState* connection);                   // Shutdown client
 
 #endif // SOCK_H
@@ -0,0 +1,170 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "timer.h"
+
+#define TIMER_MASK  (TIMER_SLOTS - 1)
+
+// Ticks a whole level spans
+#define LEVEL_SPAN(level) ((uint64_t)1 << (TIMER_SLOT_BITS * ((level) + 1)))
+
+// Rotate bitmap right, so the bit for slot start lands at bit 0
+static uint64_t rotate(uint64_t bits, unsigned start) {
+
+    start &= TIMER_MASK;
+
+    return start == 0 ? bits : (bits >> start) | (bits << (TIMER_SLOTS - start));
+}
+
+// Add task to the slot of the level its deadline falls in
+static int timer_place(TimerWheel* wheel, const TimerTask* task) {
+
+    uint64_t expires = task->expires;
+    int level = 0;
+
+    while (level < TIMER_LEVELS - 1 && expires - wheel->now >= LEVEL_SPAN(level)) level++;
+
+    // Beyond the top level, wait in its furthest slot and get placed again when that comes round
+    if (expires - wheel->now >= LEVEL_SPAN(level)) expires = wheel->now + LEVEL_SPAN(level) - 1;
+
+    int index = (int)((expires >> (TIMER_SLOT_BITS * level)) & TIMER_MASK);
+    TimerSlot* slot = &wheel->slots[level][index];
+
+    if (slot->num_tasks == slot->cap) {
+        int cap = slot->cap == 0 ? 4 : slot->cap * 2;
+        TimerTask* tasks = realloc(slot->tasks, cap * sizeof(TimerTask));
+        if (tasks == NULL) return -1;
+        slot->tasks = tasks;
+        slot->cap = cap;
+    }
+
+    slot->tasks[slot->num_tasks++] = *task;
+    wheel->occupied[level] |= (uint64_t)1 << index;
+    wheel->num_tasks++;
+
+    return 0;
+}
+
+// Empty slot, handing its tasks to caller, who frees the array
+static TimerTask* timer_take(TimerWheel* wheel, int level, int index, int* num_tasks) {
+
+    TimerSlot* slot = &wheel->slots[level][index];
+    TimerTask* tasks = slot->tasks;
+
+    *num_tasks = slot->num_tasks;
+    wheel->num_tasks -= slot->num_tasks;
+    wheel->occupied[level] &= ~((uint64_t)1 << index);
+    *slot = (TimerSlot){0};
+
+    return tasks;
+}
+
+// Start empty wheel at tick now
+void timer_init(TimerWheel* wheel, uint64_t now) {
+
+    memset(wheel, 0, sizeof *wheel);
+    wheel->now = now;
+}
+
+// Release every slot, dropping waiting tasks
+void timer_free(TimerWheel* wheel) {
+
+    for (int level = 0; level < TIMER_LEVELS; level++) {
+        for (int index = 0; index < TIMER_SLOTS; index++) free(wheel->slots[level][index].tasks);
+    }
+
+    memset(wheel, 0, sizeof *wheel);
+}
+
+// Run fn at tick expires, or at the next tick if that has already passed
+// Return -1 on failure
+int timer_add(TimerWheel* wheel, uint64_t expires, TimerFn fn, void* arg, uint64_t data) {
+
+    TimerTask task = {.expires = expires > wheel->now ? expires : wheel->now + 1, .fn = fn, .arg = arg, .data = data};
+
+    return timer_place(wheel, &task);
+}
+
+// Get first tick after now when a slot of level has to be processed, UINT64_MAX if level is empty
+static uint64_t level_next(const TimerWheel* wheel, int level) {
+
+    if (wheel->occupied[level] == 0) return UINT64_MAX;
+
+    unsigned shift = TIMER_SLOT_BITS * level;
+    uint64_t position = wheel->now >> shift;
+
+    // Slot for position + 1 comes round next, and the one for position itself only after a full turn
+    uint64_t bits = rotate(wheel->occupied[level], (unsigned)(position + 1));
+    uint64_t distance = (uint64_t)__builtin_ctzll(bits) + 1;
+
+    return (position + distance) << shift;
+}
+
+// Ticks until wheel next has work, -1 if empty
+// That may be before the earliest task is due, when a higher level has tasks to move down first
+int64_t timer_next(const TimerWheel* wheel) {
+
+    uint64_t next = UINT64_MAX;
+
+    if (wheel->num_tasks == 0) return -1;
+
+    for (int level = 0; level < TIMER_LEVELS; level++) {
+        uint64_t tick = level_next(wheel, level);
+        if (tick < next) next = tick;
+    }
+
+    return (int64_t)(next - wheel->now);
+}
+
+// Move tasks of every level that wrapped round at this tick one or more levels down, highest first
+static void timer_cascade(TimerWheel* wheel) {
+
+    int top = 0;
+    while (top < TIMER_LEVELS - 1 && (wheel->now & (LEVEL_SPAN(top) - 1)) == 0) top++;
+
+    for (int level = top; level > 0; level--) {
+
+        int num_tasks;
+        int index = (int)((wheel->now >> (TIMER_SLOT_BITS * level)) & TIMER_MASK);
+        if (!(wheel->occupied[level] & ((uint64_t)1 << index))) continue;
+
+        TimerTask* tasks = timer_take(wheel, level, index, &num_tasks);
+
+        // Only fails out of memory, and a lost task is no worse than a lost timer
+        for (int i = 0; i < num_tasks; i++) timer_place(wheel, &tasks[i]);
+        free(tasks);
+    }
+}
+
+// Run every task due up to tick now, return number run
+// Empty stretches are skipped over, so a long gap costs no more than the slots holding tasks
+int timer_advance(TimerWheel* wheel, uint64_t now) {
+
+    int num_run = 0;
+
+    while (wheel->now < now) {
+
+        int64_t next = timer_next(wheel);
+        if (next < 0 || wheel->now + (uint64_t)next > now) {
+            wheel->now = now;
+            break;
+        }
+
+        wheel->now += (uint64_t)next;
+        timer_cascade(wheel);
+
+        // Tasks may add more while they run, so take the slot first
+        int num_tasks;
+        int index = (int)(wheel->now & TIMER_MASK);
+        if (!(wheel->occupied[0] & ((uint64_t)1 << index))) continue;
+
+        TimerTask* tasks = timer_take(wheel, 0, index, &num_tasks);
+        for (int i = 0; i < num_tasks; i++) tasks[i].fn(tasks[i].arg, tasks[i].data);
+        free(tasks);
+
+        num_run += num_tasks;
+    }
+
+    return num_run;
+}
@@ -0,0 +1,43 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define TIMER_SLOT_BITS     (6)
+#define TIMER_SLOTS         (1 << TIMER_SLOT_BITS)      // Slots in each level of the wheel
+#define TIMER_LEVELS        (4)                         // Levels cover 64^4 ticks, about 4.6 hours of ms, later ones wait at the top
+
+typedef void (*TimerFn)(void* arg, uint64_t data);
+
+// Task due at a tick, timers are stored by value so owners can move without unlinking them
+// There is no cancel, owners check whether the task still applies when it runs
+typedef struct TimerTask {
+    uint64_t expires;                   // Tick task runs at
+    TimerFn fn;
+    void* arg;
+    uint64_t data;
+} TimerTask;
+
+typedef struct TimerSlot {
+    TimerTask* tasks;
+    int num_tasks;
+    int cap;
+} TimerSlot;
+
+// Hierarchical timing wheel, level 0 holds tasks due within 64 ticks and each level above 64 times further out
+// Tasks move down a level each time the level below wraps round to their slot
+typedef struct TimerWheel {
+    uint64_t now;                       // Last tick processed
+    int num_tasks;                      // Tasks waiting across every level
+    uint64_t occupied[TIMER_LEVELS];    // Bit for each slot holding any task
+    TimerSlot slots[TIMER_LEVELS][TIMER_SLOTS];
+} TimerWheel;
+
+void timer_init(TimerWheel* wheel, uint64_t now);                   // Start empty wheel at tick now
+void timer_free(TimerWheel* wheel);                                 // Release every slot, dropping waiting tasks
+int timer_add(TimerWheel* wheel, uint64_t expires, TimerFn fn, void* arg, uint64_t data);  // Run fn at tick expires, or next tick if that has passed, return -1 on failure
+int timer_advance(TimerWheel* wheel, uint64_t now);                 // Run every task due up to tick now, return number run
+int64_t timer_next(const TimerWheel* wheel);                        // Ticks until wheel next has work, -1 if empty
+
+#endif // TIMER_H
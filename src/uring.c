@@ -0,0 +1,217 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+// No liburing dependency, so wrap the raw system calls
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params* params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void* arg, size_t arg_size) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void* arg, unsigned num_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, num_args);
+}
+
+// Publish prepared sqes to kernel, return number waiting to be submitted
+static unsigned uring_publish(Uring* ring) {
+
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+
+    return ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+}
+
+// Create ring and map queues, return -1 on failure
+int uring_init(Uring* ring, unsigned entries, unsigned cq_entries) {
+
+    struct io_uring_params params = {0};
+
+    memset(ring, 0, sizeof *ring);
+
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = cq_entries;
+
+    ring->fd = sys_io_uring_setup(entries, &params);
+    if (ring->fd < 0) return -1;
+
+    // Map submission ring, completion ring, and sqe array
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        uring_exit(ring);
+        return -1;
+    }
+
+    ring->sq_head = (unsigned*)((char*)ring->sq_ring + params.sq_off.head);
+    ring->sq_tail = (unsigned*)((char*)ring->sq_ring + params.sq_off.tail);
+    ring->sq_mask = (unsigned*)((char*)ring->sq_ring + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)((char*)ring->sq_ring + params.sq_off.array);
+    ring->sq_entries = params.sq_entries;
+    ring->sq_local_tail = *ring->sq_tail;
+
+    ring->cq_head = (unsigned*)((char*)ring->cq_ring + params.cq_off.head);
+    ring->cq_tail = (unsigned*)((char*)ring->cq_ring + params.cq_off.tail);
+    ring->cq_mask = (unsigned*)((char*)ring->cq_ring + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)((char*)ring->cq_ring + params.cq_off.cqes);
+
+    return 0;
+}
+
+// Unmap queues and close ring
+void uring_exit(Uring* ring) {
+
+    if (ring->buf_ring != NULL && ring->buf_ring != MAP_FAILED) munmap(ring->buf_ring, ring->buf_ring_size);
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != NULL && ring->cq_ring != MAP_FAILED) munmap(ring->cq_ring, ring->cq_ring_size);
+    if (ring->sq_ring != NULL && ring->sq_ring != MAP_FAILED) munmap(ring->sq_ring, ring->sq_ring_size);
+    if (ring->fd >= 0) close(ring->fd);
+
+    free(ring->bufs);
+
+    memset(ring, 0, sizeof *ring);
+    ring->fd = -1;
+}
+
+// Get zeroed sqe, flushes queue to kernel if it is full
+// Returns NULL if the queue is still full after flushing
+struct io_uring_sqe* uring_get_sqe(Uring* ring) {
+
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+    if (ring->sq_local_tail - head >= ring->sq_entries) {
+        sys_io_uring_enter(ring->fd, uring_publish(ring), 0, 0, NULL, 0);
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        if (ring->sq_local_tail - head >= ring->sq_entries) return NULL;
+    }
+
+    unsigned index = ring->sq_local_tail & *ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof *sqe);
+    ring->sq_array[index] = index;
+    ring->sq_local_tail++;
+
+    return sqe;
+}
+
+// Submit prepared sqes and wait up to timeout ms for a completion, all in one system call
+// Negative timeout waits forever, zero timeout only submits
+int uring_submit_and_wait(Uring* ring, int timeout) {
+
+    struct __kernel_timespec ts = {0};
+    struct io_uring_getevents_arg arg = {0};
+    unsigned to_submit = uring_publish(ring);
+    unsigned wait_nr = 0;
+    unsigned flags = 0;
+    int status;
+
+    // Only wait if nothing has completed yet
+    if (timeout != 0 && uring_peek_cqe(ring) == NULL) {
+        wait_nr = 1;
+        flags |= IORING_ENTER_GETEVENTS;
+        if (timeout > 0) {
+            ts.tv_sec = timeout / 1000;
+            ts.tv_nsec = (long long)(timeout % 1000) * 1000000;
+            arg.ts = (uint64_t)(uintptr_t)&ts;
+            flags |= IORING_ENTER_EXT_ARG;
+        }
+    }
+
+    if (to_submit == 0 && wait_nr == 0) return 0;
+
+    if (flags & IORING_ENTER_EXT_ARG) {
+        status = sys_io_uring_enter(ring->fd, to_submit, wait_nr, flags, &arg, sizeof arg);
+    } else {
+        status = sys_io_uring_enter(ring->fd, to_submit, wait_nr, flags, NULL, 0);
+    }
+
+    // Timeouts, signals, and a full completion queue are retried next call
+    if (status < 0 && (errno == ETIME || errno == EINTR || errno == EAGAIN || errno == EBUSY)) return 0;
+
+    return status < 0 ? -1 : 0;
+}
+
+// Get next completion, or NULL if there are none
+struct io_uring_cqe* uring_peek_cqe(Uring* ring) {
+
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+    if (head == tail) return NULL;
+
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+// Mark completion returned by peek as consumed
+void uring_cqe_seen(Uring* ring) {
+
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+// Register a ring of provided receive buffers, count must be a power of two
+int uring_setup_buffers(Uring* ring, unsigned count, unsigned size, uint16_t group) {
+
+    struct io_uring_buf_reg reg = {0};
+
+    ring->buf_ring_size = count * sizeof(struct io_uring_buf);
+    ring->buf_ring = mmap(NULL, ring->buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->buf_ring == MAP_FAILED) {
+        ring->buf_ring = NULL;
+        return -1;
+    }
+
+    ring->bufs = malloc((size_t)count * size);
+    if (ring->bufs == NULL) return -1;
+
+    reg.ring_addr = (uint64_t)(uintptr_t)ring->buf_ring;
+    reg.ring_entries = count;
+    reg.bgid = group;
+
+    if (sys_io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) return -1;
+
+    ring->buf_count = count;
+    ring->buf_size = size;
+    ring->buf_group = group;
+
+    // Hand every buffer to the kernel
+    for (unsigned i = 0; i < count; i++) {
+        uring_recycle_buffer(ring, (uint16_t)i);
+    }
+
+    return 0;
+}
+
+// Get pointer to provided buffer
+char* uring_buffer(const Uring* ring, uint16_t bid) {
+
+    return ring->bufs + (size_t)bid * ring->buf_size;
+}
+
+// Hand provided buffer back to kernel
+void uring_recycle_buffer(Uring* ring, uint16_t bid) {
+
+    uint16_t tail = ring->buf_ring->tail;
+    struct io_uring_buf* buf = &ring->buf_ring->bufs[tail & (ring->buf_count - 1)];
+
+    buf->addr = (uint64_t)(uintptr_t)uring_buffer(ring, bid);
+    buf->len = ring->buf_size;
+    buf->bid = bid;
+
+    __atomic_store_n(&ring->buf_ring->tail, (uint16_t)(tail + 1), __ATOMIC_RELEASE);
+}
@@ -0,0 +1,55 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <linux/io_uring.h>
+
+typedef struct Uring {
+
+    int fd;                             // io_uring file descriptor
+
+    // Submission queue
+    unsigned* sq_head;                  // Consumed by kernel
+    unsigned* sq_tail;                  // Produced by us
+    unsigned* sq_mask;
+    unsigned* sq_array;                 // Indirection array into sqes
+    unsigned sq_entries;
+    unsigned sq_local_tail;             // Tail of sqes prepared but not yet published
+    struct io_uring_sqe* sqes;
+
+    // Completion queue
+    unsigned* cq_head;                  // Consumed by us
+    unsigned* cq_tail;                  // Produced by kernel
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+
+    // Mapped regions, kept for unmapping
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+
+    // Provided buffer ring used for receives
+    struct io_uring_buf_ring* buf_ring;
+    size_t buf_ring_size;
+    char* bufs;                         // Backing memory for all provided buffers
+    unsigned buf_count;                 // Number of buffers, power of two
+    unsigned buf_size;                  // Size of each buffer
+    uint16_t buf_group;                 // Buffer group id passed with recv requests
+
+} Uring;
+
+int uring_init(Uring* ring, unsigned entries, unsigned cq_entries);                     // Create ring and map queues, return -1 on failure
+void uring_exit(Uring* ring);                                                           // Unmap queues and close ring
+struct io_uring_sqe* uring_get_sqe(Uring* ring);                                        // Get zeroed sqe, flushes queue to kernel if it is full
+int uring_submit_and_wait(Uring* ring, int timeout);                                    // Submit prepared sqes and wait up to timeout ms for a completion
+struct io_uring_cqe* uring_peek_cqe(Uring* ring);                                       // Get next completion, or NULL if there are none
+void uring_cqe_seen(Uring* ring);                                                       // Mark completion returned by peek as consumed
+int uring_setup_buffers(Uring* ring, unsigned count, unsigned size, uint16_t group);     // Register a ring of provided receive buffers
+char* uring_buffer(const Uring* ring, uint16_t bid);                                    // Get pointer to provided buffer
+void uring_recycle_buffer(Uring* ring, uint16_t bid);                                   // Hand provided buffer back to kernel
+
+#endif // URING_H
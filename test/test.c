@@ -2,9 +2,18 @@
 #include <string.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
 
 #include "../src/sock.h"
 #include "../src/chat.h"
+#include "../src/shm.h"
+#include "../src/crypt.h"
+#include "../src/timer.h"
+#include "../src/handoff.h"
 
 void print_buffer(char* buffer, size_t num_bytes) {
     for (size_t i = 0; i < num_bytes; i++) {
@@ -100,10 +109,12 @@ bool serial_deserial_active_msg_test(bool verbose, int num_users) {
     msg.header.from = 777;
     msg.header.to = 80;
 
+    msg.total_users = num_users + 70000;
+    msg.offset = 70000;
     msg.num_users = num_users;
 
     for (int i = 0; i < msg.num_users; i++) {
-        msg.ids[i] = i + 10000;
+        msg.ids[i] = i + 10000000;
         strncpy(msg.usernames[i],"Abcdefghijklmnopqrstuvwxyz",(i < MAX_USERNAME_LEN ? i : MAX_USERNAME_LEN));
     }
 
@@ -125,6 +136,8 @@ bool serial_deserial_active_msg_test(bool verbose, int num_users) {
         printf("'Type' Before: %d After: %d\n", msg.header.type, out->header.type);
         printf("'From' Before: %d After: %d\n", msg.header.from, out->header.from);
         printf("'To' Before: %d After: %d\n", msg.header.to, out->header.to);
+        printf("'total_users' Before: %d After: %d\n", msg.total_users, out->total_users);
+        printf("'offset' Before: %d After: %d\n", msg.offset, out->offset);
         printf("'num_users' Before: %d After: %d\n", msg.num_users, out->num_users);
         printf("First 'id' Before: %d After: %d\n", msg.ids[0], out->ids[0]);
         printf("First 'username' Before: %s After: %s\n", msg.usernames[0], out->usernames[0]);
@@ -519,46 +532,1492 @@ bool corrupt_deserial_invalid_type_test(bool verbose) {
 
 
 
-int main(int argc, char* argv[]) {
+bool serial_deserial_udp_session_msg_test(bool verbose) {
 
-    int verbose = false;
+    // Create message
+    UdpSessionMessage msg = {0};
+    msg.header.type = MSG_UDP_SESSION;
+    msg.header.from = 0;
+    msg.header.to = 1048577;
 
+    msg.port = 40000;
+    msg.token = 0x0123456789abcdefULL;
 
-    if (argc == 2) {
-        if (strcmp("-v",argv[1]) == 0) {
-            verbose = true;
-        } else if (strcmp("-h",argv[1]) == 0) {
-            printf("run_test [-v] - Run Serial/Deserial Test Cases");
-        }else {
-            printf("Invalid option. See -h for help.");
+    char* buffer;
+    int num_bytes = serialize_msg((MessageHeader*)&msg, &buffer);
+    if (num_bytes <= 0) return false;
+
+    msg.header.len = num_bytes; // Message length is calculated and packed by the serialization function
+
+    UdpSessionMessage* out = (UdpSessionMessage*)deserialize_msg(buffer, num_bytes);
+    MessageView view;
+    int status = view_msg(buffer, num_bytes, &view);
+
+    if (verbose) {
+        printf("--------------------------------\n");
+        print_buffer(buffer, num_bytes);
+        printf("'Port' Before: %d After: %d\n", msg.port, out != NULL ? out->port : 0);
+        printf("'Token' Before: %llx View: %llx\n", (unsigned long long)msg.token, (unsigned long long)view.token);
+    }
+
+    // Both decoders must agree with what was sent
+    bool match = out != NULL && memcmp(&msg, out, sizeof(UdpSessionMessage)) == 0 &&
+                 status == 0 && view.port == msg.port && view.token == msg.token;
+
+    free(buffer);
+    free(out);
+
+    return match;
+}
+
+bool view_user_msg_test(bool verbose, char* username) {
+
+    // Create message
+    UserMessage msg = {0};
+    msg.header.type = MSG_USER_SETNAME;
+    msg.header.from = 1;
+    msg.header.to = 65535;
+    msg.id = 1048577;
+    strncpy(msg.username, username, MAX_USERNAME_LEN);
+
+    char* buffer;
+    int num_bytes = serialize_msg((MessageHeader*)&msg, &buffer);
+    if (num_bytes <= 0) return false;
+
+    MessageView view;
+    int status = view_msg(buffer, num_bytes, &view);
+
+    if (verbose) {
+        printf("\n--------------------------------\n");
+        print_buffer(buffer, num_bytes);
+        printf("'Id' Before: %d After: %d\n", msg.id, view.id);
+        printf("'Username' Before: %s After: %s\n", msg.username, status == 0 ? view.text : "");
+    }
+
+    // Text must be borrowed from the buffer, not copied
+    bool match = status == 0 && view.header.type == msg.header.type && view.header.len == num_bytes &&
+                 view.header.from == msg.header.from && view.header.to == msg.header.to && view.id == msg.id &&
+                 view.text > buffer && view.text < buffer + num_bytes && strcmp(view.text, msg.username) == 0;
+
+    free(buffer);
+
+    return match;
+}
+
+bool corrupt_view_chat_msg_test(bool verbose) {
+
+    (void) verbose; // Ignore compiler warnings
+
+    // Create message
+    ChatMessage msg = {0};
+    msg.header.type = MSG_CHAT;
+    strncpy(msg.msg, "Test", MAX_CHATMSG_LEN);
+
+    char* buffer;
+    int num_bytes = serialize_msg((MessageHeader*)&msg, &buffer);
+    if (num_bytes <= 0) return false;
+
+    // Overwrite last null byte
+    buffer[num_bytes - 1] = 'A';
+
+    // Confirm view fails gracefully
+    MessageView view;
+    bool failed = view_msg(buffer, num_bytes, &view) == -1;
+
+    free(buffer);
+
+    return failed;
+}
+
+bool packet_pool_reuse_test(bool verbose, size_t len) {
+
+    Packet* first = alloc_packet(len);
+    if (first == NULL) return false;
+
+    // Packet must hold len bytes
+    memset(first->data, 0xAB, len);
+
+    // Freed packet should be handed back for a packet of the same size class
+    free_packet(first);
+    Packet* second = alloc_packet(len);
+
+    if (verbose) {
+        printf("--------------------------------\n");
+        printf("Packet Len: %zu Class: %d First: %p Second: %p\n", len, second == NULL ? -1 : second->size_class, (void*)first, (void*)second);
+    }
+
+    bool match = second == first && second->len == 0 && second->next_packet == NULL;
+
+    free_packet(second);
+    packet_pool_clear();
+
+    return match;
+}
+
+bool packet_pool_oversize_test(bool verbose) {
+
+    (void) verbose; // Ignore compiler warnings
+
+    Packet* packet = alloc_packet(MAX_MESSAGE_LEN + 1);
+
+    // Confirm oversized packet fails gracefully
+    if (packet == NULL) {
+        return true;
+    } else {
+        free_packet(packet);
+        return false;
+    }
+}
+
+bool frame_prefix_test(bool verbose, size_t len) {
+
+    char* payload = malloc(len + 1);
+    if (payload == NULL) return false;
+    memset(payload, 0xCD, len + 1);
+
+    Frame* frame = alloc_frame(payload, len);
+    if (frame == NULL) {
+        free(payload);
+        return false;
+    }
+
+    if (verbose) {
+        printf("--------------------------------\n");
+        printf("Frame Len: %zu Refs: %d Prefix: %x %x\n", frame->len, frame->refs, (uint8_t)frame->data[0], (uint8_t)frame->data[1]);
+    }
+
+    // Frame must be prefixed with payload length, big endian
+    bool match = frame->refs == 1 && frame->len == len + 2 &&
+                 (uint8_t)frame->data[0] == (len >> 8) && (uint8_t)frame->data[1] == (len & 0xFF) &&
+                 memcmp(frame->data + 2, payload, len) == 0;
+
+    release_frame(frame);
+    free(payload);
+
+    // Confirm oversized frame fails gracefully
+    return match && alloc_frame("", MAX_MESSAGE_LEN + 1) == NULL;
+}
+
+bool frame_gather_test(bool verbose) {
+
+    char head[] = "head";
+    char body[] = "body";
+    struct iovec iov[3] = {{head, 4}, {NULL, 0}, {body, 5}};
+
+    Frame* frame = alloc_framev(iov, 3);
+    if (frame == NULL) return false;
+
+    if (verbose) {
+        printf("--------------------------------\n");
+        print_buffer(frame->data, frame->len);
+    }
+
+    // Fragments must be joined in order behind a single prefix
+    bool match = frame->len == 11 && frame->data[0] == 0 && frame->data[1] == 9 &&
+                 memcmp(frame->data + 2, "headbody", 9) == 0;
+
+    release_frame(frame);
+
+    // Confirm fragments adding up to an oversized message fail gracefully
+    struct iovec big[2] = {{head, MAX_MESSAGE_LEN}, {body, 1}};
+
+    return match && alloc_framev(big, 2) == NULL;
+}
+
+// Create a pair of shared rings, and attach a second view to them as the peer would
+static bool shm_pair(ShmLink* creator, ShmLink* peer) {
+
+    int fds[SHM_NUM_FDS];
+
+    if (shm_create(creator, fds) != 0) return false;
+
+    // Peer takes ownership of what it is handed, so give it copies of the creator's descriptors
+    int peer_fds[SHM_NUM_FDS] = {dup(fds[0]), dup(fds[1]), dup(fds[2])};
+
+    return shm_attach(peer, peer_fds) == 0;
+}
+
+bool shm_ring_test(bool verbose) {
+
+    ShmLink creator, peer;
+    char data[] = "ring data";
+    struct iovec iov[2] = {{data, 5}, {data + 5, 5}};
+    const char* read;
+    size_t len = 0;
+
+    if (!shm_pair(&creator, &peer)) return false;
+
+    // Bytes written by one side come out of the other, and not back out of the writer
+    bool match = shm_write(&creator, iov, 2) == 10 && shm_peek(&creator, &len) == NULL;
+    read = shm_peek(&peer, &len);
+    match = match && read != NULL && len == 10 && memcmp(read, data, 10) == 0;
+
+    if (verbose && read != NULL) {
+        printf("--------------------------------\n");
+        print_buffer((char*)read, len);
+    }
+
+    shm_consume(&peer, len);
+    match = match && shm_peek(&peer, &len) == NULL;
+
+    shm_close(&peer);
+    shm_close(&creator);
+
+    return match;
+}
+
+bool shm_wrap_test(bool verbose) {
+
+    ShmLink creator, peer;
+    char* big = malloc(SHM_RING_SIZE + 100);
+    struct iovec iov = {big, SHM_RING_SIZE + 100};
+    const char* read;
+    size_t len = 0;
+
+    if (big == NULL) return false;
+    for (size_t i = 0; i < SHM_RING_SIZE + 100; i++) big[i] = (char)(i % 251);
+
+    if (!shm_pair(&creator, &peer)) {
+        free(big);
+        return false;
+    }
+
+    // A full ring takes what fits, and the rest wraps around once peer makes room
+    bool match = shm_write(&creator, &iov, 1) == SHM_RING_SIZE;
+    read = shm_peek(&peer, &len);
+    match = match && read != NULL && len == SHM_RING_SIZE && memcmp(read, big, SHM_RING_SIZE) == 0;
+    shm_consume(&peer, 1000);
+
+    iov.iov_base = big + SHM_RING_SIZE;
+    iov.iov_len = 100;
+    match = match && shm_write(&creator, &iov, 1) == 100;
+
+    // Readable bytes come back in two pieces, up to the end of the ring and then from its start
+    read = shm_peek(&peer, &len);
+    match = match && read != NULL && len == SHM_RING_SIZE - 1000 && memcmp(read, big + 1000, len) == 0;
+    shm_consume(&peer, len);
+    read = shm_peek(&peer, &len);
+    match = match && read != NULL && len == 100 && memcmp(read, big + SHM_RING_SIZE, 100) == 0;
+
+    if (verbose && read != NULL) {
+        printf("--------------------------------\n");
+        print_buffer((char*)read, len);
+    }
+
+    shm_close(&peer);
+    shm_close(&creator);
+    free(big);
+
+    return match;
+}
+
+// Run handshake between two sessions, as connecting client and accepting server
+// Server signs with a fresh long-term key, which client pins
+bool crypt_pair(CryptSession* client, CryptSession* server) {
+
+    char hex[CRYPT_FINGERPRINT_HEX];
+
+    struct evp_pkey_st* identity = crypt_load_identity(NULL);
+    if (identity == NULL) return false;
+
+    if (crypt_fingerprint(identity, hex) != 0 || crypt_init(client, true) != 0) {
+        crypt_free_identity(identity);
+        return false;
+    }
+    if (crypt_init(server, false) != 0) {
+        crypt_free(client);
+        crypt_free_identity(identity);
+        return false;
+    }
+
+    // Both hellos are read through the record length, like they are off the wire
+    bool ready = crypt_pin(client, hex) == 0 && crypt_sign_hello(server, identity) == 0 &&
+                 crypt_record_len(server, client->hello, CRYPT_HELLO_LEN) == CRYPT_HELLO_LEN &&
+                 crypt_record_len(client, server->hello, CRYPT_HELLO_LEN) == CRYPT_SIGNED_HELLO_LEN &&
+                 crypt_finish(server, client->hello) == 0 && crypt_finish(client, server->hello) == 0;
+    if (!ready) {
+        crypt_free(client);
+        crypt_free(server);
+    }
+    crypt_free_identity(identity);
+
+    return ready;
+}
+
+// Client refuses a server hello that was tampered with, signed by another key, or that it has no pin for
+bool crypt_handshake_test(bool verbose) {
+
+    CryptSession client = {0}, server = {0};
+    char hex[CRYPT_FINGERPRINT_HEX];
+    char other[CRYPT_FINGERPRINT_HEX];
+    char tampered[CRYPT_SIGNED_HELLO_LEN];
+    bool match = true;
+
+    struct evp_pkey_st* identity = crypt_load_identity(NULL);
+    struct evp_pkey_st* impostor = crypt_load_identity(NULL);
+    if (identity == NULL || impostor == NULL) {
+        crypt_free_identity(identity);
+        crypt_free_identity(impostor);
+        return false;
+    }
+    match = crypt_fingerprint(identity, hex) == 0 && crypt_fingerprint(impostor, other) == 0;
+
+    // Swapped ephemeral key, flipped signature, key that isn't pinned, and no pin at all
+    for (int i = 0; i < 4 && match; i++) {
+        match = crypt_init(&client, true) == 0 && crypt_init(&server, false) == 0 &&
+                crypt_sign_hello(&server, i == 2 ? impostor : identity) == 0 && (i == 3 || crypt_pin(&client, hex) == 0);
+
+        memcpy(tampered, server.hello, sizeof tampered);
+        if (i == 0) tampered[CRYPT_HELLO_LEN - 1] ^= 1;
+        if (i == 1) tampered[CRYPT_SIGNED_HELLO_LEN - 1] ^= 1;
+
+        match = match && crypt_finish(&client, tampered) == -1 && !client.ready;
+
+        if (verbose) {
+            printf("--------------------------------\n");
+            print_buffer(tampered, sizeof tampered);
         }
-        
-    } else if (argc > 2) {
-        printf("Invalid number of arguments. See -h for help.");
+
+        crypt_free(&client);
+        crypt_free(&server);
     }
 
-    printf("PingMessage Test 1: %s\n", serial_deserial_ping_msg_test(verbose) ? "PASS" : "FAIL");
-    printf("UserMessage Test 1: %s\n", serial_deserial_user_msg_test(verbose, "Alex") ? "PASS" : "FAIL");
-    printf("UserMessage Test 2: %s\n", serial_deserial_user_msg_test(verbose, "") ? "PASS" : "FAIL");
-    printf("UserMessage Test 3: %s\n", serial_deserial_user_msg_test(verbose, "AReallyLongNameLikeThis") ? "PASS" : "FAIL");
-    printf("ActiveUserMessage Test 1: %s\n", serial_deserial_active_msg_test(verbose, 0) ? "PASS" : "FAIL");
-    printf("ActiveUserMessage Test 2: %s\n", serial_deserial_active_msg_test(verbose, 10) ? "PASS" : "FAIL");
-    printf("ActiveUserMessage Test 3: %s\n", serial_deserial_active_msg_test(verbose, MAX_CLIENTS) ? "PASS" : "FAIL");
-    printf("ChatMessage Test 1: %s\n", serial_deserial_chat_msg_test(verbose, "Test Message 1") ? "PASS" : "FAIL");
-    printf("ChatMessage Test 2: %s\n", serial_deserial_chat_msg_test(verbose, "") ? "PASS" : "FAIL");
-    printf("ChatMessage Test 3: %s\n", serial_deserial_chat_msg_test(verbose, "A very long message that exceeds the maximum message length. This message needs to exceed the 256 character limit, so it will go on and on and on and on and on and on and on and on. Its still not quite long enough though, so it will keep going on and on and on.") ? "PASS" : "FAIL");
-    printf("ErrorMessage Test 1: %s\n", serial_deserial_err_msg_test(verbose, "Test Message 1") ? "PASS" : "FAIL");
-    printf("ErrorMessage Test 2: %s\n", serial_deserial_err_msg_test(verbose, "") ? "PASS" : "FAIL");
-    printf("ErrorMessage Test 3: %s\n", serial_deserial_err_msg_test(verbose, "A very long message that exceeds the maximum message length. This message needs to exceed the 256 character limit, so it will go on and on and on and on and on and on and on and on. Its still not quite long enough though, so it will keep going on and on and on.") ? "PASS" : "FAIL");
-    printf("Corrupt Message Serialization 1: %s\n", corrupt_serial_user_msg_test(verbose) ? "PASS" : "FAIL");  
-    printf("Corrupt Message Serialization 2: %s\n", corrupt_serial_active_user_msg_test(verbose) ? "PASS" : "FAIL");    
-    printf("Corrupt Message Serialization 3: %s\n", corrupt_serial_chat_msg_test(verbose) ? "PASS" : "FAIL");
-    printf("Corrupt Message Serialization 4: %s\n", corrupt_serial_err_msg_test(verbose) ? "PASS" : "FAIL");
-    printf("Corrupt Message Serialization 5: %s\n", corrupt_serial_invalid_type_test(verbose) ? "PASS" : "FAIL");
-    printf("Corrupt Message Deserialization 1: %s\n", corrupt_deserial_user_msg_test(verbose) ? "PASS" : "FAIL");  
-    printf("Corrupt Message Deserialization 2: %s\n", corrupt_deserial_active_user_msg_test(verbose) ? "PASS" : "FAIL");    
-    printf("Corrupt Message Deserialization 3: %s\n", corrupt_deserial_chat_msg_test(verbose) ? "PASS" : "FAIL");
-    printf("Corrupt Message Deserialization 4: %s\n", corrupt_deserial_err_msg_test(verbose) ? "PASS" : "FAIL");
-    printf("Corrupt Message Deserialization 5: %s\n", corrupt_deserial_invalid_type_test(verbose) ? "PASS" : "FAIL");
+    // Malformed fingerprints are turned away before anything is sent
+    match = match && crypt_init(&client, true) == 0 && crypt_pin(&client, "00") == -1 && crypt_pin(&client, other) == 0;
+    hex[0] = 'x';
+    match = match && crypt_pin(&client, hex) == -1;
+    crypt_free(&client);
+
+    crypt_free_identity(identity);
+    crypt_free_identity(impostor);
+
+    return match;
+}
+
+// Key made at a path is kept there, so the fingerprint clients pin lasts across restarts
+bool crypt_identity_file_test(bool verbose) {
+
+    const char* path = "/tmp/chat_test_identity.pem";
+    char first[CRYPT_FINGERPRINT_HEX];
+    char second[CRYPT_FINGERPRINT_HEX];
+
+    unlink(path);
+
+    struct evp_pkey_st* identity = crypt_load_identity(path);
+    bool match = identity != NULL && crypt_fingerprint(identity, first) == 0;
+    crypt_free_identity(identity);
+
+    identity = crypt_load_identity(path);
+    match = match && identity != NULL && crypt_fingerprint(identity, second) == 0 && strcmp(first, second) == 0;
+    crypt_free_identity(identity);
+
+    if (verbose) {
+        printf("--------------------------------\n");
+        printf("Fingerprint: %s\n", first);
+    }
+
+    unlink(path);
+
+    return match;
+}
+
+bool crypt_record_test(bool verbose) {
+
+    CryptSession client, server;
+    char first[] = "Frame one";
+    char second[] = "Frame two, a little longer";
+    struct iovec iov[2] = {{first, sizeof first}, {second, sizeof second}};
+    char record[CRYPT_RECORD_LEN(sizeof first + sizeof second)];
+    char copy[sizeof record];
+
+    if (!crypt_pair(&client, &server)) return false;
+
+    // Several frames go into one record, and come out in order on the other side
+    size_t len = crypt_seal(&client, iov, 2, record);
+    memcpy(copy, record, len);
+    bool match = len == sizeof record && crypt_record_len(&server, record, len) == (ssize_t)len;
+    match = match && crypt_open(&server, record, len) == sizeof first + sizeof second &&
+            memcmp(record + CRYPT_HEADER_LEN, first, sizeof first) == 0 &&
+            memcmp(record + CRYPT_HEADER_LEN + sizeof first, second, sizeof second) == 0;
+
+    if (verbose) {
+        printf("--------------------------------\n");
+        print_buffer(copy, len);
+    }
+
+    // Same record again is out of sequence, and a flipped bit fails on its own
+    match = match && crypt_open(&server, copy, len) == -1;
+    len = crypt_seal(&server, iov, 1, record);
+    record[CRYPT_HEADER_LEN] ^= 1;
+    match = match && len > 0 && crypt_open(&client, record, len) == -1;
+
+    crypt_free(&client);
+    crypt_free(&server);
+
+    return match;
+}
+
+bool crypt_datagram_test(bool verbose) {
+
+    CryptSession client, server;
+    char payload[] = "Ping";
+    char datagram[CRYPT_SEQ_LEN + sizeof payload + CRYPT_TAG_LEN];
+    char copy[sizeof datagram];
+
+    if (!crypt_pair(&client, &server)) return false;
+
+    memcpy(datagram + CRYPT_SEQ_LEN, payload, sizeof payload);
+    size_t len = crypt_seal_datagram(&client, datagram, sizeof payload);
+    memcpy(copy, datagram, len);
+
+    if (verbose) {
+        printf("--------------------------------\n");
+        print_buffer(datagram, len);
+    }
+
+    // Datagram opens once, a replay of it doesn't
+    bool match = len == sizeof datagram && crypt_open_datagram(&server, datagram, len) == sizeof payload &&
+                 memcmp(datagram + CRYPT_SEQ_LEN, payload, sizeof payload) == 0;
+    match = match && crypt_open_datagram(&server, copy, len) == -1;
+
+    // Datagram keys differ by direction, so one can't be reflected back at its sender
+    memcpy(datagram + CRYPT_SEQ_LEN, payload, sizeof payload);
+    len = crypt_seal_datagram(&client, datagram, sizeof payload);
+    match = match && crypt_open_datagram(&client, datagram, len) == -1;
+
+    crypt_free(&client);
+    crypt_free(&server);
+
+    return match;
+}
+
+// Session carried over by export and import picks up where it was, in the handshake or after it
+bool crypt_export_test(bool verbose) {
+
+    CryptSession client = {0}, server = {0}, restored = {0};
+    char state[CRYPT_STATE_LEN];
+    char payload[] = "Carried over";
+    struct iovec iov = {payload, sizeof payload};
+    char record[CRYPT_RECORD_LEN(sizeof payload)];
+    char datagram[CRYPT_SEQ_LEN + sizeof payload + CRYPT_TAG_LEN];
+    char copy[sizeof datagram];
+    char hex[CRYPT_FINGERPRINT_HEX];
+
+    if (!crypt_pair(&client, &server)) return false;
+
+    // Record and datagram sealed before the export open after the import, and the datagram still can't be replayed
+    size_t len = crypt_seal(&client, &iov, 1, record);
+    memcpy(datagram + CRYPT_SEQ_LEN, payload, sizeof payload);
+    size_t dgram_len = crypt_seal_datagram(&client, datagram, sizeof payload);
+    memcpy(copy, datagram, dgram_len);
+    bool match = len > 0 && dgram_len > 0 && crypt_open_datagram(&server, datagram, dgram_len) == sizeof payload;
+
+    match = match && crypt_export(&server, state) == CRYPT_STATE_LEN && crypt_import(&restored, state, sizeof state) == 0;
+    crypt_free(&server);
+
+    if (verbose) {
+        printf("--------------------------------\n");
+        print_buffer(state, sizeof state);
+    }
+
+    match = match && crypt_open(&restored, record, len) == sizeof payload && memcmp(record + CRYPT_HEADER_LEN, payload, sizeof payload) == 0;
+    match = match && crypt_open_datagram(&restored, copy, dgram_len) == -1;
+    len = crypt_seal(&restored, &iov, 1, record);
+    match = match && len > 0 && crypt_open(&client, record, len) == sizeof payload;
+    crypt_free(&client);
+    crypt_free(&restored);
+
+    // Server still waiting on the client's hello finishes the handshake after the import
+    struct evp_pkey_st* identity = crypt_load_identity(NULL);
+    match = match && identity != NULL && crypt_fingerprint(identity, hex) == 0 &&
+            crypt_init(&client, true) == 0 && crypt_pin(&client, hex) == 0 &&
+            crypt_init(&server, false) == 0 && crypt_sign_hello(&server, identity) == 0 &&
+            crypt_export(&server, state) == CRYPT_STATE_LEN && crypt_import(&restored, state, sizeof state) == 0 &&
+            crypt_finish(&restored, client.hello) == 0 && crypt_finish(&client, restored.hello) == 0;
+    len = match ? crypt_seal(&client, &iov, 1, record) : 0;
+    match = match && len > 0 && crypt_open(&restored, record, len) == sizeof payload;
+
+    // Truncated state is turned away
+    match = match && crypt_import(&restored, state, sizeof state - 1) == -1;
+
+    crypt_free(&client);
+    crypt_free(&server);
+    crypt_free(&restored);
+    crypt_free_identity(identity);
+
+    return match;
+}
+
+// Start server on an ephemeral port and connect a client to it, both on this thread
+// Return id server gave the client, 0 on failure
+static uint32_t loopback_pair(SocketState* server, SocketState* client) {
+
+    struct sockaddr_in6 addr;
+    socklen_t addr_len = sizeof addr;
+    char port[8];
+
+    if (start_server_socket(server, "0") != SOCK_SUCCESS) return 0;
+    if (getsockname(server->socket, (struct sockaddr*)&addr, &addr_len) != 0) {
+        shutdown_server_socket(server);
+        return 0;
+    }
+
+    // Listener may be either family, the port sits in the same place in both
+    snprintf(port, sizeof port, "%u", ntohs(addr.sin6_port));
+    if (start_client_socket(client, "localhost", port) != SOCK_SUCCESS) {
+        shutdown_server_socket(server);
+        return 0;
+    }
+
+    for (int i = 0; i < 100; i++) {
+        poll_sockets(server, 10);
+        for (int j = 0; j < server->num_clients; j++) {
+            if (server->clients[j].active) return server->clients[j].id;
+        }
+    }
+
+    shutdown_client_socket(client);
+    shutdown_server_socket(server);
+
+    return 0;
+}
+
+// Poll endpoint until a packet arrives, NULL if none does within a second
+static Packet* loopback_recv(SocketState* endpoint) {
+
+    Packet* packet = pop_packet(endpoint);
+
+    for (int i = 0; i < 100 && packet == NULL; i++) {
+        poll_sockets(endpoint, 10);
+        packet = pop_packet(endpoint);
+    }
+
+    return packet;
+}
+
+bool loopback_round_trip_test(bool verbose) {
+
+    SocketState server = {0};
+    SocketState client = {0};
+
+    uint32_t id = loopback_pair(&server, &client);
+    if (id == 0) return false;
+
+    // Each endpoint keeps its own queue, so a packet only shows up on the side it was sent to
+    bool match = client_socket_send_packet(&client, "ping", 5) == SOCK_SUCCESS;
+    Packet* packet = loopback_recv(&server);
+    match = match && packet != NULL && packet->sender == id && packet->len == 5 && memcmp(packet->data, "ping", 5) == 0;
+    match = match && num_packets(&client) == 0;
+    free_packet(packet);
+
+    // io_uring submits queued sends when server next polls
+    match = match && server_socket_send_packet(&server, id, "pong", 5) == SOCK_SUCCESS;
+    poll_sockets(&server, 0);
+    packet = loopback_recv(&client);
+    match = match && packet != NULL && packet->len == 5 && memcmp(packet->data, "pong", 5) == 0;
+    match = match && num_packets(&server) == 0;
+
+    if (verbose && packet != NULL) {
+        printf("--------------------------------\n");
+        print_buffer(packet->data, packet->len);
+    }
+
+    free_packet(packet);
+    shutdown_client_socket(&client);
+    shutdown_server_socket(&server);
+
+    return match;
+}
+
+// Frame is written a byte at a time, server must hold the pieces until the whole frame is in
+bool loopback_split_frame_test(bool verbose) {
+
+    SocketState server = {0};
+    SocketState client = {0};
+    char wire[2 + 6] = {0, 6, 'h', 'e', 'l', 'l', 'o', 0};
+
+    uint32_t id = loopback_pair(&server, &client);
+    if (id == 0) return false;
+
+    bool match = true;
+    for (size_t i = 0; i < sizeof wire && match; i++) {
+        match = send(client.socket, wire + i, 1, 0) == 1;
+        for (int j = 0; j < 5; j++) poll_sockets(&server, 1);
+        if (i + 1 < sizeof wire) match = match && num_packets(&server) == 0;
+    }
+
+    Packet* packet = match ? loopback_recv(&server) : NULL;
+    match = match && packet != NULL && packet->sender == id && packet->len == 6 && memcmp(packet->data, "hello", 6) == 0;
+    match = match && num_packets(&server) == 0;
+
+    if (verbose && packet != NULL) {
+        printf("--------------------------------\n");
+        print_buffer(packet->data, packet->len);
+    }
+
+    free_packet(packet);
+    shutdown_client_socket(&client);
+    shutdown_server_socket(&server);
+
+    return match;
+}
+
+// Several frames written with one send must come out as separate packets, in order
+bool loopback_batched_frames_test(bool verbose) {
+
+    SocketState server = {0};
+    SocketState client = {0};
+    char wire[] = {0, 2, 'a', 0, 0, 3, 'b', 'b', 0, 0, 4, 'c', 'c', 'c', 0};
+    const char* payloads[] = {"a", "bb", "ccc"};
+    int count = 0;
+
+    uint32_t id = loopback_pair(&server, &client);
+    if (id == 0) return false;
+
+    bool match = send(client.socket, wire, sizeof wire, 0) == (ssize_t)sizeof wire;
+
+    for (int i = 0; i < 100 && match && num_packets(&server) < 3; i++) poll_sockets(&server, 10);
+
+    Packet* packet = pop_packets(&server, NULL);
+    while (packet != NULL) {
+        Packet* next = packet->next_packet;
+        const char* expect = payloads[count < 3 ? count : 0];
+        match = match && count < 3 && packet->sender == id && packet->len == strlen(expect) + 1 && memcmp(packet->data, expect, packet->len) == 0;
+        count++;
+        free_packet(packet);
+        packet = next;
+    }
+    match = match && count == 3;
+
+    if (verbose) {
+        printf("--------------------------------\n");
+        printf("Frames received: %d\n", count);
+    }
+
+    shutdown_client_socket(&client);
+    shutdown_server_socket(&server);
+
+    return match;
+}
+
+bool loopback_throughput_test(bool verbose, int count) {
+
+    SocketState server = {0};
+    SocketState client = {0};
+    struct timespec start, end;
+    char data[64] = {0};
+    int sent = 0;
+    int received = 0;
+    bool in_order = true;
+
+    uint32_t id = loopback_pair(&server, &client);
+    if (id == 0) return false;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // Keep a bounded number in flight, since both ends share this thread
+    for (int idle = 0; received < count && idle < 1000; ) {
+
+        while (sent < count && sent - received < 512) {
+            memcpy(data, &sent, sizeof sent);
+            if (client_socket_send_packet(&client, data, sizeof data) != SOCK_SUCCESS) break;
+            sent++;
+        }
+
+        poll_sockets(&client, 0);
+        poll_sockets(&server, 1);
+
+        Packet* packet = pop_packets(&server, NULL);
+        idle = packet == NULL ? idle + 1 : 0;
+        while (packet != NULL) {
+            Packet* next = packet->next_packet;
+            int seq;
+            memcpy(&seq, packet->data, sizeof seq);
+            in_order = in_order && seq == received && packet->sender == id && packet->len == sizeof data;
+            received++;
+            free_packet(packet);
+            packet = next;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (verbose) {
+        double secs = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+        printf("--------------------------------\n");
+        printf("%d messages of %zu bytes in %.3f s, %.0f messages/s\n", received, sizeof data, secs, received / secs);
+    }
+
+    shutdown_client_socket(&client);
+    shutdown_server_socket(&server);
+
+    return in_order && received == count;
+}
+
+// Coalescing window is longer than the test waits, busy polling must send straight away regardless
+bool busy_poll_test(bool verbose) {
+
+    sock_get_config()->busy_poll = 500;
+    sock_get_config()->coalesce_window = 5000000;
+
+    bool match = loopback_round_trip_test(verbose);
+
+    sock_get_config()->busy_poll = 0;
+    sock_get_config()->coalesce_window = -1;
+
+    return match;
+}
+
+bool client_event_test(bool verbose) {
+
+    SocketState server = {0};
+    SocketState client = {0};
+    SockEvent event = {0};
+
+    uint32_t id = loopback_pair(&server, &client);
+    if (id == 0) return false;
+
+    // Connect is queued once, and nothing more until client goes
+    bool match = pop_event(&server, &event) && event.type == SOCK_EVENT_CONNECT && event.client_id == id;
+    match = match && !pop_event(&server, &event);
+
+    shutdown_client_socket(&client);
+    for (int i = 0; i < 100 && match && server.num_inactive == 0; i++) poll_sockets(&server, 10);
+
+    match = match && pop_event(&server, &event) && event.type == SOCK_EVENT_DISCONNECT && event.client_id == id;
+    match = match && !pop_event(&server, &event);
+
+    // Flush only frees the slot that went
+    match = match && flush_inactive_client_sockets(&server) == SOCK_SUCCESS;
+    match = match && server.num_inactive == 0 && server.num_free_slots == 1 && server.clients[0].id == 0;
+
+    if (verbose) {
+        printf("--------------------------------\n");
+        printf("Client id: %u Free slots: %d\n", id, server.num_free_slots);
+    }
+
+    shutdown_server_socket(&server);
+
+    return match;
+}
+
+bool rate_limit_test(bool verbose, int limit, int count) {
+
+    SocketState server = {0};
+    SocketState client = {0};
+    ThrottleCounters counters = {0};
+    int received = 0;
+
+    sock_get_config()->rate_msgs = limit;
+
+    uint32_t id = loopback_pair(&server, &client);
+    if (id == 0) {
+        sock_get_config()->rate_msgs = 0;
+        return false;
+    }
+
+    bool match = server_socket_set_throttle_notice(&server, "slow", 5) == SOCK_SUCCESS;
+
+    // Bucket starts with a second's worth, the rest of the burst is dropped unparsed
+    for (int i = 0; i < count && match; i++) match = client_socket_send_packet(&client, "chat", 5) == SOCK_SUCCESS;
+
+    for (int i = 0; i < 20 && match; i++) {
+        poll_sockets(&server, 10);
+        received += num_packets(&server);
+        while (num_packets(&server) > 0) free_packet(pop_packet(&server));
+    }
+
+    match = match && received == limit;
+    match = match && server_socket_throttle_counters(&server, id, &counters) == SOCK_SUCCESS;
+    match = match && counters.frames_throttled == (uint64_t)(count - limit) && counters.bytes_throttled == (uint64_t)(count - limit) * 5;
+    match = match && counters.notices_sent == 1 && server.throttle.frames_throttled == counters.frames_throttled;
+
+    // Client is told once, however many frames went over
+    Packet* packet = match ? loopback_recv(&client) : NULL;
+    match = match && packet != NULL && packet->len == 5 && memcmp(packet->data, "slow", 5) == 0;
+
+    if (verbose) {
+        printf("--------------------------------\n");
+        printf("Received: %d Throttled: %llu\n", received, (unsigned long long)counters.frames_throttled);
+    }
+
+    free_packet(packet);
+    shutdown_client_socket(&client);
+    shutdown_server_socket(&server);
+    sock_get_config()->rate_msgs = 0;
+
+    return match;
+}
+
+// Connect client to test Unix listener, runs on its own thread since a client asking for
+// shared rings waits on server's answer
+static void* unix_client_start(void* arg) {
+
+    SocketState* client = arg;
+
+    start_client_socket(client, "unix:/tmp/chat_test_unix.sock", NULL);
+
+    return NULL;
+}
+
+// Client on the Unix listener is served like a TCP one, over shared memory rings if it asks for them
+bool unix_listener_test(bool verbose, bool shm) {
+
+    SocketState server = {0};
+    SocketState client = {0};
+    pthread_t thread;
+    uint32_t id = 0;
+
+    sock_get_config()->unix_path = "/tmp/chat_test_unix.sock";
+    sock_get_config()->shm_rings = shm;
+
+    bool match = start_server_socket(&server, "0") == SOCK_SUCCESS;
+    match = match && pthread_create(&thread, NULL, unix_client_start, &client) == 0;
+
+    for (int i = 0; i < 50 && match; i++) poll_sockets(&server, 10);
+    if (match) pthread_join(thread, NULL);
+
+    for (int j = 0; j < server.num_clients; j++) {
+        if (server.clients[j].active) id = server.clients[j].id;
+    }
+    match = match && client.type == SOCK_CLIENT && id != 0;
+
+    match = match && client_socket_send_packet(&client, "ping", 5) == SOCK_SUCCESS;
+    Packet* packet = match ? loopback_recv(&server) : NULL;
+    match = match && packet != NULL && packet->sender == id && packet->len == 5 && memcmp(packet->data, "ping", 5) == 0;
+    free_packet(packet);
+
+    match = match && server_socket_send_packet(&server, id, "pong", 5) == SOCK_SUCCESS;
+    poll_sockets(&server, 0);
+    packet = match ? loopback_recv(&client) : NULL;
+    match = match && packet != NULL && packet->len == 5 && memcmp(packet->data, "pong", 5) == 0;
+    match = match && (server.clients[0].shm != NULL) == shm;
+
+    if (verbose) {
+        printf("--------------------------------\n");
+        printf("Client id: %u Shared rings: %s\n", id, server.clients[0].shm != NULL ? "yes" : "no");
+    }
+
+    free_packet(packet);
+    if (client.type != SOCK_UNINITIALIZED) shutdown_client_socket(&client);
+    if (server.type != SOCK_UNINITIALIZED) shutdown_server_socket(&server);
+    sock_get_config()->unix_path = NULL;
+    sock_get_config()->shm_rings = false;
+
+    return match;
+}
+
+// Where a client thread connects, and how starting it went
+typedef struct ClientStart {
+    SocketState* client;
+    const char* port;
+    SocketStatus status;
+} ClientStart;
+
+// Connect client over TCP, runs on its own thread since an encrypted client waits on server's hello
+static void* tcp_client_start(void* arg) {
+
+    ClientStart* start = arg;
+
+    start->status = start_client_socket(start->client, "localhost", start->port);
+
+    return NULL;
+}
+
+// Encrypted client only connects to a server signing with the key it pinned, and its messages get through sealed
+bool encrypted_loopback_test(bool verbose, bool pinned) {
+
+    const char* path = "/tmp/chat_test_server.pem";
+    SocketState server = {0};
+    SocketState client = {0};
+    struct sockaddr_in6 addr;
+    socklen_t addr_len = sizeof addr;
+    char port[8];
+    char hex[CRYPT_FINGERPRINT_HEX];
+    pthread_t thread;
+    uint32_t id = 0;
+
+    unlink(path);
+    sock_get_config()->encrypt = true;
+    sock_get_config()->server_key = path;
+    sock_get_config()->server_fingerprint = hex;
+
+    bool match = start_server_socket(&server, "0") == SOCK_SUCCESS &&
+                 getsockname(server.socket, (struct sockaddr*)&addr, &addr_len) == 0;
+    snprintf(port, sizeof port, "%u", ntohs(addr.sin6_port));
+
+    // Server made its key at the path, so the right pin comes from there, the wrong one from a key of nobody's
+    struct evp_pkey_st* identity = match ? crypt_load_identity(pinned ? path : NULL) : NULL;
+    match = match && identity != NULL && crypt_fingerprint(identity, hex) == 0;
+    crypt_free_identity(identity);
+
+    ClientStart start = {.client = &client, .port = port, .status = SOCK_ERR_CLIENT_START_FAILURE};
+    match = match && pthread_create(&thread, NULL, tcp_client_start, &start) == 0;
+
+    for (int i = 0; i < 50 && match; i++) poll_sockets(&server, 10);
+    if (match) pthread_join(thread, NULL);
+
+    for (int j = 0; j < server.num_clients; j++) {
+        if (server.clients[j].active) id = server.clients[j].id;
+    }
+
+    if (pinned) {
+        match = match && start.status == SOCK_SUCCESS && id != 0;
+
+        match = match && client_socket_send_packet(&client, "ping", 5) == SOCK_SUCCESS;
+        Packet* packet = match ? loopback_recv(&server) : NULL;
+        match = match && packet != NULL && packet->sender == id && packet->len == 5 && memcmp(packet->data, "ping", 5) == 0;
+        free_packet(packet);
+
+        match = match && server_socket_send_packet(&server, id, "pong", 5) == SOCK_SUCCESS;
+        poll_sockets(&server, 0);
+        packet = match ? loopback_recv(&client) : NULL;
+        match = match && packet != NULL && packet->len == 5 && memcmp(packet->data, "pong", 5) == 0;
+        free_packet(packet);
+    } else {
+        match = match && start.status == SOCK_ERR_CLIENT_START_FAILURE && client.type == SOCK_UNINITIALIZED;
+    }
+
+    if (verbose) {
+        printf("--------------------------------\n");
+        printf("Pinned: %s Client id: %u\n", hex, id);
+    }
+
+    if (client.type != SOCK_UNINITIALIZED) shutdown_client_socket(&client);
+    if (server.type != SOCK_UNINITIALIZED) shutdown_server_socket(&server);
+    sock_get_config()->encrypt = false;
+    sock_get_config()->server_key = NULL;
+    sock_get_config()->server_fingerprint = NULL;
+    unlink(path);
+
+    return match;
+}
+
+// Server polls through several heartbeat intervals, a client that answers heartbeats stays
+// and a silent one is dropped once it leaves enough of them unanswered
+bool heartbeat_test(bool verbose, bool answer) {
+
+    SocketState server = {0};
+    SocketState client = {0};
+    SockEvent event = {0};
+    int beats = 0;
+    int polls = 0;
+
+    sock_get_config()->heartbeat_interval = 20;
+
+    uint32_t id = loopback_pair(&server, &client);
+    bool match = id != 0 && pop_event(&server, &event) && event.type == SOCK_EVENT_CONNECT;
+    match = match && server_socket_set_heartbeat(&server, "beat", 5) == SOCK_SUCCESS;
+
+    // Timer wheel runs heartbeat checks from poll, each wakes server at the interval
+    for (; polls < 100 && match && server.num_inactive == 0; polls++) {
+        poll_sockets(&server, 10);
+        poll_sockets(&client, 0);
+        while (num_packets(&client) > 0) {
+            Packet* packet = pop_packet(&client);
+            beats += packet->len == 5 && memcmp(packet->data, "beat", 5) == 0;
+            if (answer) client_socket_send_packet(&client, "alive", 6);
+            free_packet(packet);
+        }
+        while (num_packets(&server) > 0) free_packet(pop_packet(&server));
+    }
+
+    if (answer) {
+        match = match && beats > 1 && !pop_event(&server, &event);
+    } else {
+        match = match && beats == 3 && pop_event(&server, &event) && event.type == SOCK_EVENT_DISCONNECT && event.client_id == id;
+    }
+
+    if (verbose) {
+        printf("--------------------------------\n");
+        printf("Heartbeats: %d Polls: %d Dropped: %s\n", beats, polls, server.num_inactive > 0 ? "yes" : "no");
+    }
+
+    if (id != 0) {
+        shutdown_client_socket(&client);
+        shutdown_server_socket(&server);
+    }
+    sock_get_config()->heartbeat_interval = 0;
+
+    return match;
+}
+
+// Shard that isn't keeping up turns relays away, and takes them again once it has drained its inbox
+bool shard_inbox_test(bool verbose) {
+
+    SocketState first = {0};
+    SocketState second = {0};
+    struct sockaddr_in6 addr;
+    socklen_t addr_len = sizeof addr;
+    char port[8];
+    int sent = 0;
+
+    sock_get_config()->num_shards = 2;
+
+    bool match = init_server_shards() == SOCK_SUCCESS && start_server_shard(&first, "0", 0) == SOCK_SUCCESS;
+    match = match && getsockname(first.socket, (struct sockaddr*)&addr, &addr_len) == 0;
+    snprintf(port, sizeof port, "%u", match ? ntohs(addr.sin6_port) : 0);
+
+    // Second shard isn't polled yet, so its inbox only fills
+    SocketStatus status = SOCK_SUCCESS;
+    while (match && status == SOCK_SUCCESS && sent < 1000000) {
+        status = shard_send_packet(&first, 1, "relay", 6);
+        if (status == SOCK_SUCCESS) sent++;
+    }
+    match = match && status == SOCK_ERR_SHARD_BUSY && first.relays_refused == 1;
+
+    match = match && start_server_shard(&second, port, 1) == SOCK_SUCCESS && poll_sockets(&second, 0) == SOCK_SUCCESS;
+    match = match && num_packets(&second) == sent;
+    match = match && shard_send_packet(&first, 1, "relay", 6) == SOCK_SUCCESS;
+
+    if (verbose) {
+        printf("--------------------------------\n");
+        printf("Relays taken: %d Refused: %llu\n", sent, (unsigned long long)first.relays_refused);
+    }
+
+    poll_sockets(&second, 0);
+    shutdown_server_socket(&second);
+    shutdown_server_socket(&first);
+    sock_get_config()->num_shards = 1;
+
+    return match;
+}
+
+// Shrink socket buffers, then send frames client doesn't read until its queue marks it slow
+// Return status of the last send
+static SocketStatus slow_fill(SocketState* server, SocketState* client, uint32_t id) {
+
+    char data[1000] = {0};
+    int size = 4096;
+    SocketStatus status = SOCK_SUCCESS;
+
+    setsockopt(client->socket, SOL_SOCKET, SO_RCVBUF, &size, sizeof size);
+    setsockopt(server->clients[0].fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof size);
+
+    for (int i = 0; i < 10000 && status == SOCK_SUCCESS && !server->clients[0].tx_slow; i++) {
+        status = server_socket_send_packet(server, id, data, sizeof data);
+    }
+
+    return status;
+}
+
+// Let client read everything queued for it, true once server treats it normally again
+static bool slow_drain(SocketState* server, SocketState* client) {
+
+    for (int i = 0; i < 1000 && server->clients[0].tx_slow; i++) {
+        poll_sockets(client, 1);
+        while (num_packets(client) > 0) free_packet(pop_packet(client));
+        poll_sockets(server, 1);
+    }
+
+    return !server->clients[0].tx_slow;
+}
+
+bool slow_client_test(bool verbose, SlowPolicy policy) {
+
+    SocketState server = {0};
+    SocketState client = {0};
+    SockEvent event = {0};
+
+    sock_get_config()->tx_high_water = 16384;
+    sock_get_config()->slow_policy = policy;
+
+    uint32_t id = loopback_pair(&server, &client);
+    bool match = id != 0 && pop_event(&server, &event) && event.type == SOCK_EVENT_CONNECT;
+
+    SocketStatus status = match ? slow_fill(&server, &client, id) : SOCK_ERR_UNINITIALIZED;
+
+    if (match && policy == SOCK_SLOW_DROP) {
+        // Presence is turned away while slow, and client is resynced once it drains
+        Frame* frame = alloc_frame("presence", 9);
+        frame->priority = FRAME_PRIORITY_LOW;
+        match = status == SOCK_SUCCESS && server_socket_send_frame(&server, id, frame) == SOCK_ERR_CLIENT_TOO_SLOW;
+        match = match && server.slow.frames_dropped == 1 && !pop_event(&server, &event);
+        match = match && slow_drain(&server, &client);
+        match = match && pop_event(&server, &event) && event.type == SOCK_EVENT_RESYNC && event.client_id == id;
+        release_frame(frame);
+
+    } else if (match && policy == SOCK_SLOW_PAUSE) {
+        // Reading stops while slow, and picks up once client drains
+        match = status == SOCK_SUCCESS && server.slow.clients_paused == 1 && server.clients[0].rx_paused;
+        match = match && client_socket_send_packet(&client, "ping", 5) == SOCK_SUCCESS;
+        match = match && slow_drain(&server, &client) && !server.clients[0].rx_paused;
+        Packet* packet = match ? loopback_recv(&server) : NULL;
+        match = match && packet != NULL && packet->len == 5 && !pop_event(&server, &event);
+        free_packet(packet);
+
+    } else if (match) {
+        match = status == SOCK_ERR_CLIENT_TOO_SLOW && server.slow.clients_disconnected == 1;
+        match = match && pop_event(&server, &event) && event.type == SOCK_EVENT_DISCONNECT && event.client_id == id;
+    }
+
+    if (verbose) {
+        printf("--------------------------------\n");
+        printf("Dropped: %llu Paused: %llu Disconnected: %llu\n", (unsigned long long)server.slow.frames_dropped,
+               (unsigned long long)server.slow.clients_paused, (unsigned long long)server.slow.clients_disconnected);
+    }
+
+    if (id != 0) {
+        shutdown_client_socket(&client);
+        shutdown_server_socket(&server);
+    }
+    sock_get_config()->tx_high_water = 0;
+    sock_get_config()->slow_policy = SOCK_SLOW_DROP;
+
+    return match;
+}
+
+// Normal priority frames still queue for a slow client under drop, until the hard limit disconnects it
+bool slow_hard_limit_test(bool verbose) {
+
+    SocketState server = {0};
+    SocketState client = {0};
+    SockEvent event = {0};
+    char data[1000] = {0};
+
+    sock_get_config()->tx_high_water = 16384;
+    sock_get_config()->tx_hard_limit = 65536;
+
+    uint32_t id = loopback_pair(&server, &client);
+    bool match = id != 0 && pop_event(&server, &event) && event.type == SOCK_EVENT_CONNECT;
+
+    SocketStatus status = match ? slow_fill(&server, &client, id) : SOCK_ERR_UNINITIALIZED;
+    int sent = 0;
+    while (status == SOCK_SUCCESS && sent < 10000) {
+        status = server_socket_send_packet(&server, id, data, sizeof data);
+        sent++;
+    }
+
+    match = match && status == SOCK_ERR_CLIENT_TOO_SLOW && server.slow.clients_disconnected == 1;
+    match = match && pop_event(&server, &event) && event.type == SOCK_EVENT_DISCONNECT && event.client_id == id;
+
+    if (verbose) {
+        printf("--------------------------------\n");
+        printf("Sent past high watermark: %d\n", sent);
+    }
+
+    if (id != 0) {
+        shutdown_client_socket(&client);
+        shutdown_server_socket(&server);
+    }
+    sock_get_config()->tx_high_water = 0;
+    sock_get_config()->tx_hard_limit = 0;
+
+    return match;
+}
+
+// Run server being taken over from until its successor asks, then hand everything over
+// Runs on its own thread, as it would in its own process, since successor blocks until it is done
+static void* handoff_predecessor(void* arg) {
+
+    SocketState* server = arg;
+    SocketStatus status = SOCK_SUCCESS;
+
+    for (int i = 0; i < 500 && status == SOCK_SUCCESS; i++) status = poll_sockets(server, 10);
+
+    if (status == SOCK_HANDOFF_REQUESTED) server_socket_handoff(server, "users", 6);
+    else if (server->type != SOCK_UNINITIALIZED) shutdown_server_socket(server);
+
+    return NULL;
+}
+
+bool handoff_test(bool verbose) {
+
+    SocketState predecessor = {0};
+    SocketState successor = {0};
+    SocketState client = {0};
+    SocketStatus status = SOCK_ERR_SERVER_START_FAILURE;
+    pthread_t thread;
+    char frame[] = {0, 5, 'p', 'i', 'n', 'g', 0};
+    Packet* packet = NULL;
+
+    sock_get_config()->handoff_path = "/tmp/chat_test_handoff.sock";
+
+    uint32_t id = loopback_pair(&predecessor, &client);
+    if (id == 0) {
+        sock_get_config()->handoff_path = NULL;
+        return false;
+    }
+
+    // Half a frame goes in before the handoff and the rest after, so the partial frame must carry over
+    bool match = send(client.socket, frame, 3, 0) == 3;
+    for (int i = 0; i < 10; i++) poll_sockets(&predecessor, 10);
+
+    if (pthread_create(&thread, NULL, handoff_predecessor, &predecessor) == 0) {
+        status = start_server_socket(&successor, "0");
+        pthread_join(thread, NULL);
+    } else {
+        shutdown_server_socket(&predecessor);
+    }
+
+    match = match && status == SOCK_SUCCESS && predecessor.type == SOCK_UNINITIALIZED;
+    match = match && successor.handoff_state_len == 6 && memcmp(successor.handoff_state, "users", 6) == 0;
+
+    // Client never notices, and keeps its id
+    match = match && send(client.socket, frame + 3, sizeof frame - 3, 0) == sizeof frame - 3;
+    if (match) packet = loopback_recv(&successor);
+    match = match && packet != NULL && packet->sender == id && packet->len == 5 && memcmp(packet->data, "ping", 5) == 0;
+    free_packet(packet);
+    packet = NULL;
+
+    match = match && server_socket_send_packet(&successor, id, "pong", 5) == SOCK_SUCCESS;
+    poll_sockets(&successor, 0);
+    if (match) packet = loopback_recv(&client);
+    match = match && packet != NULL && packet->len == 5 && memcmp(packet->data, "pong", 5) == 0;
+
+    if (verbose && packet != NULL) {
+        printf("--------------------------------\n");
+        print_buffer(packet->data, packet->len);
+    }
+
+    free_packet(packet);
+    shutdown_client_socket(&client);
+    if (successor.type != SOCK_UNINITIALIZED) shutdown_server_socket(&successor);
+    sock_get_config()->handoff_path = NULL;
+
+    return match;
+}
+
+// Client record comes out of a socketpair field for field, with what it had part way in and its descriptors
+bool handoff_record_test(bool verbose) {
+
+    int pair[2];
+    int passed[HANDOFF_MAX_FDS];
+    int num_fds = 0;
+    HandoffType type = HANDOFF_DONE;
+    HandoffClient sent = {
+        .id = 0x00123456,
+        .udp_token = 0x0102030405060708ull,
+        .rx_dropping = 0,
+        .rx_msgs = {.tokens = -2500, .refilled = 123456789},
+        .rx_bytes = {.tokens = 1ll << 40, .refilled = 987654321},
+        .rx_notified = 42,
+        .shm_pending = true,
+        .rx_record_len = 2,
+    };
+    HandoffClient got = {0};
+    struct sockaddr_in* addr4 = (struct sockaddr_in*)&sent.udp_addr;
+    char partial[] = {0, 5, 'p', 0, 40};
+    struct iovec iov[2] = {
+        {.iov_base = partial, .iov_len = 3},
+        {.iov_base = partial + 3, .iov_len = 2},
+    };
+
+    addr4->sin_family = AF_INET;
+    addr4->sin_port = htons(7777);
+    addr4->sin_addr.s_addr = htonl(0x7f000001);
+    sent.udp_addr_len = sizeof *addr4;
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, pair) != 0) return false;
+
+    char* record = malloc(HANDOFF_RECORD_LEN);
+    int fds[2] = {pair[0], pair[0]};
+    bool match = record != NULL && handoff_send_client(pair[0], &sent, iov, 2, fds, 2) == 0;
+
+    ssize_t len = match ? handoff_recv(pair[1], record, &type, passed, HANDOFF_MAX_FDS, &num_fds) : -1;
+    match = match && len == HANDOFF_CLIENT_LEN + (ssize_t)sizeof partial && type == HANDOFF_CLIENT && num_fds == 2;
+    match = match && handoff_read_client(record, len, &got) == 0 && memcmp(record + HANDOFF_CLIENT_LEN, partial, sizeof partial) == 0;
+    match = match && got.id == sent.id && got.udp_token == sent.udp_token && got.rx_dropping == sent.rx_dropping &&
+            got.rx_msgs.tokens == sent.rx_msgs.tokens && got.rx_msgs.refilled == sent.rx_msgs.refilled &&
+            got.rx_bytes.tokens == sent.rx_bytes.tokens && got.rx_bytes.refilled == sent.rx_bytes.refilled &&
+            got.rx_notified == sent.rx_notified && got.udp_addr_len == sent.udp_addr_len &&
+            memcmp(&got.udp_addr, &sent.udp_addr, sent.udp_addr_len) == 0 &&
+            got.crypt == sent.crypt && got.shm == sent.shm && got.shm_pending == sent.shm_pending && got.rx_record_len == sent.rx_record_len;
+
+    // Short record can't be read as a client
+    match = match && handoff_read_client(record, HANDOFF_CLIENT_LEN - 1, &got) == -1;
+
+    if (verbose && len > 0) {
+        printf("--------------------------------\n");
+        print_buffer(record, len);
+    }
+
+    for (int i = 0; i < num_fds; i++) close(passed[i]);
+    close(pair[0]);
+    close(pair[1]);
+    free(record);
+
+    return match;
+}
+
+#define TIMER_TEST_TASKS (11)
+
+typedef struct TimerLog {
+    TimerWheel* wheel;
+    uint64_t ran[TIMER_TEST_TASKS];     // Tick each task ran at, 0 if it hasn't
+    int runs;                           // Times any task ran
+} TimerLog;
+
+// Note tick task ran at, task's data says which one it was
+static void timer_log_task(void* arg, uint64_t data) {
+
+    TimerLog* log = arg;
+
+    log->ran[data] = log->wheel->now;
+    log->runs++;
+}
+
+// Run tasks spread over every level, advancing by step ticks at a time, 0 to go all the way at once
+bool timer_wheel_test(bool verbose, uint64_t step) {
+
+    // Each side of every level boundary, a past deadline, and two beyond the top level
+    const uint64_t start = 1000;
+    const uint64_t delays[TIMER_TEST_TASKS] = {1, 63, 64, 65, 4095, 4096, 4097, 262149, 16777216, 33554439, 0};
+    TimerWheel wheel;
+    TimerLog log = {.wheel = &wheel};
+    bool match = true;
+
+    timer_init(&wheel, start);
+    for (int i = 0; i < TIMER_TEST_TASKS; i++) {
+        match = match && timer_add(&wheel, start + delays[i] - (i == TIMER_TEST_TASKS - 1 ? 5 : 0), timer_log_task, &log, i) == 0;
+    }
+
+    // Wheel may wake early to move tasks down, but never late
+    match = match && timer_next(&wheel) == 1;
+
+    uint64_t end = start + delays[9];
+    for (uint64_t now = start; now < end; ) {
+        now = step == 0 || end - now < step ? end : now + step;
+        timer_advance(&wheel, now);
+    }
+
+    // Past deadline runs on the next tick
+    for (int i = 0; i < TIMER_TEST_TASKS; i++) {
+        uint64_t due = start + (delays[i] == 0 ? 1 : delays[i]);
+        if (verbose && log.ran[i] != due) printf("Task %d due at %lu ran at %lu\n", i, (unsigned long)due, (unsigned long)log.ran[i]);
+        match = match && log.ran[i] == due;
+    }
+
+    match = match && log.runs == TIMER_TEST_TASKS && timer_next(&wheel) == -1;
+    timer_free(&wheel);
+
+    return match;
+}
+
+// Task that puts itself back on the wheel until it has run ten times
+static void timer_repeat_task(void* arg, uint64_t data) {
+
+    TimerLog* log = arg;
+
+    log->runs++;
+    if (log->runs < 10) timer_add(log->wheel, log->wheel->now + data, timer_repeat_task, log, data);
+}
+
+bool timer_repeat_test(bool verbose) {
+
+    TimerWheel wheel;
+    TimerLog log = {.wheel = &wheel};
+
+    timer_init(&wheel, 0);
+    bool match = timer_next(&wheel) == -1 && timer_add(&wheel, 100, timer_repeat_task, &log, 100) == 0;
+
+    // A single advance keeps running tasks added by the ones it runs, as long as they fall in range
+    // Next one is a level up, so the wheel may wake before it to move it down
+    match = match && timer_advance(&wheel, 550) == 5;
+    int64_t next = timer_next(&wheel);
+    match = match && next > 0 && next <= 50;
+    match = match && timer_advance(&wheel, 5000) == 5 && log.runs == 10 && timer_next(&wheel) == -1;
+
+    if (verbose) {
+        printf("--------------------------------\n");
+        printf("Ran %d times, wheel at %lu\n", log.runs, (unsigned long)wheel.now);
+    }
+
+    timer_free(&wheel);
+
+    return match;
+}
+
+static const char* backend_names[] = {"epoll", "poll", "io_uring"};
+
+int main(int argc, char* argv[]) {
+
+    int verbose = false;
+
+
+    if (argc == 2) {
+        if (strcmp("-v",argv[1]) == 0) {
+            verbose = true;
+        } else if (strcmp("-h",argv[1]) == 0) {
+            printf("run_test [-v] - Run Serial/Deserial Test Cases");
+        }else {
+            printf("Invalid option. See -h for help.");
+        }
+        
+    } else if (argc > 2) {
+        printf("Invalid number of arguments. See -h for help.");
+    }
+
+    printf("PingMessage Test 1: %s\n", serial_deserial_ping_msg_test(verbose) ? "PASS" : "FAIL");
+    printf("UserMessage Test 1: %s\n", serial_deserial_user_msg_test(verbose, "Alex") ? "PASS" : "FAIL");
+    printf("UserMessage Test 2: %s\n", serial_deserial_user_msg_test(verbose, "") ? "PASS" : "FAIL");
+    printf("UserMessage Test 3: %s\n", serial_deserial_user_msg_test(verbose, "AReallyLongNameLikeThis") ? "PASS" : "FAIL");
+    printf("ActiveUserMessage Test 1: %s\n", serial_deserial_active_msg_test(verbose, 0) ? "PASS" : "FAIL");
+    printf("ActiveUserMessage Test 2: %s\n", serial_deserial_active_msg_test(verbose, 10) ? "PASS" : "FAIL");
+    printf("ActiveUserMessage Test 3: %s\n", serial_deserial_active_msg_test(verbose, MAX_USERS_PER_MSG) ? "PASS" : "FAIL");
+    printf("ChatMessage Test 1: %s\n", serial_deserial_chat_msg_test(verbose, "Test Message 1") ? "PASS" : "FAIL");
+    printf("ChatMessage Test 2: %s\n", serial_deserial_chat_msg_test(verbose, "") ? "PASS" : "FAIL");
+    printf("ChatMessage Test 3: %s\n", serial_deserial_chat_msg_test(verbose, "A very long message that exceeds the maximum message length. This message needs to exceed the 256 character limit, so it will go on and on and on and on and on and on and on and on. Its still not quite long enough though, so it will keep going on and on and on.") ? "PASS" : "FAIL");
+    printf("ErrorMessage Test 1: %s\n", serial_deserial_err_msg_test(verbose, "Test Message 1") ? "PASS" : "FAIL");
+    printf("ErrorMessage Test 2: %s\n", serial_deserial_err_msg_test(verbose, "") ? "PASS" : "FAIL");
+    printf("ErrorMessage Test 3: %s\n", serial_deserial_err_msg_test(verbose, "A very long message that exceeds the maximum message length. This message needs to exceed the 256 character limit, so it will go on and on and on and on and on and on and on and on. Its still not quite long enough though, so it will keep going on and on and on.") ? "PASS" : "FAIL");
+    printf("UdpSessionMessage Test 1: %s\n", serial_deserial_udp_session_msg_test(verbose) ? "PASS" : "FAIL");
+    printf("Corrupt Message Serialization 1: %s\n", corrupt_serial_user_msg_test(verbose) ? "PASS" : "FAIL");  
+    printf("Corrupt Message Serialization 2: %s\n", corrupt_serial_active_user_msg_test(verbose) ? "PASS" : "FAIL");    
+    printf("Corrupt Message Serialization 3: %s\n", corrupt_serial_chat_msg_test(verbose) ? "PASS" : "FAIL");
+    printf("Corrupt Message Serialization 4: %s\n", corrupt_serial_err_msg_test(verbose) ? "PASS" : "FAIL");
+    printf("Corrupt Message Serialization 5: %s\n", corrupt_serial_invalid_type_test(verbose) ? "PASS" : "FAIL");
+    printf("Corrupt Message Deserialization 1: %s\n", corrupt_deserial_user_msg_test(verbose) ? "PASS" : "FAIL");  
+    printf("Corrupt Message Deserialization 2: %s\n", corrupt_deserial_active_user_msg_test(verbose) ? "PASS" : "FAIL");    
+    printf("Corrupt Message Deserialization 3: %s\n", corrupt_deserial_chat_msg_test(verbose) ? "PASS" : "FAIL");
+    printf("Corrupt Message Deserialization 4: %s\n", corrupt_deserial_err_msg_test(verbose) ? "PASS" : "FAIL");
+    printf("Corrupt Message Deserialization 5: %s\n", corrupt_deserial_invalid_type_test(verbose) ? "PASS" : "FAIL");
+    printf("MessageView Test 1: %s\n", view_user_msg_test(verbose, "Alex") ? "PASS" : "FAIL");
+    printf("MessageView Test 2: %s\n", view_user_msg_test(verbose, "") ? "PASS" : "FAIL");
+    printf("MessageView Test 3: %s\n", corrupt_view_chat_msg_test(verbose) ? "PASS" : "FAIL");
+    printf("Packet Pool Test 1: %s\n", packet_pool_reuse_test(verbose, 12) ? "PASS" : "FAIL");
+    printf("Packet Pool Test 2: %s\n", packet_pool_reuse_test(verbose, MAX_MESSAGE_LEN) ? "PASS" : "FAIL");
+    printf("Packet Pool Test 3: %s\n", packet_pool_oversize_test(verbose) ? "PASS" : "FAIL");
+    printf("Frame Test 1: %s\n", frame_prefix_test(verbose, 0) ? "PASS" : "FAIL");
+    printf("Frame Test 2: %s\n", frame_prefix_test(verbose, MAX_MESSAGE_LEN) ? "PASS" : "FAIL");
+    printf("Frame Test 3: %s\n", frame_gather_test(verbose) ? "PASS" : "FAIL");
+    printf("Shared Ring Test 1: %s\n", shm_ring_test(verbose) ? "PASS" : "FAIL");
+    printf("Shared Ring Test 2: %s\n", shm_wrap_test(verbose) ? "PASS" : "FAIL");
+    printf("Record Layer Test 1: %s\n", crypt_record_test(verbose) ? "PASS" : "FAIL");
+    printf("Record Layer Test 2: %s\n", crypt_datagram_test(verbose) ? "PASS" : "FAIL");
+    printf("Record Layer Test 3: %s\n", crypt_handshake_test(verbose) ? "PASS" : "FAIL");
+    printf("Record Layer Test 4: %s\n", crypt_identity_file_test(verbose) ? "PASS" : "FAIL");
+    printf("Record Layer Test 5: %s\n", crypt_export_test(verbose) ? "PASS" : "FAIL");
+    printf("Handoff Record Test 1: %s\n", handoff_record_test(verbose) ? "PASS" : "FAIL");
+    printf("Timer Wheel Test 1: %s\n", timer_wheel_test(verbose, 0) ? "PASS" : "FAIL");
+    printf("Timer Wheel Test 2: %s\n", timer_wheel_test(verbose, 997) ? "PASS" : "FAIL");
+    printf("Timer Wheel Test 3: %s\n", timer_repeat_test(verbose) ? "PASS" : "FAIL");
+
+    // Socket tests run on every server backend, clients fall back from io_uring to epoll
+    for (int backend = SOCK_BACKEND_EPOLL; backend <= SOCK_BACKEND_URING; backend++) {
+        const char* name = backend_names[backend];
+        sock_get_config()->backend = backend;
+        printf("Loopback Test 1 (%s): %s\n", name, loopback_round_trip_test(verbose) ? "PASS" : "FAIL");
+        printf("Loopback Test 2 (%s): %s\n", name, loopback_throughput_test(verbose, 100000) ? "PASS" : "FAIL");
+        printf("Loopback Test 3 (%s): %s\n", name, loopback_split_frame_test(verbose) ? "PASS" : "FAIL");
+        printf("Loopback Test 4 (%s): %s\n", name, loopback_batched_frames_test(verbose) ? "PASS" : "FAIL");
+        printf("Unix Listener Test 1 (%s): %s\n", name, unix_listener_test(verbose, false) ? "PASS" : "FAIL");
+        printf("Unix Listener Test 2 (%s): %s\n", name, unix_listener_test(verbose, true) ? "PASS" : "FAIL");
+        printf("Encrypted Loopback Test 1 (%s): %s\n", name, encrypted_loopback_test(verbose, true) ? "PASS" : "FAIL");
+        printf("Encrypted Loopback Test 2 (%s): %s\n", name, encrypted_loopback_test(verbose, false) ? "PASS" : "FAIL");
+        printf("Heartbeat Test 1 (%s): %s\n", name, heartbeat_test(verbose, true) ? "PASS" : "FAIL");
+        printf("Heartbeat Test 2 (%s): %s\n", name, heartbeat_test(verbose, false) ? "PASS" : "FAIL");
+        printf("Client Event Test 1 (%s): %s\n", name, client_event_test(verbose) ? "PASS" : "FAIL");
+        printf("Rate Limit Test 1 (%s): %s\n", name, rate_limit_test(verbose, 5, 20) ? "PASS" : "FAIL");
+        printf("Handoff Test 1 (%s): %s\n", name, handoff_test(verbose) ? "PASS" : "FAIL");
+    }
+    sock_get_config()->backend = SOCK_BACKEND_EPOLL;
+
+    printf("Busy Poll Test 1: %s\n", busy_poll_test(verbose) ? "PASS" : "FAIL");
+    printf("Shard Inbox Test 1: %s\n", shard_inbox_test(verbose) ? "PASS" : "FAIL");
+    printf("Slow Client Test 1: %s\n", slow_client_test(verbose, SOCK_SLOW_DROP) ? "PASS" : "FAIL");
+    printf("Slow Client Test 2: %s\n", slow_client_test(verbose, SOCK_SLOW_PAUSE) ? "PASS" : "FAIL");
+    printf("Slow Client Test 3: %s\n", slow_client_test(verbose, SOCK_SLOW_DISCONNECT) ? "PASS" : "FAIL");
+    printf("Slow Client Test 4: %s\n", slow_hard_limit_test(verbose) ? "PASS" : "FAIL");
 
 }